@@ -0,0 +1,56 @@
+#include <benchmark/benchmark.h>
+
+#include <memory>
+#include <vector>
+
+#include "block_cache.h"
+
+namespace cppserver {
+
+// 64MiB of 4KiB blocks, all resident
+#define BENCH_CACHE_BLOCK_SIZE 4096
+#define BENCH_CACHE_BLOCKS 16384
+
+static std::shared_ptr<BlockCache> bench_cache;
+
+// Concurrent hits spread over the whole cache, threads contend only when they land in the same shard
+static void BM_BlockCacheHit(benchmark::State& state) {
+  if (state.thread_index() == 0) {
+    bench_cache = std::make_shared<BlockCache>(std::make_shared<Metrics>(), uint64_t(BENCH_CACHE_BLOCKS) * BENCH_CACHE_BLOCK_SIZE, BENCH_CACHE_BLOCK_SIZE);
+    std::vector<uint8_t> data(BENCH_CACHE_BLOCK_SIZE);
+    for (uint64_t block = 0; block < BENCH_CACHE_BLOCKS; block++) {
+      uint64_t ticket;
+      bench_cache->lookup(1, block, data.data(), ticket);
+      bench_cache->insert(1, block, data.data(), ticket);
+    }
+  }
+
+  std::vector<uint8_t> data(BENCH_CACHE_BLOCK_SIZE);
+  uint64_t block = state.thread_index() * 7919;
+  for (auto _ : state) {
+    uint64_t ticket;
+    benchmark::DoNotOptimize(bench_cache->lookup(1, block % BENCH_CACHE_BLOCKS, data.data(), ticket));
+    block += 13;
+  }
+  state.SetBytesProcessed(state.iterations() * BENCH_CACHE_BLOCK_SIZE);
+
+  if (state.thread_index() == 0) bench_cache.reset();
+}
+BENCHMARK(BM_BlockCacheHit)->ThreadRange(1, 8)->UseRealTime();
+
+// Every lookup misses and evicts, the cost a scan pays
+static void BM_BlockCacheMissInsert(benchmark::State& state) {
+  BlockCache cache(std::make_shared<Metrics>(), uint64_t(BENCH_CACHE_BLOCKS) * BENCH_CACHE_BLOCK_SIZE, BENCH_CACHE_BLOCK_SIZE);
+  std::vector<uint8_t> data(BENCH_CACHE_BLOCK_SIZE);
+
+  uint64_t block = 0;
+  for (auto _ : state) {
+    uint64_t ticket;
+    if (!cache.lookup(1, block, data.data(), ticket)) cache.insert(1, block, data.data(), ticket);
+    block++;
+  }
+  state.SetBytesProcessed(state.iterations() * BENCH_CACHE_BLOCK_SIZE);
+}
+BENCHMARK(BM_BlockCacheMissInsert);
+
+}  // namespace cppserver
@@ -0,0 +1,234 @@
+#include <benchmark/benchmark.h>
+#include <sys/resource.h>
+
+#include <atomic>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+
+#include "block_client.h"
+#include "block_engine.h"
+#include "device_db_file.h"
+#include "null_logger.h"
+#include "tcp_server.h"
+
+namespace cppserver {
+
+// A 64MiB device of 4KiB blocks read one block at a time over loopback, from a block cache holding half of it
+#define BENCH_CLIENT_PORT 26603
+#define BENCH_CLIENT_BLOCK_SIZE 4096
+#define BENCH_CLIENT_BLOCKS 16384
+#define BENCH_CLIENT_CACHE_BYTES (32 * 1024 * 1024)
+
+// Requests per second against the number kept in flight on each connection,
+// over one connection and spread over a pool of four, with the server running
+// each session's requests in order or on its dispatch workers
+static void BM_BlockClientRead(benchmark::State& state) {
+  auto logger = std::make_shared<NullLogger>();
+  std::filesystem::path dir = std::filesystem::temp_directory_path() / "cppserver_bench_block_client";
+  std::filesystem::create_directories(dir);
+  std::ofstream(dir / "devices.conf") << "host 1 bench 000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f\n"
+                                      << "device 1 1 disk " << (dir / "disk.img").string() << " " << BENCH_CLIENT_BLOCK_SIZE << " " << BENCH_CLIENT_BLOCKS
+                                      << "\n";
+  DeviceDBFile db(logger, (dir / "devices.conf").string());
+  db.initialise();
+  BlockEngineOptions engine_options;
+  engine_options.cache_bytes = BENCH_CLIENT_CACHE_BYTES;
+  auto engine = std::make_shared<BlockEngine>(logger, std::make_shared<Metrics>(), db, engine_options);
+  TCPServerOptions server_options;
+  server_options.dispatch_threads = state.range(2);
+  TCPServer server(logger, std::make_shared<Metrics>(), engine, BENCH_CLIENT_PORT, server_options);
+  server.start();
+
+  BlockClientOptions options;
+  options.max_in_flight = state.range(0);
+  BlockClientPool pool(logger, std::make_shared<Metrics>(), state.range(1), options);
+  std::string error;
+  if (!pool.connect("127.0.0.1", BENCH_CLIENT_PORT, 1, 1, error)) {
+    state.SkipWithError(error.c_str());
+    server.stop();
+    return;
+  }
+
+  std::atomic<uint64_t> failed{0};
+  BlockCallback callback = [&failed](BlockResponse& response) {
+    if (!response.ok()) failed++;
+  };
+  uint64_t block = 0;
+  for (auto _ : state) {
+    pool.next().read(block, 1, callback);
+    block = (block + 1) % BENCH_CLIENT_BLOCKS;
+  }
+  pool.drain();
+  state.SetItemsProcessed(state.iterations());
+  if (failed) state.SkipWithError("reads failed");
+
+  pool.close();
+  server.stop();
+  std::filesystem::remove_all(dir);
+}
+BENCHMARK(BM_BlockClientRead)->ArgNames({"depth", "connections", "dispatch"})->ArgsProduct({{1, 4, 16, 64}, {1, 4}, {0, 8}})->UseRealTime();
+
+// Connect and attach, with and without HELLO. It is sent ahead of the ATTACH without waiting, so costs no round trip.
+static void BM_BlockClientConnect(benchmark::State& state) {
+  auto logger = std::make_shared<NullLogger>();
+  std::filesystem::path dir = std::filesystem::temp_directory_path() / "cppserver_bench_block_client";
+  std::filesystem::create_directories(dir);
+  std::ofstream(dir / "devices.conf") << "host 1 bench 000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f\n"
+                                      << "device 1 1 disk " << (dir / "disk.img").string() << " " << BENCH_CLIENT_BLOCK_SIZE << " " << BENCH_CLIENT_BLOCKS
+                                      << "\n";
+  DeviceDBFile db(logger, (dir / "devices.conf").string());
+  db.initialise();
+  auto engine = std::make_shared<BlockEngine>(logger, std::make_shared<Metrics>(), db);
+  TCPServer server(logger, std::make_shared<Metrics>(), engine, BENCH_CLIENT_PORT, TCPServerOptions());
+  server.start();
+
+  BlockClientOptions options;
+  options.hello = state.range(0);
+  BlockClient client(logger, std::make_shared<Metrics>(), options);
+  for (auto _ : state) {
+    boost::system::error_code ec;
+    std::string error;
+    if (!client.connect("127.0.0.1", BENCH_CLIENT_PORT, ec) || !client.attach(1, 1, error)) {
+      state.SkipWithError("cannot attach");
+      break;
+    }
+    client.close();
+  }
+
+  server.stop();
+  std::filesystem::remove_all(dir);
+}
+BENCHMARK(BM_BlockClientConnect)->ArgName("hello")->Arg(0)->Arg(1)->UseRealTime();
+
+// Reconnect to an attached device, with HELLO and ATTACH or resuming from a ticket in one request
+static void BM_BlockClientReconnect(benchmark::State& state) {
+  auto logger = std::make_shared<NullLogger>();
+  std::filesystem::path dir = std::filesystem::temp_directory_path() / "cppserver_bench_block_client";
+  std::filesystem::create_directories(dir);
+  std::ofstream(dir / "devices.conf") << "host 1 bench 000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f\n"
+                                      << "device 1 1 disk " << (dir / "disk.img").string() << " " << BENCH_CLIENT_BLOCK_SIZE << " " << BENCH_CLIENT_BLOCKS
+                                      << "\n";
+  DeviceDBFile db(logger, (dir / "devices.conf").string());
+  db.initialise();
+  auto engine = std::make_shared<BlockEngine>(logger, std::make_shared<Metrics>(), db);
+  TCPServer server(logger, std::make_shared<Metrics>(), engine, BENCH_CLIENT_PORT, TCPServerOptions());
+  server.start();
+
+  BlockClientOptions options;
+  options.tickets = state.range(0);
+  BlockClient client(logger, std::make_shared<Metrics>(), options);
+  boost::system::error_code ec;
+  std::string error;
+  if (!client.connect("127.0.0.1", BENCH_CLIENT_PORT, ec) || !client.attach(1, 1, error)) state.SkipWithError("cannot attach");
+  for (auto _ : state) {
+    if (!client.reconnect(error)) {
+      state.SkipWithError(error.c_str());
+      break;
+    }
+  }
+  client.close();
+
+  server.stop();
+  std::filesystem::remove_all(dir);
+}
+BENCHMARK(BM_BlockClientReconnect)->ArgName("ticket")->Arg(0)->Arg(1)->UseRealTime();
+
+// Round trip of one cached block read at a time, over loopback TCP and the Unix socket
+static void BM_BlockClientLatency(benchmark::State& state) {
+  auto logger = std::make_shared<NullLogger>();
+  std::filesystem::path dir = std::filesystem::temp_directory_path() / "cppserver_bench_block_client";
+  std::filesystem::create_directories(dir);
+  std::ofstream(dir / "devices.conf") << "host 1 bench 000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f\n"
+                                      << "device 1 1 disk " << (dir / "disk.img").string() << " " << BENCH_CLIENT_BLOCK_SIZE << " " << BENCH_CLIENT_BLOCKS
+                                      << "\n";
+  DeviceDBFile db(logger, (dir / "devices.conf").string());
+  db.initialise();
+  BlockEngineOptions engine_options;
+  engine_options.cache_bytes = BENCH_CLIENT_CACHE_BYTES;
+  auto engine = std::make_shared<BlockEngine>(logger, std::make_shared<Metrics>(), db, engine_options);
+  TCPServerOptions server_options;
+  server_options.unix_path = (dir / "cppserver.sock").string();
+  TCPServer server(logger, std::make_shared<Metrics>(), engine, BENCH_CLIENT_PORT, server_options);
+  server.start();
+
+  BlockClient client(logger, std::make_shared<Metrics>());
+  boost::system::error_code ec;
+  bool connected = state.range(0) ? client.connect_unix(server_options.unix_path, ec) : client.connect("127.0.0.1", BENCH_CLIENT_PORT, ec);
+  std::string error;
+  if (!connected || !client.attach(1, 1, error)) state.SkipWithError("cannot attach");
+
+  std::vector<uint8_t> data(BENCH_CLIENT_BLOCK_SIZE);
+  for (auto _ : state) {
+    if (!client.read(0, 1, data.data(), error)) {
+      state.SkipWithError(error.c_str());
+      break;
+    }
+  }
+  state.SetBytesProcessed(state.iterations() * data.size());
+  client.close();
+
+  server.stop();
+  std::filesystem::remove_all(dir);
+}
+BENCHMARK(BM_BlockClientLatency)->ArgName("unix")->Arg(0)->Arg(1)->UseRealTime();
+
+// Reads of a read only device in the page cache, sent from its file or copied
+// through a buffer, with the CPU time of the whole process (server and client)
+// per GiB read. Four requests of each size kept in flight over loopback.
+static void BM_BlockClientZeroCopy(benchmark::State& state) {
+  auto logger = std::make_shared<NullLogger>();
+  std::filesystem::path dir = std::filesystem::temp_directory_path() / "cppserver_bench_block_client";
+  std::filesystem::create_directories(dir);
+  std::ofstream(dir / "devices.conf") << "host 1 bench 000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f\n"
+                                      << "device 1 1 disk " << (dir / "disk.img").string() << " " << BENCH_CLIENT_BLOCK_SIZE << " " << BENCH_CLIENT_BLOCKS
+                                      << " ro\n";
+  std::vector<char> image(size_t(BENCH_CLIENT_BLOCKS) * BENCH_CLIENT_BLOCK_SIZE, 'x');
+  std::ofstream(dir / "disk.img", std::ios::binary).write(image.data(), image.size());
+  DeviceDBFile db(logger, (dir / "devices.conf").string());
+  db.initialise();
+  BlockEngineOptions engine_options;
+  engine_options.checksums = false;
+  auto engine = std::make_shared<BlockEngine>(logger, std::make_shared<Metrics>(), db, engine_options);
+  TCPServerOptions server_options;
+  server_options.session.zero_copy = state.range(0);
+  TCPServer server(logger, std::make_shared<Metrics>(), engine, BENCH_CLIENT_PORT, server_options);
+  server.start();
+
+  BlockClientOptions options;
+  options.max_in_flight = 4;
+  BlockClient client(logger, std::make_shared<Metrics>(), options);
+  boost::system::error_code ec;
+  std::string error;
+  if (!client.connect("127.0.0.1", BENCH_CLIENT_PORT, ec) || !client.attach(1, 1, error)) state.SkipWithError("cannot attach");
+
+  std::atomic<uint64_t> failed{0};
+  BlockCallback callback = [&failed](BlockResponse& response) {
+    if (!response.ok()) failed++;
+  };
+  uint32_t count = state.range(1) / BENCH_CLIENT_BLOCK_SIZE;
+  uint64_t block = 0;
+  struct rusage start;
+  ::getrusage(RUSAGE_SELF, &start);
+  for (auto _ : state) {
+    client.read(block, count, callback);
+    block = (block + count) % BENCH_CLIENT_BLOCKS;
+  }
+  client.drain();
+  struct rusage end;
+  ::getrusage(RUSAGE_SELF, &end);
+  if (failed) state.SkipWithError("reads failed");
+
+  auto seconds = [](const struct timeval& tv) { return tv.tv_sec + tv.tv_usec / 1e6; };
+  double cpu = seconds(end.ru_utime) - seconds(start.ru_utime) + seconds(end.ru_stime) - seconds(start.ru_stime);
+  double bytes = double(state.iterations()) * state.range(1);
+  state.SetBytesProcessed(bytes);
+  state.counters["cpu_s_per_GiB"] = bytes > 0 ? cpu / (bytes / (1024.0 * 1024 * 1024)) : 0;
+  client.close();
+
+  server.stop();
+  std::filesystem::remove_all(dir);
+}
+BENCHMARK(BM_BlockClientZeroCopy)->ArgNames({"zero_copy", "bytes"})->ArgsProduct({{0, 1}, {64 * 1024, 1024 * 1024}})->UseRealTime();
+
+}  // namespace cppserver
@@ -0,0 +1,77 @@
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "block_codec.h"
+
+namespace cppserver {
+
+// 1MiB of 4KiB blocks of each kind of data
+#define BENCH_CODEC_BLOCK_SIZE 4096
+#define BENCH_CODEC_BLOCKS 256
+
+enum BenchData { BENCH_TEXT, BENCH_METADATA, BENCH_RANDOM };
+
+static std::vector<uint8_t> bench_data(int kind) {
+  std::vector<uint8_t> data(BENCH_CODEC_BLOCK_SIZE * BENCH_CODEC_BLOCKS);
+  std::mt19937 gen(1);
+
+  if (kind == BENCH_TEXT) {
+    // Log lines, repetitive but with varying fields
+    char line[128];
+    for (size_t pos = 0; pos < data.size();) {
+      int len = std::snprintf(line, sizeof(line), "2024-05-01T12:%02u:%02u host%u GET /api/v1/items/%u 200 %u\n", unsigned(gen() % 60), unsigned(gen() % 60),
+                              unsigned(gen() % 16), unsigned(gen() % 100000), unsigned(gen() % 65536));
+      std::memcpy(data.data() + pos, line, std::min<size_t>(len, data.size() - pos));
+      pos += len;
+    }
+  } else if (kind == BENCH_METADATA) {
+    // Filesystem metadata: a quarter of blocks empty, the rest partly filled with 128 byte records
+    for (uint32_t block = 0; block < BENCH_CODEC_BLOCKS; block++) {
+      if (gen() % 4 == 0) continue;
+      uint8_t* ptr = data.data() + size_t(block) * BENCH_CODEC_BLOCK_SIZE;
+      for (uint32_t record = 0, records = gen() % 32; record < records; record++) {
+        uint32_t fields[4] = {uint32_t(block * 32 + record), 0x81A4, uint32_t(gen() % 4096), uint32_t(1714564800 + gen() % 86400)};
+        std::memcpy(ptr + record * 128, fields, sizeof(fields));
+      }
+    }
+  } else {
+    for (auto& byte : data) byte = gen();
+  }
+  return data;
+}
+
+static void BM_BlockCodecEncode(benchmark::State& state) {
+  BlockCodec codec(std::make_shared<Metrics>(), "bench", BENCH_CODEC_BLOCK_SIZE);
+  auto data = bench_data(state.range(0));
+  std::vector<uint8_t> records;
+
+  for (auto _ : state) {
+    records.clear();
+    codec.encode_records(data.data(), BENCH_CODEC_BLOCKS, records);
+    benchmark::DoNotOptimize(records.data());
+  }
+  state.SetBytesProcessed(state.iterations() * data.size());
+  state.counters["ratio"] = double(data.size()) / records.size();
+}
+BENCHMARK(BM_BlockCodecEncode)->ArgName("data")->Arg(BENCH_TEXT)->Arg(BENCH_METADATA)->Arg(BENCH_RANDOM);
+
+static void BM_BlockCodecDecode(benchmark::State& state) {
+  BlockCodec codec(std::make_shared<Metrics>(), "bench", BENCH_CODEC_BLOCK_SIZE);
+  auto data = bench_data(state.range(0));
+  std::vector<uint8_t> records, blocks;
+  codec.encode_records(data.data(), BENCH_CODEC_BLOCKS, records);
+
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(codec.decode_records(records.data(), records.size(), BENCH_CODEC_BLOCKS, blocks));
+  }
+  state.SetBytesProcessed(state.iterations() * data.size());
+  state.counters["ratio"] = double(data.size()) / records.size();
+}
+BENCHMARK(BM_BlockCodecDecode)->ArgName("data")->Arg(BENCH_TEXT)->Arg(BENCH_METADATA)->Arg(BENCH_RANDOM);
+
+}  // namespace cppserver
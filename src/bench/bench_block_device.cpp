@@ -0,0 +1,54 @@
+#include <benchmark/benchmark.h>
+
+#include <filesystem>
+#include <memory>
+#include <vector>
+
+#include "block_device.h"
+#include "null_logger.h"
+
+namespace cppserver {
+
+// A 64MiB device of 4KiB blocks, read 128KiB at a time from the page cache
+#define BENCH_DEVICE_BLOCK_SIZE 4096
+#define BENCH_DEVICE_BLOCKS 16384
+#define BENCH_DEVICE_READ_BLOCKS 32
+
+// Uncached reads with checksums off and on, the overhead of verifying every block read. With a
+// snapshot every block is looked up in the overlay first, though none has been written since.
+static void BM_BlockDeviceRead(benchmark::State& state) {
+  Device device;
+  device.id = 1;
+  device.filename = (std::filesystem::temp_directory_path() / "cppserver_bench_block_device.img").string();
+  device.block_size = BENCH_DEVICE_BLOCK_SIZE;
+  device.block_total = BENCH_DEVICE_BLOCKS;
+  device.read_only = false;
+
+  auto metrics = std::make_shared<Metrics>();
+  BlockDevice disk(std::make_shared<NullLogger>(), metrics, device, nullptr, state.range(0));
+  boost::system::error_code ec;
+  if (!disk.open(ec)) {
+    state.SkipWithError(ec.message().c_str());
+    return;
+  }
+
+  std::vector<uint8_t> data(BENCH_DEVICE_READ_BLOCKS * BENCH_DEVICE_BLOCK_SIZE);
+  for (size_t i = 0; i < data.size(); i++) data[i] = uint8_t(i * 7);
+  for (uint64_t block = 0; block < BENCH_DEVICE_BLOCKS; block += BENCH_DEVICE_READ_BLOCKS) disk.write(block, BENCH_DEVICE_READ_BLOCKS, data.data(), false, ec);
+  if (state.range(1)) disk.snapshot(ec);
+
+  uint64_t block = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(disk.read(block, BENCH_DEVICE_READ_BLOCKS, data.data(), ec));
+    block = (block + BENCH_DEVICE_READ_BLOCKS) % BENCH_DEVICE_BLOCKS;
+  }
+  state.SetBytesProcessed(state.iterations() * data.size());
+
+  if (state.range(1)) disk.delete_snapshot(ec);
+  disk.close();
+  std::filesystem::remove(device.filename);
+  std::filesystem::remove(device.filename + ".crc");
+}
+BENCHMARK(BM_BlockDeviceRead)->ArgNames({"checksums", "snapshot"})->ArgsProduct({{0, 1}, {0, 1}})->UseRealTime();
+
+}  // namespace cppserver
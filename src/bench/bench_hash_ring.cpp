@@ -0,0 +1,21 @@
+#include <benchmark/benchmark.h>
+
+#include <string>
+#include <vector>
+
+#include "hash_ring.h"
+
+namespace cppserver {
+
+// Find the owner of a device on a ring of state.range(0) nodes, done on every attach in a cluster
+static void BM_HashRingOwner(benchmark::State& state) {
+  std::vector<std::string> nodes;
+  for (int node = 0; node < state.range(0); node++) nodes.push_back("10.0.0." + std::to_string(node) + ":26547");
+  HashRing ring(nodes);
+
+  uint64_t device = 0;
+  for (auto _ : state) benchmark::DoNotOptimize(ring.owner(device++));
+}
+BENCHMARK(BM_HashRingOwner)->Arg(3)->Arg(64);
+
+}  // namespace cppserver
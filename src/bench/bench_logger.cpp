@@ -0,0 +1,37 @@
+#include <benchmark/benchmark.h>
+
+#include <memory>
+#include <string>
+
+#include "logger_scoped.h"
+#include "null_logger.h"
+
+namespace cppserver {
+
+// Scope formatting cost of one LoggerScoped layer
+static void BM_LoggerScoped(benchmark::State& state) {
+  LoggerScoped logger("127.0.0.1:26547", std::make_shared<NullLogger>());
+  std::string message(state.range(0), 'x');
+  for (auto _ : state) logger.debug(message);
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_LoggerScoped)->Arg(16)->Arg(256);
+
+// Nested scopes, as used by TCPServer -> TCPSession
+static void BM_LoggerScopedNested(benchmark::State& state) {
+  auto server = std::make_shared<LoggerScoped>("server", std::make_shared<NullLogger>());
+  LoggerScoped session("127.0.0.1:26547", server);
+  for (auto _ : state) session.debug("Read 65535 bytes");
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_LoggerScopedNested);
+
+// Many threads logging through one shared scope
+static void BM_LoggerScopedThreaded(benchmark::State& state) {
+  static auto logger = std::make_shared<LoggerScoped>("server", std::make_shared<NullLogger>());
+  for (auto _ : state) logger->info("New Connection #1 (127.0.0.1)");
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_LoggerScopedThreaded)->Threads(1)->Threads(4)->Threads(8);
+
+}  // namespace cppserver
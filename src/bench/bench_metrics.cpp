@@ -0,0 +1,30 @@
+#include <benchmark/benchmark.h>
+
+#include "hdr_histogram.h"
+#include "metrics.h"
+
+namespace cppserver {
+
+static void BM_CounterInc(benchmark::State& state) {
+  static Counter counter("bench_total", "Benchmark counter");
+  for (auto _ : state) counter.inc();
+}
+BENCHMARK(BM_CounterInc)->Threads(1)->Threads(4)->Threads(8);
+
+static void BM_HistogramObserve(benchmark::State& state) {
+  static Histogram histogram("bench_seconds", "Benchmark histogram", Metrics::latencyBuckets);
+  for (auto _ : state) histogram.observe(0.003);
+}
+BENCHMARK(BM_HistogramObserve)->Threads(1)->Threads(4)->Threads(8);
+
+static void BM_HdrHistogramRecord(benchmark::State& state) {
+  static HdrHistogram histogram(60000000000ULL, 3);
+  uint64_t value = 1;
+  for (auto _ : state) {
+    histogram.record(value);
+    value = (value * 7 + 13) % 10000000;
+  }
+}
+BENCHMARK(BM_HdrHistogramRecord)->Threads(1)->Threads(4)->Threads(8);
+
+}  // namespace cppserver
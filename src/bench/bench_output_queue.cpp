@@ -0,0 +1,54 @@
+#include <benchmark/benchmark.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <thread>
+#include <vector>
+
+#include "output_queue.h"
+
+namespace cppserver {
+
+// Small responses, flushed in batches as a session does after each read.
+// Arg 0 is coalescing off/on, Arg 1 is frames per flush.
+static void BM_OutputQueueSmallResponses(benchmark::State& state) {
+  int fds[2];
+  if (::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+    state.SkipWithError("socketpair failed");
+    return;
+  }
+
+  // Drain the peer end as fast as possible
+  std::thread reader([&]() {
+    std::vector<uint8_t> buffer(256 * 1024);
+    while (::read(fds[1], buffer.data(), buffer.size()) > 0) {
+    }
+  });
+
+  OutputQueueOptions options;
+  options.coalesce = state.range(0);
+  auto metrics = std::make_shared<Metrics>();
+  auto wheel = std::make_shared<TimerWheel>(std::chrono::milliseconds(10));
+  auto payload = std::make_shared<std::vector<uint8_t>>(64, 0);
+
+  {
+    OutputQueue queue(metrics, wheel, fds[0], options);
+    boost::system::error_code ec;
+    uint64_t tag = 0;
+
+    for (auto _ : state) {
+      for (int64_t i = 0; i < state.range(1); i++) queue.push(FrameHeader(OP_ECHO, 0, payload->size(), tag++), BufferRef(payload), ec);
+      queue.flush(ec);
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(1));
+    state.SetBytesProcessed(state.iterations() * state.range(1) * (FRAME_HEADER_SIZE + payload->size()));
+  }
+
+  ::shutdown(fds[0], SHUT_WR);
+  reader.join();
+  ::close(fds[0]);
+  ::close(fds[1]);
+}
+BENCHMARK(BM_OutputQueueSmallResponses)->ArgsProduct({{0, 1}, {1, 16, 64}});
+
+}  // namespace cppserver
@@ -0,0 +1,52 @@
+#include <benchmark/benchmark.h>
+
+#include <vector>
+
+#include "random.h"
+
+namespace cppserver {
+
+static void BM_RandomInt8(benchmark::State& state) {
+  Random random;
+  for (auto _ : state) benchmark::DoNotOptimize(random.get_int8());
+}
+BENCHMARK(BM_RandomInt8);
+
+static void BM_RandomInt16(benchmark::State& state) {
+  Random random;
+  for (auto _ : state) benchmark::DoNotOptimize(random.get_int16());
+}
+BENCHMARK(BM_RandomInt16);
+
+static void BM_RandomInt32(benchmark::State& state) {
+  Random random;
+  for (auto _ : state) benchmark::DoNotOptimize(random.get_int32());
+}
+BENCHMARK(BM_RandomInt32);
+
+static void BM_RandomInt64(benchmark::State& state) {
+  Random random;
+  for (auto _ : state) benchmark::DoNotOptimize(random.get_int64());
+}
+BENCHMARK(BM_RandomInt64);
+
+// Bulk reads, including sizes larger than the internal buffer
+static void BM_RandomGetRandom(benchmark::State& state) {
+  Random random;
+  std::vector<char> buffer(state.range(0));
+  for (auto _ : state) {
+    random.get_random(buffer.data(), buffer.size());
+    benchmark::DoNotOptimize(buffer.data());
+  }
+  state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_RandomGetRandom)->Arg(32)->Arg(4096)->Arg(2 * 1024 * 1024);
+
+// Contended access from several threads
+static void BM_RandomInt64Threaded(benchmark::State& state) {
+  static Random random;
+  for (auto _ : state) benchmark::DoNotOptimize(random.get_int64());
+}
+BENCHMARK(BM_RandomInt64Threaded)->Threads(1)->Threads(4)->Threads(8);
+
+}  // namespace cppserver
@@ -0,0 +1,79 @@
+#include <benchmark/benchmark.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <filesystem>
+#include <thread>
+#include <vector>
+
+#include "logger_stdio.h"
+#include "read_ahead.h"
+
+namespace cppserver {
+
+// A 64MiB device streamed in 64KiB requests through a 16MiB cache
+#define BENCH_READ_BLOCK_SIZE 4096
+#define BENCH_READ_BLOCKS 16384
+#define BENCH_READ_REQUEST_BLOCKS 16
+#define BENCH_READ_CACHE_BYTES (16 * 1024 * 1024)
+#define BENCH_READ_WINDOW_BLOCKS 256
+
+// Sequential streaming of a device whose data is not in the page cache. Each
+// request waits 20us before the next, a stand-in for the network round trip
+// a session spends between reads. Arg 0 is read-ahead off/on.
+static void BM_SequentialRead(benchmark::State& state) {
+  std::string filename = (std::filesystem::temp_directory_path() / "cppserver_bench_read_ahead.img").string();
+  auto metrics = std::make_shared<Metrics>();
+
+  Device row;
+  row.id = 1;
+  row.filename = filename;
+  row.block_size = BENCH_READ_BLOCK_SIZE;
+  row.block_total = BENCH_READ_BLOCKS;
+  auto device = std::make_shared<BlockDevice>(std::make_shared<LoggerStdIO>(LogLevel::ERROR), metrics, row,
+                                              std::make_shared<BlockCache>(metrics, BENCH_READ_CACHE_BYTES, BENCH_READ_BLOCK_SIZE));
+  boost::system::error_code ec;
+  std::vector<uint8_t> data(BENCH_READ_REQUEST_BLOCKS * BENCH_READ_BLOCK_SIZE, 0x5A);
+  if (!device->open(ec)) {
+    state.SkipWithError("open failed");
+    return;
+  }
+  for (uint64_t block = 0; block < BENCH_READ_BLOCKS; block += BENCH_READ_REQUEST_BLOCKS) device->write(block, BENCH_READ_REQUEST_BLOCKS, data.data(), false, ec);
+  device->flush(ec);
+
+  std::unique_ptr<ReadAhead> read_ahead;
+  if (state.range(0)) read_ahead = std::make_unique<ReadAhead>(metrics, 2);
+
+  for (auto _ : state) {
+    // Drop the device from the page cache and start a new stream over a fresh block cache
+    state.PauseTiming();
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    ::posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    ::close(fd);
+    device = std::make_shared<BlockDevice>(std::make_shared<LoggerStdIO>(LogLevel::ERROR), metrics, row,
+                                           std::make_shared<BlockCache>(metrics, BENCH_READ_CACHE_BYTES, BENCH_READ_BLOCK_SIZE));
+    device->open(ec);
+    ReadStream stream;
+    state.ResumeTiming();
+
+    for (uint64_t block = 0; block < BENCH_READ_BLOCKS; block += BENCH_READ_REQUEST_BLOCKS) {
+      if (read_ahead) {
+        uint64_t block_ahead;
+        uint32_t count_ahead;
+        stream.access(block, BENCH_READ_REQUEST_BLOCKS, BENCH_READ_WINDOW_BLOCKS, block_ahead, count_ahead);
+        if (count_ahead) read_ahead->submit(device, block_ahead, count_ahead);
+      }
+      device->read(block, BENCH_READ_REQUEST_BLOCKS, data.data(), ec);
+      std::this_thread::sleep_for(std::chrono::microseconds(20));
+    }
+  }
+  state.SetBytesProcessed(state.iterations() * BENCH_READ_BLOCKS * BENCH_READ_BLOCK_SIZE);
+
+  read_ahead.reset();
+  device.reset();
+  std::filesystem::remove(filename);
+}
+BENCHMARK(BM_SequentialRead)->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+}  // namespace cppserver
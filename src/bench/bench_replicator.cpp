@@ -0,0 +1,75 @@
+#include <benchmark/benchmark.h>
+
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <vector>
+
+#include "block_engine.h"
+#include "device_db_file.h"
+#include "null_logger.h"
+#include "tcp_server.h"
+
+namespace cppserver {
+
+// A 256MiB device of 4KiB blocks, written 128KiB at a time and replicated over loopback
+#define BENCH_REPLICA_PORT 26602
+#define BENCH_REPLICA_BLOCK_SIZE 4096
+#define BENCH_REPLICA_BLOCKS 65536
+#define BENCH_REPLICA_WRITE_BLOCKS 32
+#define BENCH_REPLICA_WRITES 8
+
+// Each iteration writes 1MiB. Async waits for the secondary to have all of it
+// at the end, sync has each write wait for it.
+static void BM_ReplicatorWrite(benchmark::State& state) {
+  auto logger = std::make_shared<NullLogger>();
+  std::filesystem::path dir = std::filesystem::temp_directory_path() / "cppserver_bench_replicator";
+  std::filesystem::create_directories(dir);
+  std::ofstream(dir / "devices.conf") << "host 1 bench 000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f\n"
+                                      << "device 10 1 disk " << (dir / "secondary.img").string() << " " << BENCH_REPLICA_BLOCK_SIZE << " "
+                                      << BENCH_REPLICA_BLOCKS << "\n";
+  DeviceDBFile db(logger, (dir / "devices.conf").string());
+  db.initialise();
+  auto secondary = std::make_shared<BlockEngine>(logger, std::make_shared<Metrics>(), db);
+  TCPServer server(logger, std::make_shared<Metrics>(), secondary, BENCH_REPLICA_PORT, TCPServerOptions());
+  server.start();
+
+  Device device;
+  device.id = 10;
+  device.filename = (dir / "primary.img").string();
+  device.block_size = BENCH_REPLICA_BLOCK_SIZE;
+  device.block_total = BENCH_REPLICA_BLOCKS;
+  device.read_only = false;
+
+  ReplicatorOptions options;
+  options.host = "127.0.0.1";
+  options.port = BENCH_REPLICA_PORT;
+  options.host_id = 1;
+  options.sync = state.range(0);
+
+  auto metrics = std::make_shared<Metrics>();
+  BlockDevice disk(logger, metrics, device);
+  boost::system::error_code ec;
+  disk.open(ec);
+  disk.replicate(std::make_unique<Replicator>(logger, metrics, disk, options));
+  if (!disk.replicator()->wait_synced(std::chrono::seconds(10))) state.SkipWithError("secondary not in sync");
+
+  std::vector<uint8_t> data(BENCH_REPLICA_WRITE_BLOCKS * BENCH_REPLICA_BLOCK_SIZE);
+  for (size_t i = 0; i < data.size(); i++) data[i] = uint8_t(i * 7);
+  uint64_t block = 0;
+  for (auto _ : state) {
+    for (int i = 0; i < BENCH_REPLICA_WRITES; i++) {
+      disk.write(block, BENCH_REPLICA_WRITE_BLOCKS, data.data(), false, ec);
+      block = (block + BENCH_REPLICA_WRITE_BLOCKS) % BENCH_REPLICA_BLOCKS;
+    }
+    if (!state.range(0)) disk.replicator()->wait_synced(std::chrono::seconds(10));
+  }
+  state.SetBytesProcessed(state.iterations() * BENCH_REPLICA_WRITES * data.size());
+
+  disk.close();
+  server.stop();
+  std::filesystem::remove_all(dir);
+}
+BENCHMARK(BM_ReplicatorWrite)->ArgName("sync")->Arg(0)->Arg(1)->UseRealTime();
+
+}  // namespace cppserver
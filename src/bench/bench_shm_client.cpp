@@ -0,0 +1,68 @@
+#include <benchmark/benchmark.h>
+
+#include <filesystem>
+#include <fstream>
+#include <memory>
+
+#include "block_client.h"
+#include "block_engine.h"
+#include "device_db_file.h"
+#include "null_logger.h"
+#include "shm_client.h"
+#include "tcp_server.h"
+
+namespace cppserver {
+
+// A 64MiB device of 4KiB blocks, all of it cached, served on a Unix socket
+#define BENCH_SHM_PORT 26604
+#define BENCH_SHM_BLOCK_SIZE 4096
+#define BENCH_SHM_BLOCKS 16384
+#define BENCH_SHM_CACHE_BYTES (64 * 1024 * 1024)
+
+// Round trip of one synchronous read of 1 or 16 cached blocks, through the
+// Unix socket and through shared memory
+static void BM_ShmClientRead(benchmark::State& state) {
+  auto logger = std::make_shared<NullLogger>();
+  std::filesystem::path dir = std::filesystem::temp_directory_path() / "cppserver_bench_shm_client";
+  std::filesystem::create_directories(dir);
+  std::ofstream(dir / "devices.conf") << "host 1 bench 000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f\n"
+                                      << "device 1 1 disk " << (dir / "disk.img").string() << " " << BENCH_SHM_BLOCK_SIZE << " " << BENCH_SHM_BLOCKS << "\n";
+  DeviceDBFile db(logger, (dir / "devices.conf").string());
+  db.initialise();
+  BlockEngineOptions engine_options;
+  engine_options.cache_bytes = BENCH_SHM_CACHE_BYTES;
+  auto engine = std::make_shared<BlockEngine>(logger, std::make_shared<Metrics>(), db, engine_options);
+  TCPServerOptions server_options;
+  server_options.unix_path = (dir / "cppserver.sock").string();
+  TCPServer server(logger, std::make_shared<Metrics>(), engine, BENCH_SHM_PORT, server_options);
+  server.start();
+
+  uint32_t count = state.range(0);
+  BlockClient socket_client(logger, std::make_shared<Metrics>());
+  ShmClient shm_client(logger, std::make_shared<Metrics>());
+  std::string error;
+  boost::system::error_code ec;
+  bool connected = state.range(1) ? shm_client.connect(server_options.unix_path, 1, 1, error)
+                                  : socket_client.connect_unix(server_options.unix_path, ec) && socket_client.attach(1, 1, error);
+  if (!connected) state.SkipWithError("cannot attach");
+
+  std::vector<uint8_t> data(size_t(count) * BENCH_SHM_BLOCK_SIZE);
+  uint64_t block = 0;
+  for (auto _ : state) {
+    bool ok = state.range(1) ? shm_client.read(block, count, data.data(), error) : socket_client.read(block, count, data.data(), error);
+    if (!ok) {
+      state.SkipWithError(error.c_str());
+      break;
+    }
+    block = (block + count) % BENCH_SHM_BLOCKS;
+  }
+  state.SetBytesProcessed(state.iterations() * data.size());
+  socket_client.close();
+  shm_client.close();
+
+  server.stop();
+  std::filesystem::remove_all(dir);
+}
+BENCHMARK(BM_ShmClientRead)->ArgNames({"blocks", "shm"})->ArgsProduct({{1, 16}, {0, 1}})->UseRealTime();
+
+}  // namespace cppserver
@@ -0,0 +1,44 @@
+#include <benchmark/benchmark.h>
+
+#include <boost/asio.hpp>
+#include <memory>
+#include <vector>
+
+#include "metrics.h"
+#include "null_logger.h"
+#include "protocol.h"
+#include "tcp_server.h"
+
+namespace cppserver {
+
+// Port for the loopback server, away from the cppserverd default
+#define BENCH_TCP_PORT 36547
+
+// ECHO frame round trip over loopback
+static void BM_TCPServerEcho(benchmark::State& state) {
+  auto metrics = std::make_shared<Metrics>();
+  TCPServer server(std::make_shared<NullLogger>(), metrics, nullptr, BENCH_TCP_PORT, TCPServerOptions());
+  server.start();
+
+  boost::asio::io_context io_context;
+  boost::asio::ip::tcp::socket socket(io_context);
+  socket.connect(boost::asio::ip::tcp::endpoint(boost::asio::ip::address_v4::loopback(), BENCH_TCP_PORT));
+  socket.set_option(boost::asio::ip::tcp::no_delay(true));
+
+  std::vector<uint8_t> frame(FRAME_HEADER_SIZE + state.range(0), 0x5A);
+  std::vector<uint8_t> response(frame.size());
+  uint64_t tag = 0;
+
+  for (auto _ : state) {
+    FrameHeader(OP_ECHO, 0, state.range(0), tag++).pack(frame.data());
+    boost::asio::write(socket, boost::asio::buffer(frame));
+    boost::asio::read(socket, boost::asio::buffer(response));
+  }
+
+  state.SetBytesProcessed(state.iterations() * state.range(0));
+  socket.close();
+  server.stop();
+}
+BENCHMARK(BM_TCPServerEcho)->Arg(64)->Arg(4096)->Arg(65535)->UseRealTime();
+
+}  // namespace cppserver
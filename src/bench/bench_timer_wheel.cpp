@@ -0,0 +1,69 @@
+#include <benchmark/benchmark.h>
+
+#include <boost/asio.hpp>
+#include <memory>
+#include <vector>
+
+#include "timer_wheel.h"
+
+namespace cppserver {
+
+// Number of other pending timers, as with one deadline per open session
+#define BENCH_TIMER_SESSIONS 100000
+
+// Re-arm one of 100k pending timers, as a session does on every read
+static void BM_TimerWheelRearm(benchmark::State& state) {
+  TimerWheel wheel(std::chrono::milliseconds(10));
+  std::vector<TimerWheel::Timer> timers(BENCH_TIMER_SESSIONS);
+  for (size_t i = 0; i < timers.size(); i++) wheel.arm(timers[i], std::chrono::milliseconds(1000 + i % 5000), []() {});
+
+  size_t i = 0;
+  for (auto _ : state) {
+    wheel.arm(timers[i], std::chrono::milliseconds(5000), []() {});
+    i = (i + 1) % timers.size();
+  }
+
+  for (auto& timer : timers) wheel.cancel(timer);
+}
+BENCHMARK(BM_TimerWheelRearm);
+
+static void BM_TimerWheelArmCancel(benchmark::State& state) {
+  TimerWheel wheel(std::chrono::milliseconds(10));
+  std::vector<TimerWheel::Timer> timers(BENCH_TIMER_SESSIONS);
+  for (size_t i = 0; i < timers.size(); i++) wheel.arm(timers[i], std::chrono::milliseconds(1000 + i % 5000), []() {});
+
+  TimerWheel::Timer timer;
+  for (auto _ : state) {
+    wheel.arm(timer, std::chrono::milliseconds(5000), []() {});
+    wheel.cancel(timer);
+  }
+
+  for (auto& timer : timers) wheel.cancel(timer);
+}
+BENCHMARK(BM_TimerWheelArmCancel);
+
+// The same re-arm with asio timers, which keep a heap per io_context
+static void BM_SteadyTimerRearm(benchmark::State& state) {
+  boost::asio::io_context io_context;
+  std::vector<std::unique_ptr<boost::asio::steady_timer>> timers;
+  for (size_t i = 0; i < BENCH_TIMER_SESSIONS; i++) {
+    timers.push_back(std::make_unique<boost::asio::steady_timer>(io_context, std::chrono::milliseconds(1000 + i % 5000)));
+    timers.back()->async_wait([](const boost::system::error_code&) {});
+  }
+
+  size_t i = 0;
+  for (auto _ : state) {
+    timers[i]->expires_after(std::chrono::milliseconds(5000));
+    timers[i]->async_wait([](const boost::system::error_code&) {});
+    i = (i + 1) % timers.size();
+
+    // Run the cancelled handlers so they do not pile up
+    if ((i & 1023) == 0) io_context.poll();
+  }
+
+  for (auto& timer : timers) timer->cancel();
+  io_context.poll();
+}
+BENCHMARK(BM_SteadyTimerRearm);
+
+}  // namespace cppserver
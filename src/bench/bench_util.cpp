@@ -0,0 +1,25 @@
+#include <benchmark/benchmark.h>
+
+#include <vector>
+
+#include "util.h"
+
+namespace cppserver {
+
+// Zero detection over a whole block, the worst case of every write
+static void BM_IsZero(benchmark::State& state) {
+  std::vector<uint8_t> block(state.range(0));
+  for (auto _ : state) benchmark::DoNotOptimize(Util::is_zero(block.data(), block.size()));
+  state.SetBytesProcessed(state.iterations() * block.size());
+}
+BENCHMARK(BM_IsZero)->Arg(512)->Arg(4096)->Arg(65536);
+
+// Checksum of a block, paid by every write and every read from disk of a checksummed device
+static void BM_Crc32c(benchmark::State& state) {
+  std::vector<uint8_t> block(state.range(0), 0x5A);
+  for (auto _ : state) benchmark::DoNotOptimize(Util::crc32c(block.data(), block.size()));
+  state.SetBytesProcessed(state.iterations() * block.size());
+}
+BENCHMARK(BM_Crc32c)->Arg(512)->Arg(4096)->Arg(65536)->Arg(1024 * 1024);
+
+}  // namespace cppserver
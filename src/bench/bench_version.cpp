@@ -0,0 +1,40 @@
+#include <benchmark/benchmark.h>
+
+#include "version.h"
+
+namespace cppserver {
+
+static void BM_VersionParseString(benchmark::State& state) {
+  for (auto _ : state) {
+    Version version("1.23.45");
+    benchmark::DoNotOptimize(version);
+  }
+}
+BENCHMARK(BM_VersionParseString);
+
+static void BM_VersionParseBytes(benchmark::State& state) {
+  uint8_t data[3] = {1, 23, 45};
+  for (auto _ : state) {
+    Version version(data, sizeof(data));
+    benchmark::DoNotOptimize(version);
+  }
+}
+BENCHMARK(BM_VersionParseBytes);
+
+static void BM_VersionPack(benchmark::State& state) {
+  Version version(1, 23, 45);
+  uint8_t data[3];
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(version.pack(data));
+    benchmark::ClobberMemory();
+  }
+}
+BENCHMARK(BM_VersionPack);
+
+static void BM_VersionToString(benchmark::State& state) {
+  Version version(1, 23, 45);
+  for (auto _ : state) benchmark::DoNotOptimize(version.to_string());
+}
+BENCHMARK(BM_VersionToString);
+
+}  // namespace cppserver
@@ -0,0 +1,77 @@
+#include <benchmark/benchmark.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <filesystem>
+#include <memory>
+#include <vector>
+
+#include "write_queue.h"
+
+namespace cppserver {
+
+#define BENCH_WRITE_BLOCK_SIZE 4096
+
+static int bench_fd = -1;
+static std::shared_ptr<Metrics> bench_metrics;
+static std::unique_ptr<WriteQueue> bench_queue;
+static std::string bench_filename = (std::filesystem::temp_directory_path() / "cppserver_bench_write_queue.img").string();
+
+static void bench_setup(benchmark::State& state) {
+  if (state.thread_index() != 0) return;
+  bench_fd = ::open(bench_filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  bench_metrics = std::make_shared<Metrics>();
+  bench_queue = std::make_unique<WriteQueue>(bench_metrics, bench_fd, BENCH_WRITE_BLOCK_SIZE);
+}
+
+static void bench_teardown(benchmark::State& state) {
+  if (state.thread_index() != 0) return;
+  bench_queue.reset();
+  ::close(bench_fd);
+  std::filesystem::remove(bench_filename);
+}
+
+// Each thread writes the next block of its own sequential stream and flushes, as a
+// journalling filesystem on an exported device does. Items are flushes acknowledged.
+static void BM_WriteQueueWriteFlush(benchmark::State& state) {
+  bench_setup(state);
+
+  std::vector<uint8_t> data(BENCH_WRITE_BLOCK_SIZE, uint8_t(state.thread_index()));
+  uint64_t block = uint64_t(state.thread_index()) << 20;
+  boost::system::error_code ec;
+  for (auto _ : state) {
+    if (!bench_queue->write(block++, 1, data.data(), false, ec) || !bench_queue->flush(ec)) {
+      state.SkipWithError("write failed");
+      break;
+    }
+  }
+  state.SetItemsProcessed(state.iterations());
+
+  // fdatasync calls per acknowledged flush, below 1 when flushes share a sync
+  if (state.thread_index() == 0) {
+    state.counters["syncs_per_flush"] = double(bench_metrics->counter("cppserver_device_syncs_total", "")->value()) / (state.iterations() * state.threads());
+  }
+
+  bench_teardown(state);
+}
+BENCHMARK(BM_WriteQueueWriteFlush)->Threads(1)->Threads(64)->UseRealTime();
+
+// The same load with a pwrite and fdatasync per request
+static void BM_DirectWriteFlush(benchmark::State& state) {
+  bench_setup(state);
+
+  std::vector<uint8_t> data(BENCH_WRITE_BLOCK_SIZE, uint8_t(state.thread_index()));
+  uint64_t block = uint64_t(state.thread_index()) << 20;
+  for (auto _ : state) {
+    if (::pwrite(bench_fd, data.data(), data.size(), block++ * BENCH_WRITE_BLOCK_SIZE) != ssize_t(data.size()) || ::fdatasync(bench_fd) != 0) {
+      state.SkipWithError("write failed");
+      break;
+    }
+  }
+  state.SetItemsProcessed(state.iterations());
+
+  bench_teardown(state);
+}
+BENCHMARK(BM_DirectWriteFlush)->Threads(1)->Threads(64)->UseRealTime();
+
+}  // namespace cppserver
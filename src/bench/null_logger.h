@@ -0,0 +1,20 @@
+#pragma once
+
+#include <benchmark/benchmark.h>
+
+#include <string>
+
+#include "logger.h"
+
+namespace cppserver {
+
+// Discards everything, so benchmarks measure the caller rather than stdout
+class NullLogger : public Logger {
+ public:
+  virtual void debug(const std::string &log) { benchmark::DoNotOptimize(log.data()); }
+  virtual void info(const std::string &log) { benchmark::DoNotOptimize(log.data()); }
+  virtual void warn(const std::string &log) { benchmark::DoNotOptimize(log.data()); }
+  virtual void error(const std::string &log) { benchmark::DoNotOptimize(log.data()); }
+};
+
+}  // namespace cppserver
@@ -0,0 +1,205 @@
+//
+// cppserver_loadgen
+//
+// Copyright (C) 2024 Tom Cully
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301, USA.
+//
+#include "load_generator.h"
+
+#include <iomanip>
+#include <thread>
+#include <vector>
+
+#include "logger_scoped.h"
+#include "protocol.h"
+
+namespace cppserver {
+
+// Latencies are recorded in nanoseconds up to one minute
+#define LOADGEN_HIGHEST_TRACKABLE 60000000000ULL
+
+LoadGenerator::LoadGenerator(std::shared_ptr<Logger> logger, const LoadOptions& options)
+    : _logger(std::make_shared<LoggerScoped>("loadgen", logger)), _options(options), _latency(LOADGEN_HIGHEST_TRACKABLE, 3) {}
+
+bool LoadGenerator::run() {
+  boost::asio::io_context io_context;
+  boost::asio::ip::tcp::resolver resolver(io_context);
+  boost::system::error_code ec;
+  auto endpoints = resolver.resolve(_options.host, std::to_string(_options.port), ec);
+  if (ec || endpoints.empty()) {
+    _logger->error("Cannot resolve " + _options.host + ": " + ec.message());
+    return false;
+  }
+  _endpoint = *endpoints.begin();
+
+  _logger->info("Connecting " + std::to_string(_options.connections) + " connections to " + _options.host + ":" + std::to_string(_options.port));
+
+  // Give every connection the same start time so open loop schedules line up
+  _start = clock::now() + std::chrono::milliseconds(100);
+  _deadline = _start + std::chrono::seconds(_options.duration);
+
+  std::vector<std::thread> threads;
+  for (uint32_t i = 0; i < _options.connections; i++) threads.emplace_back(&LoadGenerator::_run_connection, this, i);
+  for (auto& thread : threads) thread.join();
+
+  _end = clock::now();
+  return _errors == 0;
+}
+
+void LoadGenerator::_run_connection(uint32_t index) {
+  boost::asio::io_context io_context;
+  boost::asio::ip::tcp::socket socket(io_context);
+  boost::system::error_code ec;
+
+  socket.connect(_endpoint, ec);
+  if (ec) {
+    _logger->error("Connection #" + std::to_string(index) + " failed: " + ec.message());
+    _errors++;
+    return;
+  }
+  socket.set_option(boost::asio::ip::tcp::no_delay(true));
+
+  // One frame buffer per connection, the payload content is irrelevant
+  std::vector<uint8_t> frame(FRAME_HEADER_SIZE + _options.frame_size, 0xA5);
+
+  std::this_thread::sleep_until(_start);
+
+  if (_options.rate) {
+    _open_loop(socket, frame, index);
+  } else {
+    _closed_loop(socket, frame);
+  }
+
+  socket.close(ec);
+}
+
+void LoadGenerator::_closed_loop(boost::asio::ip::tcp::socket& socket, std::vector<uint8_t>& frame) {
+  std::vector<uint8_t> buffer;
+  boost::system::error_code ec;
+
+  for (uint64_t tag = 0; clock::now() < _deadline; tag++) {
+    FrameHeader(OP_ECHO, 0, _options.frame_size, tag).pack(frame.data());
+
+    auto sent = clock::now();
+    boost::asio::write(socket, boost::asio::buffer(frame), ec);
+    if (ec) {
+      _logger->error("Write failed: " + ec.message());
+      _errors++;
+      return;
+    }
+    _frames_sent++;
+
+    uint64_t echo_tag;
+    if (!_read_echo(socket, buffer, echo_tag)) return;
+    _latency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - sent).count());
+  }
+}
+
+void LoadGenerator::_open_loop(boost::asio::ip::tcp::socket& socket, std::vector<uint8_t>& frame, uint32_t index) {
+  // Each connection carries an equal share of the rate, staggered so sends don't arrive in bursts
+  auto interval = std::chrono::nanoseconds(1000000000ULL * _options.connections / _options.rate);
+  auto first = _start + interval * index / _options.connections;
+
+  // Blocking sync reads and writes map directly onto recv/send, so the sender
+  // thread and this receiving thread can share the socket.
+  std::thread sender([&]() {
+    boost::system::error_code ec;
+    for (uint64_t tag = 0;; tag++) {
+      auto scheduled = first + interval * tag;
+      if (scheduled >= _deadline) break;
+      std::this_thread::sleep_until(scheduled);
+
+      FrameHeader(OP_ECHO, 0, _options.frame_size, tag).pack(frame.data());
+      boost::asio::write(socket, boost::asio::buffer(frame), ec);
+      if (ec) break;
+      _frames_sent++;
+    }
+
+    // The server closes once it has echoed everything, ending the receive loop
+    socket.shutdown(boost::asio::ip::tcp::socket::shutdown_send, ec);
+  });
+
+  std::vector<uint8_t> buffer;
+  uint64_t tag;
+  while (_read_echo(socket, buffer, tag)) {
+    auto scheduled = first + interval * tag;
+    _latency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - scheduled).count());
+  }
+
+  sender.join();
+}
+
+bool LoadGenerator::_read_echo(boost::asio::ip::tcp::socket& socket, std::vector<uint8_t>& buffer, uint64_t& tag) {
+  boost::system::error_code ec;
+  uint8_t packed[FRAME_HEADER_SIZE];
+
+  boost::asio::read(socket, boost::asio::buffer(packed), ec);
+  if (ec == boost::asio::error::eof) return false;
+
+  FrameHeader header;
+  if (ec || !header.parse(packed)) {
+    _logger->error("Bad response: " + (ec ? ec.message() : std::string("bad frame header")));
+    _errors++;
+    return false;
+  }
+
+  buffer.resize(header.length);
+  boost::asio::read(socket, boost::asio::buffer(buffer), ec);
+  if (!ec && header.opcode == OP_BUSY) {
+    _logger->warn("Refused: " + std::string(buffer.begin(), buffer.end()));
+    _refused++;
+    return false;
+  }
+  if (ec || header.opcode != OP_ECHO) {
+    _logger->error("Bad response: " + (ec ? ec.message() : std::string(buffer.begin(), buffer.end())));
+    _errors++;
+    return false;
+  }
+
+  tag = header.tag;
+  _frames_received++;
+  return true;
+}
+
+void LoadGenerator::report(std::ostream& os) {
+  double elapsed = std::chrono::duration<double>(_end - _start).count();
+  double frames_per_sec = _frames_received / elapsed;
+
+  os << std::fixed << std::setprecision(2);
+  os << "Target:      " << _options.host << ":" << _options.port << std::endl;
+  os << "Connections: " << _options.connections << ", frame size " << _options.frame_size << " bytes" << std::endl;
+  if (_options.rate) {
+    os << "Mode:        open loop at " << _options.rate << " frames/s" << std::endl;
+  } else {
+    os << "Mode:        closed loop" << std::endl;
+  }
+  os << "Elapsed:     " << elapsed << " s" << std::endl;
+  if (_refused) os << "Refused:     " << _refused << " connections (server busy)" << std::endl;
+  os << "Frames:      " << _frames_sent << " sent, " << _frames_received << " received, " << _errors << " errors" << std::endl;
+  os << "Throughput:  " << frames_per_sec << " frames/s, " << frames_per_sec * (_options.frame_size + FRAME_HEADER_SIZE) / (1024 * 1024) << " MiB/s each way"
+     << std::endl;
+
+  os << "Latency (us" << (_options.rate ? ", from scheduled send" : "") << "):" << std::endl;
+  os << "  mean    " << _latency.mean() / 1000 << std::endl;
+  for (double percentile : {50.0, 90.0, 99.0, 99.9, 99.99}) {
+    os << "  p" << std::left << std::setw(6) << std::setprecision(percentile < 99.9 ? 0 : 2) << percentile << std::right << " " << std::setprecision(2)
+       << _latency.value_at_percentile(percentile) / 1000.0 << std::endl;
+  }
+  os << "  max     " << _latency.max() / 1000.0 << std::endl;
+}
+
+}  // namespace cppserver
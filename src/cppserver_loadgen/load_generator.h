@@ -0,0 +1,87 @@
+//
+// cppserver_loadgen
+//
+// Copyright (C) 2024 Tom Cully
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301, USA.
+//
+#pragma once
+
+#include <atomic>
+#include <boost/asio.hpp>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+
+#include "hdr_histogram.h"
+#include "logger.h"
+
+namespace cppserver {
+
+class LoadOptions {
+ public:
+  std::string host = "127.0.0.1";
+  uint16_t port = 26547;
+  uint32_t connections = 1;
+  uint32_t frame_size = 64;
+  uint64_t rate = 0;  // Total frames per second across all connections, 0 for closed loop
+  uint32_t duration = 10;
+};
+
+// Drives a cppserverd with ECHO frames over N connections and records the
+// round trip latency of each.
+//
+// In closed loop mode each connection sends a frame and waits for its echo
+// before sending the next. In open loop mode frames are sent on a fixed
+// schedule regardless of responses, and latency is measured from the time a
+// frame was scheduled to be sent rather than when it actually was, so a
+// stalled server is charged for every frame it delayed (no coordinated
+// omission).
+class LoadGenerator {
+ public:
+  LoadGenerator(std::shared_ptr<Logger> logger, const LoadOptions& options);
+
+  // Run the load to completion, returns false if any connection failed
+  bool run();
+
+  void report(std::ostream& os);
+
+ private:
+  typedef std::chrono::steady_clock clock;
+
+  void _run_connection(uint32_t index);
+  void _closed_loop(boost::asio::ip::tcp::socket& socket, std::vector<uint8_t>& frame);
+  void _open_loop(boost::asio::ip::tcp::socket& socket, std::vector<uint8_t>& frame, uint32_t index);
+  bool _read_echo(boost::asio::ip::tcp::socket& socket, std::vector<uint8_t>& buffer, uint64_t& tag);
+
+  std::shared_ptr<Logger> _logger;
+  LoadOptions _options;
+
+  boost::asio::ip::tcp::endpoint _endpoint;
+  clock::time_point _start;
+  clock::time_point _deadline;
+  clock::time_point _end;
+
+  HdrHistogram _latency;
+  std::atomic<uint64_t> _frames_sent{0};
+  std::atomic<uint64_t> _frames_received{0};
+  std::atomic<uint32_t> _errors{0};
+  std::atomic<uint32_t> _refused{0};
+};
+
+}  // namespace cppserver
@@ -0,0 +1,77 @@
+//
+// cppserver_loadgen
+//
+// Copyright (C) 2024 Tom Cully
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301, USA.
+//
+#include <boost/program_options.hpp>
+#include <iostream>
+#include <memory>
+#include <string>
+
+#include "load_generator.h"
+#include "logger_stdio.h"
+#include "protocol.h"
+
+namespace po = boost::program_options;
+
+using namespace std;
+using namespace cppserver;
+
+int main(int argc, char* argv[]) {
+  auto mainLogger = std::make_shared<LoggerStdIO>(LogLevel::INFO);
+
+  LoadOptions options;
+
+  try {
+    po::options_description desc("Allowed options");
+
+    // clang-format off
+    desc.add_options()
+      ("help,h", "Help")
+      ("host", po::value<std::string>(&options.host), "Target host (default 127.0.0.1)")
+      ("port", po::value<uint16_t>(&options.port), "Target port (default 26547)")
+      ("connections,c", po::value<uint32_t>(&options.connections), "Concurrent connections (default 1)")
+      ("frame_size,s", po::value<uint32_t>(&options.frame_size), "ECHO payload bytes per frame (default 64)")
+      ("rate,r", po::value<uint64_t>(&options.rate), "Total frames per second, open loop. 0 runs closed loop (default 0)")
+      ("duration,d", po::value<uint32_t>(&options.duration), "Seconds to run (default 10)");
+    // clang-format on
+
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+
+    if (vm.count("help")) {
+      std::cout << desc << std::endl;
+      return 0;
+    }
+  } catch (const po::error& e) {
+    mainLogger->error("Error: " + std::string(e.what()));
+    return 99;
+  }
+
+  if (options.connections == 0 || options.duration == 0 || options.frame_size > FRAME_MAX_PAYLOAD) {
+    mainLogger->error("Invalid Configuration");
+    return 99;
+  }
+
+  LoadGenerator generator(mainLogger, options);
+  bool ok = generator.run();
+  generator.report(std::cout);
+
+  return ok ? 0 : 1;
+}
@@ -19,14 +19,25 @@
 // 02110-1301, USA.
 //
 #include <boost/asio/signal_set.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <chrono>
+#include <fstream>
+#include <functional>
 #include <iostream>
 #include <optional>
+#include <sstream>
 #include <string>
 
+#include "block_engine.h"
 #include "config.h"
+#include "device_db_file.h"
 #include "device_db_mysql.h"
+#include "hash_ring.h"
 #include "logger_scoped.h"
 #include "logger_stdio.h"
+#include "metrics.h"
+#include "metrics_server.h"
+#include "nbd_server.h"
 #include "tcp_server.h"
 #include "url.h"
 #include "util.h"
@@ -36,10 +47,10 @@ using namespace std;
 using namespace cppserver;
 
 int main(int argc, char* argv[]) {
-  auto mainLogger = std::make_shared<LoggerStdIO>(LogLevel::DEBUG);
+  auto metrics = std::make_shared<Metrics>();
+  auto mainLogger = std::make_shared<LoggerStdIO>(LogLevel::DEBUG, metrics);
 
-  // This is v0.1.0
-  Version version(0, 1, 0);
+  Version version(CPPSERVER_VERSION_MAJOR, CPPSERVER_VERSION_MINOR, CPPSERVER_VERSION_PATCH);
 
   mainLogger->info("-----------------------------------");
   mainLogger->info("cppserverd v" + version.to_string());
@@ -52,30 +63,137 @@ int main(int argc, char* argv[]) {
     return 99;
   }
 
-  DeviceDBMySQL ddMysql(mainLogger, config.dbUrl);
-  DeviceDB& deviceDb = ddMysql;
+  std::unique_ptr<DeviceDB> deviceDb;
+  if (config.dbMode == DBMode::FILE) {
+    deviceDb = std::make_unique<DeviceDBFile>(mainLogger, config.dbFile);
+  } else {
+    deviceDb = std::make_unique<DeviceDBMySQL>(mainLogger, metrics, config.dbUrl);
+  }
 
   // Create the device database
-  deviceDb.initialise();
+  deviceDb->initialise();
+
+  // Block I/O for all sessions, with QoS shared per host and per device
+  BlockEngineOptions engineOptions;
+  engineOptions.cache_bytes = uint64_t(config.cacheSize) * 1024 * 1024;
+  engineOptions.cache_block_size = config.cacheBlockSize;
+  engineOptions.read_ahead_bytes = uint64_t(config.readAhead) * 1024;
+  engineOptions.read_ahead_threads = config.readAheadThreads;
+  engineOptions.checksums = config.checksums;
+  engineOptions.scrub_bytes_per_second = uint64_t(config.scrubRate) * 1024 * 1024;
+  engineOptions.replication.host = config.replicateHost;
+  engineOptions.replication.port = config.replicatePort;
+  engineOptions.replication.host_id = config.replicateHostId;
+  engineOptions.replication.sync = config.replicateMode == "sync";
+  auto engine = std::make_shared<BlockEngine>(mainLogger, metrics, *deviceDb, engineOptions);
+
+  // Share devices between the nodes listed in the cluster file by consistent hashing
+  std::function<void()> load_cluster = [&]() {
+    std::ifstream file(config.clusterFile);
+    if (!file) {
+      mainLogger->error("Cannot read " + config.clusterFile);
+      return;
+    }
+    std::vector<std::string> nodes;
+    for (std::string line; std::getline(file, line);) {
+      line = line.substr(0, line.find('#'));
+      line.erase(0, line.find_first_not_of(" \t\r"));
+      line.erase(line.find_last_not_of(" \t\r") + 1);
+      if (!line.empty()) nodes.push_back(line);
+    }
+    engine->cluster(config.node, std::make_shared<HashRing>(nodes, config.virtualNodes));
+  };
+  if (!config.clusterFile.empty()) load_cluster();
 
   // Create the TcpServer instance with the logger and start it on the specified port
-  TCPServer tcpServer(mainLogger, 26547);
+  TCPServerOptions serverOptions;
+  serverOptions.timer_tick_ms = config.timerTick;
+  serverOptions.max_sessions = config.maxSessions;
+  serverOptions.max_accept_rate = config.maxAcceptRate;
+  serverOptions.shed_mode = config.shedMode == "close" ? SHED_CLOSE : SHED_BUSY;
+  serverOptions.dispatch_threads = config.dispatchThreads;
+  serverOptions.ticket_lifetime = config.ticketLifetime;
+  serverOptions.ticket_rotation = config.ticketRotation;
+  serverOptions.unix_path = config.unixSocket;
+  serverOptions.unix_uids = config.unixSocketUids;
+  serverOptions.session.read_timeout_ms = config.readTimeout;
+  serverOptions.session.idle_timeout_ms = config.idleTimeout;
+  serverOptions.session.compression = config.wireCompression;
+  serverOptions.session.zero_copy = config.zeroCopy;
+  serverOptions.session.max_in_flight = config.maxInFlight;
+  serverOptions.session.output.write_timeout_ms = config.writeTimeout;
+
+  TCPServer tcpServer(mainLogger, metrics, engine, config.port, serverOptions);
   Server& server = tcpServer;
 
-  // Wait for SIGINT
+  // Create the NBD server exporting one host's devices, if enabled
+  std::unique_ptr<NBDServer> nbdServer;
+  if (config.nbdPort) {
+    NBDServerOptions nbdOptions;
+    nbdOptions.host_id = config.nbdHost;
+    nbdOptions.dispatch_threads = config.dispatchThreads;
+    nbdOptions.session.max_in_flight = config.maxInFlight;
+    nbdOptions.session.write_timeout_ms = config.writeTimeout;
+    nbdServer = std::make_unique<NBDServer>(mainLogger, metrics, engine, config.nbdPort, nbdOptions);
+  }
+
+  // Create the admin server exposing metrics, if enabled
+  std::unique_ptr<MetricsServer> metricsServer;
+  if (config.adminPort) metricsServer = std::make_unique<MetricsServer>(mainLogger, metrics, config.adminPort);
+
+  // Wait for SIGINT, dump latency percentiles on SIGUSR1, reload the cluster file on SIGHUP
   boost::asio::io_context signal_wait_context;
-  boost::asio::signal_set signals(signal_wait_context, SIGINT);
+  boost::asio::signal_set signals(signal_wait_context, SIGINT, SIGUSR1, SIGHUP);
+
+  // Close a latency histogram interval every metricsInterval seconds
+  boost::asio::steady_timer interval_timer(signal_wait_context);
+  std::function<void()> start_interval = [&]() {
+    interval_timer.expires_after(std::chrono::seconds(config.metricsInterval));
+    interval_timer.async_wait([&](const boost::system::error_code& error) {
+      if (error) return;
+      metrics->rotate();
+      start_interval();
+    });
+  };
+
+  std::function<void()> wait_signal = [&]() {
+    signals.async_wait([&](const boost::system::error_code& error, int signal_number) {
+      if (error) return;
+
+      if (signal_number == SIGUSR1) {
+        mainLogger->debug("SIGUSR1 received");
+        std::istringstream summary(metrics->to_summary());
+        for (std::string line; std::getline(summary, line);) mainLogger->info(line);
+        wait_signal();
+        return;
+      }
+
+      if (signal_number == SIGHUP) {
+        mainLogger->debug("SIGHUP received");
+        if (!config.clusterFile.empty()) load_cluster();
+        wait_signal();
+        return;
+      }
 
-  signals.async_wait([&](const boost::system::error_code& error, int signal_number) {
-    if (!error) {
       mainLogger->debug("SIGINT received");
+      interval_timer.cancel();
       server.stop();
-    }
-  });
+      if (nbdServer) nbdServer->stop();
+      if (metricsServer) metricsServer->stop();
+    });
+  };
+  wait_signal();
+  start_interval();
 
   // Start TCP server
   server.start();
 
+  // Start NBD server
+  if (nbdServer) nbdServer->start();
+
+  // Start admin server
+  if (metricsServer) metricsServer->start();
+
   // Start other server processes...
 
   // Do the SIGINT Wait
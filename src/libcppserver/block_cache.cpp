@@ -0,0 +1,298 @@
+//
+// cppserver
+//
+// Copyright (C) 2024 Tom Cully
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301, USA.
+//
+#include "block_cache.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace cppserver {
+
+uint64_t BlockCache::Key::hash() const {
+  // splitmix64 finaliser over both fields, so neighbouring blocks land in different shards
+  uint64_t x = device * 0x9E3779B97F4A7C15ULL ^ block;
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+  return x ^ (x >> 31);
+}
+
+BlockCache::Index::Index(uint32_t capacity) {
+  // Keep the load factor at or below one half
+  uint64_t size = 1;
+  while (size < uint64_t(capacity) * 2) size <<= 1;
+  _buckets.resize(size);
+  _mask = size - 1;
+}
+
+uint32_t BlockCache::Index::find(const Key& key) const {
+  for (uint64_t i = key.hash() & _mask;; i = (i + 1) & _mask) {
+    const Bucket& bucket = _buckets[i];
+    if (bucket.value == NIL) return NIL;
+    if (bucket.key == key) return bucket.value;
+  }
+}
+
+void BlockCache::Index::insert(const Key& key, uint32_t value) {
+  for (uint64_t i = key.hash() & _mask;; i = (i + 1) & _mask) {
+    Bucket& bucket = _buckets[i];
+    if (bucket.value == NIL || bucket.key == key) {
+      bucket.key = key;
+      bucket.value = value;
+      return;
+    }
+  }
+}
+
+void BlockCache::Index::erase(const Key& key) {
+  uint64_t i = key.hash() & _mask;
+  for (;; i = (i + 1) & _mask) {
+    if (_buckets[i].value == NIL) return;
+    if (_buckets[i].key == key) break;
+  }
+
+  // Shift later members of the probe run back into the hole, unless that would move them before their home bucket
+  for (uint64_t j = (i + 1) & _mask; _buckets[j].value != NIL; j = (j + 1) & _mask) {
+    uint64_t home = _buckets[j].key.hash() & _mask;
+    if (((j - home) & _mask) >= ((j - i) & _mask)) {
+      _buckets[i] = _buckets[j];
+      i = j;
+    }
+  }
+  _buckets[i].value = NIL;
+}
+
+BlockCache::Shard::Shard(uint32_t blocks, uint32_t block_size)
+    : small_target(std::max<uint32_t>(1, blocks * BLOCK_CACHE_SMALL_PERCENT / 100)),
+      slab(new uint8_t[size_t(blocks) * block_size]),
+      entries(blocks),
+      index(blocks),
+      ghosts(std::max<uint32_t>(1, blocks - small_target)),
+      ghost_index(ghosts.size()) {}
+
+BlockCache::BlockCache(std::shared_ptr<Metrics> metrics, uint64_t capacity_bytes, uint32_t pblock_size)
+    : block_size(pblock_size),
+      _hits(metrics->counter("cppserver_cache_hits_total", "Total block reads served from the block cache")),
+      _misses(metrics->counter("cppserver_cache_misses_total", "Total block reads that missed the block cache")),
+      _prefetch_hits(metrics->counter("cppserver_cache_prefetch_hits_total", "Total first reads of blocks placed in the block cache by read-ahead")),
+      _evictions(metrics->counter("cppserver_cache_evictions_total", "Total blocks evicted from the block cache")),
+      _invalidations(metrics->counter("cppserver_cache_invalidations_total", "Total cached blocks dropped by writes")),
+      _blocks(metrics->gauge("cppserver_cache_blocks", "Blocks held in the block cache")) {
+  uint64_t blocks = std::max<uint64_t>(1, capacity_bytes / block_size);
+  uint64_t shards = std::clamp<uint64_t>(blocks / BLOCK_CACHE_MIN_SHARD_BLOCKS, 1, BLOCK_CACHE_SHARDS);
+
+  _capacity = 0;
+  for (uint64_t i = 0; i < shards; i++) {
+    uint32_t shard_blocks = blocks / shards + (i < blocks % shards ? 1 : 0);
+    auto shard = std::make_unique<Shard>(shard_blocks, block_size);
+    for (uint32_t slot = 0; slot < shard_blocks; slot++) _push(*shard, QUEUE_FREE, slot);
+    _shards.push_back(std::move(shard));
+    _capacity += shard_blocks;
+  }
+}
+
+BlockCache::Shard& BlockCache::_shard(const Key& key) {
+  // The index uses the low hash bits, take the shard from the high ones
+  return *_shards[(key.hash() >> 32) % _shards.size()];
+}
+
+bool BlockCache::lookup(uint64_t device, uint64_t block, uint8_t* data, uint64_t& ticket) {
+  Key key{device, block};
+  Shard& shard = _shard(key);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+
+  uint32_t slot = shard.index.find(key);
+  if (slot == NIL) {
+    ticket = shard.invalidations;
+    _misses->inc();
+    return false;
+  }
+
+  Entry& entry = shard.entries[slot];
+  if (entry.prefetched) {
+    entry.prefetched = false;
+    _prefetch_hits->inc();
+  } else if (entry.freq < BLOCK_CACHE_MAX_FREQ) {
+    entry.freq++;
+  }
+  std::memcpy(data, shard.slab.get() + size_t(slot) * block_size, block_size);
+  _hits->inc();
+  return true;
+}
+
+bool BlockCache::probe(uint64_t device, uint64_t block, uint64_t& ticket) {
+  Key key{device, block};
+  Shard& shard = _shard(key);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+
+  ticket = shard.invalidations;
+  return shard.index.find(key) != NIL;
+}
+
+void BlockCache::insert(uint64_t device, uint64_t block, const uint8_t* data, uint64_t ticket, bool prefetched) {
+  Key key{device, block};
+  Shard& shard = _shard(key);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+
+  // Written since the read began, or cached by a concurrent reader
+  if (ticket != shard.invalidations || shard.index.find(key) != NIL) return;
+
+  uint32_t slot = shard.lists[QUEUE_FREE].head;
+  if (slot != NIL) {
+    _unlink(shard, slot);
+    _blocks->inc();
+  } else {
+    slot = _evict(shard);
+  }
+
+  Queue queue = QUEUE_SMALL;
+  if (shard.ghost_index.find(key) != NIL) {
+    shard.ghost_index.erase(key);
+    queue = QUEUE_MAIN;
+  }
+
+  Entry& entry = shard.entries[slot];
+  entry.key = key;
+  entry.freq = 0;
+  entry.prefetched = prefetched;
+  _push(shard, queue, slot);
+  shard.index.insert(key, slot);
+  std::memcpy(shard.slab.get() + size_t(slot) * block_size, data, block_size);
+}
+
+void BlockCache::invalidate(uint64_t device, uint64_t block) {
+  Key key{device, block};
+  Shard& shard = _shard(key);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+
+  shard.invalidations++;
+
+  uint32_t slot = shard.index.find(key);
+  if (slot == NIL) return;
+
+  shard.index.erase(key);
+  _unlink(shard, slot);
+  _push(shard, QUEUE_FREE, slot);
+  _invalidations->inc();
+  _blocks->dec();
+}
+
+uint64_t BlockCache::capacity() const { return _capacity; }
+
+uint64_t BlockCache::size() {
+  uint64_t total = 0;
+  for (auto& shard : _shards) {
+    std::lock_guard<std::mutex> lock(shard->mutex);
+    total += shard->lists[QUEUE_SMALL].size + shard->lists[QUEUE_MAIN].size;
+  }
+  return total;
+}
+
+double BlockCache::hit_ratio() const {
+  uint64_t hits = _hits->value();
+  uint64_t lookups = hits + _misses->value();
+  return lookups ? double(hits) / lookups : 0.0;
+}
+
+void BlockCache::_push(Shard& shard, Queue queue, uint32_t slot) {
+  List& list = shard.lists[queue];
+  Entry& entry = shard.entries[slot];
+  entry.queue = queue;
+  entry.prev = NIL;
+  entry.next = list.head;
+  if (list.head != NIL) {
+    shard.entries[list.head].prev = slot;
+  } else {
+    list.tail = slot;
+  }
+  list.head = slot;
+  list.size++;
+}
+
+void BlockCache::_unlink(Shard& shard, uint32_t slot) {
+  Entry& entry = shard.entries[slot];
+  List& list = shard.lists[entry.queue];
+  if (entry.prev != NIL) {
+    shard.entries[entry.prev].next = entry.next;
+  } else {
+    list.head = entry.next;
+  }
+  if (entry.next != NIL) {
+    shard.entries[entry.next].prev = entry.prev;
+  } else {
+    list.tail = entry.prev;
+  }
+  entry.prev = entry.next = NIL;
+  list.size--;
+}
+
+void BlockCache::_remember(Shard& shard, const Key& key) {
+  if (shard.ghost_index.find(key) != NIL) return;
+
+  uint32_t position = shard.ghost_next;
+  if (shard.ghost_count == shard.ghosts.size()) {
+    // Forget the oldest ghost, unless it has since been re-remembered elsewhere in the ring
+    const Key& oldest = shard.ghosts[position];
+    if (shard.ghost_index.find(oldest) == position) shard.ghost_index.erase(oldest);
+  } else {
+    shard.ghost_count++;
+  }
+
+  shard.ghosts[position] = key;
+  shard.ghost_index.insert(key, position);
+  shard.ghost_next = (position + 1) % shard.ghosts.size();
+}
+
+uint32_t BlockCache::_evict(Shard& shard) {
+  List& small = shard.lists[QUEUE_SMALL];
+  List& main = shard.lists[QUEUE_MAIN];
+
+  for (;;) {
+    if (small.size >= shard.small_target || main.size == 0) {
+      // Blocks read again while on probation are promoted, the rest are evicted and remembered as ghosts
+      uint32_t slot = small.tail;
+      Entry& entry = shard.entries[slot];
+      _unlink(shard, slot);
+      if (entry.freq > 0) {
+        entry.freq = 0;
+        _push(shard, QUEUE_MAIN, slot);
+        continue;
+      }
+      _remember(shard, entry.key);
+      shard.index.erase(entry.key);
+      _evictions->inc();
+      return slot;
+    }
+
+    // Main is CLOCK-like, each remembered access buys another pass
+    uint32_t slot = main.tail;
+    Entry& entry = shard.entries[slot];
+    _unlink(shard, slot);
+    if (entry.freq > 0) {
+      entry.freq--;
+      _push(shard, QUEUE_MAIN, slot);
+      continue;
+    }
+    shard.index.erase(entry.key);
+    _evictions->inc();
+    return slot;
+  }
+}
+
+}  // namespace cppserver
@@ -0,0 +1,175 @@
+//
+// cppserver
+//
+// Copyright (C) 2024 Tom Cully
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301, USA.
+//
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "metrics.h"
+
+namespace cppserver {
+
+// Upper bound on shards, small caches use fewer so each shard keeps a useful number of blocks
+#define BLOCK_CACHE_SHARDS 16
+#define BLOCK_CACHE_MIN_SHARD_BLOCKS 64
+
+// Share of each shard given to the probationary queue
+#define BLOCK_CACHE_SMALL_PERCENT 10
+
+// Accesses remembered per block, each buys one more pass through the main queue
+#define BLOCK_CACHE_MAX_FREQ 3
+
+// Sharded cache of device blocks keyed by (device id, block number).
+//
+// Each shard runs S3-FIFO (Yang et al., SOSP 2023): new blocks enter a small
+// probationary FIFO and only move to the main FIFO if they are read again
+// before falling out of it, so a sequential scan passes through without
+// displacing the hot set. Keys evicted from the small queue are remembered in
+// a ghost FIFO, and a block re-read while its ghost is remembered goes
+// straight to main.
+//
+// Block slots, queue links and the hash indexes are all allocated when the
+// cache is constructed, so lookups and inserts never touch the heap.
+//
+// Reads that miss take a ticket from lookup() and hand it back to insert()
+// once the block has been read from the device. A write invalidates after
+// updating the device, and any insert whose ticket predates an invalidation
+// in its shard is dropped, so a read racing a write never caches stale data.
+class BlockCache {
+ public:
+  BlockCache(std::shared_ptr<Metrics> metrics, uint64_t capacity_bytes, uint32_t block_size);
+
+  // Copy a cached block into data. On a miss returns false and sets ticket for insert().
+  bool lookup(uint64_t device, uint64_t block, uint8_t* data, uint64_t& ticket);
+
+  // Check for a block without reading it or counting an access. When absent sets ticket for insert().
+  bool probe(uint64_t device, uint64_t block, uint64_t& ticket);
+
+  // Cache a block read from the device after a missed lookup or probe. A
+  // prefetched block's first hit is not counted as a re-read, so read-ahead
+  // of a scan stays on probation.
+  void insert(uint64_t device, uint64_t block, const uint8_t* data, uint64_t ticket, bool prefetched = false);
+
+  // Drop a block after it has been written
+  void invalidate(uint64_t device, uint64_t block);
+
+  // Blocks the cache can hold and currently holds
+  uint64_t capacity() const;
+  uint64_t size();
+
+  // Fraction of lookups served from the cache
+  double hit_ratio() const;
+
+  const uint32_t block_size;
+
+ private:
+  static const uint32_t NIL = UINT32_MAX;
+
+  class Key {
+   public:
+    uint64_t device = 0;
+    uint64_t block = 0;
+
+    bool operator==(const Key& other) const { return device == other.device && block == other.block; }
+    uint64_t hash() const;
+  };
+
+  // Fixed capacity open addressing map from Key to a slot, linear probing with
+  // backward shift deletion so it never needs tombstones or rehashing
+  class Index {
+   public:
+    Index(uint32_t capacity);
+
+    uint32_t find(const Key& key) const;
+    void insert(const Key& key, uint32_t value);
+    void erase(const Key& key);
+
+   private:
+    class Bucket {
+     public:
+      Key key;
+      uint32_t value = NIL;
+    };
+
+    std::vector<Bucket> _buckets;
+    uint64_t _mask;
+  };
+
+  enum Queue : uint8_t { QUEUE_FREE, QUEUE_SMALL, QUEUE_MAIN };
+
+  class Entry {
+   public:
+    Key key;
+    uint32_t prev = NIL;
+    uint32_t next = NIL;
+    uint8_t freq = 0;
+    bool prefetched = false;
+    Queue queue = QUEUE_FREE;
+  };
+
+  // Doubly linked FIFO threaded through the shard's entries, new entries at head
+  class List {
+   public:
+    uint32_t head = NIL;
+    uint32_t tail = NIL;
+    uint32_t size = 0;
+  };
+
+  class Shard {
+   public:
+    Shard(uint32_t blocks, uint32_t block_size);
+
+    std::mutex mutex;
+    uint64_t invalidations = 0;
+
+    uint32_t small_target;
+    std::unique_ptr<uint8_t[]> slab;
+    std::vector<Entry> entries;
+    List lists[3];
+    Index index;
+
+    // Keys recently evicted from the small queue, a ring the size of the main queue
+    std::vector<Key> ghosts;
+    uint32_t ghost_next = 0;
+    uint32_t ghost_count = 0;
+    Index ghost_index;
+  };
+
+  Shard& _shard(const Key& key);
+  void _push(Shard& shard, Queue queue, uint32_t slot);
+  void _unlink(Shard& shard, uint32_t slot);
+  void _remember(Shard& shard, const Key& key);
+  uint32_t _evict(Shard& shard);
+
+  uint64_t _capacity;
+  std::vector<std::unique_ptr<Shard>> _shards;
+
+  std::shared_ptr<Counter> _hits;
+  std::shared_ptr<Counter> _misses;
+  std::shared_ptr<Counter> _prefetch_hits;
+  std::shared_ptr<Counter> _evictions;
+  std::shared_ptr<Counter> _invalidations;
+  std::shared_ptr<Gauge> _blocks;
+};
+
+}  // namespace cppserver
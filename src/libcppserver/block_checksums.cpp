@@ -0,0 +1,147 @@
+//
+// cppserver
+//
+// Copyright (C) 2024 Tom Cully
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301, USA.
+//
+#include "block_checksums.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+
+namespace cppserver {
+
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t) && std::atomic<uint32_t>::is_always_lock_free, "Checksums are mapped as atomics");
+
+static boost::system::error_code last_error() { return boost::system::error_code(errno, boost::system::system_category()); }
+
+BlockChecksums::BlockChecksums(const std::string& pfilename, uint64_t pblock_total) : filename(pfilename), block_total(pblock_total) {}
+
+BlockChecksums::~BlockChecksums() {
+  if (_entries) ::munmap(_entries, _length);
+  if (_fd >= 0) ::close(_fd);
+}
+
+bool BlockChecksums::open(bool read_only, boost::system::error_code& ec) {
+  _length = block_total * sizeof(uint32_t);
+  if (_length == 0) {
+    ec = boost::system::errc::make_error_code(boost::system::errc::invalid_argument);
+    return false;
+  }
+
+  _read_only = read_only;
+  _fd = ::open(filename.c_str(), read_only ? O_RDONLY : O_RDWR | O_CREAT, 0644);
+  struct stat st;
+  if (_fd < 0 || ::fstat(_fd, &st) != 0) {
+    ec = last_error();
+    return false;
+  }
+
+  // Blocks added by growing the file have no checksum
+  if (uint64_t(st.st_size) < _length && (read_only || ::ftruncate(_fd, _length) != 0)) {
+    ec = read_only ? boost::system::errc::make_error_code(boost::system::errc::invalid_argument) : last_error();
+    return false;
+  }
+
+  void* map = ::mmap(nullptr, _length, read_only ? PROT_READ : PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+  if (map == MAP_FAILED) {
+    ec = last_error();
+    return false;
+  }
+  _entries = static_cast<std::atomic<uint32_t>*>(map);
+  return true;
+}
+
+uint32_t BlockChecksums::_stripe_count(uint64_t block, uint32_t count) const {
+  if (count == 0) return 0;
+  return std::min<uint64_t>(_first_stripe(block + count - 1) - _first_stripe(block) + 1, BLOCK_CHECKSUMS_STRIPES);
+}
+
+void BlockChecksums::begin_change(uint64_t block, uint32_t count, std::vector<uint64_t>& state) {
+  state.resize(_stripe_count(block, count));
+  for (uint32_t i = 0; i < state.size(); i++) state[i] = _stripe(_first_stripe(block) + i).fetch_add(1);
+}
+
+void BlockChecksums::_end_change(uint64_t block, uint32_t count, const uint32_t* crcs, size_t step, const std::vector<uint64_t>& state) {
+  // Another change in progress when this one began
+  bool overlapped = crcs == nullptr;
+  for (uint64_t value : state) overlapped |= (value & 0xFFFFFFFF) != 0;
+
+  if (!overlapped) {
+    for (uint32_t i = 0; i < count; i++) _entries[block + i].store(crcs[i * step], std::memory_order_release);
+
+    // Checked after storing: a change beginning later stores after this one, one that began before may not have
+    for (uint32_t i = 0; i < state.size(); i++) overlapped |= _stripe(_first_stripe(block) + i).load() != state[i] + 1;
+  }
+  if (overlapped) {
+    for (uint32_t i = 0; i < count; i++) _entries[block + i].store(0, std::memory_order_release);
+  }
+
+  for (uint32_t i = 0; i < state.size(); i++) _stripe(_first_stripe(block) + i).fetch_add((uint64_t(1) << 32) - 1);
+}
+
+bool BlockChecksums::snapshot(uint64_t block, uint32_t count, std::vector<uint64_t>& state) const {
+  state.resize(_stripe_count(block, count));
+  bool quiet = true;
+  for (uint32_t i = 0; i < state.size(); i++) {
+    state[i] = _stripe(_first_stripe(block) + i).load();
+    quiet &= (state[i] & 0xFFFFFFFF) == 0;
+  }
+  return quiet;
+}
+
+bool BlockChecksums::unchanged(uint64_t block, uint32_t count, const std::vector<uint64_t>& state) const {
+  // A state from a snapshot of other blocks cannot vouch for these
+  if (state.size() != _stripe_count(block, count)) return false;
+  for (uint32_t i = 0; i < state.size(); i++) {
+    if (_stripe(_first_stripe(block) + i).load() != state[i]) return false;
+  }
+  return true;
+}
+
+void BlockChecksums::record(uint64_t block, uint32_t count, const uint32_t* crcs, const std::vector<uint64_t>& state) {
+  if (_read_only) return;
+
+  std::vector<bool> recorded(count);
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t none = 0;
+    recorded[i] = _entries[block + i].compare_exchange_strong(none, crcs[i]);
+  }
+
+  // A change that began before the checksums were set may already have set its own, take these back
+  if (unchanged(block, count, state)) return;
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t crc = crcs[i];
+    if (recorded[i]) _entries[block + i].compare_exchange_strong(crc, 0);
+  }
+}
+
+bool BlockChecksums::sync(boost::system::error_code& ec) {
+  if (_read_only) return true;
+  if (::msync(_entries, _length, MS_SYNC) != 0) {
+    ec = last_error();
+    return false;
+  }
+  return true;
+}
+
+}  // namespace cppserver
@@ -0,0 +1,95 @@
+//
+// cppserver
+//
+// Copyright (C) 2024 Tom Cully
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301, USA.
+//
+#pragma once
+
+#include <atomic>
+#include <boost/system/error_code.hpp>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace cppserver {
+
+// Changes are tracked in this many stripes of consecutive blocks, wrapping round the device
+#define BLOCK_CHECKSUMS_STRIPES 256
+#define BLOCK_CHECKSUMS_STRIPE_BLOCKS 16
+
+// The CRC32C of every block of a device, kept in a sidecar file mapped into
+// memory: one native-order u32 per block, 0 for a block with no checksum. A
+// new or extended sidecar is sparse, so existing devices start with none and
+// the scrubber fills them in. A block whose checksum happens to be 0 is
+// never verified.
+//
+// While a block is being changed it may disagree with its checksum, so
+// changes are bracketed by begin_change() and end_change() and counted per
+// stripe, seqlock style. Readers only verify blocks when no change was in
+// progress or completed in their stripes during the read. Changes that
+// overlap cannot tell whose data landed last and clear the checksums.
+class BlockChecksums {
+ public:
+  BlockChecksums(const std::string& filename, uint64_t block_total);
+  ~BlockChecksums();
+
+  bool open(bool read_only, boost::system::error_code& ec);
+
+  uint32_t get(uint64_t block) const { return _entries[block].load(std::memory_order_acquire); }
+
+  void begin_change(uint64_t block, uint32_t count, std::vector<uint64_t>& state);
+  // Set the new checksums of count blocks from block once they are written, or clear them if crcs is null
+  void end_change(uint64_t block, uint32_t count, const uint32_t* crcs, const std::vector<uint64_t>& state) { _end_change(block, count, crcs, 1, state); }
+  // As above with the same checksum for every block
+  void end_change(uint64_t block, uint32_t count, uint32_t crc, const std::vector<uint64_t>& state) { _end_change(block, count, &crc, 0, state); }
+
+  // Before reading, false if a change is in progress
+  bool snapshot(uint64_t block, uint32_t count, std::vector<uint64_t>& state) const;
+  // After reading, true if no change began since the snapshot
+  bool unchanged(uint64_t block, uint32_t count, const std::vector<uint64_t>& state) const;
+
+  // Set the checksums of blocks read between snapshot() and unchanged() that
+  // have none. Never set on a read only sidecar.
+  void record(uint64_t block, uint32_t count, const uint32_t* crcs, const std::vector<uint64_t>& state);
+
+  // Make set checksums durable
+  bool sync(boost::system::error_code& ec);
+
+  const std::string filename;
+  const uint64_t block_total;
+
+ private:
+  int _fd = -1;
+  bool _read_only = false;
+  std::atomic<uint32_t>* _entries = nullptr;
+  size_t _length = 0;
+
+  // Per stripe, changes in progress in the low 32 bits and changes completed in the high
+  std::atomic<uint64_t> _stripes[BLOCK_CHECKSUMS_STRIPES] = {};
+
+  // Block i's checksum is crcs[i * step]
+  void _end_change(uint64_t block, uint32_t count, const uint32_t* crcs, size_t step, const std::vector<uint64_t>& state);
+
+  // The stripes holding count blocks from block
+  uint64_t _first_stripe(uint64_t block) const { return block / BLOCK_CHECKSUMS_STRIPE_BLOCKS; }
+  uint32_t _stripe_count(uint64_t block, uint32_t count) const;
+  std::atomic<uint64_t>& _stripe(uint64_t stripe) { return _stripes[stripe % BLOCK_CHECKSUMS_STRIPES]; }
+  const std::atomic<uint64_t>& _stripe(uint64_t stripe) const { return _stripes[stripe % BLOCK_CHECKSUMS_STRIPES]; }
+};
+
+}  // namespace cppserver
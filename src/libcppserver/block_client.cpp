@@ -0,0 +1,594 @@
+//
+// cppserver
+//
+// Copyright (C) 2024 Tom Cully
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301, USA.
+//
+#include "block_client.h"
+
+#include <algorithm>
+#include <cstring>
+#include <future>
+
+#include "logger_scoped.h"
+
+namespace cppserver {
+
+BlockClient::BlockClient(std::shared_ptr<Logger> logger, std::shared_ptr<Metrics> metrics, const BlockClientOptions& options)
+    : _logger(std::make_unique<LoggerScoped>("client", logger)),
+      _metrics(metrics),
+      _options(options),
+      _latency(metrics->latency("cppserver_client_request_seconds", "Time from a client sending a request to its response")),
+      _requests(metrics->counter("cppserver_client_requests_total", "Total requests sent by clients")) {
+  _options.max_in_flight = std::max<uint32_t>(1, _options.max_in_flight);
+}
+
+BlockClient::~BlockClient() { close(); }
+
+bool BlockClient::connect(const std::string& host, uint16_t port, boost::system::error_code& ec) {
+  if (!_open(host, port, ec)) return false;
+  if (_options.hello) _send_hello();
+  return true;
+}
+
+bool BlockClient::connect_unix(const std::string& path, boost::system::error_code& ec) {
+  if (!_open_unix(path, ec)) return false;
+  if (_options.hello) _send_hello();
+  return true;
+}
+
+bool BlockClient::_open(const std::string& host, uint16_t port, boost::system::error_code& ec) {
+  using boost::asio::ip::tcp;
+  close();
+
+  tcp::resolver resolver(_io_context);
+  auto endpoints = resolver.resolve(host, std::to_string(port), ec);
+  if (ec) return false;
+  tcp::socket socket(_io_context);
+  boost::asio::connect(socket, endpoints, ec);
+  if (ec) return false;
+  socket.set_option(tcp::no_delay(true));
+
+  _node_host = host;
+  _node_port = port;
+  _unix_path.clear();
+  _start(std::make_unique<boost::asio::generic::stream_protocol::socket>(std::move(socket)), host + ":" + std::to_string(port));
+  return true;
+}
+
+bool BlockClient::_open_unix(const std::string& path, boost::system::error_code& ec) {
+  using boost::asio::local::stream_protocol;
+  close();
+
+  stream_protocol::socket socket(_io_context);
+  socket.connect(stream_protocol::endpoint(path), ec);
+  if (ec) return false;
+
+  _unix_path = path;
+  _start(std::make_unique<boost::asio::generic::stream_protocol::socket>(std::move(socket)), "unix:" + path);
+  return true;
+}
+
+bool BlockClient::_reopen(boost::system::error_code& ec) { return _unix_path.empty() ? _open(_node_host, _node_port, ec) : _open_unix(_unix_path, ec); }
+
+void BlockClient::_start(std::unique_ptr<boost::asio::generic::stream_protocol::socket> socket, const std::string& node) {
+  _socket = std::move(socket);
+  _node = node;
+  _codec.reset();
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _hello = Hello();
+  }
+  _connected = true;
+  _reader = std::make_unique<std::thread>(&BlockClient::_read_responses, this);
+}
+
+void BlockClient::_send_hello() {
+  uint32_t capabilities = CAP_OUT_OF_ORDER | (_options.compression ? uint32_t(CAP_COMPRESSION) : 0);
+  Hello(Version(CPPSERVER_VERSION_MAJOR, CPPSERVER_VERSION_MINOR, CPPSERVER_VERSION_PATCH), capabilities, FRAME_MAX_PAYLOAD, _options.max_in_flight)
+      .pack(_hello_request);
+
+  // An older server fails it, leaving the baseline
+  std::vector<BlockRequest> requests(1);
+  requests[0].opcode = OP_HELLO;
+  requests[0].data = _hello_request;
+  requests[0].length = HELLO_SIZE;
+  requests[0].callback = [this](BlockResponse& response) {
+    Hello hello;
+    if (!response.ok() || !hello.parse(response.data.data(), response.data.size())) return;
+    std::lock_guard<std::mutex> lock(_mutex);
+    _hello = hello;
+  };
+  submit(requests);
+}
+
+Hello BlockClient::hello() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _hello;
+}
+
+void BlockClient::close() {
+  if (_socket) {
+    boost::system::error_code ec;
+    _socket->shutdown(boost::asio::socket_base::shutdown_both, ec);
+  }
+  if (_reader) {
+    _reader->join();
+    _reader.reset();
+  }
+  _socket.reset();
+}
+
+bool BlockClient::attach(uint64_t host_id, uint64_t device_id, std::string& error) {
+  _attached = false;
+  _ticket.clear();
+  for (bool redirected = false;; redirected = true) {
+    uint8_t payload[ATTACH_REQUEST_SIZE];
+    put_u64(payload, host_id);
+    put_u64(payload + 8, device_id);
+
+    BlockRequest request;
+    request.opcode = OP_ATTACH;
+    request.flags = (_options.compression ? ATTACH_COMPRESSED : 0) | (_options.tickets ? ATTACH_TICKET : 0);
+    request.data = payload;
+    request.length = sizeof(payload);
+    BlockResponse response = _call(request);
+
+    if (response.opcode == OP_REDIRECT) {
+      std::string node(response.data.begin(), response.data.end());
+      size_t colon = node.rfind(':');
+      uint16_t port = colon == std::string::npos ? 0 : std::atoi(node.c_str() + colon + 1);
+      if (!_options.follow_redirects || redirected || !port) {
+        error = "Device " + std::to_string(device_id) + " is served by " + node;
+        return false;
+      }
+
+      boost::system::error_code ec;
+      if (!connect(node.substr(0, colon), port, ec)) {
+        error = "Cannot connect to " + node + ": " + ec.message();
+        return false;
+      }
+      continue;
+    }
+
+    if (!response.ok()) {
+      error = response.error;
+      return false;
+    }
+    if (!_attach_response(response.data.data(), response.data.size(), error)) return false;
+    _attached = true;
+    _host_id = host_id;
+    _device_id = device_id;
+    return true;
+  }
+}
+
+bool BlockClient::reconnect(std::string& error) {
+  if (!_attached) {
+    error = "Not attached";
+    return false;
+  }
+
+  boost::system::error_code ec;
+  if (!_ticket.empty()) {
+    if (!_reopen(ec)) {
+      error = "Cannot connect to " + _node + ": " + ec.message();
+      return false;
+    }
+
+    // Replaced by the ticket in the response, if any
+    std::vector<uint8_t> ticket;
+    ticket.swap(_ticket);
+    BlockRequest request;
+    request.opcode = OP_RESUME;
+    request.flags = _options.tickets ? ATTACH_TICKET : 0;
+    request.data = ticket.data();
+    request.length = ticket.size();
+    BlockResponse response = _call(request);
+
+    Hello hello;
+    if (response.opcode == OP_RESUME && hello.parse(response.data.data(), response.data.size()) &&
+        _attach_response(response.data.data() + HELLO_SIZE, response.data.size() - HELLO_SIZE, error)) {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _hello = hello;
+      return true;
+    }
+    // Expired, sealed by a secret since retired, or the device has moved: start over
+    std::string reason = !response.ok() ? response.error : response.opcode == OP_REDIRECT ? "redirected" : "bad response";
+    _logger->debug("Resume failed (" + reason + ")");
+    if (_options.hello) _send_hello();
+    return attach(_host_id, _device_id, error);
+  }
+
+  if (!_reopen(ec)) {
+    error = "Cannot connect to " + _node + ": " + ec.message();
+    return false;
+  }
+  if (_options.hello) _send_hello();
+  return attach(_host_id, _device_id, error);
+}
+
+bool BlockClient::_attach_response(const uint8_t* data, size_t len, std::string& error) {
+  if (len < ATTACH_RESPONSE_SIZE || (!(data[12] & ATTACH_TICKET) && len != ATTACH_RESPONSE_SIZE)) {
+    error = "Bad attach response";
+    return false;
+  }
+  _block_size = get_u32(data);
+  _block_total = get_u64(data + 4);
+  _read_only = data[12] & ATTACH_READ_ONLY;
+  _codec = data[12] & ATTACH_COMPRESSED ? std::make_unique<BlockCodec>(_metrics, "client", _block_size) : nullptr;
+  _ticket.assign(data + ATTACH_RESPONSE_SIZE, data + len);
+  return true;
+}
+
+//
+// Asynchronous requests
+//
+
+void BlockClient::read(uint64_t block, uint32_t count, BlockCallback callback, uint8_t flags) {
+  std::vector<BlockRequest> requests(1);
+  requests[0].opcode = OP_READ;
+  requests[0].flags = flags;
+  requests[0].block = block;
+  requests[0].count = count;
+  requests[0].callback = std::move(callback);
+  submit(requests);
+}
+
+void BlockClient::write(uint64_t block, uint32_t count, const uint8_t* data, BlockCallback callback, uint8_t flags) {
+  std::vector<BlockRequest> requests(1);
+  requests[0].opcode = OP_WRITE;
+  requests[0].flags = flags;
+  requests[0].block = block;
+  requests[0].count = count;
+  requests[0].data = data;
+  requests[0].callback = std::move(callback);
+  submit(requests);
+}
+
+void BlockClient::trim(uint64_t block, uint32_t count, BlockCallback callback) {
+  std::vector<BlockRequest> requests(1);
+  requests[0].opcode = OP_TRIM;
+  requests[0].block = block;
+  requests[0].count = count;
+  requests[0].callback = std::move(callback);
+  submit(requests);
+}
+
+void BlockClient::flush(BlockCallback callback) {
+  std::vector<BlockRequest> requests(1);
+  requests[0].opcode = OP_FLUSH;
+  requests[0].callback = std::move(callback);
+  submit(requests);
+}
+
+void BlockClient::echo(const uint8_t* data, uint32_t length, BlockCallback callback) {
+  std::vector<BlockRequest> requests(1);
+  requests[0].opcode = OP_ECHO;
+  requests[0].data = data;
+  requests[0].length = length;
+  requests[0].callback = std::move(callback);
+  submit(requests);
+}
+
+void BlockClient::submit(std::vector<BlockRequest>& requests) {
+  // Requests that could never be sent fail here rather than on the server
+  std::vector<const BlockRequest*> valid;
+  valid.reserve(requests.size());
+  for (auto& request : requests) {
+    uint64_t data_length = request.opcode == OP_WRITE ? uint64_t(request.count) * _block_size : request.length;
+    if (WRITE_REQUEST_HEADER_SIZE + data_length <= FRAME_MAX_PAYLOAD) {
+      valid.push_back(&request);
+      continue;
+    }
+    BlockResponse response;
+    response.opcode = OP_ERROR;
+    response.error = "Request too large";
+    if (request.callback) request.callback(response);
+  }
+
+  std::vector<uint8_t> fixed;
+  std::vector<boost::asio::const_buffer> buffers;
+  for (size_t start = 0; start < valid.size(); start += _options.max_in_flight) {
+    size_t count = std::min<size_t>(_options.max_in_flight, valid.size() - start);
+    const BlockRequest* const* batch = valid.data() + start;
+    uint64_t tag = _reserve(batch, count);
+    if (!tag) {
+      for (size_t i = 0; i < count; i++) {
+        BlockResponse response;
+        response.opcode = OP_ERROR;
+        response.error = "Not connected";
+        if (batch[i]->callback) batch[i]->callback(response);
+      }
+      continue;
+    }
+
+    // Headers and fixed fields are gathered with the callers' data, reserved up front so the buffers stay valid
+    fixed.clear();
+    fixed.reserve(count * (FRAME_HEADER_SIZE + READ_REQUEST_SIZE));
+    buffers.clear();
+    for (size_t i = 0; i < count; i++) {
+      size_t offset = fixed.size();
+      size_t data_length = _encode(*batch[i], tag + i, fixed);
+      buffers.emplace_back(fixed.data() + offset, fixed.size() - offset);
+      if (data_length) buffers.emplace_back(batch[i]->data, data_length);
+    }
+    _send(buffers);
+  }
+}
+
+//
+// Synchronous requests
+//
+
+bool BlockClient::read(uint64_t block, uint32_t count, uint8_t* data, std::string& error) {
+  BlockRequest request;
+  request.opcode = OP_READ;
+  request.block = block;
+  request.count = count;
+  BlockResponse response = _call(request);
+  if (response.ok() && response.data.size() != size_t(count) * _block_size) response.error = "Short read";
+  if (!response.ok()) {
+    error = response.error;
+    return false;
+  }
+  std::memcpy(data, response.data.data(), response.data.size());
+  return true;
+}
+
+bool BlockClient::write(uint64_t block, uint32_t count, const uint8_t* data, bool fua, std::string& error) {
+  BlockRequest request;
+  request.opcode = OP_WRITE;
+  request.flags = fua ? WRITE_FUA : 0;
+  request.block = block;
+  request.count = count;
+  request.data = data;
+  BlockResponse response = _call(request);
+  error = response.error;
+  return response.ok();
+}
+
+bool BlockClient::trim(uint64_t block, uint32_t count, std::string& error) {
+  BlockRequest request;
+  request.opcode = OP_TRIM;
+  request.block = block;
+  request.count = count;
+  BlockResponse response = _call(request);
+  error = response.error;
+  return response.ok();
+}
+
+bool BlockClient::flush(std::string& error) {
+  BlockRequest request;
+  request.opcode = OP_FLUSH;
+  BlockResponse response = _call(request);
+  error = response.error;
+  return response.ok();
+}
+
+void BlockClient::drain() {
+  std::unique_lock<std::mutex> lock(_mutex);
+  _room.wait(lock, [this]() { return _in_flight == 0; });
+}
+
+BlockResponse BlockClient::_call(BlockRequest request) {
+  std::promise<BlockResponse> promise;
+  std::future<BlockResponse> future = promise.get_future();
+  request.callback = [&promise](BlockResponse& response) { promise.set_value(std::move(response)); };
+
+  std::vector<BlockRequest> requests;
+  requests.push_back(std::move(request));
+  submit(requests);
+  return future.get();
+}
+
+//
+// Sending
+//
+
+uint64_t BlockClient::_reserve(const BlockRequest* const* requests, size_t count) {
+  std::unique_lock<std::mutex> lock(_mutex);
+  _room.wait(lock, [&]() { return !_connected || _in_flight + count <= _options.max_in_flight; });
+  if (!_connected) return 0;
+
+  uint64_t first = _next_tag;
+  auto now = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < count; i++) _pending.emplace(_next_tag++, Pending{requests[i]->opcode, requests[i]->count, requests[i]->callback, now});
+  _in_flight += count;
+  return first;
+}
+
+size_t BlockClient::_encode(const BlockRequest& request, uint64_t tag, std::vector<uint8_t>& out) const {
+  size_t offset = out.size();
+  size_t fields = 0;
+  size_t data_length = 0;
+  switch (request.opcode) {
+    case OP_READ:
+    case OP_TRIM:
+      fields = READ_REQUEST_SIZE;
+      break;
+    case OP_WRITE:
+      fields = WRITE_REQUEST_HEADER_SIZE;
+      data_length = size_t(request.count) * _block_size;
+      break;
+    case OP_FLUSH:
+    case OP_SNAPSHOT:
+      break;
+    default:
+      data_length = request.length;
+  }
+
+  out.resize(offset + FRAME_HEADER_SIZE + fields);
+  uint8_t* ptr = out.data() + offset;
+  FrameHeader(request.opcode, request.flags, fields + data_length, tag).pack(ptr);
+  if (fields) put_u64(ptr + FRAME_HEADER_SIZE, request.block);
+  if (fields == READ_REQUEST_SIZE) put_u32(ptr + FRAME_HEADER_SIZE + 8, request.count);
+  return data_length;
+}
+
+void BlockClient::_send(const std::vector<boost::asio::const_buffer>& buffers) {
+  std::lock_guard<std::mutex> lock(_send_mutex);
+  boost::system::error_code ec;
+  boost::asio::write(*_socket, buffers, ec);
+  if (ec) {
+    // The reader then fails everything in flight
+    _logger->warn("Cannot send to " + _node + ": " + ec.message());
+    _socket->shutdown(boost::asio::socket_base::shutdown_both, ec);
+    return;
+  }
+  _requests->inc(buffers.size());
+}
+
+//
+// Receiving
+//
+
+void BlockClient::_read_responses() {
+  std::vector<uint8_t> buffer(BLOCK_CLIENT_READ_SIZE);
+  size_t len = 0;
+  std::string error = "Connection closed";
+
+  for (bool reading = true; reading;) {
+    if (buffer.size() - len < BLOCK_CLIENT_READ_SIZE) buffer.resize(len + BLOCK_CLIENT_READ_SIZE);
+    boost::system::error_code ec;
+    len += _socket->read_some(boost::asio::buffer(buffer.data() + len, buffer.size() - len), ec);
+    if (ec) {
+      if (ec != boost::asio::error::eof) error = "Connection failed: " + ec.message();
+      break;
+    }
+
+    size_t pos = 0;
+    FrameHeader header;
+    while (len - pos >= FRAME_HEADER_SIZE) {
+      if (!header.parse(buffer.data() + pos)) {
+        error = "Bad frame from " + _node;
+        reading = false;
+        break;
+      }
+      if (len - pos - FRAME_HEADER_SIZE < header.length) break;
+
+      const uint8_t* payload = buffer.data() + pos + FRAME_HEADER_SIZE;
+      if (header.opcode == OP_BUSY) {
+        error = "Server busy: " + std::string(payload, payload + header.length);
+      } else {
+        _complete(header, payload);
+      }
+      pos += FRAME_HEADER_SIZE + header.length;
+    }
+    std::memmove(buffer.data(), buffer.data() + pos, len - pos);
+    len -= pos;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _connected = false;
+  }
+  _fail_all(error);
+}
+
+void BlockClient::_complete(const FrameHeader& header, const uint8_t* payload) {
+  Pending pending;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto it = _pending.find(header.tag);
+    if (it == _pending.end()) {
+      _logger->warn("Response from " + _node + " to unknown request " + std::to_string(header.tag));
+      return;
+    }
+    pending = std::move(it->second);
+    _pending.erase(it);
+  }
+  _latency->record(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - pending.sent).count());
+
+  BlockResponse response;
+  response.opcode = header.opcode;
+  if (header.opcode == OP_ERROR) {
+    response.error = std::string(payload, payload + header.length);
+  } else if (header.opcode == OP_READ && _codec) {
+    if (!_codec->decode_records(payload, header.length, pending.count, response.data)) response.error = "Corrupt compressed read";
+  } else {
+    response.data.assign(payload, payload + header.length);
+  }
+  if (pending.callback) pending.callback(response);
+  _finished(1);
+}
+
+void BlockClient::_finished(uint32_t count) {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _in_flight -= count;
+  }
+  _room.notify_all();
+}
+
+void BlockClient::_fail_all(const std::string& error) {
+  std::unordered_map<uint64_t, Pending> failed;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    failed.swap(_pending);
+  }
+  _room.notify_all();
+
+  for (auto& pending : failed) {
+    BlockResponse response;
+    response.opcode = OP_ERROR;
+    response.error = error;
+    if (pending.second.callback) pending.second.callback(response);
+  }
+  _finished(failed.size());
+}
+
+//
+// BlockClientPool
+//
+
+BlockClientPool::BlockClientPool(std::shared_ptr<Logger> logger, std::shared_ptr<Metrics> metrics, size_t size, const BlockClientOptions& options) {
+  for (size_t i = 0; i < std::max<size_t>(1, size); i++) _clients.push_back(std::make_unique<BlockClient>(logger, metrics, options));
+}
+
+bool BlockClientPool::connect(const std::string& host, uint16_t port, uint64_t host_id, uint64_t device_id, std::string& error) {
+  for (auto& client : _clients) {
+    boost::system::error_code ec;
+    if (!client->connect(host, port, ec)) {
+      error = "Cannot connect to " + host + ":" + std::to_string(port) + ": " + ec.message();
+      return false;
+    }
+    if (!client->attach(host_id, device_id, error)) return false;
+  }
+  return true;
+}
+
+void BlockClientPool::close() {
+  for (auto& client : _clients) client->close();
+}
+
+void BlockClientPool::drain() {
+  for (auto& client : _clients) client->drain();
+}
+
+BlockClient& BlockClientPool::next() {
+  // Starting from a different connection each time so ties are spread
+  size_t start = _next++;
+  BlockClient* best = nullptr;
+  for (size_t i = 0; i < _clients.size(); i++) {
+    BlockClient* client = _clients[(start + i) % _clients.size()].get();
+    if (!best || client->in_flight() < best->in_flight()) best = client;
+  }
+  return *best;
+}
+
+}  // namespace cppserver
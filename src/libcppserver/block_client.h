@@ -0,0 +1,234 @@
+//
+// cppserver
+//
+// Copyright (C) 2024 Tom Cully
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301, USA.
+//
+#pragma once
+
+#include <atomic>
+#include <boost/asio.hpp>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "block_codec.h"
+#include "logger.h"
+#include "metrics.h"
+#include "protocol.h"
+
+namespace cppserver {
+
+// Bytes requested from the socket per read
+#define BLOCK_CLIENT_READ_SIZE 65536
+
+class BlockClientOptions {
+ public:
+  uint32_t max_in_flight = 64;   // Requests sent but not yet answered, submitting more waits
+  bool compression = false;      // Ask for compressed transfers at attach
+  bool follow_redirects = true;  // Reconnect to the node a cluster redirects an attach to
+  bool hello = true;             // Negotiate capabilities on connect, otherwise the server treats this as a baseline client
+  bool tickets = true;           // Ask for a resumption ticket at attach for reconnect() to resume the session with
+};
+
+class BlockResponse {
+ public:
+  uint8_t opcode = 0;
+  // Set if the request failed, from the server's error or because the connection closed
+  std::string error;
+  // Blocks read, or the payload of any other response
+  std::vector<uint8_t> data;
+
+  bool ok() const { return error.empty(); }
+};
+
+typedef std::function<void(BlockResponse& response)> BlockCallback;
+
+// One request for BlockClient::submit(). data must stay valid until the callback.
+class BlockRequest {
+ public:
+  uint8_t opcode = 0;
+  uint8_t flags = 0;
+  uint64_t block = 0;
+  uint32_t count = 0;            // Blocks to read, write or trim
+  const uint8_t* data = nullptr;  // count blocks to write, or length bytes to echo
+  uint32_t length = 0;
+  BlockCallback callback;
+};
+
+// A client connection speaking the block protocol. Requests are tagged and
+// any number of threads may submit them, up to max_in_flight at a time, without waiting for
+// earlier ones: each is matched to its response by tag, in whatever order
+// the server answers. Callbacks run on the connection's reader thread, so
+// must not wait for other requests on the same connection.
+//
+// The synchronous calls wrap the asynchronous ones and wait for their
+// callback. submit() sends a batch of requests with a single write.
+class BlockClient {
+ public:
+  BlockClient(std::shared_ptr<Logger> logger, std::shared_ptr<Metrics> metrics, const BlockClientOptions& options = BlockClientOptions());
+  ~BlockClient();
+
+  // Connect, sending HELLO without waiting for its response
+  bool connect(const std::string& host, uint16_t port, boost::system::error_code& ec);
+  // Connect to a server on this host through its Unix socket, likewise
+  bool connect_unix(const std::string& path, boost::system::error_code& ec);
+  // Fail every request in flight and close the connection
+  void close();
+  bool connected() const { return _connected; }
+
+  // Attach to a device, following a redirect to the node serving it once if allowed. On failure error says why.
+  bool attach(uint64_t host_id, uint64_t device_id, std::string& error);
+  // Connect again to the node last attached to and attach to the same device,
+  // resuming from the ticket in one request if the server still accepts it,
+  // otherwise with HELLO and ATTACH. On failure error says why.
+  bool reconnect(std::string& error);
+  // The latest resumption ticket, empty if the server gave none
+  const std::vector<uint8_t>& ticket() const { return _ticket; }
+  uint32_t block_size() const { return _block_size; }
+  uint64_t block_total() const { return _block_total; }
+  bool read_only() const { return _read_only; }
+  bool compressed() const { return _codec != nullptr; }
+  // host:port of the node currently connected to, or unix:path
+  const std::string& node() const { return _node; }
+  // What the server agreed to in HELLO, the baseline until its response has arrived, so certain once any later request completes
+  Hello hello();
+
+  void read(uint64_t block, uint32_t count, BlockCallback callback, uint8_t flags = 0);
+  void write(uint64_t block, uint32_t count, const uint8_t* data, BlockCallback callback, uint8_t flags = 0);
+  void trim(uint64_t block, uint32_t count, BlockCallback callback);
+  void flush(BlockCallback callback);
+  void echo(const uint8_t* data, uint32_t length, BlockCallback callback);
+  void submit(std::vector<BlockRequest>& requests);
+
+  bool read(uint64_t block, uint32_t count, uint8_t* data, std::string& error);
+  bool write(uint64_t block, uint32_t count, const uint8_t* data, bool fua, std::string& error);
+  bool trim(uint64_t block, uint32_t count, std::string& error);
+  bool flush(std::string& error);
+
+  // Wait until every request submitted so far has completed
+  void drain();
+  uint32_t in_flight() const { return _in_flight; }
+
+ private:
+  class Pending {
+   public:
+    uint8_t opcode;
+    uint32_t count;
+    BlockCallback callback;
+    std::chrono::steady_clock::time_point sent;
+  };
+
+  std::unique_ptr<Logger> _logger;
+  std::shared_ptr<Metrics> _metrics;
+  BlockClientOptions _options;
+
+  boost::asio::io_context _io_context;
+  std::unique_ptr<boost::asio::generic::stream_protocol::socket> _socket;
+  std::atomic<bool> _connected{false};
+  std::string _node;
+  std::string _node_host;
+  uint16_t _node_port = 0;
+  std::string _unix_path;
+  uint8_t _hello_request[HELLO_SIZE];
+  Hello _hello;
+
+  // The device last attached to, and the ticket to resume it with
+  bool _attached = false;
+  uint64_t _host_id = 0;
+  uint64_t _device_id = 0;
+  std::vector<uint8_t> _ticket;
+
+  uint32_t _block_size = 0;
+  uint64_t _block_total = 0;
+  bool _read_only = false;
+  // Set while compressed transfers are granted, only used by the reader thread once attached
+  std::unique_ptr<BlockCodec> _codec;
+
+  // Serialises writes of requests to the socket
+  std::mutex _send_mutex;
+
+  // Guards the requests in flight
+  std::mutex _mutex;
+  std::condition_variable _room;
+  std::unordered_map<uint64_t, Pending> _pending;
+  // Requests sent whose callback has not yet returned
+  std::atomic<uint32_t> _in_flight{0};
+  uint64_t _next_tag = 1;
+
+  std::shared_ptr<LatencyHistogram> _latency;
+  std::shared_ptr<Counter> _requests;
+
+  std::unique_ptr<std::thread> _reader;
+
+  // Connect without sending HELLO
+  bool _open(const std::string& host, uint16_t port, boost::system::error_code& ec);
+  bool _open_unix(const std::string& path, boost::system::error_code& ec);
+  // Connect again to the node currently or last connected to
+  bool _reopen(boost::system::error_code& ec);
+  // Start reading responses on a connected socket
+  void _start(std::unique_ptr<boost::asio::generic::stream_protocol::socket> socket, const std::string& node);
+  void _send_hello();
+  // Take the device's geometry, grants and any ticket from an ATTACH response
+  bool _attach_response(const uint8_t* data, size_t len, std::string& error);
+
+  // Register count requests once there is room for them, returning the first tag
+  uint64_t _reserve(const BlockRequest* const* requests, size_t count);
+  // Append the header and fixed fields of a request to out, returning the length of data that follows them
+  size_t _encode(const BlockRequest& request, uint64_t tag, std::vector<uint8_t>& out) const;
+  void _send(const std::vector<boost::asio::const_buffer>& buffers);
+
+  void _read_responses();
+  void _complete(const FrameHeader& header, const uint8_t* payload);
+  // Fail every request in flight with error
+  void _fail_all(const std::string& error);
+  // Count requests whose callbacks have returned, making room for more
+  void _finished(uint32_t count);
+
+  // Send one request and wait for its response
+  BlockResponse _call(BlockRequest request);
+};
+
+// Connections to one device, each request going to the connection with the
+// fewest in flight. Spreads a busy device's requests over several sessions,
+// and so several server threads.
+class BlockClientPool {
+ public:
+  BlockClientPool(std::shared_ptr<Logger> logger, std::shared_ptr<Metrics> metrics, size_t size, const BlockClientOptions& options = BlockClientOptions());
+
+  // Connect every connection and attach it to the device. On failure error says why.
+  bool connect(const std::string& host, uint16_t port, uint64_t host_id, uint64_t device_id, std::string& error);
+  void close();
+
+  BlockClient& next();
+  // Wait until every request submitted on every connection so far has completed
+  void drain();
+  size_t size() const { return _clients.size(); }
+
+ private:
+  std::vector<std::unique_ptr<BlockClient>> _clients;
+  std::atomic<size_t> _next{0};
+};
+
+}  // namespace cppserver
@@ -0,0 +1,101 @@
+//
+// cppserver
+//
+// Copyright (C) 2024 Tom Cully
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301, USA.
+//
+#include "block_codec.h"
+
+#include <lz4.h>
+
+#include <cstring>
+
+#include "protocol.h"
+#include "util.h"
+
+namespace cppserver {
+
+BlockCodec::BlockCodec(std::shared_ptr<Metrics> metrics, const std::string& path, uint32_t pblock_size)
+    : block_size(pblock_size),
+      _raw_bytes(metrics->counter("cppserver_compression_raw_bytes_total", "Total bytes of blocks before compression", "path=\"" + path + "\"")),
+      _encoded_bytes(metrics->counter("cppserver_compression_encoded_bytes_total", "Total bytes of blocks after compression", "path=\"" + path + "\"")),
+      _incompressible(
+          metrics->counter("cppserver_compression_incompressible_blocks_total", "Total blocks kept raw as they did not compress", "path=\"" + path + "\"")) {}
+
+uint32_t BlockCodec::encode(const uint8_t* block, uint8_t* out) {
+  _raw_bytes->inc(block_size);
+
+  if (Util::is_zero(block, block_size)) return 0;
+
+  // Only worth it if the block shrinks by the minimum saving, LZ4 gives up once past the limit
+  int limit = block_size - block_size / BLOCK_CODEC_MIN_SAVING;
+  int len = LZ4_compress_default(reinterpret_cast<const char*>(block), reinterpret_cast<char*>(out), block_size, limit);
+  if (len <= 0 || uint32_t(len) >= block_size) {
+    std::memcpy(out, block, block_size);
+    _encoded_bytes->inc(block_size);
+    _incompressible->inc();
+    return block_size;
+  }
+
+  _encoded_bytes->inc(len);
+  return len;
+}
+
+bool BlockCodec::decode(const uint8_t* in, uint32_t len, uint8_t* block) {
+  if (len == 0) {
+    std::memset(block, 0, block_size);
+    return true;
+  }
+  if (len == block_size) {
+    std::memcpy(block, in, block_size);
+    return true;
+  }
+  if (len > block_size) return false;
+
+  return LZ4_decompress_safe(reinterpret_cast<const char*>(in), reinterpret_cast<char*>(block), len, block_size) == int(block_size);
+}
+
+void BlockCodec::encode_records(const uint8_t* blocks, uint32_t count, std::vector<uint8_t>& out) {
+  size_t pos = out.size();
+  out.resize(pos + records_bound(count));
+
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t len = encode(blocks + size_t(i) * block_size, out.data() + pos + 4);
+    put_u32(out.data() + pos, len);
+    pos += 4 + len;
+  }
+  out.resize(pos);
+}
+
+bool BlockCodec::decode_records(const uint8_t* in, size_t len, uint32_t max_blocks, std::vector<uint8_t>& blocks) {
+  blocks.clear();
+
+  // Zero blocks encode to bare lengths, so a small payload can expand a long way
+  for (size_t pos = 0; pos < len;) {
+    if (len - pos < 4 || blocks.size() / block_size == max_blocks) return false;
+    uint32_t record = get_u32(in + pos);
+    pos += 4;
+    if (record > len - pos) return false;
+
+    blocks.resize(blocks.size() + block_size);
+    if (!decode(in + pos, record, blocks.data() + blocks.size() - block_size)) return false;
+    pos += record;
+  }
+  return true;
+}
+
+}  // namespace cppserver
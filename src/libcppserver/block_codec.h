@@ -0,0 +1,72 @@
+//
+// cppserver
+//
+// Copyright (C) 2024 Tom Cully
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301, USA.
+//
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "metrics.h"
+
+namespace cppserver {
+
+// A compressed block must save at least 1/BLOCK_CODEC_MIN_SAVING of the block, otherwise it is kept raw
+#define BLOCK_CODEC_MIN_SAVING 8
+
+// Per-block LZ4 encoding shared by compressed transfers and compressed devices.
+//
+// A block encodes to one of three forms, told apart by the encoded length:
+// 0 for an all-zero block, the block size for a raw block that did not
+// compress well enough to be worth decoding, anything else for LZ4 data.
+// Blocks are independent, so any one can be decoded alone.
+//
+// On the wire a run of blocks is sent as records, each a big-endian u32
+// encoded length followed by that many bytes.
+class BlockCodec {
+ public:
+  // Counts into cppserver_compression_*{path="<path>"}
+  BlockCodec(std::shared_ptr<Metrics> metrics, const std::string& path, uint32_t block_size);
+
+  // Encode one block into out, which must hold block_size bytes. Returns the encoded length, never more than block_size.
+  uint32_t encode(const uint8_t* block, uint8_t* out);
+
+  // Decode len encoded bytes into one block. Returns false if they are corrupt.
+  bool decode(const uint8_t* in, uint32_t len, uint8_t* block);
+
+  // Append count blocks to out as records
+  void encode_records(const uint8_t* blocks, uint32_t count, std::vector<uint8_t>& out);
+
+  // Decode the records filling len bytes into blocks. Returns false if malformed or more than max_blocks.
+  bool decode_records(const uint8_t* in, size_t len, uint32_t max_blocks, std::vector<uint8_t>& blocks);
+
+  // Size of the records for count blocks in the worst case
+  size_t records_bound(uint32_t count) const { return size_t(count) * (4 + block_size); }
+
+  const uint32_t block_size;
+
+ private:
+  std::shared_ptr<Counter> _raw_bytes;
+  std::shared_ptr<Counter> _encoded_bytes;
+  std::shared_ptr<Counter> _incompressible;
+};
+
+}  // namespace cppserver
@@ -0,0 +1,259 @@
+//
+// cppserver
+//
+// Copyright (C) 2024 Tom Cully
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301, USA.
+//
+#include "block_container.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+
+#include "protocol.h"
+
+namespace cppserver {
+
+static boost::system::error_code last_error() { return boost::system::error_code(errno, boost::system::system_category()); }
+
+static const uint8_t container_padding[BLOCK_CONTAINER_SLOT_ALIGN] = {};
+
+BlockContainer::BlockContainer(std::shared_ptr<Metrics> metrics, int fd, const Device& device)
+    : _fd(fd),
+      _block_size(device.block_size),
+      _block_total(device.block_total),
+      _codec(metrics, "disk", device.block_size),
+      _stored_bytes(
+          metrics->gauge("cppserver_device_stored_bytes", "Bytes of block data space in compressed devices", "device=\"" + std::to_string(device.id) + "\"")) {}
+
+BlockContainer::~BlockContainer() { _stored_bytes->dec(_stored); }
+
+uint64_t BlockContainer::_data_start() const {
+  uint64_t index_end = BLOCK_CONTAINER_HEADER_SIZE + _block_total * BLOCK_CONTAINER_ENTRY_SIZE;
+  return (index_end + BLOCK_CONTAINER_HEADER_SIZE - 1) / BLOCK_CONTAINER_HEADER_SIZE * BLOCK_CONTAINER_HEADER_SIZE;
+}
+
+bool BlockContainer::open(bool read_only, boost::system::error_code& ec) {
+  uint8_t header[24];
+
+  struct stat st;
+  if (::fstat(_fd, &st) != 0) {
+    ec = last_error();
+    return false;
+  }
+
+  if (st.st_size == 0 && !read_only) {
+    // A new container, every block a zero block with no space
+    std::memset(header, 0, sizeof(header));
+    put_u32(header, BLOCK_CONTAINER_MAGIC);
+    put_u32(header + 4, BLOCK_CONTAINER_VERSION);
+    put_u32(header + 8, _block_size);
+    put_u64(header + 16, _block_total);
+    std::vector<struct iovec> iovecs = {{header, sizeof(header)}};
+    if (!_pwritev(iovecs, 0, ec) || ::ftruncate(_fd, _data_start()) != 0 || ::fdatasync(_fd) != 0) {
+      if (!ec) ec = last_error();
+      return false;
+    }
+    st.st_size = _data_start();
+  }
+
+  if (uint64_t(st.st_size) < _data_start() || !_pread(header, sizeof(header), 0, ec) || get_u32(header) != BLOCK_CONTAINER_MAGIC ||
+      get_u32(header + 4) != BLOCK_CONTAINER_VERSION || get_u32(header + 8) != _block_size || get_u64(header + 16) != _block_total) {
+    if (!ec) ec = boost::system::errc::make_error_code(boost::system::errc::invalid_argument);
+    return false;
+  }
+
+  std::vector<uint8_t> raw(_block_total * BLOCK_CONTAINER_ENTRY_SIZE);
+  if (!_pread(raw.data(), raw.size(), BLOCK_CONTAINER_HEADER_SIZE, ec)) return false;
+
+  _index.resize(_block_total);
+  _tail = _data_start();
+  uint64_t stored = 0;
+  for (uint64_t i = 0; i < _block_total; i++) {
+    const uint8_t* ptr = raw.data() + i * BLOCK_CONTAINER_ENTRY_SIZE;
+    Entry& entry = _index[i];
+    entry.offset = get_u64(ptr);
+    entry.length = get_u32(ptr + 8);
+    entry.capacity = get_u32(ptr + 12);
+    if (entry.length > entry.capacity || entry.length > _block_size || (entry.capacity && entry.offset < _data_start())) {
+      ec = boost::system::errc::make_error_code(boost::system::errc::invalid_argument);
+      return false;
+    }
+    if (entry.capacity) _tail = std::max(_tail, entry.offset + entry.capacity);
+    stored += entry.capacity;
+  }
+  _stored = stored;
+  _stored_bytes->inc(stored);
+  return true;
+}
+
+bool BlockContainer::read(uint64_t block, uint32_t count, uint8_t* data, boost::system::error_code& ec) {
+  std::vector<uint8_t> encoded;
+  std::shared_lock<std::shared_mutex> lock(_mutex);
+
+  for (uint32_t i = 0; i < count;) {
+    const Entry& first = _index[block + i];
+    if (first.length == 0) {
+      std::memset(data + size_t(i) * _block_size, 0, _block_size);
+      i++;
+      continue;
+    }
+
+    // Blocks written together were appended together, read their whole span at once
+    uint32_t run = 1;
+    uint64_t end = first.offset + first.capacity;
+    while (i + run < count && _index[block + i + run].length && _index[block + i + run].offset == end) end += _index[block + i + run++].capacity;
+
+    encoded.resize(end - first.offset);
+    if (!_pread(encoded.data(), encoded.size(), first.offset, ec)) return false;
+
+    for (uint32_t j = 0; j < run; j++) {
+      const Entry& entry = _index[block + i + j];
+      if (!_codec.decode(encoded.data() + (entry.offset - first.offset), entry.length, data + size_t(i + j) * _block_size)) {
+        ec = boost::system::errc::make_error_code(boost::system::errc::io_error);
+        return false;
+      }
+    }
+    i += run;
+  }
+  return true;
+}
+
+bool BlockContainer::write(uint64_t block, uint32_t count, const uint8_t* data, boost::system::error_code& ec) {
+  // Compress before taking the lock
+  std::vector<uint8_t> encoded(size_t(count) * _block_size);
+  std::vector<uint32_t> lengths(count);
+  for (uint32_t i = 0; i < count; i++) lengths[i] = _codec.encode(data + size_t(i) * _block_size, encoded.data() + size_t(i) * _block_size);
+
+  std::unique_lock<std::shared_mutex> lock(_mutex);
+
+  // Blocks that fit their space are rewritten in place, the rest appended with one write. The
+  // index only changes once all the data is written.
+  std::vector<Entry> entries(_index.begin() + block, _index.begin() + block + count);
+  std::vector<struct iovec> appended;
+  uint64_t tail = _tail;
+  for (uint32_t i = 0; i < count; i++) {
+    Entry& entry = entries[i];
+    uint8_t* ptr = encoded.data() + size_t(i) * _block_size;
+    entry.length = lengths[i];
+
+    if (lengths[i] <= entry.capacity) {
+      std::vector<struct iovec> iovecs = {{ptr, lengths[i]}};
+      if (lengths[i] && !_pwritev(iovecs, entry.offset, ec)) return false;
+      continue;
+    }
+
+    uint32_t capacity = (lengths[i] + BLOCK_CONTAINER_SLOT_ALIGN - 1) / BLOCK_CONTAINER_SLOT_ALIGN * BLOCK_CONTAINER_SLOT_ALIGN;
+    appended.push_back({ptr, lengths[i]});
+    if (capacity > lengths[i]) appended.push_back({const_cast<uint8_t*>(container_padding), capacity - lengths[i]});
+    entry.offset = tail;
+    entry.capacity = capacity;
+    tail += capacity;
+  }
+  if (!appended.empty() && !_pwritev(appended, _tail, ec)) return false;
+
+  for (uint32_t i = 0; i < count; i++) {
+    _stored = _stored + entries[i].capacity - _index[block + i].capacity;
+    _stored_bytes->inc(int64_t(entries[i].capacity) - _index[block + i].capacity);
+    _index[block + i] = entries[i];
+  }
+  _tail = tail;
+  return _write_index(block, count, ec);
+}
+
+bool BlockContainer::trim(uint64_t block, uint32_t count, boost::system::error_code& ec) {
+  std::unique_lock<std::shared_mutex> lock(_mutex);
+
+  for (uint32_t i = 0; i < count; i++) {
+    Entry& entry = _index[block + i];
+    if (!entry.capacity) continue;
+
+    // Best effort, the space is no longer referenced either way
+    ::fallocate(_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, entry.offset, entry.capacity);
+    _stored -= entry.capacity;
+    _stored_bytes->dec(entry.capacity);
+    entry = Entry();
+  }
+  return _write_index(block, count, ec);
+}
+
+bool BlockContainer::flush(boost::system::error_code& ec) {
+  if (::fdatasync(_fd) != 0) {
+    ec = last_error();
+    return false;
+  }
+  return true;
+}
+
+bool BlockContainer::_write_index(uint64_t block, uint32_t count, boost::system::error_code& ec) {
+  std::vector<uint8_t> raw(size_t(count) * BLOCK_CONTAINER_ENTRY_SIZE);
+  for (uint32_t i = 0; i < count; i++) {
+    const Entry& entry = _index[block + i];
+    uint8_t* ptr = raw.data() + size_t(i) * BLOCK_CONTAINER_ENTRY_SIZE;
+    put_u64(ptr, entry.offset);
+    put_u32(ptr + 8, entry.length);
+    put_u32(ptr + 12, entry.capacity);
+  }
+  std::vector<struct iovec> iovecs = {{raw.data(), raw.size()}};
+  return _pwritev(iovecs, BLOCK_CONTAINER_HEADER_SIZE + block * BLOCK_CONTAINER_ENTRY_SIZE, ec);
+}
+
+bool BlockContainer::_pwritev(std::vector<struct iovec>& iovecs, uint64_t offset, boost::system::error_code& ec) {
+  for (size_t first = 0; first < iovecs.size();) {
+    int n_iov = std::min<size_t>(iovecs.size() - first, IOV_MAX);
+    ssize_t n = ::pwritev(_fd, iovecs.data() + first, n_iov, offset);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      ec = last_error();
+      return false;
+    }
+
+    // Step over what was written, trimming a partly written iovec
+    offset += n;
+    while (first < iovecs.size() && size_t(n) >= iovecs[first].iov_len) n -= iovecs[first++].iov_len;
+    if (n > 0) {
+      iovecs[first].iov_base = static_cast<uint8_t*>(iovecs[first].iov_base) + n;
+      iovecs[first].iov_len -= n;
+    }
+  }
+  return true;
+}
+
+bool BlockContainer::_pread(uint8_t* data, size_t len, uint64_t offset, boost::system::error_code& ec) {
+  for (size_t done = 0; done < len;) {
+    ssize_t n = ::pread(_fd, data + done, len - done, offset + done);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      ec = last_error();
+      return false;
+    }
+    if (n == 0) {
+      ec = boost::system::errc::make_error_code(boost::system::errc::io_error);
+      return false;
+    }
+    done += n;
+  }
+  return true;
+}
+
+}  // namespace cppserver
@@ -0,0 +1,100 @@
+//
+// cppserver
+//
+// Copyright (C) 2024 Tom Cully
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301, USA.
+//
+#pragma once
+
+#include <sys/uio.h>
+
+#include <boost/system/error_code.hpp>
+#include <cstdint>
+#include <memory>
+#include <shared_mutex>
+#include <vector>
+
+#include "block_codec.h"
+#include "device_db.h"
+#include "metrics.h"
+
+namespace cppserver {
+
+#define BLOCK_CONTAINER_MAGIC 0x43534243  // "CSBC"
+#define BLOCK_CONTAINER_VERSION 1
+#define BLOCK_CONTAINER_HEADER_SIZE 4096
+#define BLOCK_CONTAINER_ENTRY_SIZE 16
+
+// Block data space is allocated in multiples of this, so a rewrite that grows a little still fits in place
+#define BLOCK_CONTAINER_SLOT_ALIGN 256
+
+// A device stored as independently compressed blocks behind an offset index.
+//
+// File layout, integers big-endian:
+//
+//   0       magic (4), version (4), block size (4), reserved (4), block total (8)
+//   4096    index, one entry per block: offset (8), length (4), capacity (4)
+//   after   block data, aligned to 4096
+//
+// An entry's length is the BlockCodec encoded length, 0 for a zero block,
+// and capacity is the space allocated for it at offset. A rewrite that fits
+// the capacity is written in place, otherwise new space is appended. Data is
+// written before its index entry. Zero writes keep their space for reuse,
+// trims punch it out. Space given up by blocks that moved is not reclaimed.
+//
+// Readers share a lock and writers take it exclusively once their blocks are
+// compressed, so a block is never read while being rewritten in place.
+class BlockContainer {
+ public:
+  BlockContainer(std::shared_ptr<Metrics> metrics, int fd, const Device& device);
+  ~BlockContainer();
+
+  // Load the index, laying out an empty file first. Fails on a file of different geometry.
+  bool open(bool read_only, boost::system::error_code& ec);
+
+  bool read(uint64_t block, uint32_t count, uint8_t* data, boost::system::error_code& ec);
+  bool write(uint64_t block, uint32_t count, const uint8_t* data, boost::system::error_code& ec);
+  bool trim(uint64_t block, uint32_t count, boost::system::error_code& ec);
+  bool flush(boost::system::error_code& ec);
+
+ private:
+  class Entry {
+   public:
+    uint64_t offset = 0;
+    uint32_t length = 0;
+    uint32_t capacity = 0;
+  };
+
+  int _fd;
+  uint32_t _block_size;
+  uint64_t _block_total;
+  BlockCodec _codec;
+
+  std::shared_mutex _mutex;
+  std::vector<Entry> _index;
+  uint64_t _tail = 0;
+  uint64_t _stored = 0;
+
+  std::shared_ptr<Gauge> _stored_bytes;
+
+  uint64_t _data_start() const;
+  bool _write_index(uint64_t block, uint32_t count, boost::system::error_code& ec);
+  bool _pwritev(std::vector<struct iovec>& iovecs, uint64_t offset, boost::system::error_code& ec);
+  bool _pread(uint8_t* data, size_t len, uint64_t offset, boost::system::error_code& ec);
+};
+
+}  // namespace cppserver
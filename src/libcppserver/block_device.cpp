@@ -0,0 +1,547 @@
+//
+// cppserver
+//
+// Copyright (C) 2024 Tom Cully
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301, USA.
+//
+#include "block_device.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include "logger_scoped.h"
+#include "util.h"
+
+namespace cppserver {
+
+static boost::system::error_code last_error() { return boost::system::error_code(errno, boost::system::system_category()); }
+
+BlockDevice::BlockDevice(std::shared_ptr<Logger> logger, std::shared_ptr<Metrics> metrics, const Device& pdevice, std::shared_ptr<BlockCache> cache,
+                         bool checksums)
+    : device(pdevice),
+      qos(pdevice.iops_limit, pdevice.bps_limit),
+      _logger(std::make_unique<LoggerScoped>("device " + std::to_string(pdevice.id), logger)),
+      _metrics(metrics),
+      _cache(cache && cache->block_size == pdevice.block_size ? cache : nullptr),
+      _use_checksums(checksums),
+      _bytes_read(metrics->counter("cppserver_device_read_bytes_total", "Total bytes read from devices", "device=\"" + std::to_string(pdevice.id) + "\"")),
+      _bytes_written(
+          metrics->counter("cppserver_device_written_bytes_total", "Total bytes written to devices", "device=\"" + std::to_string(pdevice.id) + "\"")),
+      _bytes_trimmed(
+          metrics->counter("cppserver_device_trimmed_bytes_total", "Total bytes discarded by trim requests", "device=\"" + std::to_string(pdevice.id) + "\"")),
+      _hole_bytes_read(metrics->counter("cppserver_device_hole_read_bytes_total", "Total bytes read from holes without reading the disk",
+                                        "device=\"" + std::to_string(pdevice.id) + "\"")),
+      _checksum_errors(metrics->counter("cppserver_device_checksum_errors_total", "Total blocks read that did not match their checksum",
+                                        "device=\"" + std::to_string(pdevice.id) + "\"")),
+      _read_latency(metrics->latency("cppserver_device_read_latency_seconds", "Device read latency")),
+      _write_latency(metrics->latency("cppserver_device_write_latency_seconds", "Device write latency")),
+      _flush_latency(metrics->latency("cppserver_device_flush_latency_seconds", "Device flush latency")) {}
+
+BlockDevice::~BlockDevice() { close(); }
+
+bool BlockDevice::open(boost::system::error_code& ec) {
+  if (device.block_size == 0) {
+    ec = boost::system::errc::make_error_code(boost::system::errc::invalid_argument);
+    _logger->error("Block size is 0");
+    return false;
+  }
+
+  _fd = ::open(device.filename.c_str(), device.read_only ? O_RDONLY : O_RDWR | O_CREAT, 0644);
+  if (_fd < 0) {
+    ec = last_error();
+    _logger->error("Cannot open " + device.filename + ": " + ec.message());
+    return false;
+  }
+
+  if (device.compressed) {
+    _container = std::make_unique<BlockContainer>(_metrics, _fd, device);
+    if (!_container->open(device.read_only, ec)) {
+      _logger->error("Cannot open " + device.filename + " as a compressed container: " + ec.message());
+      close();
+      return false;
+    }
+  } else {
+    // Extend short files, reads past the end of the data return zeros
+    struct stat st;
+    off_t size = device.block_total * device.block_size;
+    if (!device.read_only && ::fstat(_fd, &st) == 0 && st.st_size < size && ::ftruncate(_fd, size) != 0) {
+      ec = last_error();
+      _logger->error("Cannot extend " + device.filename + ": " + ec.message());
+      close();
+      return false;
+    }
+    _sparse = ::fstat(_fd, &st) == 0 && st.st_blocks * 512 < st.st_size;
+
+    if (!device.read_only) _write_queue = std::make_unique<WriteQueue>(_metrics, _fd, device.block_size);
+  }
+
+  // Writes since a snapshot are only visible through its overlay, so the device cannot open without it, even once made read only
+  {
+    auto overlay = std::make_unique<BlockOverlay>(_metrics, device.filename, device.id, device.block_size, device.block_total);
+    if (overlay->open(device.read_only, ec)) {
+      _overlay = std::move(overlay);
+    } else if (ec != boost::system::errc::no_such_file_or_directory) {
+      _logger->error("Cannot open snapshot overlay " + overlay->filename + ": " + ec.message());
+      close();
+      return false;
+    }
+    ec.clear();
+  }
+
+  _open_checksums();
+
+  // Checksums are verified on every read, an overlay holds blocks newer than the file's, and a short file would end a range early
+  if (device.read_only && !device.compressed && !_checksums && !_overlay) {
+    struct stat st;
+    _file_ranges = ::fstat(_fd, &st) == 0 && uint64_t(st.st_size) >= device.block_total * device.block_size;
+  }
+
+  _logger->info("Opened " + device.filename + (device.compressed ? " (compressed)" : "") + (device.read_only ? " (read only)" : "") +
+                (_cache ? " (cached)" : "") + (_checksums ? " (checksummed)" : "") + (_overlay ? " (snapshotted)" : ""));
+  return true;
+}
+
+void BlockDevice::_open_checksums() {
+  if (!_use_checksums) return;
+
+  std::vector<uint8_t> zero(device.block_size);
+  _zero_crc = Util::crc32c(zero.data(), zero.size());
+
+  // The device still works without them
+  boost::system::error_code ec;
+  _checksums = std::make_unique<BlockChecksums>(device.filename + ".crc", device.block_total);
+  if (!_checksums->open(device.read_only, ec)) {
+    _logger->warn("Checksums disabled, cannot open " + _checksums->filename + ": " + ec.message());
+    _checksums.reset();
+  }
+}
+
+void BlockDevice::_mismatch(uint64_t block, const char* found_by) {
+  _checksum_errors->inc();
+  _logger->error("Checksum mismatch in block " + std::to_string(block) + " found by " + found_by);
+}
+
+void BlockDevice::close() {
+  _file_ranges = false;
+  _replicator.reset();
+  _overlay.reset();
+  _write_queue.reset();
+  _container.reset();
+  _checksums.reset();
+  if (_fd >= 0) {
+    ::close(_fd);
+    _fd = -1;
+  }
+}
+
+bool BlockDevice::valid_range(uint64_t block, uint64_t count) const { return block <= device.block_total && count <= device.block_total - block; }
+
+bool BlockDevice::read(uint64_t block, uint32_t count, uint8_t* data, boost::system::error_code& ec) {
+  ScopedLatency timer(*_read_latency);
+  std::shared_lock<std::shared_mutex> lock(_snapshot_mutex);
+
+  if (!(_cache ? _read_cached(block, count, data, ec) : _pread(block, count, data, ec))) return false;
+
+  _bytes_read->inc(size_t(count) * device.block_size);
+  return true;
+}
+
+bool BlockDevice::file_range(uint64_t block, uint32_t count, int& fd, off_t& offset) {
+  if (!_file_ranges) return false;
+
+  fd = _fd;
+  offset = block * device.block_size;
+  _bytes_read->inc(size_t(count) * device.block_size);
+  return true;
+}
+
+bool BlockDevice::read_hit(uint64_t block, uint32_t count, uint8_t* data) {
+  if (!_cache) return false;
+  ScopedLatency timer(*_read_latency);
+  std::shared_lock<std::shared_mutex> lock(_snapshot_mutex);
+
+  // Probe first so a read that falls back to the file does not count its misses twice
+  uint64_t ticket;
+  for (uint32_t i = 0; i < count; i++) {
+    if (!_cache->probe(device.id, block + i, ticket)) return false;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    if (!_cache->lookup(device.id, block + i, data + size_t(i) * device.block_size, ticket)) return false;
+  }
+
+  _bytes_read->inc(size_t(count) * device.block_size);
+  return true;
+}
+
+bool BlockDevice::_read_cached(uint64_t block, uint32_t count, uint8_t* data, boost::system::error_code& ec) {
+  uint64_t tickets[BLOCK_DEVICE_MISS_RUN];
+
+  for (uint32_t i = 0; i < count;) {
+    uint8_t* ptr = data + size_t(i) * device.block_size;
+    if (_cache->lookup(device.id, block + i, ptr, tickets[0])) {
+      i++;
+      continue;
+    }
+
+    // Read the following missing blocks with the same call, stopping at the next hit
+    uint32_t run = 1;
+    bool hit = false;
+    while (i + run < count && run < BLOCK_DEVICE_MISS_RUN) {
+      if (_cache->lookup(device.id, block + i + run, ptr + size_t(run) * device.block_size, tickets[run])) {
+        hit = true;
+        break;
+      }
+      run++;
+    }
+
+    if (!_pread(block + i, run, ptr, ec)) return false;
+    for (uint32_t j = 0; j < run; j++) _cache->insert(device.id, block + i + j, ptr + size_t(j) * device.block_size, tickets[j]);
+
+    i += run + (hit ? 1 : 0);
+  }
+  return true;
+}
+
+uint32_t BlockDevice::prefetch(uint64_t block, uint32_t count, std::vector<uint8_t>& scratch) {
+  if (!_cache || block >= device.block_total) return 0;
+  count = std::min<uint64_t>(count, device.block_total - block);
+  std::shared_lock<std::shared_mutex> lock(_snapshot_mutex);
+
+  uint64_t tickets[BLOCK_DEVICE_MISS_RUN];
+  uint32_t fetched = 0;
+  boost::system::error_code ec;
+
+  for (uint32_t i = 0; i < count;) {
+    // Runs of absent blocks, as for reads
+    uint32_t run = 0;
+    while (i + run < count && run < BLOCK_DEVICE_MISS_RUN && !_cache->probe(device.id, block + i + run, tickets[run])) run++;
+    if (run == 0) {
+      i++;
+      continue;
+    }
+
+    scratch.resize(size_t(run) * device.block_size);
+    if (!_pread(block + i, run, scratch.data(), ec)) break;
+    for (uint32_t j = 0; j < run; j++) _cache->insert(device.id, block + i + j, scratch.data() + size_t(j) * device.block_size, tickets[j], true);
+
+    fetched += run;
+    i += run;
+  }
+  return fetched;
+}
+
+bool BlockDevice::_pread(uint64_t block, uint32_t count, uint8_t* data, boost::system::error_code& ec) {
+  if (!_checksums) return _read_blocks(block, count, data, ec);
+
+  // Verified only if no write to the blocks overlapped the read, see BlockChecksums
+  std::vector<uint64_t> state;
+  bool quiet = _checksums->snapshot(block, count, state);
+  if (!_read_blocks(block, count, data, ec)) return false;
+  if (!quiet || !_checksums->unchanged(block, count, state)) return true;
+
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t crc = _checksums->get(block + i);
+    if (crc && Util::crc32c(data + size_t(i) * device.block_size, device.block_size) != crc) {
+      _mismatch(block + i, "read");
+      ec = boost::system::errc::make_error_code(boost::system::errc::io_error);
+      return false;
+    }
+  }
+  return true;
+}
+
+int BlockDevice::scrub(uint64_t block, uint32_t count, std::vector<uint8_t>& scratch) {
+  if (!_checksums) return 0;
+  std::shared_lock<std::shared_mutex> lock(_snapshot_mutex);
+
+  std::vector<uint64_t> state;
+  bool quiet = _checksums->snapshot(block, count, state);
+
+  boost::system::error_code ec;
+  scratch.resize(size_t(count) * device.block_size);
+  if (!_read_blocks(block, count, scratch.data(), ec)) {
+    _logger->error("Scrub read of block " + std::to_string(block) + " failed: " + ec.message());
+    return -1;
+  }
+
+  // Blocks being written are left for the next pass
+  if (!quiet || !_checksums->unchanged(block, count, state)) return 0;
+
+  int mismatches = 0;
+  std::vector<uint32_t> crcs(count);
+  for (uint32_t i = 0; i < count; i++) {
+    crcs[i] = Util::crc32c(scratch.data() + size_t(i) * device.block_size, device.block_size);
+    uint32_t stored = _checksums->get(block + i);
+    if (stored && stored != crcs[i]) {
+      _mismatch(block + i, "scrub");
+      mismatches++;
+    }
+  }
+  _checksums->record(block, count, crcs.data(), state);
+  return mismatches;
+}
+
+bool BlockDevice::_read_blocks(uint64_t block, uint32_t count, uint8_t* data, boost::system::error_code& ec) {
+  if (!_overlay) return _read_image(block, count, data, ec);
+
+  // Runs of blocks from the image, zeroed since the snapshot, or in consecutive overlay slots
+  for (uint32_t i = 0, run; i < count; i += run) {
+    uint8_t* ptr = data + size_t(i) * device.block_size;
+    uint32_t slot, next;
+    run = 1;
+
+    if (!_overlay->lookup(block + i, slot)) {
+      while (i + run < count && !_overlay->lookup(block + i + run, next)) run++;
+      if (!_read_image(block + i, run, ptr, ec)) return false;
+    } else if (slot == BLOCK_OVERLAY_ZERO) {
+      while (i + run < count && _overlay->lookup(block + i + run, next) && next == BLOCK_OVERLAY_ZERO) run++;
+      std::memset(ptr, 0, size_t(run) * device.block_size);
+    } else {
+      while (i + run < count && _overlay->lookup(block + i + run, next) && next == slot + run) run++;
+      if (!_overlay->read(slot, run, ptr, ec)) return false;
+    }
+  }
+  return true;
+}
+
+bool BlockDevice::_read_image(uint64_t block, uint32_t count, uint8_t* data, boost::system::error_code& ec) {
+  if (_container) return _container->read(block, count, data, ec);
+
+  size_t len = size_t(count) * device.block_size;
+  off_t offset = block * device.block_size;
+
+  if (!_sparse && !(_write_queue && _write_queue->holes())) return _pread_data(data, len, offset, ec);
+
+  // Read only the data extents, zero filling holes between them
+  for (off_t pos = offset, end = offset + len; pos < end;) {
+    off_t data_start = ::lseek(_fd, pos, SEEK_DATA);
+    if (data_start < 0 && errno != ENXIO) return _pread_data(data + (pos - offset), end - pos, pos, ec);
+    if (data_start < 0 || data_start > end) data_start = end;
+
+    if (data_start > pos) {
+      std::memset(data + (pos - offset), 0, data_start - pos);
+      _hole_bytes_read->inc(data_start - pos);
+      pos = data_start;
+      if (pos == end) break;
+    }
+
+    off_t data_end = ::lseek(_fd, pos, SEEK_HOLE);
+    if (data_end < 0 || data_end > end) data_end = end;
+    if (!_pread_data(data + (pos - offset), data_end - pos, pos, ec)) return false;
+    pos = data_end;
+  }
+  return true;
+}
+
+bool BlockDevice::_pread_data(uint8_t* data, size_t len, off_t offset, boost::system::error_code& ec) {
+  for (size_t done = 0; done < len;) {
+    ssize_t n = ::pread(_fd, data + done, len - done, offset + done);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      ec = last_error();
+      return false;
+    }
+    if (n == 0) {
+      // Past the end of a read only file
+      std::memset(data + done, 0, len - done);
+      break;
+    }
+    done += n;
+  }
+  return true;
+}
+
+bool BlockDevice::write(uint64_t block, uint32_t count, const uint8_t* data, bool fua, boost::system::error_code& ec) {
+  if (device.read_only) {
+    ec = boost::system::errc::make_error_code(boost::system::errc::read_only_file_system);
+    return false;
+  }
+
+  ScopedLatency timer(*_write_latency);
+  std::shared_lock<std::shared_mutex> lock(_snapshot_mutex);
+
+  std::vector<uint32_t> crcs;
+  std::vector<uint64_t> state;
+  if (_checksums) {
+    crcs.resize(count);
+    for (uint32_t i = 0; i < count; i++) crcs[i] = Util::crc32c(data + size_t(i) * device.block_size, device.block_size);
+    _checksums->begin_change(block, count, state);
+  }
+
+  bool written = _overlay ? _overlay->write(block, count, data, ec) && (!fua || _overlay->flush(ec)) : _write_image(block, count, data, fua, ec);
+
+  // After the write, so a read that missed before it cannot cache the old data. A failed write may have changed some blocks.
+  if (_cache) {
+    for (uint32_t i = 0; i < count; i++) _cache->invalidate(device.id, block + i);
+  }
+  if (_checksums) _checksums->end_change(block, count, written ? crcs.data() : nullptr, state);
+  lock.unlock();
+
+  // Even if the write failed, which may have changed some blocks
+  if (_replicator) _replicator->replicate(block, count);
+  if (!written) return false;
+
+  _bytes_written->inc(size_t(count) * device.block_size);
+  return true;
+}
+
+bool BlockDevice::trim(uint64_t block, uint32_t count, boost::system::error_code& ec) {
+  if (device.read_only) {
+    ec = boost::system::errc::make_error_code(boost::system::errc::read_only_file_system);
+    return false;
+  }
+
+  std::shared_lock<std::shared_mutex> lock(_snapshot_mutex);
+  std::vector<uint64_t> state;
+  if (_checksums) _checksums->begin_change(block, count, state);
+
+  bool trimmed = _overlay ? _overlay->zero(block, count, ec) : _trim_image(block, count, ec);
+  if (_cache) {
+    for (uint32_t i = 0; i < count; i++) _cache->invalidate(device.id, block + i);
+  }
+  if (_checksums) {
+    if (trimmed) {
+      _checksums->end_change(block, count, _zero_crc, state);
+    } else {
+      _checksums->end_change(block, count, nullptr, state);
+    }
+  }
+  lock.unlock();
+
+  if (_replicator) _replicator->replicate(block, count);
+  if (!trimmed) return false;
+
+  _bytes_trimmed->inc(size_t(count) * device.block_size);
+  return true;
+}
+
+bool BlockDevice::flush(boost::system::error_code& ec) {
+  ScopedLatency timer(*_flush_latency);
+  std::shared_lock<std::shared_mutex> lock(_snapshot_mutex);
+
+  // Data before the checksums describing it
+  if (_overlay ? !_overlay->flush(ec) : !_flush_image(ec)) return false;
+  return !_checksums || _checksums->sync(ec);
+}
+
+bool BlockDevice::_write_image(uint64_t block, uint32_t count, const uint8_t* data, bool fua, boost::system::error_code& ec) {
+  return _container ? _container->write(block, count, data, ec) && (!fua || _container->flush(ec)) : _write_queue->write(block, count, data, fua, ec);
+}
+
+bool BlockDevice::_trim_image(uint64_t block, uint32_t count, boost::system::error_code& ec) {
+  return _container ? _container->trim(block, count, ec) : _write_queue->trim(block, count, ec);
+}
+
+bool BlockDevice::_flush_image(boost::system::error_code& ec) {
+  // Nothing to make durable on a read only device
+  if (_container) return _container->flush(ec);
+  return !_write_queue || _write_queue->flush(ec);
+}
+
+bool BlockDevice::snapshot(boost::system::error_code& ec) {
+  std::unique_lock<std::shared_mutex> lock(_snapshot_mutex);
+  if (device.read_only) {
+    ec = boost::system::errc::make_error_code(boost::system::errc::read_only_file_system);
+    return false;
+  }
+  if (_overlay) {
+    ec = boost::system::errc::make_error_code(boost::system::errc::file_exists);
+    return false;
+  }
+
+  // Durable first, so the image the snapshot freezes survives a crash
+  auto overlay = std::make_unique<BlockOverlay>(_metrics, device.filename, device.id, device.block_size, device.block_total);
+  if (!_flush_image(ec) || !overlay->create(ec)) {
+    _logger->error("Cannot snapshot: " + ec.message());
+    return false;
+  }
+  _overlay = std::move(overlay);
+
+  _logger->info("Snapshot taken");
+  return true;
+}
+
+bool BlockDevice::delete_snapshot(boost::system::error_code& ec) {
+  std::unique_lock<std::shared_mutex> lock(_snapshot_mutex);
+  // Merging writes the image
+  if (device.read_only) {
+    ec = boost::system::errc::make_error_code(boost::system::errc::read_only_file_system);
+    return false;
+  }
+  if (!_overlay) {
+    ec = boost::system::errc::make_error_code(boost::system::errc::no_such_file_or_directory);
+    return false;
+  }
+
+  std::vector<std::pair<uint64_t, uint32_t>> mapped;
+  mapped.reserve(_overlay->blocks());
+  _overlay->for_each([&](uint64_t block, uint32_t slot) {
+    mapped.emplace_back(block, slot);
+    return true;
+  });
+
+  // Merge the overlay into the image in runs of consecutive blocks, zeroed or in consecutive slots
+  std::vector<uint8_t> buffer;
+  for (size_t i = 0, run; i < mapped.size(); i += run) {
+    auto [block, slot] = mapped[i];
+    bool zero = slot == BLOCK_OVERLAY_ZERO;
+    run = 1;
+    while (i + run < mapped.size() && run < BLOCK_DEVICE_MERGE_RUN && mapped[i + run].first == block + run &&
+           mapped[i + run].second == (zero ? BLOCK_OVERLAY_ZERO : slot + uint32_t(run))) {
+      run++;
+    }
+
+    bool merged;
+    if (zero) {
+      merged = _trim_image(block, run, ec);
+    } else {
+      buffer.resize(run * device.block_size);
+      merged = _overlay->read(slot, run, buffer.data(), ec) && _write_image(block, run, buffer.data(), false, ec);
+    }
+    if (!merged) {
+      _logger->error("Cannot merge snapshot: " + ec.message());
+      return false;
+    }
+  }
+
+  // The overlay is only dropped once the image holds everything in it
+  if (!_flush_image(ec)) return false;
+  _overlay->remove();
+  _overlay.reset();
+
+  _logger->info("Snapshot deleted, merged " + std::to_string(mapped.size()) + " blocks");
+  return true;
+}
+
+bool BlockDevice::read_snapshot(uint64_t block, uint32_t count, uint8_t* data, boost::system::error_code& ec) {
+  std::shared_lock<std::shared_mutex> lock(_snapshot_mutex);
+  if (!_overlay) {
+    ec = boost::system::errc::make_error_code(boost::system::errc::no_such_file_or_directory);
+    return false;
+  }
+
+  if (!_read_image(block, count, data, ec)) return false;
+  _bytes_read->inc(size_t(count) * device.block_size);
+  return true;
+}
+
+}  // namespace cppserver
@@ -0,0 +1,174 @@
+//
+// cppserver
+//
+// Copyright (C) 2024 Tom Cully
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301, USA.
+//
+#pragma once
+
+#include <boost/system/error_code.hpp>
+#include <cstdint>
+#include <memory>
+#include <shared_mutex>
+#include <vector>
+
+#include "block_cache.h"
+#include "block_checksums.h"
+#include "block_container.h"
+#include "block_overlay.h"
+#include "device_db.h"
+#include "logger.h"
+#include "metrics.h"
+#include "qos.h"
+#include "replicator.h"
+#include "write_queue.h"
+
+namespace cppserver {
+
+// Reads of uncached blocks are issued in runs of at most this many blocks
+#define BLOCK_DEVICE_MISS_RUN 32
+
+// Blocks copied from a snapshot overlay into the image per write when merging
+#define BLOCK_DEVICE_MERGE_RUN 256
+
+// The backing file of a Device, read and written in whole blocks. A missing
+// file is created sparse at the device's full size. Thread safe: reads go
+// through the block cache when one is given and its block size matches the
+// device's, writes and flushes from all sessions share a WriteQueue. Once the
+// file has holes, reads find them with SEEK_DATA/SEEK_HOLE and fill them
+// with zeros rather than reading them. A compressed device is instead a
+// BlockContainer, written directly without the WriteQueue.
+//
+// With checksums every block's CRC32C is kept in a BlockChecksums sidecar
+// next to the file, updated on write and verified whenever a block is read
+// from the file. A mismatch fails the read with EIO.
+//
+// A snapshot freezes the image, the file or container, as it is: later
+// writes and trims go to a BlockOverlay and reads of blocks written since
+// are resolved through it. Taking one only flushes the image, deleting one
+// merges the overlay back into the image. Both wait for requests in progress
+// and hold new ones back while they run. A device made read only while
+// snapshotted is still read through the overlay, and keeps its snapshot
+// until it is writable again.
+//
+// A replicated device tells its Replicator about every write and trim once
+// it completes, so in sync mode only after the device has it.
+class BlockDevice {
+ public:
+  BlockDevice(std::shared_ptr<Logger> logger, std::shared_ptr<Metrics> metrics, const Device& device, std::shared_ptr<BlockCache> cache = nullptr,
+              bool checksums = false);
+  ~BlockDevice();
+
+  bool open(boost::system::error_code& ec);
+  void close();
+
+  // True if count blocks from block lie within the device
+  bool valid_range(uint64_t block, uint64_t count) const;
+
+  bool read(uint64_t block, uint32_t count, uint8_t* data, boost::system::error_code& ec);
+
+  // Where count blocks from block lie in the file, for a read to send them
+  // straight from it. Only a read only, uncompressed, unchecksummed and
+  // unsnapshotted device whose file covers it can be, its file then holding
+  // every block as it will always be.
+  // Counted as read. Returns false if the blocks have to be read instead.
+  bool file_range(uint64_t block, uint32_t count, int& fd, off_t& offset);
+
+  bool cached() const { return _cache != nullptr; }
+  // Read blocks only if every one is in the cache, so without blocking on the file. Returns false otherwise.
+  bool read_hit(uint64_t block, uint32_t count, uint8_t* data);
+  // Read blocks missing from the cache into it, using scratch as the read
+  // buffer. Returns the number of blocks read, 0 if the device is uncached.
+  uint32_t prefetch(uint64_t block, uint32_t count, std::vector<uint8_t>& scratch);
+
+  // With fua the blocks are durable before this returns, as if followed by a flush
+  bool write(uint64_t block, uint32_t count, const uint8_t* data, bool fua, boost::system::error_code& ec);
+
+  // Discard blocks, which then read as zeros
+  bool trim(uint64_t block, uint32_t count, boost::system::error_code& ec);
+
+  // Make every completed write durable
+  bool flush(boost::system::error_code& ec);
+
+  // Freeze the image, failing if it already is
+  bool snapshot(boost::system::error_code& ec);
+  // Merge the writes since the snapshot into the image and drop the snapshot
+  bool delete_snapshot(boost::system::error_code& ec);
+  // Read the image as it was at the snapshot. Not verified against checksums, which follow the device's current data.
+  bool read_snapshot(uint64_t block, uint32_t count, uint8_t* data, boost::system::error_code& ec);
+
+  // Ship every later write and trim to a secondary. Called once, before the device is shared.
+  void replicate(std::unique_ptr<Replicator> replicator) { _replicator = std::move(replicator); }
+  Replicator* replicator() const { return _replicator.get(); }
+
+  bool checksummed() const { return _checksums != nullptr; }
+  // Verify blocks against their checksums bypassing the cache, recording any
+  // that have none. Returns the number that did not match, or -1 if the read failed.
+  int scrub(uint64_t block, uint32_t count, std::vector<uint8_t>& scratch);
+
+  const Device device;
+  QoS qos;
+
+ private:
+  std::unique_ptr<Logger> _logger;
+  std::shared_ptr<Metrics> _metrics;
+  int _fd = -1;
+  std::unique_ptr<WriteQueue> _write_queue;
+  std::unique_ptr<BlockContainer> _container;
+
+  // Shared by requests, held exclusively to take or delete a snapshot
+  std::shared_mutex _snapshot_mutex;
+  std::unique_ptr<BlockOverlay> _overlay;
+
+  std::shared_ptr<BlockCache> _cache;
+
+  bool _use_checksums;
+  std::unique_ptr<BlockChecksums> _checksums;
+  uint32_t _zero_crc;
+
+  // Closed before anything else as it reads the device
+  std::unique_ptr<Replicator> _replicator;
+
+  // Set at open if the file already had holes, later the write queue reports them
+  bool _sparse = false;
+  // Set at open if reads can be sent from the file, see file_range()
+  bool _file_ranges = false;
+
+  void _open_checksums();
+  // Report a block not matching its checksum
+  void _mismatch(uint64_t block, const char* found_by);
+
+  bool _pread(uint64_t block, uint32_t count, uint8_t* data, boost::system::error_code& ec);
+  bool _read_blocks(uint64_t block, uint32_t count, uint8_t* data, boost::system::error_code& ec);
+  bool _read_image(uint64_t block, uint32_t count, uint8_t* data, boost::system::error_code& ec);
+  bool _write_image(uint64_t block, uint32_t count, const uint8_t* data, bool fua, boost::system::error_code& ec);
+  bool _trim_image(uint64_t block, uint32_t count, boost::system::error_code& ec);
+  bool _flush_image(boost::system::error_code& ec);
+  bool _pread_data(uint8_t* data, size_t len, off_t offset, boost::system::error_code& ec);
+  bool _read_cached(uint64_t block, uint32_t count, uint8_t* data, boost::system::error_code& ec);
+
+  std::shared_ptr<Counter> _bytes_read;
+  std::shared_ptr<Counter> _bytes_written;
+  std::shared_ptr<Counter> _bytes_trimmed;
+  std::shared_ptr<Counter> _hole_bytes_read;
+  std::shared_ptr<Counter> _checksum_errors;
+  std::shared_ptr<LatencyHistogram> _read_latency;
+  std::shared_ptr<LatencyHistogram> _write_latency;
+  std::shared_ptr<LatencyHistogram> _flush_latency;
+};
+
+}  // namespace cppserver
@@ -0,0 +1,176 @@
+//
+// cppserver
+//
+// Copyright (C) 2024 Tom Cully
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301, USA.
+//
+#include "block_engine.h"
+
+#include <algorithm>
+#include <thread>
+
+#include "logger_scoped.h"
+
+namespace cppserver {
+
+//
+// BlockHost
+//
+
+BlockHost::BlockHost(std::shared_ptr<Metrics> metrics, const Host& phost)
+    : host(phost),
+      qos(phost.iops_limit, phost.bps_limit),
+      throttle_latency(
+          metrics->latency("cppserver_host_throttle_seconds", "Time host requests were delayed by QoS", "host=\"" + std::to_string(phost.id) + "\"")) {}
+
+//
+// BlockEngine
+//
+
+BlockEngine::BlockEngine(std::shared_ptr<Logger> logger, std::shared_ptr<Metrics> metrics, DeviceDB& db, const BlockEngineOptions& options)
+    : _logger(std::make_shared<LoggerScoped>("engine", logger)),
+      _metrics(metrics),
+      _db(db),
+      _read_ahead_bytes(options.read_ahead_bytes),
+      _checksums(options.checksums),
+      _replication(options.replication),
+      _throttled(metrics->counter("cppserver_qos_throttled_total", "Total block requests delayed by QoS")),
+      _redirects(metrics->counter("cppserver_cluster_redirects_total", "Total attaches redirected to the node serving the device")) {
+  if (options.cache_bytes) {
+    _cache = std::make_shared<BlockCache>(metrics, options.cache_bytes, options.cache_block_size);
+    _logger->info("Block cache of " + std::to_string(_cache->capacity()) + " blocks of " + std::to_string(options.cache_block_size) + " bytes");
+    if (_read_ahead_bytes && options.read_ahead_threads) _read_ahead = std::make_unique<ReadAhead>(metrics, options.read_ahead_threads);
+  }
+  if (_checksums && options.scrub_bytes_per_second) _scrubber = std::make_unique<Scrubber>(logger, metrics, options.scrub_bytes_per_second);
+}
+
+bool BlockEngine::attach(uint64_t host_id, uint64_t device_id, std::shared_ptr<BlockHost>& host, std::shared_ptr<BlockDevice>& device, std::string& error) {
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  auto host_it = _hosts.find(host_id);
+  if (host_it == _hosts.end()) {
+    std::shared_ptr<Host> row = _db.get_host(host_id);
+    if (!row) {
+      error = "Unknown host " + std::to_string(host_id);
+      return false;
+    }
+    host_it = _hosts.emplace(host_id, std::make_shared<BlockHost>(_metrics, *row)).first;
+  }
+  host = host_it->second;
+
+  const auto& devices = host->host.devices;
+  if (std::find(devices.begin(), devices.end(), device_id) == devices.end()) {
+    error = "Unknown device " + std::to_string(device_id);
+    return false;
+  }
+
+  auto device_it = _devices.find(device_id);
+  if (device_it == _devices.end()) {
+    std::shared_ptr<Device> row = _db.get_device(device_id);
+    if (!row) {
+      error = "Unknown device " + std::to_string(device_id);
+      return false;
+    }
+
+    auto opened = std::make_shared<BlockDevice>(_logger, _metrics, *row, _cache, _checksums);
+    boost::system::error_code ec;
+    if (!opened->open(ec)) {
+      error = "Cannot open device " + std::to_string(device_id) + ": " + ec.message();
+      return false;
+    }
+    if (!_replication.host.empty() && !row->read_only) opened->replicate(std::make_unique<Replicator>(_logger, _metrics, *opened, _replication));
+    device_it = _devices.emplace(device_id, opened).first;
+    if (_scrubber && opened->checksummed()) _scrubber->add(opened);
+  }
+  device = device_it->second;
+
+  return true;
+}
+
+bool BlockEngine::resume(uint64_t host_id, uint64_t device_id, std::shared_ptr<BlockHost>& host, std::shared_ptr<BlockDevice>& device, std::string& error) {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto host_it = _hosts.find(host_id);
+    auto device_it = _devices.find(device_id);
+    if (host_it != _hosts.end() && device_it != _devices.end()) {
+      host = host_it->second;
+      device = device_it->second;
+      return true;
+    }
+  }
+  return attach(host_id, device_id, host, device, error);
+}
+
+void BlockEngine::cluster(const std::string& node, std::shared_ptr<const HashRing> ring) {
+  std::vector<std::shared_ptr<BlockDevice>> released;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _node = node;
+    _ring = ring;
+    for (auto it = _devices.begin(); it != _devices.end();) {
+      if (ring->owner(it->first) == node) {
+        it++;
+        continue;
+      }
+      released.push_back(it->second);
+      it = _devices.erase(it);
+    }
+  }
+
+  _logger->info("Serving " + std::string(ring->contains(node) ? "" : "no ") + "devices as " + node + " of " + std::to_string(ring->nodes().size()) + " nodes");
+  for (auto& device : released) {
+    if (_scrubber) _scrubber->remove(device);
+    _logger->info("Device " + std::to_string(device->device.id) + " moved to " + ring->owner(device->device.id));
+  }
+}
+
+std::vector<Device> BlockEngine::devices(uint64_t host_id) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _db.get_host_devices(host_id);
+}
+
+bool BlockEngine::owns(uint64_t device_id, std::string& owner) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (!_ring) return true;
+
+  owner = _ring->owner(device_id);
+  if (owner == _node) return true;
+  _redirects->inc();
+  return false;
+}
+
+void BlockEngine::throttle(BlockHost& host, BlockDevice& device, uint64_t bytes) {
+  if (!host.qos.limited() && !device.qos.limited()) return;
+
+  std::chrono::nanoseconds wait = std::max(host.qos.reserve(bytes), device.qos.reserve(bytes));
+  if (wait.count() == 0) return;
+
+  _throttled->inc();
+  host.throttle_latency->record(wait.count());
+  std::this_thread::sleep_for(wait);
+}
+
+void BlockEngine::read_ahead(const std::shared_ptr<BlockDevice>& device, ReadStream& stream, uint64_t block, uint32_t count) {
+  if (!_read_ahead || !device->cached()) return;
+
+  uint64_t block_ahead;
+  uint32_t count_ahead;
+  stream.access(block, count, _read_ahead_bytes / device->device.block_size, block_ahead, count_ahead);
+  if (count_ahead) _read_ahead->submit(device, block_ahead, count_ahead);
+}
+
+}  // namespace cppserver
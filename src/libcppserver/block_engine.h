@@ -0,0 +1,124 @@
+//
+// cppserver
+//
+// Copyright (C) 2024 Tom Cully
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301, USA.
+//
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "block_cache.h"
+#include "block_device.h"
+#include "device_db.h"
+#include "hash_ring.h"
+#include "logger.h"
+#include "metrics.h"
+#include "qos.h"
+#include "read_ahead.h"
+#include "replicator.h"
+#include "scrubber.h"
+
+namespace cppserver {
+
+// A host with its QoS limits, shared by all of its sessions
+class BlockHost {
+ public:
+  BlockHost(std::shared_ptr<Metrics> metrics, const Host& host);
+
+  const Host host;
+  QoS qos;
+
+  // Time requests from this host were held back by QoS
+  std::shared_ptr<LatencyHistogram> throttle_latency;
+};
+
+// Serves block I/O for sessions. Hosts and devices are loaded from the
+// DeviceDB on first use and kept, so every session of a host, and every host
+// using a device, shares the same QoS limits.
+class BlockEngineOptions {
+ public:
+  uint64_t cache_bytes = 0;                 // Block cache memory, allocated up front, 0 to disable
+  uint32_t cache_block_size = 4096;         // Only devices with this block size are cached
+  uint64_t read_ahead_bytes = 1024 * 1024;  // Largest read-ahead window of a sequential stream, 0 to disable. Needs the cache.
+  uint32_t read_ahead_threads = 2;          // Workers reading ahead into the cache
+  bool checksums = true;                    // Keep and verify per-block CRC32C checksums in a sidecar file next to each device
+  uint64_t scrub_bytes_per_second = 0;      // Rate the scrubber verifies checksummed devices at, 0 to disable
+  ReplicatorOptions replication;            // Writable devices are replicated to replication.host if set, from when first attached
+};
+
+class BlockEngine {
+ public:
+  BlockEngine(std::shared_ptr<Logger> logger, std::shared_ptr<Metrics> metrics, DeviceDB& db, const BlockEngineOptions& options = BlockEngineOptions());
+
+  // Find a host and one of its devices, opening the device on first use. On failure error says why.
+  bool attach(uint64_t host_id, uint64_t device_id, std::shared_ptr<BlockHost>& host, std::shared_ptr<BlockDevice>& device, std::string& error);
+  // Attach again as a session resumed from a ticket, which vouches that host
+  // may use device: the DeviceDB is only consulted if either is not loaded.
+  bool resume(uint64_t host_id, uint64_t device_id, std::shared_ptr<BlockHost>& host, std::shared_ptr<BlockDevice>& device, std::string& error);
+  // The devices host may attach to, as the DeviceDB lists them
+  std::vector<Device> devices(uint64_t host_id);
+
+  // Hold a request of bytes back until both the host and device limits allow
+  // it. Throttled requests are delayed in arrival order, never rejected.
+  void throttle(BlockHost& host, BlockDevice& device, uint64_t bytes);
+
+  // Serve only the devices ring gives to node, the address clients and other
+  // nodes reach this one at. Devices open here that now belong to another
+  // node are closed once no session uses them.
+  void cluster(const std::string& node, std::shared_ptr<const HashRing> ring);
+  // True if this node serves device, otherwise owner is set to the node that does, empty if none
+  bool owns(uint64_t device_id, std::string& owner);
+
+  // Track a session's read of device in stream, reading ahead if it is sequential
+  void read_ahead(const std::shared_ptr<BlockDevice>& device, ReadStream& stream, uint64_t block, uint32_t count);
+
+ private:
+  std::shared_ptr<Logger> _logger;
+  std::shared_ptr<Metrics> _metrics;
+
+  // Guards the DeviceDB, which is not thread safe, both maps and the ring
+  std::mutex _mutex;
+  DeviceDB& _db;
+  std::unordered_map<uint64_t, std::shared_ptr<BlockHost>> _hosts;
+  std::unordered_map<uint64_t, std::shared_ptr<BlockDevice>> _devices;
+
+  // Set when clustered
+  std::string _node;
+  std::shared_ptr<const HashRing> _ring;
+
+  // Shared by every device
+  std::shared_ptr<BlockCache> _cache;
+  uint64_t _read_ahead_bytes;
+
+  bool _checksums;
+  ReplicatorOptions _replication;
+
+  // Declared after the devices so their threads stop before they close
+  std::unique_ptr<ReadAhead> _read_ahead;
+  std::unique_ptr<Scrubber> _scrubber;
+
+  std::shared_ptr<Counter> _throttled;
+  std::shared_ptr<Counter> _redirects;
+};
+
+}  // namespace cppserver
@@ -0,0 +1,265 @@
+//
+// cppserver
+//
+// Copyright (C) 2024 Tom Cully
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301, USA.
+//
+#include "block_overlay.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <vector>
+
+#include "protocol.h"
+
+namespace cppserver {
+
+static boost::system::error_code last_error() { return boost::system::error_code(errno, boost::system::system_category()); }
+
+static bool pwritev_all(int fd, std::vector<struct iovec>& iovecs, uint64_t offset, boost::system::error_code& ec) {
+  for (size_t first = 0; first < iovecs.size();) {
+    ssize_t n = ::pwritev(fd, iovecs.data() + first, std::min<size_t>(iovecs.size() - first, IOV_MAX), offset);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      ec = last_error();
+      return false;
+    }
+    offset += n;
+    while (first < iovecs.size() && size_t(n) >= iovecs[first].iov_len) n -= iovecs[first++].iov_len;
+    if (n > 0) {
+      iovecs[first].iov_base = static_cast<uint8_t*>(iovecs[first].iov_base) + n;
+      iovecs[first].iov_len -= n;
+    }
+  }
+  return true;
+}
+
+BlockOverlay::BlockOverlay(std::shared_ptr<Metrics> metrics, const std::string& pfilename, uint64_t device_id, uint32_t block_size, uint64_t block_total)
+    : filename(pfilename + ".cow"),
+      map_filename(pfilename + ".cow.map"),
+      _block_size(block_size),
+      _block_total(block_total),
+      _leaf_count((block_total + BLOCK_OVERLAY_LEAF_BLOCKS - 1) / BLOCK_OVERLAY_LEAF_BLOCKS),
+      _blocks_gauge(metrics->gauge("cppserver_device_snapshot_blocks", "Blocks of devices written since their snapshot",
+                                   "device=\"" + std::to_string(device_id) + "\"")) {
+  _leaves = std::make_unique<std::atomic<Leaf*>[]>(_leaf_count);
+  for (uint64_t i = 0; i < _leaf_count; i++) _leaves[i].store(nullptr);
+}
+
+BlockOverlay::~BlockOverlay() { _close(); }
+
+bool BlockOverlay::_open_files(int flags, boost::system::error_code& ec) {
+  _close();
+  _fd = ::open(filename.c_str(), flags, 0644);
+  if (_fd >= 0) _map_fd = ::open(map_filename.c_str(), flags, 0644);
+  if (_fd < 0 || _map_fd < 0) {
+    ec = last_error();
+    _close();
+    return false;
+  }
+  return true;
+}
+
+void BlockOverlay::_close() {
+  if (_fd >= 0) ::close(_fd);
+  if (_map_fd >= 0) ::close(_map_fd);
+  _fd = _map_fd = -1;
+
+  for (uint64_t i = 0; i < _leaf_count; i++) delete _leaves[i].exchange(nullptr);
+  _blocks_gauge->dec(_blocks);
+  _blocks = 0;
+  _next_slot = 0;
+  _map_size = 0;
+}
+
+bool BlockOverlay::create(boost::system::error_code& ec) {
+  // An overlay exists while its map does, so remove that first
+  ::unlink(map_filename.c_str());
+  return _open_files(O_RDWR | O_CREAT | O_TRUNC, ec);
+}
+
+bool BlockOverlay::open(bool read_only, boost::system::error_code& ec) {
+  if (!_open_files(read_only ? O_RDONLY : O_RDWR, ec)) return false;
+
+  struct stat st;
+  if (::fstat(_map_fd, &st) != 0) {
+    ec = last_error();
+    return false;
+  }
+
+  // A record torn by a crash is ignored and later overwritten
+  std::vector<uint8_t> records(st.st_size / BLOCK_OVERLAY_RECORD_SIZE * BLOCK_OVERLAY_RECORD_SIZE);
+  for (size_t done = 0; done < records.size();) {
+    ssize_t n = ::pread(_map_fd, records.data() + done, records.size() - done, done);
+    if (n <= 0) {
+      if (n < 0 && errno == EINTR) continue;
+      ec = n < 0 ? last_error() : boost::system::errc::make_error_code(boost::system::errc::io_error);
+      return false;
+    }
+    done += n;
+  }
+
+  std::lock_guard<std::mutex> lock(_mutex);
+  for (size_t pos = 0; pos < records.size(); pos += BLOCK_OVERLAY_RECORD_SIZE) {
+    uint64_t block = get_u64(records.data() + pos);
+    uint32_t slot = get_u32(records.data() + pos + 8);
+    if (block >= _block_total) {
+      ec = boost::system::errc::make_error_code(boost::system::errc::invalid_argument);
+      return false;
+    }
+    _set(block, slot);
+    if (slot != BLOCK_OVERLAY_ZERO) _next_slot = std::max(_next_slot, slot + 1);
+  }
+  _map_size = records.size();
+  return true;
+}
+
+void BlockOverlay::remove() {
+  _close();
+  ::unlink(filename.c_str());
+  ::unlink(map_filename.c_str());
+}
+
+bool BlockOverlay::lookup(uint64_t block, uint32_t& slot) const {
+  Leaf* leaf = _leaves[block >> BLOCK_OVERLAY_LEAF_BITS].load(std::memory_order_acquire);
+  if (!leaf) return false;
+
+  uint32_t index = block & (BLOCK_OVERLAY_LEAF_BLOCKS - 1);
+  if (!(leaf->present[index / 64].load(std::memory_order_acquire) & (uint64_t(1) << (index % 64)))) return false;
+  slot = leaf->slots[index].load(std::memory_order_acquire);
+  return true;
+}
+
+void BlockOverlay::_set(uint64_t block, uint32_t slot) {
+  std::atomic<Leaf*>& entry = _leaves[block >> BLOCK_OVERLAY_LEAF_BITS];
+  Leaf* leaf = entry.load(std::memory_order_acquire);
+  if (!leaf) {
+    leaf = new Leaf();
+    entry.store(leaf, std::memory_order_release);
+  }
+
+  uint32_t index = block & (BLOCK_OVERLAY_LEAF_BLOCKS - 1);
+  leaf->slots[index].store(slot, std::memory_order_release);
+  uint64_t bit = uint64_t(1) << (index % 64);
+  if (!(leaf->present[index / 64].fetch_or(bit, std::memory_order_acq_rel) & bit)) {
+    _blocks++;
+    _blocks_gauge->inc();
+  }
+}
+
+bool BlockOverlay::read(uint32_t slot, uint32_t count, uint8_t* data, boost::system::error_code& ec) {
+  size_t len = size_t(count) * _block_size;
+  for (size_t done = 0; done < len;) {
+    ssize_t n = ::pread(_fd, data + done, len - done, uint64_t(slot) * _block_size + done);
+    if (n <= 0) {
+      if (n < 0 && errno == EINTR) continue;
+      ec = n < 0 ? last_error() : boost::system::errc::make_error_code(boost::system::errc::io_error);
+      return false;
+    }
+    done += n;
+  }
+  return true;
+}
+
+bool BlockOverlay::write(uint64_t block, uint32_t count, const uint8_t* data, boost::system::error_code& ec) {
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  // Blocks with a slot are rewritten in place, a run of consecutive slots at a time, the rest get new slots
+  std::vector<uint32_t> slots(count);
+  std::vector<struct iovec> appended;
+  uint32_t first_new = _next_slot;
+  for (uint32_t i = 0; i < count; i++) {
+    if (!lookup(block + i, slots[i]) || slots[i] == BLOCK_OVERLAY_ZERO) {
+      slots[i] = _next_slot++;
+      appended.push_back({const_cast<uint8_t*>(data) + size_t(i) * _block_size, _block_size});
+      continue;
+    }
+
+    uint32_t run = 1;
+    while (i + run < count && lookup(block + i + run, slots[i + run]) && slots[i + run] == slots[i] + run) run++;
+    std::vector<struct iovec> iovecs = {{const_cast<uint8_t*>(data) + size_t(i) * _block_size, size_t(run) * _block_size}};
+    if (!pwritev_all(_fd, iovecs, uint64_t(slots[i]) * _block_size, ec)) return false;
+    i += run - 1;
+  }
+  if (appended.empty()) return true;
+  if (!pwritev_all(_fd, appended, uint64_t(first_new) * _block_size, ec)) return false;
+
+  // Map the new slots once their data is written
+  return _map(block, count, slots.data(), ec);
+}
+
+bool BlockOverlay::zero(uint64_t block, uint32_t count, boost::system::error_code& ec) {
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  std::vector<uint32_t> slots(std::min<uint32_t>(count, BLOCK_OVERLAY_LEAF_BLOCKS), BLOCK_OVERLAY_ZERO);
+  for (uint32_t done = 0; done < count; done += slots.size()) {
+    if (!_map(block + done, std::min<uint32_t>(count - done, slots.size()), slots.data(), ec)) return false;
+  }
+  return true;
+}
+
+bool BlockOverlay::_map(uint64_t block, uint32_t count, const uint32_t* slots, boost::system::error_code& ec) {
+  // Only blocks whose slot changes need a record
+  std::vector<uint8_t> records;
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t slot;
+    if (lookup(block + i, slot) && slot == slots[i]) continue;
+
+    records.resize(records.size() + BLOCK_OVERLAY_RECORD_SIZE);
+    put_u64(records.data() + records.size() - BLOCK_OVERLAY_RECORD_SIZE, block + i);
+    put_u32(records.data() + records.size() - 4, slots[i]);
+  }
+  if (records.empty()) return true;
+
+  std::vector<struct iovec> iovecs = {{records.data(), records.size()}};
+  if (!pwritev_all(_map_fd, iovecs, _map_size, ec)) return false;
+  _map_size += records.size();
+
+  for (size_t pos = 0; pos < records.size(); pos += BLOCK_OVERLAY_RECORD_SIZE) _set(get_u64(records.data() + pos), get_u32(records.data() + pos + 8));
+  return true;
+}
+
+bool BlockOverlay::flush(boost::system::error_code& ec) {
+  if (::fdatasync(_fd) != 0 || ::fdatasync(_map_fd) != 0) {
+    ec = last_error();
+    return false;
+  }
+  return true;
+}
+
+bool BlockOverlay::for_each(const std::function<bool(uint64_t block, uint32_t slot)>& fn) const {
+  for (uint64_t leaf_index = 0; leaf_index < _leaf_count; leaf_index++) {
+    Leaf* leaf = _leaves[leaf_index].load(std::memory_order_acquire);
+    if (!leaf) continue;
+
+    for (uint32_t word = 0; word < BLOCK_OVERLAY_LEAF_BLOCKS / 64; word++) {
+      for (uint64_t bits = leaf->present[word].load(); bits; bits &= bits - 1) {
+        uint32_t index = word * 64 + __builtin_ctzll(bits);
+        if (!fn((leaf_index << BLOCK_OVERLAY_LEAF_BITS) + index, leaf->slots[index].load())) return false;
+      }
+    }
+  }
+  return true;
+}
+
+}  // namespace cppserver
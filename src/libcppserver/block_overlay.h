@@ -0,0 +1,114 @@
+//
+// cppserver
+//
+// Copyright (C) 2024 Tom Cully
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301, USA.
+//
+#pragma once
+
+#include <atomic>
+#include <boost/system/error_code.hpp>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "metrics.h"
+
+namespace cppserver {
+
+// Blocks per leaf of the block map, 2^12
+#define BLOCK_OVERLAY_LEAF_BITS 12
+#define BLOCK_OVERLAY_LEAF_BLOCKS (1 << BLOCK_OVERLAY_LEAF_BITS)
+
+// Slot of a block trimmed since the snapshot, it reads as zeros without data
+#define BLOCK_OVERLAY_ZERO UINT32_MAX
+
+#define BLOCK_OVERLAY_RECORD_SIZE 12
+
+// The blocks of a device written since it was snapshotted, leaving the image
+// as it was. Blocks are stored in <file>.cow in slots, in the order first
+// written, and <file>.cow.map logs where each block went: a big-endian block
+// (8) and slot (4) per record, the latest record of a block winning.
+//
+// In memory the map is a radix tree of one level: a leaf per
+// BLOCK_OVERLAY_LEAF_BLOCKS blocks, allocated on the first write among them,
+// holding a bitmap of the blocks present and their slots. Lookups are lock
+// free, so a block never written since the snapshot costs a load or two.
+// Writers are serialised, each writing its blocks with one call per run.
+class BlockOverlay {
+ public:
+  BlockOverlay(std::shared_ptr<Metrics> metrics, const std::string& filename, uint64_t device_id, uint32_t block_size, uint64_t block_total);
+  ~BlockOverlay();
+
+  // Start an empty overlay, replacing any
+  bool create(boost::system::error_code& ec);
+  // Load an existing overlay, read only for a device that cannot be written.
+  // Fails with no_such_file_or_directory if there is none.
+  bool open(bool read_only, boost::system::error_code& ec);
+  // Delete the overlay's files
+  void remove();
+
+  // The slot of a block written since the snapshot
+  bool lookup(uint64_t block, uint32_t& slot) const;
+
+  // Read count blocks from consecutive slots
+  bool read(uint32_t slot, uint32_t count, uint8_t* data, boost::system::error_code& ec);
+  bool write(uint64_t block, uint32_t count, const uint8_t* data, boost::system::error_code& ec);
+  // Make blocks read as zeros
+  bool zero(uint64_t block, uint32_t count, boost::system::error_code& ec);
+  bool flush(boost::system::error_code& ec);
+
+  // Call fn for every block in the overlay in block order, stopping if it returns false
+  bool for_each(const std::function<bool(uint64_t block, uint32_t slot)>& fn) const;
+
+  uint64_t blocks() const { return _blocks; }
+
+  const std::string filename;
+  const std::string map_filename;
+
+ private:
+  class Leaf {
+   public:
+    std::atomic<uint64_t> present[BLOCK_OVERLAY_LEAF_BLOCKS / 64] = {};
+    std::atomic<uint32_t> slots[BLOCK_OVERLAY_LEAF_BLOCKS] = {};
+  };
+
+  uint32_t _block_size;
+  uint64_t _block_total;
+  int _fd = -1;
+  int _map_fd = -1;
+
+  std::unique_ptr<std::atomic<Leaf*>[]> _leaves;
+  uint64_t _leaf_count;
+
+  std::mutex _mutex;
+  uint32_t _next_slot = 0;
+  uint64_t _map_size = 0;
+  uint64_t _blocks = 0;
+
+  std::shared_ptr<Gauge> _blocks_gauge;
+
+  bool _open_files(int flags, boost::system::error_code& ec);
+  void _close();
+  void _set(uint64_t block, uint32_t slot);
+  // Write the map records of count blocks from block and apply them
+  bool _map(uint64_t block, uint32_t count, const uint32_t* slots, boost::system::error_code& ec);
+};
+
+}  // namespace cppserver
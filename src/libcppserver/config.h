@@ -23,6 +23,7 @@
 #include <boost/program_options.hpp>
 #include <cstdint>
 #include <string>
+#include <vector>
 
 #include "logger.h"
 #include "url.h"
@@ -33,9 +34,42 @@ enum DBMode { FILE, MYSQL, POSTGRESQL };
 
 class Config {
  public:
-  DBMode dbMode;
+  DBMode dbMode = MYSQL;
   URL dbUrl;
-  uint16_t port;
+  std::string dbFile;
+  uint16_t port = 26547;
+  uint16_t adminPort = 26548;
+  std::string unixSocket;
+  std::vector<uint32_t> unixSocketUids;
+  uint16_t nbdPort = 0;
+  uint64_t nbdHost = 0;
+  uint32_t metricsInterval = 10;
+  uint32_t timerTick = 10;
+  uint32_t readTimeout = 5000;
+  uint32_t idleTimeout = 0;
+  uint32_t writeTimeout = 30000;
+  uint32_t maxSessions = 0;
+  uint32_t maxAcceptRate = 0;
+  std::string shedMode = "busy";
+  uint32_t dispatchThreads = 8;
+  uint32_t maxInFlight = 32;
+  uint32_t ticketLifetime = 3600;
+  uint32_t ticketRotation = 3600;
+  uint32_t cacheSize = 0;
+  uint32_t cacheBlockSize = 4096;
+  uint32_t readAhead = 1024;
+  uint32_t readAheadThreads = 2;
+  bool wireCompression = true;
+  bool zeroCopy = true;
+  bool checksums = true;
+  uint32_t scrubRate = 8;
+  std::string replicateHost;
+  uint16_t replicatePort = 26547;
+  uint64_t replicateHostId = 0;
+  std::string replicateMode = "async";
+  std::string node;
+  std::string clusterFile;
+  uint32_t virtualNodes = 160;
 
   Config(std::shared_ptr<Logger> logger);
   Config(std::shared_ptr<Logger> logger, int argc, char* argv[]);
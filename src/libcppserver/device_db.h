@@ -20,7 +20,9 @@
 //
 #pragma once
 
+#include <cstdint>
 #include <iostream>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -36,6 +38,10 @@ class Host {
   std::string name;
   aes_key_t aes_key;
   std::vector<uint64_t> devices;
+
+  // QoS limits shared by all of the host's sessions, 0 for no limit
+  uint64_t iops_limit = 0;
+  uint64_t bps_limit = 0;
 };
 
 class Device {
@@ -46,10 +52,18 @@ class Device {
   uint32_t block_size;
   uint64_t block_total;
   bool read_only;
+
+  // Stored as a compressed block container rather than a raw image
+  bool compressed = false;
+
+  // QoS limits shared by every host using the device, 0 for no limit
+  uint64_t iops_limit = 0;
+  uint64_t bps_limit = 0;
 };
 
 class DeviceDB {
  public:
+  virtual ~DeviceDB() {}
   virtual bool initialise() = 0;
   virtual std::shared_ptr<Host> get_host(uint64_t host_id) = 0;
   virtual std::shared_ptr<Device> get_device(uint64_t device_id) = 0;
@@ -0,0 +1,139 @@
+//
+// cppserver
+//
+// Copyright (C) 2024 Tom Cully
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301, USA.
+//
+#include "device_db_file.h"
+
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#include "logger_scoped.h"
+#include "util.h"
+
+namespace cppserver {
+
+DeviceDBFile::DeviceDBFile(std::shared_ptr<Logger> logger, const std::string& filename)
+    : _logger(std::make_unique<LoggerScoped>("devicedb", logger)), _filename(filename) {}
+
+DeviceDBFile::~DeviceDBFile() { close(); }
+
+bool DeviceDBFile::initialise() {
+  std::ifstream file(_filename);
+  if (!file) {
+    _logger->error("Cannot open " + _filename);
+    return false;
+  }
+
+  _hosts.clear();
+  _devices.clear();
+
+  std::string line;
+  for (int number = 1; std::getline(file, line); number++) {
+    if (!_parse_line(line)) {
+      _logger->error(_filename + ":" + std::to_string(number) + ": Bad record");
+      return false;
+    }
+  }
+
+  _logger->info("Loaded " + std::to_string(_hosts.size()) + " hosts, " + std::to_string(_devices.size()) + " devices");
+  return true;
+}
+
+bool DeviceDBFile::_parse_line(const std::string& line) {
+  std::istringstream fields(line);
+  std::string type;
+  if (!(fields >> type) || type[0] == '#') return true;
+
+  // Optional trailing key=value limits and flags
+  auto parse_options = [&](uint64_t& iops, uint64_t& bps, Device* device) {
+    std::string option;
+    while (fields >> option) {
+      if (option == "ro" && device) {
+        device->read_only = true;
+      } else if (option == "lz4" && device) {
+        device->compressed = true;
+      } else if (option.rfind("iops=", 0) == 0) {
+        iops = std::stoull(option.substr(5));
+      } else if (option.rfind("bps=", 0) == 0) {
+        bps = std::stoull(option.substr(4));
+      } else {
+        return false;
+      }
+    }
+    return true;
+  };
+
+  try {
+    if (type == "host") {
+      Host host;
+      std::string key;
+      std::vector<uint8_t> key_bytes;
+      if (!(fields >> host.id >> host.name >> key)) return false;
+      if (!Util::from_hex(key, key_bytes) || key_bytes.size() != AES_KEY_SIZE) return false;
+      std::memcpy(host.aes_key, key_bytes.data(), AES_KEY_SIZE);
+      if (!parse_options(host.iops_limit, host.bps_limit, nullptr)) return false;
+      _hosts[host.id] = host;
+      return true;
+    }
+
+    if (type == "device") {
+      Device device;
+      uint64_t host_id;
+      device.read_only = false;
+      if (!(fields >> device.id >> host_id >> device.name >> device.filename >> device.block_size >> device.block_total)) return false;
+      if (!parse_options(device.iops_limit, device.bps_limit, &device)) return false;
+
+      auto host = _hosts.find(host_id);
+      if (host == _hosts.end()) return false;
+      host->second.devices.push_back(device.id);
+      _devices[device.id] = device;
+      return true;
+    }
+  } catch (const std::exception&) {
+    return false;
+  }
+
+  return false;
+}
+
+std::shared_ptr<Host> DeviceDBFile::get_host(uint64_t host_id) {
+  auto it = _hosts.find(host_id);
+  if (it == _hosts.end()) return NULL;
+  return std::make_shared<Host>(it->second);
+}
+
+std::shared_ptr<Device> DeviceDBFile::get_device(uint64_t device_id) {
+  auto it = _devices.find(device_id);
+  if (it == _devices.end()) return NULL;
+  return std::make_shared<Device>(it->second);
+}
+
+std::vector<Device> DeviceDBFile::get_host_devices(uint64_t host_id) {
+  std::vector<Device> devices;
+  auto host = _hosts.find(host_id);
+  if (host == _hosts.end()) return devices;
+
+  for (uint64_t device_id : host->second.devices) devices.push_back(_devices[device_id]);
+  return devices;
+}
+
+bool DeviceDBFile::close() { return true; }
+
+}  // namespace cppserver
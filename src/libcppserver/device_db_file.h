@@ -0,0 +1,62 @@
+//
+// cppserver
+//
+// Copyright (C) 2024 Tom Cully
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301, USA.
+//
+#pragma once
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "device_db.h"
+#include "logger.h"
+
+namespace cppserver {
+
+// DeviceDB read from a text file, for tests and single node deployments.
+// One record per line, blank lines and lines starting with # are ignored:
+//
+//   host <id> <name> <aes_key as 64 hex digits> [iops=N] [bps=N]
+//   device <id> <host id> <name> <filename> <block_size> <block_total> [ro] [lz4] [iops=N] [bps=N]
+//
+// Devices must follow the host they belong to. Names and filenames cannot
+// contain whitespace.
+class DeviceDBFile : public DeviceDB {
+ public:
+  DeviceDBFile(std::shared_ptr<Logger> logger, const std::string& filename);
+  ~DeviceDBFile();
+
+  virtual bool initialise();
+  virtual std::shared_ptr<Host> get_host(uint64_t host_id);
+  virtual std::shared_ptr<Device> get_device(uint64_t device_id);
+  virtual std::vector<Device> get_host_devices(uint64_t host_id);
+  virtual bool close();
+
+ private:
+  std::unique_ptr<Logger> _logger;
+
+  std::string _filename;
+  std::map<uint64_t, Host> _hosts;
+  std::map<uint64_t, Device> _devices;
+
+  bool _parse_line(const std::string& line);
+};
+
+}  // namespace cppserver
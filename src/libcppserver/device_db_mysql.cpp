@@ -22,6 +22,7 @@
 
 #include <mysql/mysql.h>
 
+#include <chrono>
 #include <cstring>
 #include <iostream>
 #include <string>
@@ -31,7 +32,13 @@
 
 namespace cppserver {
 
-DeviceDBMySQL::DeviceDBMySQL(std::shared_ptr<Logger> logger, URL& dbUrl) : _dbUrl(dbUrl), _logger(std::make_unique<LoggerScoped>("mysql", logger)) {}
+DeviceDBMySQL::DeviceDBMySQL(std::shared_ptr<Logger> logger, std::shared_ptr<Metrics> metrics, URL& dbUrl)
+    : _logger(std::make_unique<LoggerScoped>("mysql", logger)),
+      _dbUrl(dbUrl),
+      _query_duration(metrics->histogram("cppserver_db_query_duration_seconds", "DeviceDB query latency in seconds", Metrics::latencyBuckets)),
+      _get_host_latency(metrics->latency("cppserver_db_get_host_latency_seconds", "DeviceDB get_host call latency")),
+      _get_device_latency(metrics->latency("cppserver_db_get_device_latency_seconds", "DeviceDB get_device call latency")),
+      _get_host_devices_latency(metrics->latency("cppserver_db_get_host_devices_latency_seconds", "DeviceDB get_host_devices call latency")) {}
 
 DeviceDBMySQL::~DeviceDBMySQL() { close(); }
 
@@ -69,35 +76,53 @@ bool DeviceDBMySQL::initialise() {
   return true;
 }
 
-std::shared_ptr<Host> DeviceDBMySQL::get_host(uint64_t host_id) {
+MYSQL_RES* DeviceDBMySQL::_query(const std::string& query) {
+  auto start = std::chrono::steady_clock::now();
+
   // Do Query
-  if (mysql_query(conn, ("SELECT id, name, aes_key FROM host WHERE id = " + std::to_string(host_id)).c_str())) {
+  if (mysql_query(conn, query.c_str())) {
     _logger->error("Query failed: " + std::string(mysql_error(conn)));
-    return NULL;
+    return nullptr;
   }
 
   // Get Result
   MYSQL_RES* result = mysql_store_result(conn);
   if (!result) {
-    _logger->error("Query host: Bad Result Set: " + std::string(mysql_error(conn)));
-    return NULL;
+    _logger->error("Bad Result Set: " + std::string(mysql_error(conn)));
+    return nullptr;
   }
 
+  _query_duration->observe(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+  return result;
+}
+
+std::shared_ptr<Host> DeviceDBMySQL::get_host(uint64_t host_id) {
+  ScopedLatency timer(*_get_host_latency);
+
+  MYSQL_RES* result = _query("SELECT id, name, aes_key, iops_limit, bps_limit FROM host WHERE id = " + std::to_string(host_id));
+  if (!result) return NULL;
+
   // Check Fields
   int num_fields = mysql_num_fields(result);
 
-  if (num_fields != 3) {
-    _logger->error("Query host: Expected 3 fields, got " + std::to_string(num_fields));
+  if (num_fields != 5) {
+    _logger->error("Query host: Expected 5 fields, got " + std::to_string(num_fields));
     mysql_free_result(result);
     return NULL;
   }
 
-  std::shared_ptr<Host> host = std::make_shared<Host>();
-
   // Get The Data
   MYSQL_ROW row = mysql_fetch_row(result);
+  if (!row) {
+    mysql_free_result(result);
+    return NULL;
+  }
+
+  std::shared_ptr<Host> host = std::make_shared<Host>();
   host->id = std::stoll(std::string(row[0]));
   host->name = std::string(row[1]);
+  host->iops_limit = row[3] ? std::stoull(std::string(row[3])) : 0;
+  host->bps_limit = row[4] ? std::stoull(std::string(row[4])) : 0;
 
   if (row[2]) {  // Make sure the field is not NULL
     unsigned long* lengths = mysql_fetch_lengths(result);
@@ -115,12 +140,58 @@ std::shared_ptr<Host> DeviceDBMySQL::get_host(uint64_t host_id) {
   }
 
   mysql_free_result(result);
+
+  for (const auto& device : _query_devices("host_id = " + std::to_string(host_id))) host->devices.push_back(device.id);
+
   return host;
 }
 
-std::shared_ptr<Device> DeviceDBMySQL::get_device(uint64_t device_id) { return NULL; }
+std::vector<Device> DeviceDBMySQL::_query_devices(const std::string& where) {
+  std::vector<Device> devices;
 
-std::vector<Device> DeviceDBMySQL::get_host_devices(uint64_t host_id) { return std::vector<Device>(); }
+  MYSQL_RES* result = _query("SELECT id, name, filename, block_size, block_total, read_only, compressed, iops_limit, bps_limit FROM device WHERE " + where);
+  if (!result) return devices;
+
+  // Check Fields
+  int num_fields = mysql_num_fields(result);
+
+  if (num_fields != 9) {
+    _logger->error("Query device: Expected 9 fields, got " + std::to_string(num_fields));
+    mysql_free_result(result);
+    return devices;
+  }
+
+  // Get The Data
+  while (MYSQL_ROW row = mysql_fetch_row(result)) {
+    Device device;
+    device.id = std::stoll(std::string(row[0]));
+    device.name = std::string(row[1]);
+    device.filename = std::string(row[2]);
+    device.block_size = std::stoul(std::string(row[3]));
+    device.block_total = std::stoull(std::string(row[4]));
+    device.read_only = row[5] && std::string(row[5]) != "0";
+    device.compressed = row[6] && std::string(row[6]) != "0";
+    device.iops_limit = row[7] ? std::stoull(std::string(row[7])) : 0;
+    device.bps_limit = row[8] ? std::stoull(std::string(row[8])) : 0;
+    devices.push_back(device);
+  }
+
+  mysql_free_result(result);
+  return devices;
+}
+
+std::shared_ptr<Device> DeviceDBMySQL::get_device(uint64_t device_id) {
+  ScopedLatency timer(*_get_device_latency);
+
+  auto devices = _query_devices("id = " + std::to_string(device_id));
+  if (devices.empty()) return NULL;
+  return std::make_shared<Device>(devices[0]);
+}
+
+std::vector<Device> DeviceDBMySQL::get_host_devices(uint64_t host_id) {
+  ScopedLatency timer(*_get_host_devices_latency);
+  return _query_devices("host_id = " + std::to_string(host_id));
+}
 
 bool DeviceDBMySQL::close() {
   _logger->debug("closing...");
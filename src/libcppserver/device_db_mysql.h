@@ -28,13 +28,14 @@
 
 #include "device_db.h"
 #include "logger.h"
+#include "metrics.h"
 #include "url.h"
 
 namespace cppserver {
 
 class DeviceDBMySQL : public DeviceDB {
  public:
-  DeviceDBMySQL(std::shared_ptr<Logger> logger, URL& dbUrl);
+  DeviceDBMySQL(std::shared_ptr<Logger> logger, std::shared_ptr<Metrics> metrics, URL& dbUrl);
   ~DeviceDBMySQL();
 
   virtual bool initialise();
@@ -48,6 +49,14 @@ class DeviceDBMySQL : public DeviceDB {
 
   URL _dbUrl;
   struct MYSQL* conn = nullptr;
+
+  std::shared_ptr<Histogram> _query_duration;
+  std::shared_ptr<LatencyHistogram> _get_host_latency;
+  std::shared_ptr<LatencyHistogram> _get_device_latency;
+  std::shared_ptr<LatencyHistogram> _get_host_devices_latency;
+
+  MYSQL_RES* _query(const std::string& query);
+  std::vector<Device> _query_devices(const std::string& where);
 };
 
 }  // namespace cppserver
\ No newline at end of file
@@ -0,0 +1,73 @@
+//
+// cppserver
+//
+// Copyright (C) 2024 Tom Cully
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301, USA.
+//
+#include "dispatcher.h"
+
+namespace cppserver {
+
+Dispatcher::Dispatcher(std::shared_ptr<Metrics> metrics, uint32_t threads)
+    : _requests(metrics->counter("cppserver_dispatch_requests_total", "Total requests run by dispatch workers")),
+      _wait_latency(metrics->latency("cppserver_dispatch_wait_seconds", "Time requests waited for a dispatch worker")) {
+  for (uint32_t i = 0; i < threads; i++) _threads.emplace_back(&Dispatcher::_execute, this);
+}
+
+Dispatcher::~Dispatcher() {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _running = false;
+  }
+  _submitted.notify_all();
+  for (auto& thread : _threads) thread.join();
+}
+
+void Dispatcher::submit(Queue& queue, std::function<void()> task) {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    // A queue is in the ready list exactly while it has tasks
+    if (queue._tasks.empty()) _ready.push_back(&queue);
+    queue._tasks.emplace_back(std::move(task), std::chrono::steady_clock::now());
+  }
+  _submitted.notify_one();
+}
+
+void Dispatcher::_execute() {
+  std::unique_lock<std::mutex> lock(_mutex);
+
+  for (;;) {
+    _submitted.wait(lock, [this]() { return !_running || !_ready.empty(); });
+    if (!_running) return;
+
+    // Take one task from the front queue, then send the queue to the back
+    Queue* queue = _ready.front();
+    _ready.pop_front();
+    auto task = std::move(queue->_tasks.front());
+    queue->_tasks.pop_front();
+    if (!queue->_tasks.empty()) _ready.push_back(queue);
+
+    lock.unlock();
+    _wait_latency->record(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - task.second).count());
+    _requests->inc();
+    task.first();
+    task.first = nullptr;
+    lock.lock();
+  }
+}
+
+}  // namespace cppserver
@@ -0,0 +1,75 @@
+//
+// cppserver
+//
+// Copyright (C) 2024 Tom Cully
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301, USA.
+//
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "metrics.h"
+
+namespace cppserver {
+
+// Worker threads running block requests for every session of a server.
+//
+// Each session submits to its own Queue. Queues with work wait their turn in
+// a ready list and a worker takes one request from the front queue, moving it
+// to the back if it has more, so every session with requests queued gets an
+// equal share of the workers however many it has queued.
+//
+// Queues are intrusive: the owner embeds a Dispatcher::Queue and must not
+// destroy it while it has requests queued.
+class Dispatcher {
+ public:
+  class Queue {
+   private:
+    friend class Dispatcher;
+    std::deque<std::pair<std::function<void()>, std::chrono::steady_clock::time_point>> _tasks;
+  };
+
+  Dispatcher(std::shared_ptr<Metrics> metrics, uint32_t threads);
+  ~Dispatcher();
+
+  // Run task on a worker once queue's turn comes
+  void submit(Queue& queue, std::function<void()> task);
+
+  uint32_t threads() const { return _threads.size(); }
+
+ private:
+  std::mutex _mutex;
+  std::condition_variable _submitted;
+  std::deque<Queue*> _ready;
+  bool _running = true;
+  std::vector<std::thread> _threads;
+
+  std::shared_ptr<Counter> _requests;
+  std::shared_ptr<LatencyHistogram> _wait_latency;
+
+  void _execute();
+};
+
+}  // namespace cppserver
@@ -0,0 +1,66 @@
+//
+// cppserver
+//
+// Copyright (C) 2024 Tom Cully
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301, USA.
+//
+#include "hash_ring.h"
+
+#include <algorithm>
+
+namespace cppserver {
+
+static const std::string no_node;
+
+HashRing::HashRing(const std::vector<std::string>& nodes, uint32_t virtual_nodes) : _nodes(nodes) {
+  std::sort(_nodes.begin(), _nodes.end());
+  _nodes.erase(std::unique(_nodes.begin(), _nodes.end()), _nodes.end());
+
+  // A node's points depend only on its name, so they are the same whichever other nodes there are
+  _points.reserve(_nodes.size() * virtual_nodes);
+  for (uint32_t node = 0; node < _nodes.size(); node++) {
+    for (uint32_t point = 0; point < virtual_nodes; point++) _points.emplace_back(hash(_nodes[node] + "#" + std::to_string(point)), node);
+  }
+  std::sort(_points.begin(), _points.end());
+}
+
+const std::string& HashRing::owner(uint64_t device_id) const {
+  if (_points.empty()) return no_node;
+
+  auto it = std::lower_bound(_points.begin(), _points.end(), std::make_pair(hash(device_id), uint32_t(0)));
+  if (it == _points.end()) it = _points.begin();
+  return _nodes[it->second];
+}
+
+bool HashRing::contains(const std::string& node) const { return std::binary_search(_nodes.begin(), _nodes.end(), node); }
+
+uint64_t HashRing::hash(uint64_t value) {
+  // splitmix64's finaliser, so consecutive ids land far apart
+  value += 0x9e3779b97f4a7c15ULL;
+  value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  value = (value ^ (value >> 27)) * 0x94d049bb133111ebULL;
+  return value ^ (value >> 31);
+}
+
+uint64_t HashRing::hash(const std::string& value) {
+  // FNV-1a, then mixed as above since FNV's high bits mix poorly for short strings
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (unsigned char c : value) h = (h ^ c) * 0x100000001b3ULL;
+  return hash(h);
+}
+
+}  // namespace cppserver
@@ -0,0 +1,61 @@
+//
+// cppserver
+//
+// Copyright (C) 2024 Tom Cully
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301, USA.
+//
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace cppserver {
+
+// Points each node is given on the ring
+#define HASH_RING_VIRTUAL_NODES 160
+
+// Consistent hashing of devices onto the nodes of a cluster. Each node is
+// hashed onto a 64-bit ring at virtual_nodes points and a device belongs to
+// the node of the first point at or after its id's hash, wrapping around.
+// With many points per node each gets close to an even share, and adding or
+// removing a node only moves the devices between its points and the ones
+// before them, to or from that node.
+//
+// Immutable, so a ring can be shared between threads and replaced whole when
+// the cluster changes.
+class HashRing {
+ public:
+  explicit HashRing(const std::vector<std::string>& nodes, uint32_t virtual_nodes = HASH_RING_VIRTUAL_NODES);
+
+  // The node a device belongs to, empty if the ring has no nodes
+  const std::string& owner(uint64_t device_id) const;
+
+  bool contains(const std::string& node) const;
+  const std::vector<std::string>& nodes() const { return _nodes; }
+
+  static uint64_t hash(uint64_t value);
+  static uint64_t hash(const std::string& value);
+
+ private:
+  std::vector<std::string> _nodes;
+  // Sorted by hash, with the index of the node in _nodes
+  std::vector<std::pair<uint64_t, uint32_t>> _points;
+};
+
+}  // namespace cppserver
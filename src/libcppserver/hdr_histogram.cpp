@@ -0,0 +1,172 @@
+//
+// cppserver
+//
+// Copyright (C) 2024 Tom Cully
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301, USA.
+//
+#include "hdr_histogram.h"
+
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+
+namespace cppserver {
+
+HdrHistogram::HdrHistogram(uint64_t phighest_trackable, uint8_t psignificant_digits)
+    : highest_trackable(phighest_trackable), significant_digits(psignificant_digits) {
+  if (significant_digits < 1 || significant_digits > 5) {
+    throw std::invalid_argument("HdrHistogram significant digits must be 1-5");
+  }
+  if (highest_trackable < 2) {
+    throw std::invalid_argument("HdrHistogram highest trackable value must be at least 2");
+  }
+
+  // Enough linear sub-buckets to hold the requested precision
+  uint64_t largest_single_unit = 2 * static_cast<uint64_t>(std::pow(10, significant_digits));
+  int sub_bucket_count_magnitude = static_cast<int>(std::ceil(std::log2(static_cast<double>(largest_single_unit))));
+  _sub_bucket_half_count_magnitude = (sub_bucket_count_magnitude > 1 ? sub_bucket_count_magnitude : 1) - 1;
+  _sub_bucket_count = uint64_t(1) << (_sub_bucket_half_count_magnitude + 1);
+  _sub_bucket_half_count = _sub_bucket_count / 2;
+  _sub_bucket_mask = _sub_bucket_count - 1;
+
+  // Enough power-of-two buckets to reach highest_trackable
+  uint64_t smallest_untrackable = _sub_bucket_count;
+  size_t buckets = 1;
+  while (smallest_untrackable <= highest_trackable) {
+    if (smallest_untrackable > std::numeric_limits<uint64_t>::max() / 2) {
+      buckets++;
+      break;
+    }
+    smallest_untrackable <<= 1;
+    buckets++;
+  }
+  _counts_len = (buckets + 1) * _sub_bucket_half_count;
+
+  _counts = std::make_unique<std::atomic<uint64_t>[]>(_counts_len);
+  reset();
+}
+
+HdrHistogram::HdrHistogram(const HdrHistogram& other) : HdrHistogram(other.highest_trackable, other.significant_digits) { merge(other); }
+
+size_t HdrHistogram::_index_of(uint64_t value) const {
+  int bucket_index = 64 - __builtin_clzll(value | _sub_bucket_mask) - (_sub_bucket_half_count_magnitude + 1);
+  uint64_t sub_bucket_index = value >> bucket_index;
+  return ((static_cast<size_t>(bucket_index) + 1) << _sub_bucket_half_count_magnitude) + (sub_bucket_index - _sub_bucket_half_count);
+}
+
+uint64_t HdrHistogram::_value_at_index(size_t index) const {
+  int bucket_index = static_cast<int>(index >> _sub_bucket_half_count_magnitude) - 1;
+  uint64_t sub_bucket_index = (index & (_sub_bucket_half_count - 1)) + _sub_bucket_half_count;
+  if (bucket_index < 0) {
+    sub_bucket_index -= _sub_bucket_half_count;
+    bucket_index = 0;
+  }
+  return sub_bucket_index << bucket_index;
+}
+
+uint64_t HdrHistogram::_highest_equivalent_value(uint64_t value) const {
+  int bucket_index = 64 - __builtin_clzll(value | _sub_bucket_mask) - (_sub_bucket_half_count_magnitude + 1);
+  uint64_t sub_bucket_index = value >> bucket_index;
+  int adjusted_bucket = (sub_bucket_index >= _sub_bucket_count) ? bucket_index + 1 : bucket_index;
+  uint64_t lowest_equivalent = sub_bucket_index << bucket_index;
+  return lowest_equivalent + (uint64_t(1) << adjusted_bucket) - 1;
+}
+
+void HdrHistogram::_check_compatible(const HdrHistogram& other) const {
+  if (other.highest_trackable != highest_trackable || other.significant_digits != significant_digits) {
+    throw std::invalid_argument("HdrHistogram configurations differ");
+  }
+}
+
+void HdrHistogram::record(uint64_t value) {
+  if (value < 1) value = 1;
+  if (value > highest_trackable) value = highest_trackable;
+
+  _counts[_index_of(value)].fetch_add(1, std::memory_order_relaxed);
+  _total_count.fetch_add(1, std::memory_order_relaxed);
+  _total_sum.fetch_add(value, std::memory_order_relaxed);
+}
+
+void HdrHistogram::merge(const HdrHistogram& other) {
+  _check_compatible(other);
+  for (size_t i = 0; i < _counts_len; i++) {
+    uint64_t count = other._counts[i].load(std::memory_order_relaxed);
+    if (count) _counts[i].fetch_add(count, std::memory_order_relaxed);
+  }
+  _total_count.fetch_add(other._total_count.load(std::memory_order_relaxed), std::memory_order_relaxed);
+  _total_sum.fetch_add(other._total_sum.load(std::memory_order_relaxed), std::memory_order_relaxed);
+}
+
+void HdrHistogram::subtract(const HdrHistogram& other) {
+  _check_compatible(other);
+  for (size_t i = 0; i < _counts_len; i++) {
+    uint64_t count = other._counts[i].load(std::memory_order_relaxed);
+    if (count) _counts[i].fetch_sub(count, std::memory_order_relaxed);
+  }
+  _total_count.fetch_sub(other._total_count.load(std::memory_order_relaxed), std::memory_order_relaxed);
+  _total_sum.fetch_sub(other._total_sum.load(std::memory_order_relaxed), std::memory_order_relaxed);
+}
+
+void HdrHistogram::reset() {
+  for (size_t i = 0; i < _counts_len; i++) _counts[i].store(0, std::memory_order_relaxed);
+  _total_count.store(0, std::memory_order_relaxed);
+  _total_sum.store(0, std::memory_order_relaxed);
+}
+
+uint64_t HdrHistogram::count() const { return _total_count.load(std::memory_order_relaxed); }
+
+uint64_t HdrHistogram::sum() const { return _total_sum.load(std::memory_order_relaxed); }
+
+uint64_t HdrHistogram::min() const {
+  for (size_t i = 0; i < _counts_len; i++) {
+    if (_counts[i].load(std::memory_order_relaxed)) return _value_at_index(i);
+  }
+  return 0;
+}
+
+uint64_t HdrHistogram::max() const {
+  for (size_t i = _counts_len; i > 0; i--) {
+    if (_counts[i - 1].load(std::memory_order_relaxed)) return _highest_equivalent_value(_value_at_index(i - 1));
+  }
+  return 0;
+}
+
+double HdrHistogram::mean() const {
+  uint64_t total = count();
+  return total ? static_cast<double>(sum()) / total : 0;
+}
+
+uint64_t HdrHistogram::value_at_percentile(double percentile) const {
+  if (percentile > 100) percentile = 100;
+
+  // Sum the counts rather than trusting _total_count, which a concurrent writer may have run ahead of
+  uint64_t total = 0;
+  for (size_t i = 0; i < _counts_len; i++) total += _counts[i].load(std::memory_order_relaxed);
+  if (!total) return 0;
+
+  uint64_t count_at_percentile = static_cast<uint64_t>(std::ceil(percentile / 100.0 * total));
+  if (count_at_percentile < 1) count_at_percentile = 1;
+
+  uint64_t cumulative = 0;
+  for (size_t i = 0; i < _counts_len; i++) {
+    cumulative += _counts[i].load(std::memory_order_relaxed);
+    if (cumulative >= count_at_percentile) return _highest_equivalent_value(_value_at_index(i));
+  }
+  return 0;
+}
+
+}  // namespace cppserver
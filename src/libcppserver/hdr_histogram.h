@@ -0,0 +1,78 @@
+//
+// cppserver
+//
+// Copyright (C) 2024 Tom Cully
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301, USA.
+//
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+namespace cppserver {
+
+// High Dynamic Range histogram after Gil Tene's HdrHistogram. Values from 1 to
+// highest_trackable are stored in log-linear buckets with a fixed number of
+// significant decimal digits of precision, so percentiles are exact to that
+// precision regardless of the distribution.
+//
+// record() is lock-free and safe to call from any number of threads. Histograms
+// with the same configuration can be merged, subtracted and copied, which is
+// how interval snapshots are taken without stopping writers.
+class HdrHistogram {
+ public:
+  HdrHistogram(uint64_t highest_trackable, uint8_t significant_digits);
+  HdrHistogram(const HdrHistogram& other);
+
+  // Record a value. Values above highest_trackable are clamped, zero is recorded as 1.
+  void record(uint64_t value);
+
+  void merge(const HdrHistogram& other);
+  void subtract(const HdrHistogram& other);
+  void reset();
+
+  uint64_t count() const;
+  uint64_t sum() const;
+  uint64_t min() const;
+  uint64_t max() const;
+  double mean() const;
+
+  // Value at a percentile 0-100, reported as the highest value equivalent to its bucket
+  uint64_t value_at_percentile(double percentile) const;
+
+  const uint64_t highest_trackable;
+  const uint8_t significant_digits;
+
+ private:
+  int _sub_bucket_half_count_magnitude;
+  uint64_t _sub_bucket_count;
+  uint64_t _sub_bucket_half_count;
+  uint64_t _sub_bucket_mask;
+  size_t _counts_len;
+
+  std::unique_ptr<std::atomic<uint64_t>[]> _counts;
+  std::atomic<uint64_t> _total_count{0};
+  std::atomic<uint64_t> _total_sum{0};
+
+  size_t _index_of(uint64_t value) const;
+  uint64_t _value_at_index(size_t index) const;
+  uint64_t _highest_equivalent_value(uint64_t value) const;
+  void _check_compatible(const HdrHistogram& other) const;
+};
+
+}  // namespace cppserver
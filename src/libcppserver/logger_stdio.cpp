@@ -29,27 +29,35 @@ namespace cppserver {
 
 LoggerStdIO::LoggerStdIO(LogLevel log_level) { _log_level = log_level; }
 
+LoggerStdIO::LoggerStdIO(LogLevel log_level, std::shared_ptr<Metrics> metrics)
+    : _log_level(log_level), _lines_dropped(metrics->counter("cppserver_log_lines_dropped_total", "Total log lines that could not be written")) {}
+
 void LoggerStdIO::debug(const std::string &log) {
   if (_log_level > LogLevel::DEBUG) return;
-  std::lock_guard<std::mutex> lock(mtx);
-  std::cout << _getDateTime() << " [DEBUG] " << log << std::endl;
+  _write(" [DEBUG] ", log);
 }
 
 void LoggerStdIO::info(const std::string &log) {
   if (_log_level > LogLevel::INFO) return;
-  std::lock_guard<std::mutex> lock(mtx);
-  std::cout << _getDateTime() << " [INFO ] " << log << std::endl;
+  _write(" [INFO ] ", log);
 }
 
 void LoggerStdIO::warn(const std::string &log) {
   if (_log_level > LogLevel::WARN) return;
-  std::lock_guard<std::mutex> lock(mtx);
-  std::cout << _getDateTime() << " [WARN ] " << log << std::endl;
+  _write(" [WARN ] ", log);
 }
 
-void LoggerStdIO::error(const std::string &log) {
+void LoggerStdIO::error(const std::string &log) { _write(" [ERROR] ", log); }
+
+void LoggerStdIO::_write(const char *level, const std::string &log) {
   std::lock_guard<std::mutex> lock(mtx);
-  std::cout << _getDateTime() << " [ERROR] " << log << std::endl;
+  std::cout << _getDateTime() << level << log << std::endl;
+
+  // A failed write (closed or full stdout) loses the line, count it and carry on
+  if (!std::cout) {
+    std::cout.clear();
+    if (_lines_dropped) _lines_dropped->inc();
+  }
 }
 
 const std::string LoggerStdIO::_getDateTime() {
@@ -24,12 +24,14 @@
 #include <string>
 
 #include "logger.h"
+#include "metrics.h"
 
 namespace cppserver {
 
 class LoggerStdIO : public Logger {
  public:
   LoggerStdIO(LogLevel log_level);
+  LoggerStdIO(LogLevel log_level, std::shared_ptr<Metrics> metrics);
 
   virtual void debug(const std::string &log);
   virtual void info(const std::string &log);
@@ -39,7 +41,10 @@ class LoggerStdIO : public Logger {
  private:
   LogLevel _log_level;
   const std::string _getDateTime();
+  void _write(const char *level, const std::string &log);
   std::mutex mtx;
+
+  std::shared_ptr<Counter> _lines_dropped;
 };
 
 }  // namespace cppserver
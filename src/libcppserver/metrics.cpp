@@ -0,0 +1,293 @@
+//
+// cppserver
+//
+// Copyright (C) 2024 Tom Cully
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301, USA.
+//
+#include "metrics.h"
+
+#include <algorithm>
+#include <iterator>
+#include <sstream>
+#include <stdexcept>
+
+namespace cppserver {
+
+static std::string format_double(double value) {
+  std::ostringstream oss;
+  oss << value;
+  return oss.str();
+}
+
+//
+// Metric
+//
+
+Metric::Metric(const std::string& pname, const std::string& phelp, const std::string& plabels) : name(pname), help(phelp), labels(plabels) {}
+
+size_t Metric::_shard_index() {
+  static std::atomic<size_t> next_index{0};
+  thread_local size_t index = next_index.fetch_add(1, std::memory_order_relaxed) % METRICS_SHARDS;
+  return index;
+}
+
+std::string Metric::_series(const std::string& suffix, const std::string& extra) const {
+  std::string all = labels.empty() ? extra : (extra.empty() ? labels : labels + "," + extra);
+  return name + suffix + (all.empty() ? "" : "{" + all + "}");
+}
+
+//
+// Counter
+//
+
+Counter::Counter(const std::string& name, const std::string& help, const std::string& labels) : Metric(name, help, labels) {}
+
+void Counter::inc(uint64_t value) { _shards[_shard_index()].value.fetch_add(value, std::memory_order_relaxed); }
+
+uint64_t Counter::value() const {
+  uint64_t total = 0;
+  for (const auto& shard : _shards) total += shard.value.load(std::memory_order_relaxed);
+  return total;
+}
+
+void Counter::write_prometheus(std::string& out) const { out += _series() + " " + std::to_string(value()) + "\n"; }
+
+//
+// Gauge
+//
+
+Gauge::Gauge(const std::string& name, const std::string& help, const std::string& labels) : Metric(name, help, labels) {}
+
+void Gauge::inc(int64_t value) { _shards[_shard_index()].value.fetch_add(value, std::memory_order_relaxed); }
+
+void Gauge::dec(int64_t value) { _shards[_shard_index()].value.fetch_sub(value, std::memory_order_relaxed); }
+
+int64_t Gauge::value() const {
+  int64_t total = 0;
+  for (const auto& shard : _shards) total += shard.value.load(std::memory_order_relaxed);
+  return total;
+}
+
+void Gauge::write_prometheus(std::string& out) const { out += _series() + " " + std::to_string(value()) + "\n"; }
+
+//
+// Histogram
+//
+
+Histogram::Histogram(const std::string& name, const std::string& help, const std::vector<double>& pbounds, const std::string& labels)
+    : Metric(name, help, labels), bounds(pbounds) {
+  if (!std::is_sorted(bounds.begin(), bounds.end())) {
+    throw std::invalid_argument("Histogram bounds must be ascending");
+  }
+  for (auto& shard : _shards) {
+    shard.buckets = std::make_unique<std::atomic<uint64_t>[]>(bounds.size() + 1);
+    for (size_t i = 0; i <= bounds.size(); i++) shard.buckets[i] = 0;
+  }
+}
+
+void Histogram::observe(double value) {
+  size_t bucket = std::lower_bound(bounds.begin(), bounds.end(), value) - bounds.begin();
+  Shard& shard = _shards[_shard_index()];
+  shard.buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+
+  // Shards are mostly private to one thread, so this rarely loops
+  double sum = shard.sum.load(std::memory_order_relaxed);
+  while (!shard.sum.compare_exchange_weak(sum, sum + value, std::memory_order_relaxed)) {
+  }
+}
+
+void Histogram::snapshot(std::vector<uint64_t>& buckets, uint64_t& count, double& sum) const {
+  buckets.assign(bounds.size() + 1, 0);
+  sum = 0;
+  for (const auto& shard : _shards) {
+    for (size_t i = 0; i <= bounds.size(); i++) buckets[i] += shard.buckets[i].load(std::memory_order_relaxed);
+    sum += shard.sum.load(std::memory_order_relaxed);
+  }
+  for (size_t i = 1; i < buckets.size(); i++) buckets[i] += buckets[i - 1];
+  count = buckets.back();
+}
+
+void Histogram::write_prometheus(std::string& out) const {
+  std::vector<uint64_t> buckets;
+  uint64_t count;
+  double sum;
+  snapshot(buckets, count, sum);
+
+  for (size_t i = 0; i < bounds.size(); i++) {
+    out += _series("_bucket", "le=\"" + format_double(bounds[i]) + "\"") + " " + std::to_string(buckets[i]) + "\n";
+  }
+  out += _series("_bucket", "le=\"+Inf\"") + " " + std::to_string(count) + "\n";
+  out += _series("_sum") + " " + format_double(sum) + "\n";
+  out += _series("_count") + " " + std::to_string(count) + "\n";
+}
+
+//
+// LatencyHistogram
+//
+
+// Track up to one minute in nanoseconds to 3 significant digits
+#define LATENCY_HIGHEST_TRACKABLE 60000000000ULL
+#define LATENCY_SIGNIFICANT_DIGITS 3
+
+const std::vector<double> LatencyHistogram::quantiles = {0.5, 0.9, 0.99, 0.999};
+
+LatencyHistogram::LatencyHistogram(const std::string& name, const std::string& help, const std::string& labels)
+    : Metric(name, help, labels),
+      _lifetime(LATENCY_HIGHEST_TRACKABLE, LATENCY_SIGNIFICANT_DIGITS),
+      _previous(LATENCY_HIGHEST_TRACKABLE, LATENCY_SIGNIFICANT_DIGITS),
+      _interval(LATENCY_HIGHEST_TRACKABLE, LATENCY_SIGNIFICANT_DIGITS) {}
+
+void LatencyHistogram::record(uint64_t nanoseconds) { _lifetime.record(nanoseconds); }
+
+void LatencyHistogram::rotate() {
+  HdrHistogram current(_lifetime);
+
+  std::lock_guard<std::mutex> lock(_mutex);
+  _interval.reset();
+  _interval.merge(current);
+  _interval.subtract(_previous);
+  _previous.reset();
+  _previous.merge(current);
+}
+
+HdrHistogram LatencyHistogram::lifetime() const { return HdrHistogram(_lifetime); }
+
+HdrHistogram LatencyHistogram::interval() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  return HdrHistogram(_interval);
+}
+
+void LatencyHistogram::_write_quantiles(std::string& out, const std::string& window, const HdrHistogram& histogram) const {
+  for (double quantile : quantiles) {
+    out += _series("", "window=\"" + window + "\",quantile=\"" + format_double(quantile) + "\"") + " " +
+           format_double(histogram.value_at_percentile(quantile * 100) / 1e9) + "\n";
+  }
+  out += _series("_sum", "window=\"" + window + "\"") + " " + format_double(histogram.sum() / 1e9) + "\n";
+  out += _series("_count", "window=\"" + window + "\"") + " " + std::to_string(histogram.count()) + "\n";
+}
+
+void LatencyHistogram::write_prometheus(std::string& out) const {
+  _write_quantiles(out, "lifetime", _lifetime);
+
+  std::lock_guard<std::mutex> lock(_mutex);
+  _write_quantiles(out, "interval", _interval);
+}
+
+void LatencyHistogram::write_summary(std::string& out) {
+  HdrHistogram lifetime_snapshot = lifetime();
+  HdrHistogram interval_snapshot = interval();
+
+  for (const auto& [window, histogram] : {std::make_pair("interval", &interval_snapshot), std::make_pair("lifetime", &lifetime_snapshot)}) {
+    out += _series() + " (" + window + ") count=" + std::to_string(histogram->count());
+    for (double quantile : quantiles) {
+      out += " p" + format_double(quantile * 100) + "=" + std::to_string(histogram->value_at_percentile(quantile * 100) / 1000) + "us";
+    }
+    out += " max=" + std::to_string(histogram->max() / 1000) + "us\n";
+  }
+}
+
+//
+// ScopedLatency
+//
+
+ScopedLatency::ScopedLatency(LatencyHistogram& histogram) : _histogram(histogram), _start(std::chrono::steady_clock::now()) {}
+
+ScopedLatency::~ScopedLatency() {
+  _histogram.record(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - _start).count());
+}
+
+//
+// Metrics
+//
+
+Metrics::Metrics() {}
+
+template <typename T, typename... Args>
+std::shared_ptr<T> Metrics::_get_or_create(const std::string& name, const std::string& help, const std::string& labels, Args&&... args) {
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  std::string key = labels.empty() ? name : name + " " + labels;
+  auto it = _metrics.find(key);
+  if (it != _metrics.end()) {
+    auto metric = std::dynamic_pointer_cast<T>(it->second);
+    if (!metric) throw std::runtime_error("Metric " + name + " already registered with a different type");
+    return metric;
+  }
+
+  auto metric = std::make_shared<T>(name, help, std::forward<Args>(args)..., labels);
+
+  // Every member of a family must share a type
+  auto family = _metrics.lower_bound(name);
+  if (family != _metrics.end() && family->second->name == name && std::string(family->second->type()) != metric->type()) {
+    throw std::runtime_error("Metric " + name + " already registered with a different type");
+  }
+
+  _metrics[key] = metric;
+  return metric;
+}
+
+std::shared_ptr<Counter> Metrics::counter(const std::string& name, const std::string& help, const std::string& labels) {
+  return _get_or_create<Counter>(name, help, labels);
+}
+
+std::shared_ptr<Gauge> Metrics::gauge(const std::string& name, const std::string& help, const std::string& labels) {
+  return _get_or_create<Gauge>(name, help, labels);
+}
+
+std::shared_ptr<Histogram> Metrics::histogram(const std::string& name, const std::string& help, const std::vector<double>& bounds, const std::string& labels) {
+  return _get_or_create<Histogram>(name, help, labels, bounds);
+}
+
+std::shared_ptr<LatencyHistogram> Metrics::latency(const std::string& name, const std::string& help, const std::string& labels) {
+  return _get_or_create<LatencyHistogram>(name, help, labels);
+}
+
+void Metrics::rotate() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  for (const auto& [name, metric] : _metrics) {
+    auto latency = std::dynamic_pointer_cast<LatencyHistogram>(metric);
+    if (latency) latency->rotate();
+  }
+}
+
+std::string Metrics::to_summary() {
+  std::string out;
+  std::lock_guard<std::mutex> lock(_mutex);
+  for (const auto& [name, metric] : _metrics) {
+    auto latency = std::dynamic_pointer_cast<LatencyHistogram>(metric);
+    if (latency) latency->write_summary(out);
+  }
+  return out;
+}
+
+std::string Metrics::to_prometheus() {
+  std::string out;
+  std::lock_guard<std::mutex> lock(_mutex);
+  for (auto it = _metrics.begin(); it != _metrics.end(); ++it) {
+    const Metric& metric = *it->second;
+    if (it == _metrics.begin() || std::prev(it)->second->name != metric.name) {
+      out += "# HELP " + metric.name + " " + metric.help + "\n";
+      out += "# TYPE " + metric.name + " " + metric.type() + "\n";
+    }
+    metric.write_prometheus(out);
+  }
+  return out;
+}
+
+const std::vector<double> Metrics::latencyBuckets = {0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10};
+
+}  // namespace cppserver
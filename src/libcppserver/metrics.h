@@ -0,0 +1,199 @@
+//
+// cppserver
+//
+// Copyright (C) 2024 Tom Cully
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301, USA.
+//
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "hdr_histogram.h"
+
+namespace cppserver {
+
+// Number of per-thread shards per metric. Threads are spread over the shards
+// round-robin, so writers on different threads rarely share a cache line.
+#define METRICS_SHARDS 16
+
+// Metrics sharing a name but with different labels form one family, e.g.
+// per-host series. labels is in exposition form, e.g. host="12".
+class Metric {
+ public:
+  Metric(const std::string& name, const std::string& help, const std::string& labels);
+  virtual ~Metric() {}
+
+  // Prometheus metric type
+  virtual const char* type() const = 0;
+
+  // Append this metric's samples in Prometheus text exposition format
+  virtual void write_prometheus(std::string& out) const = 0;
+
+  const std::string name;
+  const std::string help;
+  const std::string labels;
+
+ protected:
+  static size_t _shard_index();
+
+  // Sample name with suffix, labels and any extra labels
+  std::string _series(const std::string& suffix = "", const std::string& extra = "") const;
+};
+
+class Counter : public Metric {
+ public:
+  Counter(const std::string& name, const std::string& help, const std::string& labels = "");
+
+  void inc(uint64_t value = 1);
+  uint64_t value() const;
+
+  virtual const char* type() const { return "counter"; }
+  virtual void write_prometheus(std::string& out) const;
+
+ private:
+  struct alignas(64) Shard {
+    std::atomic<uint64_t> value{0};
+  };
+  std::array<Shard, METRICS_SHARDS> _shards;
+};
+
+class Gauge : public Metric {
+ public:
+  Gauge(const std::string& name, const std::string& help, const std::string& labels = "");
+
+  void inc(int64_t value = 1);
+  void dec(int64_t value = 1);
+  int64_t value() const;
+
+  virtual const char* type() const { return "gauge"; }
+  virtual void write_prometheus(std::string& out) const;
+
+ private:
+  struct alignas(64) Shard {
+    std::atomic<int64_t> value{0};
+  };
+  std::array<Shard, METRICS_SHARDS> _shards;
+};
+
+class Histogram : public Metric {
+ public:
+  // bounds are the inclusive upper bounds of each bucket, ascending. An implicit +Inf bucket is added.
+  Histogram(const std::string& name, const std::string& help, const std::vector<double>& bounds, const std::string& labels = "");
+
+  void observe(double value);
+
+  // Aggregate over all shards. buckets are cumulative, the last entry being the +Inf bucket.
+  void snapshot(std::vector<uint64_t>& buckets, uint64_t& count, double& sum) const;
+
+  virtual const char* type() const { return "histogram"; }
+  virtual void write_prometheus(std::string& out) const;
+
+  const std::vector<double> bounds;
+
+ private:
+  struct alignas(64) Shard {
+    std::unique_ptr<std::atomic<uint64_t>[]> buckets;
+    std::atomic<double> sum{0};
+  };
+  std::array<Shard, METRICS_SHARDS> _shards;
+};
+
+// Latency distribution in nanoseconds backed by an HdrHistogram, exported as a
+// summary with quantiles for both the process lifetime and the last complete
+// interval. Intervals are closed by rotate(), normally on a fixed timer.
+class LatencyHistogram : public Metric {
+ public:
+  LatencyHistogram(const std::string& name, const std::string& help, const std::string& labels = "");
+
+  void record(uint64_t nanoseconds);
+
+  // Close the current interval, interval() then covers values recorded between the last two calls
+  void rotate();
+
+  HdrHistogram lifetime() const;
+  HdrHistogram interval();
+
+  virtual const char* type() const { return "summary"; }
+  virtual void write_prometheus(std::string& out) const;
+
+  // Append human readable interval and lifetime percentile lines
+  void write_summary(std::string& out);
+
+  static const std::vector<double> quantiles;
+
+ private:
+  HdrHistogram _lifetime;
+
+  // Snapshots are only touched by rotate() and readers, never by record()
+  mutable std::mutex _mutex;
+  HdrHistogram _previous;
+  HdrHistogram _interval;
+
+  void _write_quantiles(std::string& out, const std::string& window, const HdrHistogram& histogram) const;
+};
+
+// Records the time from construction to destruction into a LatencyHistogram
+class ScopedLatency {
+ public:
+  ScopedLatency(LatencyHistogram& histogram);
+  ~ScopedLatency();
+
+ private:
+  LatencyHistogram& _histogram;
+  std::chrono::steady_clock::time_point _start;
+};
+
+class Metrics {
+ public:
+  Metrics();
+
+  // Get or create a metric by name and labels. Returned handles are shared by all callers using the same name and labels.
+  std::shared_ptr<Counter> counter(const std::string& name, const std::string& help, const std::string& labels = "");
+  std::shared_ptr<Gauge> gauge(const std::string& name, const std::string& help, const std::string& labels = "");
+  std::shared_ptr<Histogram> histogram(const std::string& name, const std::string& help, const std::vector<double>& bounds, const std::string& labels = "");
+  std::shared_ptr<LatencyHistogram> latency(const std::string& name, const std::string& help, const std::string& labels = "");
+
+  // Close the current interval of every latency histogram
+  void rotate();
+
+  // Aggregate and render every registered metric in Prometheus text format
+  std::string to_prometheus();
+
+  // Human readable lifetime and interval percentiles of every latency histogram
+  std::string to_summary();
+
+  // Default latency buckets in seconds, 100us to 10s
+  static const std::vector<double> latencyBuckets;
+
+ private:
+  std::mutex _mutex;
+  // Keyed by name, then labels after a space, which sorts each family together
+  std::map<std::string, std::shared_ptr<Metric>> _metrics;
+
+  template <typename T, typename... Args>
+  std::shared_ptr<T> _get_or_create(const std::string& name, const std::string& help, const std::string& labels, Args&&... args);
+};
+
+}  // namespace cppserver
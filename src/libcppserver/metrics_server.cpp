@@ -0,0 +1,116 @@
+//
+// cppserver
+//
+// Copyright (C) 2024 Tom Cully
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301, USA.
+//
+#include "metrics_server.h"
+
+#include <istream>
+#include <string>
+
+#include "logger_scoped.h"
+
+namespace cppserver {
+
+MetricsServer::MetricsServer(std::shared_ptr<Logger> logger, std::shared_ptr<Metrics> metrics, uint16_t port)
+    : _port(port),
+      _acceptor(_io_context, boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), port)),
+      _metrics(metrics),
+      _logger(std::make_shared<LoggerScoped>("admin", logger)) {
+  _start_accept();
+}
+
+MetricsServer::~MetricsServer() { stop(); }
+
+void MetricsServer::start() {
+  _logger->debug("Starting...");
+  _thread = std::make_shared<std::thread>([this]() { _io_context.run(); });
+  _logger->info("Serving metrics on TCP " + std::to_string(_port));
+}
+
+void MetricsServer::stop() {
+  if (_thread) {
+    _logger->debug("Stopping...");
+    _io_context.stop();
+
+    if (_thread->joinable()) {
+      _thread->join();
+      _thread.reset();
+    }
+    _logger->info("Stopped");
+  }
+}
+
+void MetricsServer::_start_accept() {
+  auto req = std::make_shared<Request>(_io_context);
+  _acceptor.async_accept(req->socket, [this, req](const boost::system::error_code& error) { _handle_accept(error, req); });
+}
+
+void MetricsServer::_handle_accept(const boost::system::error_code& error, std::shared_ptr<Request> req) {
+  if (error) {
+    _logger->error("Error accepting admin connection: " + error.message());
+  } else {
+    boost::asio::async_read_until(req->socket, req->request, "\r\n\r\n",
+                                  [this, req](const boost::system::error_code& error, std::size_t) { _handle_request(error, req); });
+  }
+
+  if (error != boost::asio::error::operation_aborted) _start_accept();
+}
+
+void MetricsServer::_handle_request(const boost::system::error_code& error, std::shared_ptr<Request> req) {
+  if (error) {
+    _logger->debug("Dropping admin request: " + error.message());
+    return;
+  }
+
+  std::istream stream(&req->request);
+  std::string method, path;
+  stream >> method >> path;
+
+  req->response = _route(method, path);
+  boost::asio::async_write(req->socket, boost::asio::buffer(req->response), [req](const boost::system::error_code&, std::size_t) {
+    boost::system::error_code ec;
+    req->socket.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ec);
+    req->socket.close(ec);
+  });
+}
+
+std::string MetricsServer::_route(const std::string& method, const std::string& path) {
+  std::string status = "200 OK";
+  std::string body;
+
+  if (method != "GET") {
+    status = "405 Method Not Allowed";
+  } else if (path == "/metrics") {
+    body = _metrics->to_prometheus();
+  } else {
+    status = "404 Not Found";
+  }
+
+  return "HTTP/1.0 " + status +
+         "\r\n"
+         "Content-Type: text/plain; version=0.0.4\r\n"
+         "Content-Length: " +
+         std::to_string(body.size()) +
+         "\r\n"
+         "Connection: close\r\n"
+         "\r\n" +
+         body;
+}
+
+}  // namespace cppserver
@@ -0,0 +1,69 @@
+//
+// cppserver
+//
+// Copyright (C) 2024 Tom Cully
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301, USA.
+//
+#pragma once
+
+#include <boost/asio.hpp>
+#include <memory>
+#include <thread>
+
+#include "logger.h"
+#include "metrics.h"
+#include "server.h"
+
+namespace cppserver {
+
+// Requests larger than this are dropped without a response
+#define METRICS_MAX_REQUEST 8192
+
+// Minimal HTTP/1.0 admin listener serving the metrics registry in Prometheus
+// text format on GET /metrics. Each scrape is handled on the server's own
+// io_context thread and the connection is closed after the response.
+class MetricsServer : public Server {
+ public:
+  MetricsServer(std::shared_ptr<Logger> logger, std::shared_ptr<Metrics> metrics, uint16_t port);
+  ~MetricsServer();
+
+  virtual void start();
+  virtual void stop();
+
+ private:
+  struct Request {
+    Request(boost::asio::io_context &io_context) : socket(io_context), request(METRICS_MAX_REQUEST) {}
+    boost::asio::ip::tcp::socket socket;
+    boost::asio::streambuf request;
+    std::string response;
+  };
+
+  void _start_accept();
+  void _handle_accept(const boost::system::error_code &error, std::shared_ptr<Request> req);
+  void _handle_request(const boost::system::error_code &error, std::shared_ptr<Request> req);
+  std::string _route(const std::string &method, const std::string &path);
+
+  uint16_t _port;
+  boost::asio::io_context _io_context;
+  boost::asio::ip::tcp::acceptor _acceptor;
+  std::shared_ptr<std::thread> _thread;
+
+  std::shared_ptr<Metrics> _metrics;
+  std::shared_ptr<Logger> _logger;
+};
+
+}  // namespace cppserver
@@ -0,0 +1,156 @@
+//
+// cppserver
+//
+// Copyright (C) 2024 Tom Cully
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301, USA.
+//
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace cppserver {
+
+// The NBD protocol, fixed newstyle, as spoken by Linux nbd-client, qemu and
+// libnbd. All integers are big-endian.
+//
+// On connect the server sends NBDMAGIC, IHAVEOPT and its handshake flags,
+// the client answers with its own flags and then sends options, each
+//
+//   IHAVEOPT (8), option (4), length (4), data
+//
+// answered, except EXPORT_NAME, by one or more option replies
+//
+//   NBD_OPTION_REPLY_MAGIC (8), option (4), reply type (4), length (4), data
+//
+// until EXPORT_NAME or GO picks an export and moves the connection to
+// transmission. Requests are then
+//
+//   NBD_REQUEST_MAGIC (4), command flags (2), type (2), cookie (8), offset (8), length (4), data for WRITE
+//
+// and answered, in any order, by a simple reply
+//
+//   NBD_SIMPLE_REPLY_MAGIC (4), errno (4), cookie (8), data for READ
+//
+// or, once STRUCTURED_REPLY was negotiated, by structured reply chunks
+//
+//   NBD_STRUCTURED_REPLY_MAGIC (4), flags (2), type (2), cookie (8), length (4), payload
+//
+// the last of a request's chunks flagged NBD_REPLY_FLAG_DONE.
+#define NBD_MAGIC 0x4e42444d41474943ULL              // "NBDMAGIC"
+#define NBD_OPTION_MAGIC 0x49484156454f5054ULL       // "IHAVEOPT"
+#define NBD_OPTION_REPLY_MAGIC 0x0003e889045565a9ULL
+#define NBD_REQUEST_MAGIC 0x25609513
+#define NBD_SIMPLE_REPLY_MAGIC 0x67446698
+#define NBD_STRUCTURED_REPLY_MAGIC 0x668e33ef
+
+#define NBD_OPTION_HEADER_SIZE 16
+#define NBD_OPTION_REPLY_HEADER_SIZE 20
+#define NBD_REQUEST_SIZE 28
+#define NBD_SIMPLE_REPLY_SIZE 16
+#define NBD_STRUCTURED_REPLY_SIZE 20
+// Zeros after the export geometry in an EXPORT_NAME reply, unless NO_ZEROES was agreed
+#define NBD_EXPORT_ZEROES 124
+
+// Largest option data accepted, and largest READ or WRITE
+#define NBD_MAX_OPTION_SIZE 4096
+#define NBD_MAX_PAYLOAD (32 * 1024 * 1024)
+
+// Handshake flags, from the server
+enum NBDHandshakeFlags : uint16_t {
+  NBD_FLAG_FIXED_NEWSTYLE = 0x01,
+  NBD_FLAG_NO_ZEROES = 0x02,
+};
+
+// Client flags, in answer to the handshake
+enum NBDClientFlags : uint32_t {
+  NBD_FLAG_C_FIXED_NEWSTYLE = 0x01,
+  NBD_FLAG_C_NO_ZEROES = 0x02,
+};
+
+// Transmission flags, describing an export
+enum NBDTransmissionFlags : uint16_t {
+  NBD_FLAG_HAS_FLAGS = 0x0001,
+  NBD_FLAG_READ_ONLY = 0x0002,
+  NBD_FLAG_SEND_FLUSH = 0x0004,
+  NBD_FLAG_SEND_FUA = 0x0008,
+  NBD_FLAG_SEND_TRIM = 0x0020,
+  NBD_FLAG_SEND_WRITE_ZEROES = 0x0040,
+  NBD_FLAG_CAN_MULTI_CONN = 0x0100,  // A flush on any connection covers writes completed on every connection
+};
+
+enum NBDOption : uint32_t {
+  NBD_OPT_EXPORT_NAME = 1,
+  NBD_OPT_ABORT = 2,
+  NBD_OPT_LIST = 3,
+  NBD_OPT_STARTTLS = 5,
+  NBD_OPT_INFO = 6,
+  NBD_OPT_GO = 7,
+  NBD_OPT_STRUCTURED_REPLY = 8,
+};
+
+enum NBDOptionReply : uint32_t {
+  NBD_REP_ACK = 1,
+  NBD_REP_SERVER = 2,
+  NBD_REP_INFO = 3,
+  NBD_REP_ERR_UNSUP = 0x80000001,
+  NBD_REP_ERR_POLICY = 0x80000002,
+  NBD_REP_ERR_INVALID = 0x80000003,
+  NBD_REP_ERR_UNKNOWN = 0x80000006,
+  NBD_REP_ERR_BLOCK_SIZE_REQD = 0x80000008,  // The client must ask for NBD_INFO_BLOCK_SIZE, agreeing to keep to it
+};
+
+// Information in an NBD_REP_INFO reply to INFO or GO
+enum NBDInfo : uint16_t {
+  NBD_INFO_EXPORT = 0,      // size (8), transmission flags (2)
+  NBD_INFO_BLOCK_SIZE = 3,  // minimum (4), preferred (4), maximum (4)
+};
+
+enum NBDCommand : uint16_t {
+  NBD_CMD_READ = 0,
+  NBD_CMD_WRITE = 1,
+  NBD_CMD_DISC = 2,
+  NBD_CMD_FLUSH = 3,
+  NBD_CMD_TRIM = 4,
+  NBD_CMD_WRITE_ZEROES = 6,
+};
+
+enum NBDCommandFlags : uint16_t {
+  NBD_CMD_FLAG_FUA = 0x01,
+  NBD_CMD_FLAG_NO_HOLE = 0x02,  // WRITE_ZEROES must write the zeros rather than trim
+};
+
+enum NBDReplyFlags : uint16_t {
+  NBD_REPLY_FLAG_DONE = 0x01,
+};
+
+enum NBDReplyType : uint16_t {
+  NBD_REPLY_TYPE_NONE = 0,
+  NBD_REPLY_TYPE_OFFSET_DATA = 1,  // offset (8), data
+  NBD_REPLY_TYPE_ERROR = 0x8001,   // errno (4), message length (2), message
+};
+
+// Errors in replies, as numbered by the protocol rather than the host
+enum NBDError : uint32_t {
+  NBD_EPERM = 1,
+  NBD_EIO = 5,
+  NBD_EINVAL = 22,
+  NBD_ENOSPC = 28,
+  NBD_ESHUTDOWN = 108,
+};
+
+}  // namespace cppserver
@@ -0,0 +1,102 @@
+//
+// cppserver
+//
+// Copyright (C) 2024 Tom Cully
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301, USA.
+//
+#include "nbd_server.h"
+
+#include <algorithm>
+
+#include "logger_scoped.h"
+
+namespace cppserver {
+
+NBDServer::NBDServer(std::shared_ptr<Logger> logger, std::shared_ptr<Metrics> metrics, std::shared_ptr<BlockEngine> engine, uint16_t port,
+                     const NBDServerOptions& options)
+    : _options(options),
+      _dispatcher(options.dispatch_threads ? std::make_shared<Dispatcher>(metrics, options.dispatch_threads) : nullptr),
+      _acceptor(_io_context, boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), port)),
+      _accept_backoff_timer(_io_context),
+      _logger(std::make_shared<LoggerScoped>("nbd", logger)),
+      _metrics(metrics),
+      _engine(engine),
+      _sessions_accepted(metrics->counter("cppserver_nbd_sessions_accepted_total", "Total NBD sessions accepted")),
+      _accept_errors(metrics->counter("cppserver_nbd_accept_errors_total", "Total NBD accept errors")) {
+  _start_accept();
+}
+
+NBDServer::~NBDServer() { stop(); }
+
+void NBDServer::start() {
+  _logger->debug("Starting...");
+  _thread = std::make_shared<std::thread>([this]() { _io_context.run(); });
+  _logger->info("Listening on TCP " + std::to_string(port()) + ", exporting the devices of host " + std::to_string(_options.host_id));
+}
+
+void NBDServer::stop() {
+  if (_thread) {
+    _logger->debug("Stopping...");
+    _io_context.stop();
+
+    if (_thread->joinable()) {
+      _thread->join();
+      _thread.reset();
+    }
+    _logger->info("Stopped");
+  }
+}
+
+void NBDServer::_start_accept() {
+  auto new_connection = std::make_shared<boost::asio::ip::tcp::socket>(_io_context);
+
+  _acceptor.async_accept(*new_connection, [this, new_connection](const boost::system::error_code& error) { _handle_accept(error, new_connection); });
+}
+
+void NBDServer::_handle_accept(const boost::system::error_code& error, std::shared_ptr<boost::asio::ip::tcp::socket> new_connection) {
+  if (error) {
+    if (error == boost::asio::error::operation_aborted) return;
+    _accept_errors->inc();
+
+    // Errors such as EMFILE are usually transient, retry once sessions have had a chance to close
+    _accept_backoff_ms = std::min<uint32_t>(_accept_backoff_ms ? _accept_backoff_ms * 2 : NBD_SERVER_ACCEPT_BACKOFF_MIN_MS, NBD_SERVER_ACCEPT_BACKOFF_MAX_MS);
+    _logger->error("Error accepting new connection (" + error.message() + "), retrying in " + std::to_string(_accept_backoff_ms) + "ms");
+    _accept_backoff_timer.expires_after(std::chrono::milliseconds(_accept_backoff_ms));
+    _accept_backoff_timer.async_wait([this](const boost::system::error_code& ec) {
+      if (!ec) _start_accept();
+    });
+    return;
+  }
+  _accept_backoff_ms = 0;
+
+  boost::system::error_code ec;
+  auto endpoint = new_connection->remote_endpoint(ec);
+  std::string peer = endpoint.address().to_string() + ":" + std::to_string(endpoint.port());
+
+  int id = _next_connection_id++;
+  _logger->info("New Connection #" + std::to_string(id) + " (" + peer + ")");
+
+  // Finished sessions are removed on this thread, which joins the session thread
+  _connections[id] = std::make_shared<NBDSession>(_logger, _metrics, _dispatcher, _engine, _options.host_id, _options.session, new_connection, peer,
+                                                  [this, id]() { boost::asio::post(_io_context, [this, id]() { _connections.erase(id); }); });
+  _sessions_accepted->inc();
+
+  // Start accepting another connection
+  _start_accept();
+}
+
+}  // namespace cppserver
@@ -0,0 +1,92 @@
+//
+// cppserver
+//
+// Copyright (C) 2024 Tom Cully
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301, USA.
+//
+#pragma once
+
+#include <boost/asio.hpp>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <unordered_map>
+
+#include "block_engine.h"
+#include "dispatcher.h"
+#include "logger.h"
+#include "metrics.h"
+#include "nbd_session.h"
+#include "server.h"
+
+namespace cppserver {
+
+// Accept error backoff, doubling from min to max until an accept succeeds
+#define NBD_SERVER_ACCEPT_BACKOFF_MIN_MS 10
+#define NBD_SERVER_ACCEPT_BACKOFF_MAX_MS 1000
+
+class NBDServerOptions {
+ public:
+  uint64_t host_id = 0;           // Host whose devices are exported, as NBD clients cannot say which host they are
+  uint32_t dispatch_threads = 8;  // Workers running requests from every session, 0 for each session to run its own in order
+  NBDSessionOptions session;
+};
+
+// Serves a host's devices to stock NBD clients, such as the Linux kernel
+// through nbd-client, qemu or libnbd, each device an export. A client may
+// open several connections to the same export, as flushes cover writes from
+// all of them.
+class NBDServer : public Server {
+ public:
+  NBDServer(std::shared_ptr<Logger> logger, std::shared_ptr<Metrics> metrics, std::shared_ptr<BlockEngine> engine, uint16_t port,
+            const NBDServerOptions& options);
+  ~NBDServer();
+
+  virtual void start();
+  virtual void stop();
+
+  // The TCP port listened on, the one chosen if constructed with port 0
+  uint16_t port() const { return _acceptor.local_endpoint().port(); }
+
+ private:
+  void _start_accept();
+  void _handle_accept(const boost::system::error_code& error, std::shared_ptr<boost::asio::ip::tcp::socket> new_connection);
+
+  NBDServerOptions _options;
+
+  // Shared by all sessions, declared before _connections so it outlives them
+  std::shared_ptr<Dispatcher> _dispatcher;
+
+  boost::asio::io_context _io_context;
+  boost::asio::ip::tcp::acceptor _acceptor;
+  std::unordered_map<int, std::shared_ptr<NBDSession>> _connections;
+  int _next_connection_id = 0;
+
+  boost::asio::steady_timer _accept_backoff_timer;
+  uint32_t _accept_backoff_ms = 0;
+
+  std::shared_ptr<std::thread> _thread;
+
+  std::shared_ptr<Logger> _logger;
+  std::shared_ptr<Metrics> _metrics;
+  std::shared_ptr<BlockEngine> _engine;
+
+  std::shared_ptr<Counter> _sessions_accepted;
+  std::shared_ptr<Counter> _accept_errors;
+};
+
+}  // namespace cppserver
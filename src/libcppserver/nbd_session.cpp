@@ -0,0 +1,532 @@
+//
+// cppserver
+//
+// Copyright (C) 2024 Tom Cully
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301, USA.
+//
+#include "nbd_session.h"
+
+#include <fcntl.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include "logger_scoped.h"
+#include "protocol.h"
+
+namespace cppserver {
+
+NBDSession::NBDSession(std::shared_ptr<Logger> logger, std::shared_ptr<Metrics> metrics, std::shared_ptr<Dispatcher> dispatcher,
+                       std::shared_ptr<BlockEngine> engine, uint64_t host_id, const NBDSessionOptions& options,
+                       std::shared_ptr<boost::asio::ip::tcp::socket> connection, const std::string& peer, std::function<void()> on_closed)
+    : _logger(std::make_unique<LoggerScoped>(peer, logger)),
+      _metrics(metrics),
+      _engine(engine),
+      _host_id(host_id),
+      _options(options),
+      _fd(connection->release()),
+      _on_closed(on_closed),
+      _running(true),
+      _dispatcher(options.max_in_flight > 1 ? dispatcher : nullptr),
+      _sessions_active(metrics->gauge("cppserver_nbd_sessions_active", "NBD sessions currently open")),
+      _requests(metrics->counter("cppserver_nbd_requests_total", "Total requests received from NBD sessions")),
+      _errors(metrics->counter("cppserver_nbd_errors_total", "Total NBD requests answered with an error")),
+      _request_latency(metrics->latency("cppserver_nbd_request_seconds", "Time from receiving an NBD request to its reply")) {
+  // Blocking from here on, a client that stops reading replies times out
+  ::fcntl(_fd, F_SETFL, ::fcntl(_fd, F_GETFL) & ~O_NONBLOCK);
+  struct timeval timeout = {time_t(options.write_timeout_ms / 1000), suseconds_t(options.write_timeout_ms % 1000 * 1000)};
+  ::setsockopt(_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  int one = 1;
+  ::setsockopt(_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  _thread = std::make_unique<std::thread>(&NBDSession::_execute, this);
+}
+
+NBDSession::~NBDSession() {
+  close();
+  ::close(_fd);
+}
+
+void NBDSession::close() {
+  // Fails the session thread's blocking read, and any reply being written
+  _running = false;
+  ::shutdown(_fd, SHUT_RDWR);
+
+  if (_thread->joinable()) _thread->join();
+}
+
+void NBDSession::_execute() {
+  _sessions_active->inc();
+  _logger->info("Connected");
+
+  if (_negotiate()) _transmit();
+
+  // Requests in flight may still be writing their replies
+  _wait_in_flight(0);
+  ::shutdown(_fd, SHUT_RDWR);
+
+  _sessions_active->dec();
+  _logger->info("Closed");
+
+  if (_on_closed) _on_closed();
+}
+
+//
+// Negotiation
+//
+
+bool NBDSession::_negotiate() {
+  uint8_t greeting[18];
+  put_u64(greeting, NBD_MAGIC);
+  put_u64(greeting + 8, NBD_OPTION_MAGIC);
+  put_u16(greeting + 16, NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
+  if (!_write({boost::asio::buffer(greeting)})) return false;
+
+  uint8_t client[4];
+  if (!_read(client, sizeof(client))) return false;
+  uint32_t flags = get_u32(client);
+  if (flags & ~uint32_t(NBD_FLAG_C_FIXED_NEWSTYLE | NBD_FLAG_C_NO_ZEROES)) {
+    _logger->warn("Closing (Unknown client flags " + std::to_string(flags) + ")");
+    return false;
+  }
+  _no_zeroes = flags & NBD_FLAG_C_NO_ZEROES;
+
+  for (;;) {
+    uint8_t header[NBD_OPTION_HEADER_SIZE];
+    if (!_read(header, sizeof(header))) return false;
+    if (get_u64(header) != NBD_OPTION_MAGIC) {
+      _logger->warn("Closing (Bad option magic)");
+      return false;
+    }
+    uint32_t option = get_u32(header + 8);
+    uint32_t length = get_u32(header + 12);
+    if (length > NBD_MAX_OPTION_SIZE) {
+      _logger->warn("Closing (Option " + std::to_string(option) + " too large)");
+      return false;
+    }
+    std::vector<uint8_t> data(length);
+    if (length && !_read(data.data(), length)) return false;
+
+    bool transmit = false;
+    if (!_handle_option(option, data, transmit)) return false;
+    if (transmit) return true;
+  }
+}
+
+bool NBDSession::_handle_option(uint32_t option, const std::vector<uint8_t>& data, bool& transmit) {
+  switch (option) {
+    case NBD_OPT_EXPORT_NAME: {
+      std::string name(data.begin(), data.end());
+      Device device;
+      std::string error = "Unknown export";
+      if (!_find_export(name, device) || !_attach(device, error)) {
+        // EXPORT_NAME has no error reply, only closing
+        _logger->warn("Closing (Export " + name + ": " + error + ")");
+        return false;
+      }
+      uint8_t reply[10 + NBD_EXPORT_ZEROES] = {};
+      put_u64(reply, device.block_total * device.block_size);
+      put_u16(reply + 8, _transmission_flags(device));
+      transmit = true;
+      return _write({boost::asio::buffer(reply, _no_zeroes ? 10 : sizeof(reply))});
+    }
+    case NBD_OPT_ABORT:
+      _send_option_reply(option, NBD_REP_ACK);
+      _logger->info("Client aborted");
+      return false;
+    case NBD_OPT_LIST: {
+      if (!data.empty()) return _send_option_error(option, NBD_REP_ERR_INVALID, "LIST takes no data");
+      for (const Device& device : _engine->devices(_host_id)) {
+        std::vector<uint8_t> reply(4 + device.name.size());
+        put_u32(reply.data(), device.name.size());
+        std::memcpy(reply.data() + 4, device.name.data(), device.name.size());
+        if (!_send_option_reply(option, NBD_REP_SERVER, reply.data(), reply.size())) return false;
+      }
+      return _send_option_reply(option, NBD_REP_ACK);
+    }
+    case NBD_OPT_INFO:
+    case NBD_OPT_GO:
+      return _handle_info(option, data, transmit);
+    case NBD_OPT_STRUCTURED_REPLY:
+      if (!data.empty()) return _send_option_error(option, NBD_REP_ERR_INVALID, "STRUCTURED_REPLY takes no data");
+      if (!_options.structured_replies) return _send_option_error(option, NBD_REP_ERR_UNSUP, "Structured replies are disabled");
+      _structured = true;
+      return _send_option_reply(option, NBD_REP_ACK);
+    case NBD_OPT_STARTTLS:
+      return _send_option_error(option, NBD_REP_ERR_POLICY, "TLS is not supported");
+    default:
+      return _send_option_error(option, NBD_REP_ERR_UNSUP, "Unsupported option " + std::to_string(option));
+  }
+}
+
+bool NBDSession::_handle_info(uint32_t option, const std::vector<uint8_t>& data, bool& transmit) {
+  // Name length (4), name, information requests (2), each (2)
+  if (data.size() < 6 || data.size() < 6 + size_t(get_u32(data.data()))) return _send_option_error(option, NBD_REP_ERR_INVALID, "Bad export request");
+  uint32_t name_length = get_u32(data.data());
+  std::string name(data.begin() + 4, data.begin() + 4 + name_length);
+  uint16_t requests = get_u16(data.data() + 4 + name_length);
+  if (data.size() != 6 + name_length + 2 * size_t(requests)) return _send_option_error(option, NBD_REP_ERR_INVALID, "Bad export request");
+
+  Device device;
+  if (!_find_export(name, device)) return _send_option_error(option, NBD_REP_ERR_UNKNOWN, "Unknown export " + name);
+
+  // Requests must be whole blocks, so only a client asking for the block size is taken to keep to it
+  bool block_size_requested = false;
+  for (uint16_t i = 0; i < requests; i++) block_size_requested |= get_u16(data.data() + 6 + name_length + 2 * size_t(i)) == NBD_INFO_BLOCK_SIZE;
+  if (!block_size_requested && device.block_size > 1) {
+    return _send_option_error(option, NBD_REP_ERR_BLOCK_SIZE_REQD,
+                              "Export " + name + " needs requests of whole " + std::to_string(device.block_size) + " byte blocks");
+  }
+
+  std::string error;
+  if (option == NBD_OPT_GO && !_attach(device, error)) return _send_option_error(option, NBD_REP_ERR_UNKNOWN, error);
+
+  uint8_t export_info[12];
+  put_u16(export_info, NBD_INFO_EXPORT);
+  put_u64(export_info + 2, device.block_total * device.block_size);
+  put_u16(export_info + 10, _transmission_flags(device));
+
+  uint8_t block_info[14];
+  put_u16(block_info, NBD_INFO_BLOCK_SIZE);
+  put_u32(block_info + 2, device.block_size);
+  put_u32(block_info + 6, device.block_size);
+  put_u32(block_info + 10, NBD_MAX_PAYLOAD);
+
+  if (!_send_option_reply(option, NBD_REP_INFO, export_info, sizeof(export_info)) ||
+      !_send_option_reply(option, NBD_REP_INFO, block_info, sizeof(block_info))) {
+    return false;
+  }
+  transmit = option == NBD_OPT_GO;
+  return _send_option_reply(option, NBD_REP_ACK);
+}
+
+bool NBDSession::_send_option_reply(uint32_t option, uint32_t type, const uint8_t* data, size_t length) {
+  uint8_t header[NBD_OPTION_REPLY_HEADER_SIZE];
+  put_u64(header, NBD_OPTION_REPLY_MAGIC);
+  put_u32(header + 8, option);
+  put_u32(header + 12, type);
+  put_u32(header + 16, length);
+  return _write({boost::asio::buffer(header), boost::asio::buffer(data, length)});
+}
+
+bool NBDSession::_send_option_error(uint32_t option, uint32_t type, const std::string& message) {
+  _logger->debug("Option " + std::to_string(option) + " refused (" + message + ")");
+  return _send_option_reply(option, type, reinterpret_cast<const uint8_t*>(message.data()), message.size());
+}
+
+bool NBDSession::_find_export(const std::string& name, Device& device) {
+  for (const Device& candidate : _engine->devices(_host_id)) {
+    if (name.empty() || candidate.name == name || std::to_string(candidate.id) == name) {
+      device = candidate;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool NBDSession::_attach(const Device& device, std::string& error) {
+  // NBD cannot redirect, the client has to be pointed at the node serving the device
+  std::string owner;
+  if (!_engine->owns(device.id, owner)) {
+    error = owner.empty() ? "No node serves device " + std::to_string(device.id) : "Device " + std::to_string(device.id) + " is served by " + owner;
+    return false;
+  }
+  if (!_engine->attach(_host_id, device.id, _host, _device, error)) {
+    _logger->warn("Attach failed (" + error + ")");
+    return false;
+  }
+  _logger->info("Attached host " + std::to_string(_host_id) + " to device " + std::to_string(device.id) + " (" + device.name + ")" +
+                (_structured ? " with structured replies" : ""));
+  _read_stream.reset();
+  return true;
+}
+
+uint16_t NBDSession::_transmission_flags(const Device& device) const {
+  // Writes from every session share the device's WriteQueue, so any connection's flush covers them all
+  return NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA | NBD_FLAG_SEND_TRIM | NBD_FLAG_SEND_WRITE_ZEROES | NBD_FLAG_CAN_MULTI_CONN |
+         (device.read_only ? NBD_FLAG_READ_ONLY : 0);
+}
+
+//
+// Transmission
+//
+
+void NBDSession::_transmit() {
+  while (_running) {
+    uint8_t packed[NBD_REQUEST_SIZE];
+    if (!_read(packed, sizeof(packed))) {
+      if (_running) _logger->info("Remote Closed Connection");
+      return;
+    }
+    if (get_u32(packed) != NBD_REQUEST_MAGIC) {
+      _logger->error("Closing (Bad request magic)");
+      return;
+    }
+
+    Request request;
+    request.flags = get_u16(packed + 4);
+    request.type = get_u16(packed + 6);
+    request.cookie = get_u64(packed + 8);
+    request.offset = get_u64(packed + 16);
+    request.length = get_u32(packed + 24);
+    request.received = std::chrono::steady_clock::now();
+    _requests->inc();
+    if (!_handle_request(request)) return;
+  }
+}
+
+bool NBDSession::_handle_request(const Request& request) {
+  switch (request.type) {
+    case NBD_CMD_READ:
+      return _handle_read(request);
+    case NBD_CMD_WRITE: {
+      // The data follows whether or not the write is valid
+      if (request.length > NBD_MAX_PAYLOAD) {
+        _logger->error("Closing (Write of " + std::to_string(request.length) + " bytes too large)");
+        return false;
+      }
+      auto data = std::make_shared<std::vector<uint8_t>>(request.length);
+      if (request.length && !_read(data->data(), request.length)) return false;
+      return _handle_write(request, data);
+    }
+    case NBD_CMD_DISC:
+      _logger->info("Client disconnected");
+      return false;
+    case NBD_CMD_FLUSH:
+      return _handle_flush(request);
+    case NBD_CMD_TRIM:
+    case NBD_CMD_WRITE_ZEROES:
+      return _handle_trim(request);
+    default:
+      return _reply_error(request, NBD_EINVAL, "Unknown command " + std::to_string(request.type));
+  }
+}
+
+uint32_t NBDSession::_check_range(const Request& request, uint64_t& block, uint32_t& count) const {
+  uint32_t block_size = _device->device.block_size;
+  if (request.offset % block_size || request.length % block_size) return NBD_EINVAL;
+  block = request.offset / block_size;
+  count = request.length / block_size;
+  if (!_device->valid_range(block, count)) return request.type == NBD_CMD_READ ? NBD_EINVAL : NBD_ENOSPC;
+  return 0;
+}
+
+bool NBDSession::_handle_read(const Request& request) {
+  uint64_t block;
+  uint32_t count;
+  uint32_t error = request.length > NBD_MAX_PAYLOAD ? NBD_EINVAL : _check_range(request, block, count);
+  if (error) return _reply_error(request, error, "Bad read range");
+
+  _engine->throttle(*_host, *_device, request.length);
+  _engine->read_ahead(_device, _read_stream, block, count);
+
+  auto data = std::make_shared<std::vector<uint8_t>>(request.length);
+
+  // Blocks all in the cache are answered here, handing them to a worker would cost more than the read
+  if (_dispatcher && _device->read_hit(block, count, data->data())) return _reply(request, data->data(), data->size());
+
+  return _run([this, request, device = _device, data, block, count]() {
+    boost::system::error_code ec;
+    if (!device->read(block, count, data->data(), ec)) return _reply_error(request, NBD_EIO, "Read failed: " + ec.message());
+    return _reply(request, data->data(), data->size());
+  });
+}
+
+bool NBDSession::_handle_write(const Request& request, std::shared_ptr<std::vector<uint8_t>> data) {
+  if (_device->device.read_only) return _reply_error(request, NBD_EPERM, "Device is read only");
+  uint64_t block;
+  uint32_t count;
+  if (uint32_t error = _check_range(request, block, count)) return _reply_error(request, error, "Bad write range");
+
+  _engine->throttle(*_host, *_device, request.length);
+
+  return _run([this, request, device = _device, data, block, count]() {
+    boost::system::error_code ec;
+    if (!device->write(block, count, data->data(), request.flags & NBD_CMD_FLAG_FUA, ec)) {
+      return _reply_error(request, NBD_EIO, "Write failed: " + ec.message());
+    }
+    return _reply(request);
+  });
+}
+
+bool NBDSession::_handle_trim(const Request& request) {
+  if (_device->device.read_only) return _reply_error(request, NBD_EPERM, "Device is read only");
+  uint64_t block;
+  uint32_t count;
+  if (uint32_t error = _check_range(request, block, count)) return _reply_error(request, error, "Bad trim range");
+
+  // Trimmed blocks read as zeros, only a client forbidding holes needs them written
+  bool write_zeroes = request.type == NBD_CMD_WRITE_ZEROES && (request.flags & NBD_CMD_FLAG_NO_HOLE);
+  _engine->throttle(*_host, *_device, write_zeroes ? request.length : 0);
+
+  return _run([this, request, device = _device, block, count, write_zeroes]() {
+    boost::system::error_code ec;
+    bool fua = request.flags & NBD_CMD_FLAG_FUA;
+    bool done = true;
+    if (write_zeroes) {
+      uint32_t run = std::min<uint32_t>(count, NBD_MAX_PAYLOAD / device->device.block_size);
+      std::vector<uint8_t> zeros(size_t(run) * device->device.block_size);
+      for (uint32_t offset = 0; done && offset < count; offset += run) {
+        done = device->write(block + offset, std::min(run, count - offset), zeros.data(), fua, ec);
+      }
+    } else {
+      done = device->trim(block, count, ec) && (!fua || device->flush(ec));
+    }
+    if (!done) return _reply_error(request, NBD_EIO, "Trim failed: " + ec.message());
+    return _reply(request);
+  });
+}
+
+bool NBDSession::_handle_flush(const Request& request) {
+  _wait_in_flight(0);
+
+  boost::system::error_code ec;
+  if (!_device->flush(ec)) return _reply_error(request, NBD_EIO, "Flush failed: " + ec.message());
+  return _reply(request);
+}
+
+bool NBDSession::_reply(const Request& request, const uint8_t* data, size_t length) {
+  _request_latency->record(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - request.received).count());
+
+  if (!_structured) {
+    uint8_t header[NBD_SIMPLE_REPLY_SIZE];
+    put_u32(header, NBD_SIMPLE_REPLY_MAGIC);
+    put_u32(header + 4, 0);
+    put_u64(header + 8, request.cookie);
+    return _write({boost::asio::buffer(header), boost::asio::buffer(data, length)});
+  }
+
+  // A read's data is sent as one chunk, any other reply is a bare DONE
+  bool read = request.type == NBD_CMD_READ;
+  uint8_t header[NBD_STRUCTURED_REPLY_SIZE + 8];
+  put_u32(header, NBD_STRUCTURED_REPLY_MAGIC);
+  put_u16(header + 4, NBD_REPLY_FLAG_DONE);
+  put_u16(header + 6, read ? NBD_REPLY_TYPE_OFFSET_DATA : NBD_REPLY_TYPE_NONE);
+  put_u64(header + 8, request.cookie);
+  put_u32(header + 16, read ? 8 + length : 0);
+  put_u64(header + 20, request.offset);
+  return _write({boost::asio::buffer(header, read ? sizeof(header) : NBD_STRUCTURED_REPLY_SIZE), boost::asio::buffer(data, length)});
+}
+
+bool NBDSession::_reply_error(const Request& request, uint32_t error, const std::string& message) {
+  _errors->inc();
+  _logger->debug("Request " + std::to_string(request.type) + " failed (" + message + ")");
+
+  if (!_structured) {
+    // No data follows, even for a read
+    uint8_t header[NBD_SIMPLE_REPLY_SIZE];
+    put_u32(header, NBD_SIMPLE_REPLY_MAGIC);
+    put_u32(header + 4, error);
+    put_u64(header + 8, request.cookie);
+    return _write({boost::asio::buffer(header)});
+  }
+
+  uint8_t header[NBD_STRUCTURED_REPLY_SIZE + 6];
+  put_u32(header, NBD_STRUCTURED_REPLY_MAGIC);
+  put_u16(header + 4, NBD_REPLY_FLAG_DONE);
+  put_u16(header + 6, NBD_REPLY_TYPE_ERROR);
+  put_u64(header + 8, request.cookie);
+  put_u32(header + 16, 6 + message.size());
+  put_u32(header + 20, error);
+  put_u16(header + 24, message.size());
+  return _write({boost::asio::buffer(header), boost::asio::buffer(message)});
+}
+
+//
+// Dispatch
+//
+
+bool NBDSession::_run(std::function<bool()> request) {
+  if (!_dispatcher) return request();
+
+  _wait_in_flight(_options.max_in_flight - 1);
+  if (!_running) return false;
+  {
+    std::lock_guard<std::mutex> lock(_in_flight_mutex);
+    _in_flight++;
+  }
+
+  _dispatcher->submit(_dispatch_queue, [this, request = std::move(request)]() {
+    if (!request()) {
+      // Fails the session thread's read, so it stops taking requests
+      _running = false;
+      ::shutdown(_fd, SHUT_RDWR);
+    }
+
+    // Notified under the lock, the session may be destroyed as soon as it is released
+    std::lock_guard<std::mutex> lock(_in_flight_mutex);
+    _in_flight--;
+    _in_flight_done.notify_all();
+  });
+  return true;
+}
+
+void NBDSession::_wait_in_flight(uint32_t count) {
+  std::unique_lock<std::mutex> lock(_in_flight_mutex);
+  _in_flight_done.wait(lock, [this, count]() { return _in_flight <= count; });
+}
+
+//
+// Socket
+//
+
+bool NBDSession::_read(void* data, size_t length) {
+  uint8_t* ptr = static_cast<uint8_t*>(data);
+  while (length) {
+    ssize_t received = ::recv(_fd, ptr, length, MSG_WAITALL);
+    if (received < 0 && errno == EINTR) continue;
+    if (received <= 0) return false;
+    ptr += received;
+    length -= received;
+  }
+  return true;
+}
+
+bool NBDSession::_write(const std::vector<boost::asio::const_buffer>& buffers) {
+  std::vector<struct iovec> iov;
+  for (const auto& buffer : buffers) {
+    if (buffer.size()) iov.push_back({const_cast<void*>(buffer.data()), buffer.size()});
+  }
+
+  std::lock_guard<std::mutex> lock(_write_mutex);
+  size_t first = 0;
+  while (first < iov.size()) {
+    struct msghdr msg = {};
+    msg.msg_iov = iov.data() + first;
+    msg.msg_iovlen = iov.size() - first;
+    ssize_t sent = ::sendmsg(_fd, &msg, MSG_NOSIGNAL);
+    if (sent < 0) {
+      if (errno == EINTR) continue;
+      if (_running) _logger->error(errno == EAGAIN ? "Closing (Write timed out)" : "Closing (Error during write: " + std::string(std::strerror(errno)) + ")");
+      return false;
+    }
+
+    // Step past what was sent, which may end part way through a buffer
+    while (first < iov.size() && size_t(sent) >= iov[first].iov_len) sent -= iov[first++].iov_len;
+    if (sent) {
+      iov[first].iov_base = static_cast<uint8_t*>(iov[first].iov_base) + sent;
+      iov[first].iov_len -= sent;
+    }
+  }
+  return true;
+}
+
+}  // namespace cppserver
@@ -0,0 +1,156 @@
+//
+// cppserver
+//
+// Copyright (C) 2024 Tom Cully
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301, USA.
+//
+#pragma once
+
+#include <atomic>
+#include <boost/asio.hpp>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "block_engine.h"
+#include "dispatcher.h"
+#include "logger.h"
+#include "metrics.h"
+#include "nbd_protocol.h"
+#include "read_ahead.h"
+#include "session.h"
+
+namespace cppserver {
+
+class NBDSessionOptions {
+ public:
+  uint32_t max_in_flight = 32;        // Reads, writes and trims run at once on dispatch workers, 1 to run every request in order
+  bool structured_replies = true;     // Agree to structured replies when a client asks
+  uint32_t write_timeout_ms = 30000;  // Close a session whose client stops reading replies for this long
+};
+
+// Serves one NBD connection for the devices of one host, each an export
+// named by its device name or id. The client negotiates with fixed newstyle
+// options, then sends requests that are validated and throttled on the
+// session thread in arrival order and run on the Dispatcher's workers, each
+// answered as soon as it completes. Flush and disconnect wait for every
+// request in flight first.
+//
+// Offsets and lengths must be whole blocks of the device, which GO tells the
+// client as its minimum block size. INFO and GO fail with
+// NBD_REP_ERR_BLOCK_SIZE_REQD unless the client asks for it, agreeing to keep
+// to it. EXPORT_NAME cannot negotiate, so its unaligned requests just fail
+// with EINVAL. Trims discard blocks so that they read as
+// zeros, which also serves WRITE_ZEROES unless the client asks for no hole.
+class NBDSession : public Session {
+ public:
+  NBDSession(std::shared_ptr<Logger> logger, std::shared_ptr<Metrics> metrics, std::shared_ptr<Dispatcher> dispatcher, std::shared_ptr<BlockEngine> engine,
+             uint64_t host_id, const NBDSessionOptions& options, std::shared_ptr<boost::asio::ip::tcp::socket> connection, const std::string& peer,
+             std::function<void()> on_closed);
+  ~NBDSession();
+
+  virtual void close();
+
+ private:
+  class Request {
+   public:
+    uint16_t flags;
+    uint16_t type;
+    uint64_t cookie;
+    uint64_t offset;
+    uint32_t length;
+    std::chrono::steady_clock::time_point received;
+  };
+
+  std::unique_ptr<Logger> _logger;
+  std::shared_ptr<Metrics> _metrics;
+  std::shared_ptr<BlockEngine> _engine;
+  uint64_t _host_id;
+  NBDSessionOptions _options;
+  // Taken from the accepted socket and used with blocking calls, shut down by close()
+  int _fd;
+  std::function<void()> _on_closed;
+  std::atomic<bool> _running{false};
+
+  // Agreed during negotiation
+  bool _no_zeroes = false;
+  bool _structured = false;
+
+  // The export, once chosen
+  std::shared_ptr<BlockHost> _host;
+  std::shared_ptr<BlockDevice> _device;
+  ReadStream _read_stream;
+
+  // Serialises replies written by the session thread and dispatch workers
+  std::mutex _write_mutex;
+
+  std::shared_ptr<Dispatcher> _dispatcher;
+  Dispatcher::Queue _dispatch_queue;
+  std::mutex _in_flight_mutex;
+  std::condition_variable _in_flight_done;
+  uint32_t _in_flight = 0;
+
+  std::shared_ptr<Gauge> _sessions_active;
+  std::shared_ptr<Counter> _requests;
+  std::shared_ptr<Counter> _errors;
+  std::shared_ptr<LatencyHistogram> _request_latency;
+
+  std::unique_ptr<std::thread> _thread;
+
+  void _execute();
+
+  // Negotiate until the client picks an export, returning false if it goes away or aborts instead
+  bool _negotiate();
+  bool _handle_option(uint32_t option, const std::vector<uint8_t>& data, bool& transmit);
+  bool _send_option_reply(uint32_t option, uint32_t type, const uint8_t* data = nullptr, size_t length = 0);
+  bool _send_option_error(uint32_t option, uint32_t type, const std::string& message);
+  // Find an export by name, the host's first device if name is empty
+  bool _find_export(const std::string& name, Device& device);
+  // Reply to INFO or GO for name, attaching to it for GO
+  bool _handle_info(uint32_t option, const std::vector<uint8_t>& data, bool& transmit);
+  bool _attach(const Device& device, std::string& error);
+  uint16_t _transmission_flags(const Device& device) const;
+
+  // Serve requests until the client disconnects
+  void _transmit();
+  bool _handle_request(const Request& request);
+  bool _handle_read(const Request& request);
+  bool _handle_write(const Request& request, std::shared_ptr<std::vector<uint8_t>> data);
+  bool _handle_trim(const Request& request);
+  bool _handle_flush(const Request& request);
+  // Check a request is for whole blocks within the device, setting its first block and count
+  uint32_t _check_range(const Request& request, uint64_t& block, uint32_t& count) const;
+
+  bool _reply(const Request& request, const uint8_t* data = nullptr, size_t length = 0);
+  bool _reply_error(const Request& request, uint32_t error, const std::string& message);
+
+  // Run a request's I/O on a dispatch worker if there is one, otherwise here. A request failing to send its reply closes the session.
+  bool _run(std::function<bool()> request);
+  void _wait_in_flight(uint32_t count);
+
+  bool _read(void* data, size_t length);
+  // Write every buffer in order as one message
+  bool _write(const std::vector<boost::asio::const_buffer>& buffers);
+};
+
+}  // namespace cppserver
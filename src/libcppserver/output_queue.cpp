@@ -0,0 +1,303 @@
+//
+// cppserver
+//
+// Copyright (C) 2024 Tom Cully
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301, USA.
+//
+#include "output_queue.h"
+
+#include <poll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <boost/asio/error.hpp>
+#include <cerrno>
+#include <climits>
+
+namespace cppserver {
+
+//
+// BufferRef
+//
+
+BufferRef::BufferRef() : _data(nullptr), _size(0) {}
+
+BufferRef::BufferRef(std::shared_ptr<const std::vector<uint8_t>> buffer) : _buffer(buffer), _data(buffer->data()), _size(buffer->size()) {}
+
+BufferRef::BufferRef(std::shared_ptr<const std::vector<uint8_t>> buffer, size_t offset, size_t size)
+    : _buffer(buffer), _data(buffer->data() + offset), _size(size) {}
+
+BufferRef::BufferRef(const uint8_t* data, size_t size) : _data(data), _size(size) {}
+
+BufferRef BufferRef::file(std::shared_ptr<const void> owner, int fd, off_t offset, size_t size) {
+  BufferRef ref;
+  ref._buffer = owner;
+  ref._size = size;
+  ref._fd = fd;
+  ref._offset = offset;
+  return ref;
+}
+
+//
+// OutputQueue
+//
+
+OutputQueue::OutputQueue(std::shared_ptr<Metrics> metrics, std::shared_ptr<TimerWheel> timer_wheel, int fd, const OutputQueueOptions& options)
+    : _fd(fd),
+      _options(options),
+      _timer_wheel(timer_wheel),
+      _bytes_written(metrics->counter("cppserver_session_bytes_written_total", "Total bytes written to sessions")),
+      _file_bytes_written(metrics->counter("cppserver_session_file_bytes_written_total", "Total bytes sent to sessions from files with sendfile")),
+      _frames_written(metrics->counter("cppserver_session_frames_written_total", "Total frames written to sessions")),
+      _writes(metrics->counter("cppserver_session_writes_total", "Total gathered write calls to sessions")),
+      _stalls(metrics->counter("cppserver_session_output_stalls_total", "Total pushes that hit the output queue high water mark")),
+      _write_timeouts(metrics->counter("cppserver_session_write_timeouts_total", "Total sessions closed because a write timed out")) {
+  _options.max_write_iovecs = std::max<size_t>(2, std::min<size_t>(_options.max_write_iovecs, IOV_MAX));
+}
+
+OutputQueue::~OutputQueue() {
+  close();
+  _timer_wheel->cancel(_write_deadline);
+}
+
+bool OutputQueue::push(const FrameHeader& header, BufferRef payload, boost::system::error_code& ec) {
+  std::unique_lock<std::mutex> lock(_mutex);
+
+  if (_closed || _error) {
+    ec = _error ? _error : boost::asio::error::operation_aborted;
+    return false;
+  }
+
+  Entry& entry = _queue.emplace_back();
+  header.pack(entry.header);
+  entry.payload = std::move(payload);
+  _queued_bytes += FRAME_HEADER_SIZE + entry.payload.size();
+
+  // Backpressure, write down to the low water mark or wait for the writer to
+  if (_queued_bytes > _options.high_water) {
+    _stalls->inc();
+    while (_queued_bytes > _options.low_water && !_closed && !_error) {
+      if (!_writing) {
+        _write(lock, _options.low_water);
+      } else {
+        _drained.wait(lock);
+      }
+    }
+  }
+
+  ec = _error;
+  return !_error && !_closed;
+}
+
+bool OutputQueue::flush(boost::system::error_code& ec, bool wait) {
+  std::unique_lock<std::mutex> lock(_mutex);
+
+  while ((_queued_bytes > 0 || _writing) && !_closed && !_error) {
+    if (!_writing) {
+      _write(lock, 0);
+    } else if (!wait && !_write_target) {
+      break;
+    } else {
+      _drained.wait(lock);
+    }
+  }
+
+  ec = _error;
+  return !_error;
+}
+
+void OutputQueue::close() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  _closed = true;
+
+  // Wake a writer blocked on a peer that is not reading, it clears the queue on its way out
+  if (_writing) {
+    ::shutdown(_fd, SHUT_RDWR);
+  } else {
+    _queue.clear();
+    _queued_bytes = 0;
+    _front_written = 0;
+  }
+  _drained.notify_all();
+}
+
+size_t OutputQueue::queued_bytes() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _queued_bytes;
+}
+
+void OutputQueue::_write(std::unique_lock<std::mutex>& lock, size_t target) {
+  _writing = true;
+  _write_target = target;
+
+  std::vector<struct iovec> iov(_options.max_write_iovecs);
+  while (_queued_bytes > target && !_closed && !_error) {
+    // Gather from the front of the queue. Entries stay put while unlocked, only this writer pops them.
+    size_t iovcnt = 0;
+    size_t bytes = 0;
+    size_t skip = _front_written;
+    // Set when the next bytes are a file range, sent on their own
+    const BufferRef* file = nullptr;
+    size_t file_skip = 0;
+    bool more = false;
+    for (auto it = _queue.begin(); it != _queue.end() && iovcnt + 2 <= iov.size() && bytes < _options.max_write_bytes; ++it) {
+      if (skip < FRAME_HEADER_SIZE) {
+        iov[iovcnt++] = {it->header + skip, FRAME_HEADER_SIZE - skip};
+        bytes += FRAME_HEADER_SIZE - skip;
+        skip = 0;
+      } else {
+        skip -= FRAME_HEADER_SIZE;
+      }
+      if (it->payload.fd() >= 0 && it->payload.size() > skip) {
+        if (iovcnt == 0) {
+          file = &it->payload;
+          file_skip = skip;
+        }
+        more = iovcnt > 0;
+        break;
+      }
+      if (it->payload.size() > skip) {
+        iov[iovcnt++] = {const_cast<uint8_t*>(it->payload.data()) + skip, it->payload.size() - skip};
+        bytes += it->payload.size() - skip;
+      }
+      skip = 0;
+
+      if (!_options.coalesce) break;
+    }
+
+    // No progress for write_timeout_ms shuts the socket down, failing the send
+    uint64_t generation = ++_write_generation;
+    _timer_wheel->arm(_write_deadline, std::chrono::milliseconds(_options.write_timeout_ms), [this, generation]() {
+      if (_write_generation != generation) return;
+      _write_timed_out = true;
+      ::shutdown(_fd, SHUT_RDWR);
+    });
+
+    lock.unlock();
+    size_t written = 0;
+    boost::system::error_code ec;
+    bool ok = file ? _send_file(file->fd(), file->offset() + file_skip, std::min(file->size() - file_skip, _options.max_write_bytes), written, ec)
+                   : _send(iov.data(), iovcnt, more, written, ec);
+    _write_generation++;
+    lock.lock();
+
+    if (_write_timed_out) {
+      _write_timeouts->inc();
+      _error = boost::asio::error::timed_out;
+    } else if (!ok) {
+      _error = ec;
+    } else {
+      _writes->inc();
+      _bytes_written->inc(written);
+      if (file) _file_bytes_written->inc(written);
+      _consume(written);
+    }
+    _drained.notify_all();
+  }
+
+  _timer_wheel->cancel(_write_deadline);
+  if (_closed || _error) {
+    _queue.clear();
+    _queued_bytes = 0;
+    _front_written = 0;
+  }
+
+  _writing = false;
+  _drained.notify_all();
+}
+
+bool OutputQueue::_send(struct iovec* iov, size_t iovcnt, bool more, size_t& written, boost::system::error_code& ec) {
+  struct msghdr msg = {};
+  msg.msg_iov = iov;
+  msg.msg_iovlen = iovcnt;
+
+  while (true) {
+    ssize_t len = ::sendmsg(_fd, &msg, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+    if (len >= 0) {
+      written = len;
+      return true;
+    }
+
+    if (errno == EINTR) continue;
+
+    // The socket is non-blocking once asio has used it, wait until it drains
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      if (!_wait_writable(ec)) return false;
+      continue;
+    }
+
+    ec = boost::system::error_code(errno, boost::system::system_category());
+    return false;
+  }
+}
+
+bool OutputQueue::_send_file(int fd, off_t offset, size_t size, size_t& written, boost::system::error_code& ec) {
+  while (true) {
+    ssize_t len = ::sendfile(_fd, fd, &offset, size);
+    if (len > 0) {
+      written = len;
+      return true;
+    }
+
+    // The file ends before the range does, the frame can never be completed
+    if (len == 0) {
+      ec = boost::system::errc::make_error_code(boost::system::errc::io_error);
+      return false;
+    }
+
+    if (errno == EINTR) continue;
+
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      if (!_wait_writable(ec)) return false;
+      continue;
+    }
+
+    ec = boost::system::error_code(errno, boost::system::system_category());
+    return false;
+  }
+}
+
+bool OutputQueue::_wait_writable(boost::system::error_code& ec) {
+  struct pollfd pfd = {_fd, POLLOUT, 0};
+  if (::poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+    ec = boost::system::error_code(errno, boost::system::system_category());
+    return false;
+  }
+  return true;
+}
+
+void OutputQueue::_consume(size_t written) {
+  while (written > 0) {
+    Entry& front = _queue.front();
+    size_t remaining = FRAME_HEADER_SIZE + front.payload.size() - _front_written;
+
+    if (written < remaining) {
+      _front_written += written;
+      _queued_bytes -= written;
+      return;
+    }
+
+    written -= remaining;
+    _queued_bytes -= remaining;
+    _front_written = 0;
+    _queue.pop_front();
+    _frames_written->inc();
+  }
+}
+
+}  // namespace cppserver
@@ -0,0 +1,151 @@
+//
+// cppserver
+//
+// Copyright (C) 2024 Tom Cully
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301, USA.
+//
+#pragma once
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <atomic>
+#include <boost/system/error_code.hpp>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "metrics.h"
+#include "protocol.h"
+#include "timer_wheel.h"
+
+namespace cppserver {
+
+// A slice of a reference counted buffer. The slice keeps the whole buffer
+// alive, so producers can hand bytes to an OutputQueue without copying them.
+//
+// It may instead be a range of a file, which an OutputQueue sends with
+// sendfile so the bytes never pass through user space. Such a reference has
+// no data() and only an OutputQueue can use it.
+class BufferRef {
+ public:
+  BufferRef();
+  BufferRef(std::shared_ptr<const std::vector<uint8_t>> buffer);
+  BufferRef(std::shared_ptr<const std::vector<uint8_t>> buffer, size_t offset, size_t size);
+  // Memory not owned, which the caller keeps valid for as long as the reference is used
+  BufferRef(const uint8_t* data, size_t size);
+
+  // size bytes at offset in the file fd, kept open by owner for as long as the reference is
+  static BufferRef file(std::shared_ptr<const void> owner, int fd, off_t offset, size_t size);
+
+  const uint8_t* data() const { return _data; }
+  size_t size() const { return _size; }
+  // The file a file range is in, -1 otherwise
+  int fd() const { return _fd; }
+  off_t offset() const { return _offset; }
+
+ private:
+  std::shared_ptr<const void> _buffer;
+  const uint8_t* _data;
+  size_t _size;
+  int _fd = -1;
+  off_t _offset = 0;
+};
+
+class OutputQueueOptions {
+ public:
+  bool coalesce = true;                   // Gather queued frames into one writev, otherwise one frame per call
+  size_t max_write_bytes = 1024 * 1024;   // Most bytes gathered into one writev
+  size_t max_write_iovecs = 64;           // Most iovecs gathered into one writev
+  size_t high_water = 4 * 1024 * 1024;    // Producers block while more than this is queued
+  size_t low_water = 1024 * 1024;         // and resume once the queue drains to this
+  uint32_t write_timeout_ms = 30000;      // Fail a write that makes no progress for this long
+};
+
+// Frames waiting to be written to a socket. Any thread may push; whichever
+// thread finds no write in progress becomes the writer and drains the queue
+// with gathered writes, picking up frames pushed by others while it writes.
+//
+// A frame whose payload is a file range is written in two steps, its header
+// gathered with the frames before it and sent with MSG_MORE, then the range
+// with sendfile.
+//
+// push() applies backpressure: above the high water mark it writes (or waits
+// for the current writer) until the queue is back at the low water mark.
+class OutputQueue {
+ public:
+  OutputQueue(std::shared_ptr<Metrics> metrics, std::shared_ptr<TimerWheel> timer_wheel, int fd, const OutputQueueOptions& options);
+  ~OutputQueue();
+
+  // Queue a frame, header.length must equal payload.size(). Returns false once the queue has failed or closed.
+  bool push(const FrameHeader& header, BufferRef payload, boost::system::error_code& ec);
+
+  // Write everything queued so far. Unless wait, return at once if another
+  // thread is already writing everything queued.
+  bool flush(boost::system::error_code& ec, bool wait = true);
+
+  // Drop anything queued and fail further pushes
+  void close();
+
+  size_t queued_bytes();
+
+ private:
+  class Entry {
+   public:
+    uint8_t header[FRAME_HEADER_SIZE];
+    BufferRef payload;
+  };
+
+  int _fd;
+  OutputQueueOptions _options;
+  std::shared_ptr<TimerWheel> _timer_wheel;
+
+  std::mutex _mutex;
+  std::condition_variable _drained;
+  std::deque<Entry> _queue;
+  size_t _queued_bytes = 0;
+  size_t _front_written = 0;  // Bytes of the front entry already written
+  bool _writing = false;
+  size_t _write_target = 0;  // Queued bytes the current writer stops at
+  bool _closed = false;
+  boost::system::error_code _error;
+
+  // Shuts the socket down if a write stalls, failing the blocked writev or poll
+  TimerWheel::Timer _write_deadline;
+  std::atomic<uint64_t> _write_generation{0};
+  std::atomic<bool> _write_timed_out{false};
+
+  std::shared_ptr<Counter> _bytes_written;
+  std::shared_ptr<Counter> _file_bytes_written;
+  std::shared_ptr<Counter> _frames_written;
+  std::shared_ptr<Counter> _writes;
+  std::shared_ptr<Counter> _stalls;
+  std::shared_ptr<Counter> _write_timeouts;
+
+  void _write(std::unique_lock<std::mutex>& lock, size_t target);
+  // With more the kernel holds a partial segment back for the bytes that follow
+  bool _send(struct iovec* iov, size_t iovcnt, bool more, size_t& written, boost::system::error_code& ec);
+  bool _send_file(int fd, off_t offset, size_t size, size_t& written, boost::system::error_code& ec);
+  // Wait until the socket can take more, false if polling fails
+  bool _wait_writable(boost::system::error_code& ec);
+  void _consume(size_t written);
+};
+
+}  // namespace cppserver
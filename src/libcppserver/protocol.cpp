@@ -0,0 +1,108 @@
+//
+// cppserver
+//
+// Copyright (C) 2024 Tom Cully
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301, USA.
+//
+#include "protocol.h"
+
+#include <algorithm>
+
+namespace cppserver {
+
+void put_u16(uint8_t* ptr, uint16_t value) {
+  ptr[0] = value >> 8;
+  ptr[1] = value;
+}
+
+void put_u32(uint8_t* ptr, uint32_t value) {
+  for (int i = 0; i < 4; i++) ptr[i] = value >> (24 - i * 8);
+}
+
+void put_u64(uint8_t* ptr, uint64_t value) {
+  for (int i = 0; i < 8; i++) ptr[i] = value >> (56 - i * 8);
+}
+
+uint16_t get_u16(const uint8_t* ptr) { return (uint16_t(ptr[0]) << 8) | ptr[1]; }
+
+uint32_t get_u32(const uint8_t* ptr) {
+  uint32_t value = 0;
+  for (int i = 0; i < 4; i++) value = (value << 8) | ptr[i];
+  return value;
+}
+
+uint64_t get_u64(const uint8_t* ptr) {
+  uint64_t value = 0;
+  for (int i = 0; i < 8; i++) value = (value << 8) | ptr[i];
+  return value;
+}
+
+FrameHeader::FrameHeader() : opcode(0), flags(0), length(0), tag(0) {}
+
+FrameHeader::FrameHeader(uint8_t popcode, uint8_t pflags, uint32_t plength, uint64_t ptag) : opcode(popcode), flags(pflags), length(plength), tag(ptag) {}
+
+bool FrameHeader::parse(const uint8_t* ptr) {
+  if (get_u16(ptr) != FRAME_MAGIC) return false;
+  opcode = ptr[2];
+  flags = ptr[3];
+  length = get_u32(ptr + 4);
+  tag = get_u64(ptr + 8);
+  return length <= FRAME_MAX_PAYLOAD;
+}
+
+size_t FrameHeader::pack(uint8_t* ptr) const {
+  put_u16(ptr, FRAME_MAGIC);
+  ptr[2] = opcode;
+  ptr[3] = flags;
+  put_u32(ptr + 4, length);
+  put_u64(ptr + 8, tag);
+  return FRAME_HEADER_SIZE;
+}
+
+Hello::Hello() : version(0, 0, 0), capabilities(0), max_payload(FRAME_MAX_PAYLOAD), max_in_flight(1) {}
+
+Hello::Hello(const Version& pversion, uint32_t pcapabilities, uint32_t pmax_payload, uint32_t pmax_in_flight)
+    : version(pversion), capabilities(pcapabilities), max_payload(pmax_payload), max_in_flight(pmax_in_flight) {}
+
+bool Hello::parse(const uint8_t* ptr, size_t len) {
+  if (len < HELLO_SIZE) return false;
+  version = Version(ptr[0], ptr[1], ptr[2]);
+  capabilities = get_u32(ptr + 4);
+  max_payload = get_u32(ptr + 8);
+  max_in_flight = get_u32(ptr + 12);
+  return true;
+}
+
+size_t Hello::pack(uint8_t* ptr) const {
+  ptr[0] = version.major;
+  ptr[1] = version.minor;
+  ptr[2] = version.patch;
+  ptr[3] = 0;
+  put_u32(ptr + 4, capabilities);
+  put_u32(ptr + 8, max_payload);
+  put_u32(ptr + 12, max_in_flight);
+  return HELLO_SIZE;
+}
+
+Hello Hello::agree(const Hello& other) const {
+  uint32_t common = capabilities & other.capabilities;
+  // In order, only one request at a time can be running
+  uint32_t in_flight = common & CAP_OUT_OF_ORDER ? std::max<uint32_t>(1, std::min(max_in_flight, other.max_in_flight)) : 1;
+  return Hello(version, common, std::max<uint32_t>(HELLO_MIN_PAYLOAD, std::min(max_payload, other.max_payload)), in_flight);
+}
+
+}  // namespace cppserver
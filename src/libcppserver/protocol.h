@@ -0,0 +1,209 @@
+//
+// cppserver
+//
+// Copyright (C) 2024 Tom Cully
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301, USA.
+//
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "version.h"
+
+namespace cppserver {
+
+// Wire framing. Every message in either direction is a fixed size header
+// followed by length bytes of payload. All integers are big-endian.
+//
+//   0      2        3       4        8                16
+//   +------+--------+-------+--------+----------------+
+//   | 'CS' | opcode | flags | length | tag            |
+//   +------+--------+-------+--------+----------------+
+//
+// The tag is chosen by the client and returned unchanged in the response.
+// READ, WRITE and TRIM responses may arrive in any order, so clients match
+// them by tag. ATTACH, FLUSH and SNAPSHOT are answered only after every
+// request received before them.
+//
+// Block requests act on the device attached to the session:
+//
+//   ATTACH   request host id (8), device id (8)
+//            response block size (4), block total (8), attach flags (1)
+//   READ     request block (8), count (4), with READ_SNAPSHOT from the snapshot
+//            response count blocks of data, as BlockCodec records if compressed
+//   WRITE    request block (8), whole blocks of data, or records with WRITE_COMPRESSED
+//            response empty, with WRITE_FUA only once the data is durable
+//   FLUSH    request and response empty, sent once every write completed
+//            before the request is durable
+//   TRIM     request block (8), count (4), the blocks then read as zeros
+//            response empty
+//   SNAPSHOT request empty, freezing the device as it is for READ_SNAPSHOT,
+//            with SNAPSHOT_DELETE merging later writes in and dropping it
+//            response empty
+//
+// A client may open with HELLO, sending its Version and what it supports:
+//
+//   HELLO    request and response version (3), reserved (1), capabilities (4),
+//            max payload (4), max in flight (4)
+//
+// The response carries the server's version and what both sides support:
+// the capabilities in common and the smaller limits. A client that sends no
+// HELLO, or whose HELLO fails with ERROR on an older server, gets the
+// baseline: responses in request order and FRAME_MAX_PAYLOAD. The client need
+// not wait for the response before sending more requests, as the server
+// answers HELLO only after every request before it and applies it to every
+// request after it.
+//
+// A client asking with ATTACH_TICKET in the ATTACH request header flags may be
+// given a ticket, opaque bytes only that server can read, following the
+// ATTACH response and flagged by ATTACH_TICKET in its attach flags. On a
+// later connection RESUME then stands in for HELLO and ATTACH:
+//
+//   RESUME   request ticket, with ATTACH_TICKET asking for a new one
+//            response HELLO response (16), ATTACH response, ticket if granted
+//
+// restoring what the ticket's session agreed and the device it attached to
+// without the server looking either up again. Tickets expire, and are only
+// valid on the server that issued them. If RESUME fails with ERROR or
+// REDIRECT the client sends HELLO and ATTACH instead.
+//
+// A client connected through the server's Unix socket can move its session
+// onto shared memory, so requests and data no longer pass through the socket:
+//
+//   SHM      request and response slots (4), slot size (4)
+//
+// The response carries the memfd of a ShmRegion with that many slots, and
+// eventfds for its submission and completion rings, as SCM_RIGHTS. The server
+// answers SHM only after every request before it, and from then on reads no
+// more frames from the socket, only watching it to see the client go. A
+// request is an entry in the submission ring, its payload as above written to
+// a free slot, and its response an entry in the completion ring with the
+// same tag and slot, its payload in the slot. A slot is the client's to reuse
+// once its response has arrived. HELLO and ATTACH still apply, max payload
+// becoming the slot size.
+//
+// In a cluster a node answers an ATTACH for a device another node serves
+// with REDIRECT, its payload the address of that node as host:port, and the
+// client attaches there instead.
+//
+// A client asks for compressed transfers with ATTACH_COMPRESSED in the ATTACH
+// request header flags. If the response attach flags grant it, READ
+// responses carry records until the next ATTACH, and WRITE requests may.
+
+#define FRAME_MAGIC 0x4353
+#define FRAME_HEADER_SIZE 16
+#define FRAME_MAX_PAYLOAD (4 * 1024 * 1024)
+
+enum Opcode : uint8_t {
+  OP_ECHO = 0x01,      // Respond with the same payload
+  OP_HELLO = 0x02,     // Negotiate capabilities
+  OP_RESUME = 0x03,    // Restore a session from a ticket
+  OP_SHM = 0x04,       // Move the session onto shared memory rings
+  OP_ATTACH = 0x10,    // Attach the session to one of a host's devices
+  OP_READ = 0x11,      // Read blocks
+  OP_WRITE = 0x12,     // Write blocks
+  OP_FLUSH = 0x13,     // Make completed writes durable
+  OP_TRIM = 0x14,      // Discard blocks
+  OP_SNAPSHOT = 0x15,  // Take or delete a snapshot of the device
+  OP_REDIRECT = 0xFD,  // Response to an ATTACH for a device another node serves, payload is its host:port
+  OP_BUSY = 0xFE,      // Sent by the server before closing a connection it will not serve, payload is a message
+  OP_ERROR = 0xFF,     // Response to a request that could not be handled, payload is a message
+};
+
+// HELLO capability bits
+enum Capabilities : uint32_t {
+  CAP_COMPRESSION = 0x01,   // Compressed transfers can be granted at ATTACH
+  CAP_OUT_OF_ORDER = 0x02,  // READ, WRITE and TRIM responses may arrive in any order
+};
+
+// Response attach flags, and request header flags for OP_ATTACH and OP_RESUME
+enum AttachFlags : uint8_t {
+  ATTACH_READ_ONLY = 0x01,   // The device cannot be written
+  ATTACH_COMPRESSED = 0x02,  // Blocks are transferred compressed
+  ATTACH_TICKET = 0x04,      // A resumption ticket is asked for, or follows
+};
+
+// Request header flags for OP_WRITE
+enum WriteFlags : uint8_t {
+  WRITE_FUA = 0x01,         // Force unit access, acknowledge only once durable
+  WRITE_COMPRESSED = 0x02,  // The blocks are records, only once compression is granted
+};
+
+// Request header flags for OP_READ
+enum ReadFlags : uint8_t {
+  READ_SNAPSHOT = 0x01,  // Read the device as it was when snapshotted
+};
+
+// Request header flags for OP_SNAPSHOT
+enum SnapshotFlags : uint8_t {
+  SNAPSHOT_DELETE = 0x01,  // Delete the snapshot rather than take one
+};
+
+#define HELLO_SIZE 16
+// Smallest max payload a HELLO can agree, room for a read of any one block
+#define HELLO_MIN_PAYLOAD (64 * 1024)
+#define SHM_REQUEST_SIZE 8
+#define ATTACH_REQUEST_SIZE 16
+#define ATTACH_RESPONSE_SIZE 13
+#define READ_REQUEST_SIZE 12
+#define WRITE_REQUEST_HEADER_SIZE 8
+#define TRIM_REQUEST_SIZE 12
+
+// Big-endian field access for payloads
+void put_u16(uint8_t* ptr, uint16_t value);
+void put_u32(uint8_t* ptr, uint32_t value);
+void put_u64(uint8_t* ptr, uint64_t value);
+uint16_t get_u16(const uint8_t* ptr);
+uint32_t get_u32(const uint8_t* ptr);
+uint64_t get_u64(const uint8_t* ptr);
+
+class FrameHeader {
+ public:
+  FrameHeader();
+  FrameHeader(uint8_t popcode, uint8_t pflags, uint32_t plength, uint64_t ptag);
+
+  // Parse a header from FRAME_HEADER_SIZE bytes. Returns false on bad magic or an oversize payload.
+  bool parse(const uint8_t* ptr);
+  size_t pack(uint8_t* ptr) const;
+
+  uint8_t opcode;
+  uint8_t flags;
+  uint32_t length;
+  uint64_t tag;
+};
+
+// The payload of a HELLO request or response
+class Hello {
+ public:
+  Hello();
+  Hello(const Version& pversion, uint32_t pcapabilities, uint32_t pmax_payload, uint32_t pmax_in_flight);
+
+  // Parse HELLO_SIZE bytes. Returns false if len is shorter, later versions may send more.
+  bool parse(const uint8_t* ptr, size_t len);
+  size_t pack(uint8_t* ptr) const;
+
+  // What both this and other support
+  Hello agree(const Hello& other) const;
+
+  Version version;
+  uint32_t capabilities;
+  uint32_t max_payload;
+  uint32_t max_in_flight;
+};
+
+}  // namespace cppserver
@@ -0,0 +1,39 @@
+//
+// cppserver
+//
+// Copyright (C) 2024 Tom Cully
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301, USA.
+//
+#include "qos.h"
+
+#include <algorithm>
+
+namespace cppserver {
+
+QoS::QoS(uint64_t iops_limit, uint64_t bps_limit) {
+  if (iops_limit) _iops = std::make_unique<TokenBucket>(iops_limit, std::max(1.0, iops_limit * QOS_BURST_MS / 1000.0));
+  if (bps_limit) _bps = std::make_unique<TokenBucket>(bps_limit, std::max(1.0, bps_limit * QOS_BURST_MS / 1000.0));
+}
+
+std::chrono::nanoseconds QoS::reserve(uint64_t bytes) {
+  std::chrono::nanoseconds wait(0);
+  if (_iops) wait = std::max(wait, _iops->reserve(1));
+  if (_bps) wait = std::max(wait, _bps->reserve(bytes));
+  return wait;
+}
+
+}  // namespace cppserver
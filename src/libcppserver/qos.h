@@ -0,0 +1,49 @@
+//
+// cppserver
+//
+// Copyright (C) 2024 Tom Cully
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301, USA.
+//
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+
+#include "token_bucket.h"
+
+namespace cppserver {
+
+// Bursts of up to this many milliseconds worth of either limit pass unthrottled
+#define QOS_BURST_MS 100
+
+// IOPS and bandwidth limits for a host or device, 0 meaning unlimited
+class QoS {
+ public:
+  QoS(uint64_t iops_limit, uint64_t bps_limit);
+
+  // Account for a request of bytes, returning how long it must be held back to stay within both limits
+  std::chrono::nanoseconds reserve(uint64_t bytes);
+
+  bool limited() const { return _iops || _bps; }
+
+ private:
+  std::unique_ptr<TokenBucket> _iops;
+  std::unique_ptr<TokenBucket> _bps;
+};
+
+}  // namespace cppserver
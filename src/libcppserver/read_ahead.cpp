@@ -0,0 +1,111 @@
+//
+// cppserver
+//
+// Copyright (C) 2024 Tom Cully
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301, USA.
+//
+#include "read_ahead.h"
+
+#include <algorithm>
+
+namespace cppserver {
+
+void ReadStream::access(uint64_t block, uint32_t count, uint32_t max_window, uint64_t& block_ahead, uint32_t& count_ahead) {
+  count_ahead = 0;
+  uint64_t end = block + count;
+
+  if (block != _next) {
+    // Not sequential, back off and wait for the next sequential read
+    _window /= 2;
+    if (_window < READ_AHEAD_MIN_BLOCKS) _window = 0;
+    _next = end;
+    _ahead = end;
+    return;
+  }
+  _next = end;
+
+  uint32_t start = std::max<uint32_t>(READ_AHEAD_MIN_BLOCKS, count * 4);
+  _window = std::min(max_window, _window ? _window * 2 : start);
+  if (_window < READ_AHEAD_MIN_BLOCKS) {
+    _window = 0;
+    return;
+  }
+
+  // Keep window blocks ahead of the reader, topping up in chunks of at least half the window
+  _ahead = std::max(_ahead, end);
+  uint64_t target = end + _window;
+  if (target - _ahead < _window / 2) return;
+
+  block_ahead = _ahead;
+  count_ahead = target - _ahead;
+  _ahead = target;
+}
+
+void ReadStream::reset() {
+  _next = UINT64_MAX;
+  _ahead = 0;
+  _window = 0;
+}
+
+ReadAhead::ReadAhead(std::shared_ptr<Metrics> metrics, uint32_t threads)
+    : _requests(metrics->counter("cppserver_read_ahead_requests_total", "Total read-ahead requests queued")),
+      _blocks(metrics->counter("cppserver_read_ahead_blocks_total", "Total blocks read into the block cache by read-ahead")),
+      _dropped(metrics->counter("cppserver_read_ahead_dropped_total", "Total read-ahead requests dropped with the queue full")) {
+  for (uint32_t i = 0; i < threads; i++) _threads.emplace_back(&ReadAhead::_execute, this);
+}
+
+ReadAhead::~ReadAhead() {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _running = false;
+  }
+  _submitted.notify_all();
+  for (auto& thread : _threads) thread.join();
+}
+
+void ReadAhead::submit(std::shared_ptr<BlockDevice> device, uint64_t block, uint32_t count) {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_pending.size() >= READ_AHEAD_MAX_PENDING) {
+      _dropped->inc();
+      return;
+    }
+    _pending.push_back(Request{device, block, count});
+  }
+  _requests->inc();
+  _submitted.notify_one();
+}
+
+void ReadAhead::_execute() {
+  std::vector<uint8_t> scratch;
+  std::unique_lock<std::mutex> lock(_mutex);
+
+  for (;;) {
+    _submitted.wait(lock, [this]() { return !_running || !_pending.empty(); });
+    if (!_running) return;
+
+    Request request = std::move(_pending.front());
+    _pending.pop_front();
+
+    lock.unlock();
+    _blocks->inc(request.device->prefetch(request.block, request.count, scratch));
+    request.device.reset();
+    lock.lock();
+  }
+}
+
+}  // namespace cppserver
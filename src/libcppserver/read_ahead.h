@@ -0,0 +1,94 @@
+//
+// cppserver
+//
+// Copyright (C) 2024 Tom Cully
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301, USA.
+//
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "block_device.h"
+#include "metrics.h"
+
+namespace cppserver {
+
+// Smallest read-ahead window in blocks, and the most prefetches waiting for a worker
+#define READ_AHEAD_MIN_BLOCKS 16
+#define READ_AHEAD_MAX_PENDING 64
+
+// Sequential stream detection for one session's reads of one device.
+//
+// A read starting where the previous one ended is sequential and grows the
+// window, starting at a few times the request size and doubling up to the
+// maximum. A read anywhere else halves it, and below READ_AHEAD_MIN_BLOCKS
+// read-ahead is off until reads are sequential again, so random workloads
+// cost nothing. Read-ahead is topped up in chunks of at least half the window
+// rather than on every read, keeping prefetches large.
+class ReadStream {
+ public:
+  // Account for a read of count blocks from block. Sets count_ahead to the
+  // blocks to read ahead from block_ahead, 0 for none.
+  void access(uint64_t block, uint32_t count, uint32_t max_window, uint64_t& block_ahead, uint32_t& count_ahead);
+
+  void reset();
+
+  uint32_t window() const { return _window; }
+
+ private:
+  uint64_t _next = UINT64_MAX;  // Block following the previous read
+  uint64_t _ahead = 0;          // End of the blocks already read ahead
+  uint32_t _window = 0;
+};
+
+// Worker threads reading ahead into the block cache. Requests beyond
+// READ_AHEAD_MAX_PENDING are dropped, read-ahead is only ever a hint.
+class ReadAhead {
+ public:
+  ReadAhead(std::shared_ptr<Metrics> metrics, uint32_t threads);
+  ~ReadAhead();
+
+  void submit(std::shared_ptr<BlockDevice> device, uint64_t block, uint32_t count);
+
+ private:
+  class Request {
+   public:
+    std::shared_ptr<BlockDevice> device;
+    uint64_t block;
+    uint32_t count;
+  };
+
+  std::mutex _mutex;
+  std::condition_variable _submitted;
+  std::deque<Request> _pending;
+  bool _running = true;
+  std::vector<std::thread> _threads;
+
+  std::shared_ptr<Counter> _requests;
+  std::shared_ptr<Counter> _blocks;
+  std::shared_ptr<Counter> _dropped;
+
+  void _execute();
+};
+
+}  // namespace cppserver
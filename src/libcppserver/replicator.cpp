@@ -0,0 +1,579 @@
+//
+// cppserver
+//
+// Copyright (C) 2024 Tom Cully
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301, USA.
+//
+#include "replicator.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include "block_device.h"
+#include "logger_scoped.h"
+#include "protocol.h"
+#include "util.h"
+
+namespace cppserver {
+
+Replicator::Replicator(std::shared_ptr<Logger> logger, std::shared_ptr<Metrics> metrics, BlockDevice& device, const ReplicatorOptions& options)
+    : _logger(std::make_unique<LoggerScoped>("replica " + std::to_string(device.device.id), logger)),
+      _metrics(metrics),
+      _device(device),
+      _options(options),
+      _filename(device.device.filename + ".replica"),
+      _total(device.device.block_total),
+      _dirty((_total + 63) / 64),
+      _summary((_dirty.size() + 63) / 64),
+      _wake_fd(::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+      _bytes(metrics->counter("cppserver_replica_bytes_total", "Total bytes of blocks sent to secondaries",
+                             "device=\"" + std::to_string(device.device.id) + "\"")),
+      _connects(metrics->counter("cppserver_replica_connects_total", "Total connections made to secondaries",
+                                "device=\"" + std::to_string(device.device.id) + "\"")),
+      _sync_timeouts(metrics->counter("cppserver_replica_sync_timeouts_total", "Total sync writes acknowledged before the secondary had them",
+                                      "device=\"" + std::to_string(device.device.id) + "\"")),
+      _dirty_gauge(metrics->gauge("cppserver_replica_dirty_blocks", "Blocks changed but not yet sent to the secondary",
+                                  "device=\"" + std::to_string(device.device.id) + "\"")),
+      _connected(metrics->gauge("cppserver_replica_connected", "1 while connected to the secondary",
+                               "device=\"" + std::to_string(device.device.id) + "\"")),
+      _ack_latency(metrics->latency("cppserver_replica_ack_seconds", "Time from sending blocks to a secondary to their acknowledgement")),
+      _lag(metrics->latency("cppserver_replica_lag_seconds", "Time from a change to a secondary having it durably")) {
+  // The largest run, compressed or not, must fit in a frame
+  uint32_t block_size = device.device.block_size;
+  _run = std::max<uint32_t>(1, std::min<uint64_t>(_options.run_bytes, FRAME_MAX_PAYLOAD - WRITE_REQUEST_HEADER_SIZE) / (4 + block_size));
+  _options.window = std::max<uint32_t>(1, _options.window);
+
+  _load();
+  _thread = std::thread(&Replicator::_execute, this);
+}
+
+Replicator::~Replicator() {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _running = false;
+  }
+  _changed.notify_all();
+  uint64_t value = 1;
+  if (::write(_wake_fd, &value, sizeof(value)) < 0) _logger->error("Cannot wake the replicator");
+  _thread.join();
+
+  _save();
+  ::close(_wake_fd);
+  _dirty_gauge->dec(_dirty_count);
+}
+
+void Replicator::replicate(uint64_t block, uint32_t count) {
+  uint64_t change;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_marked == _passed) _first_marked = std::chrono::steady_clock::now();
+    _set(block, count);
+    change = ++_marked;
+  }
+  _wake();
+  if (!_options.sync) return;
+
+  std::unique_lock<std::mutex> lock(_mutex);
+  if (!_streaming) return;
+  if (!_changed.wait_for(lock, std::chrono::milliseconds(_options.sync_timeout_ms), [&]() { return _acked >= change || !_streaming; })) _sync_timeouts->inc();
+}
+
+uint64_t Replicator::dirty() const {
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _dirty_count;
+}
+
+bool Replicator::streaming() const {
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _streaming;
+}
+
+bool Replicator::wait_synced(std::chrono::milliseconds timeout) {
+  std::unique_lock<std::mutex> lock(_mutex);
+  return _changed.wait_for(lock, timeout, [this]() { return _streaming && _acked == _marked && _dirty_count == 0; });
+}
+
+//
+// Dirty bitmap
+//
+
+void Replicator::_load() {
+  bool loaded = false;
+  int fd = ::open(_filename.c_str(), O_RDONLY);
+  if (fd >= 0) {
+    size_t len = _dirty.size() * sizeof(uint64_t);
+    uint8_t extra;
+    loaded = ::pread(fd, _dirty.data(), len, 0) == ssize_t(len) && ::pread(fd, &extra, 1, len) == 0;
+    ::close(fd);
+    // Only valid until the device changes, so a crash before the next save sends everything
+    ::unlink(_filename.c_str());
+  }
+
+  if (!loaded) {
+    std::fill(_dirty.begin(), _dirty.end(), 0);
+    _set(0, _total);
+    _logger->info("Sending every block to the secondary");
+    return;
+  }
+
+  if (_total % 64) _dirty.back() &= (uint64_t(1) << (_total % 64)) - 1;
+  for (size_t word = 0; word < _dirty.size(); word++) {
+    if (!_dirty[word]) continue;
+    _summary[word / 64] |= uint64_t(1) << (word % 64);
+    _dirty_count += __builtin_popcountll(_dirty[word]);
+  }
+  _dirty_gauge->inc(_dirty_count);
+  _logger->info("Sending " + std::to_string(_dirty_count) + " blocks changed since the secondary was last in sync");
+}
+
+void Replicator::_save() {
+  int fd = ::open(_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  size_t len = _dirty.size() * sizeof(uint64_t);
+  bool saved = fd >= 0 && ::write(fd, _dirty.data(), len) == ssize_t(len) && ::fsync(fd) == 0;
+  if (fd >= 0) ::close(fd);
+  if (!saved) {
+    _logger->error("Cannot save " + _filename + ", every block will be sent again: " + std::string(strerror(errno)));
+    ::unlink(_filename.c_str());
+  }
+}
+
+void Replicator::_set(uint64_t block, uint64_t count) {
+  uint64_t added = 0;
+  while (count) {
+    uint64_t word = block / 64;
+    uint64_t bits = std::min<uint64_t>(64 - block % 64, count);
+    uint64_t mask = (bits == 64 ? ~uint64_t(0) : (uint64_t(1) << bits) - 1) << (block % 64);
+    added += __builtin_popcountll(mask & ~_dirty[word]);
+    _dirty[word] |= mask;
+    _summary[word / 64] |= uint64_t(1) << (word % 64);
+    block += bits;
+    count -= bits;
+  }
+  _dirty_count += added;
+  _dirty_gauge->inc(added);
+}
+
+void Replicator::_clear(uint64_t block, uint64_t count) {
+  uint64_t removed = 0;
+  while (count) {
+    uint64_t word = block / 64;
+    uint64_t bits = std::min<uint64_t>(64 - block % 64, count);
+    uint64_t mask = (bits == 64 ? ~uint64_t(0) : (uint64_t(1) << bits) - 1) << (block % 64);
+    removed += __builtin_popcountll(mask & _dirty[word]);
+    _dirty[word] &= ~mask;
+    if (!_dirty[word]) _summary[word / 64] &= ~(uint64_t(1) << (word % 64));
+    block += bits;
+    count -= bits;
+  }
+  _dirty_count -= removed;
+  _dirty_gauge->dec(removed);
+}
+
+uint64_t Replicator::_next_dirty(uint64_t from) const {
+  uint64_t word = from / 64;
+  if (word >= _dirty.size()) return _total;
+  uint64_t bits = _dirty[word] & (~uint64_t(0) << (from % 64));
+  if (bits) return word * 64 + __builtin_ctzll(bits);
+
+  // Skip clean words through the summary, 64 at a time
+  word++;
+  for (uint64_t summary_word = word / 64; summary_word < _summary.size(); summary_word++) {
+    uint64_t summary = _summary[summary_word];
+    if (summary_word == word / 64) summary &= ~uint64_t(0) << (word % 64);
+    if (!summary) continue;
+    uint64_t found = summary_word * 64 + __builtin_ctzll(summary);
+    return found * 64 + __builtin_ctzll(_dirty[found]);
+  }
+  return _total;
+}
+
+bool Replicator::_take(uint64_t& block, uint32_t& count, bool& pass_ended) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  pass_ended = false;
+
+  if (!_pass_open) {
+    if (_marked == _passed && !_dirty_count) return false;
+    _passed = _marked;
+    _pass_marked = _first_marked;
+    _pass_open = true;
+    _pass_sent = false;
+    _cursor = 0;
+  }
+
+  block = _next_dirty(_cursor);
+  if (block >= _total) {
+    _pass_open = false;
+    pass_ended = true;
+    return false;
+  }
+  count = 1;
+  while (count < _run && block + count < _total && _test(block + count)) count++;
+  _clear(block, count);
+  _cursor = block + count;
+  return true;
+}
+
+void Replicator::_wake() {
+  if (_wake_pending.exchange(true)) return;
+  uint64_t value = 1;
+  if (::write(_wake_fd, &value, sizeof(value)) < 0) _logger->error("Cannot wake the replicator");
+}
+
+bool Replicator::_sleep(uint32_t timeout_ms) {
+  std::unique_lock<std::mutex> lock(_mutex);
+  return _changed.wait_for(lock, std::chrono::milliseconds(timeout_ms), [this]() { return !_running; });
+}
+
+//
+// Connection
+//
+
+void Replicator::_execute() {
+  for (;;) {
+    if (_connect()) {
+      _stream();
+      _disconnect();
+    } else {
+      _socket.reset();
+    }
+    if (_sleep(_options.retry_ms)) return;
+  }
+}
+
+bool Replicator::_connect() {
+  using boost::asio::ip::tcp;
+  std::string secondary = _options.host + ":" + std::to_string(_options.port);
+
+  // Connect asynchronously so an unreachable secondary times out
+  boost::system::error_code ec = boost::asio::error::timed_out;
+  tcp::resolver resolver(_io_context);
+  auto endpoints = resolver.resolve(_options.host, std::to_string(_options.port), ec);
+  if (!ec) {
+    _socket = std::make_unique<tcp::socket>(_io_context);
+    ec = boost::asio::error::timed_out;
+    boost::asio::async_connect(*_socket, endpoints, [&](const boost::system::error_code& error, const tcp::endpoint&) { ec = error; });
+    _io_context.restart();
+    _io_context.run_for(std::chrono::milliseconds(_options.ack_timeout_ms));
+    if (!_io_context.stopped()) {
+      _socket->close();
+      _io_context.run();
+      ec = boost::asio::error::timed_out;
+    }
+  }
+  if (ec) {
+    if (!_failing) _logger->warn("Cannot connect to " + secondary + ": " + ec.message());
+    _failing = true;
+    return false;
+  }
+  _socket->set_option(tcp::no_delay(true));
+  _socket->non_blocking(true);
+
+  // Agree to out of order acknowledgements and attach to the device's copy together, an older secondary fails the HELLO
+  uint8_t request[FRAME_HEADER_SIZE + HELLO_SIZE + FRAME_HEADER_SIZE + ATTACH_REQUEST_SIZE];
+  uint8_t* ptr = request;
+  uint32_t capabilities = CAP_OUT_OF_ORDER | (_options.compression ? uint32_t(CAP_COMPRESSION) : 0);
+  ptr += FrameHeader(OP_HELLO, 0, HELLO_SIZE, 0).pack(ptr);
+  ptr += Hello(Version(CPPSERVER_VERSION_MAJOR, CPPSERVER_VERSION_MINOR, CPPSERVER_VERSION_PATCH), capabilities, FRAME_MAX_PAYLOAD, _options.window).pack(ptr);
+  ptr += FrameHeader(OP_ATTACH, _options.compression ? ATTACH_COMPRESSED : 0, ATTACH_REQUEST_SIZE, 0).pack(ptr);
+  put_u64(ptr, _options.host_id);
+  put_u64(ptr + 8, _device.device.id);
+
+  uint8_t header_bytes[FRAME_HEADER_SIZE];
+  FrameHeader header;
+  std::vector<uint8_t> response;
+  bool sent = _write_all(request, sizeof(request));
+  for (int i = 0; i < 2 && sent; i++) {
+    if (!_read_exact(header_bytes, sizeof(header_bytes)) || !header.parse(header_bytes)) {
+      sent = false;
+      break;
+    }
+    response.resize(header.length);
+    if (!_read_exact(response.data(), response.size())) return false;
+  }
+  if (!sent) {
+    if (!_failing) _logger->warn("No attach response from " + secondary);
+    _failing = true;
+    return false;
+  }
+
+  std::string error;
+  if (header.opcode == OP_ERROR) {
+    error = std::string(response.begin(), response.end());
+  } else if (header.opcode != OP_ATTACH || response.size() != ATTACH_RESPONSE_SIZE) {
+    error = "bad attach response";
+  } else if (get_u32(response.data()) != _device.device.block_size || get_u64(response.data() + 4) != _total) {
+    error = "its copy of the device is a different size";
+  } else if (response[12] & ATTACH_READ_ONLY) {
+    error = "its copy of the device is read only";
+  }
+  if (!error.empty()) {
+    if (!_failing) _logger->error("Cannot replicate to " + secondary + ": " + error);
+    _failing = true;
+    return false;
+  }
+
+  _codec = response[12] & ATTACH_COMPRESSED ? std::make_unique<BlockCodec>(_metrics, "replica", _device.device.block_size) : nullptr;
+  _failing = false;
+  _connects->inc();
+  _connected->inc();
+  _logger->info("Replicating to " + secondary + (_options.sync ? " synchronously" : ""));
+  return true;
+}
+
+void Replicator::_disconnect() {
+  {
+    // Anything not known to be durable on the secondary is sent again
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (const auto& frame : _in_flight) _set(frame.block, frame.count);
+    for (const auto& run : _unflushed) _set(run.block, run.count);
+    _streaming = false;
+    _pass_open = false;
+  }
+  _changed.notify_all();
+
+  _in_flight.clear();
+  _unflushed.clear();
+  _rx.clear();
+  _codec.reset();
+  _socket.reset();
+  _connected->dec();
+}
+
+//
+// Streaming
+//
+
+void Replicator::_stream() {
+  std::vector<uint8_t> data;
+  std::vector<uint8_t> frame;
+
+  for (;;) {
+    while (_in_flight.size() < _options.window) {
+      uint64_t block;
+      uint32_t count;
+      bool pass_ended;
+      if (_take(block, count, pass_ended)) {
+        if (!_send_run(block, count, data, frame)) return;
+      } else if (!pass_ended) {
+        break;
+      } else if (!_end_pass()) {
+        return;
+      }
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      if (!_running) return;
+    }
+
+    // Idle until woken while nothing is in flight, a silent secondary fails the connection otherwise
+    short events;
+    if (!_poll(POLLIN, true, _in_flight.empty() ? -1 : _options.ack_timeout_ms, events)) {
+      _logger->warn("Secondary stopped acknowledging blocks");
+      return;
+    }
+    if (events && !_receive()) return;
+  }
+}
+
+bool Replicator::_send_run(uint64_t block, uint32_t count, std::vector<uint8_t>& data, std::vector<uint8_t>& frame) {
+  size_t len = size_t(count) * _device.device.block_size;
+  size_t offset = FRAME_HEADER_SIZE + WRITE_REQUEST_HEADER_SIZE;
+  frame.resize(offset + len);
+
+  boost::system::error_code ec;
+  if (!_device.read(block, count, frame.data() + offset, ec)) {
+    _logger->error("Cannot read blocks " + std::to_string(block) + "-" + std::to_string(block + count - 1) + " to replicate: " + ec.message());
+    // Taken but not sent, so still to send. Reconnecting after retry_ms retries it, and keeps the pass from completing without it.
+    std::lock_guard<std::mutex> lock(_mutex);
+    _set(block, count);
+    return false;
+  }
+
+  uint8_t opcode = OP_WRITE;
+  uint8_t flags = 0;
+  if (Util::is_zero(frame.data() + offset, len)) {
+    opcode = OP_TRIM;
+    frame.resize(FRAME_HEADER_SIZE + TRIM_REQUEST_SIZE);
+    put_u32(frame.data() + FRAME_HEADER_SIZE + 8, count);
+  } else if (_codec) {
+    flags = WRITE_COMPRESSED;
+    data.resize(offset);
+    _codec->encode_records(frame.data() + offset, count, data);
+    frame.swap(data);
+  }
+  put_u64(frame.data() + FRAME_HEADER_SIZE, block);
+
+  uint64_t tag = _next_tag++;
+  FrameHeader(opcode, flags, frame.size() - FRAME_HEADER_SIZE, tag).pack(frame.data());
+  _in_flight.push_back({tag, block, count, std::chrono::steady_clock::now(), false, 0, {}});
+  _pass_sent = true;
+
+  if (!_write_all(frame.data(), frame.size())) return false;
+  if (opcode == OP_WRITE) _bytes->inc(len);
+  return true;
+}
+
+bool Replicator::_end_pass() {
+  if (!_pass_sent) {
+    // Complete once whatever is in flight from earlier passes is
+    if (_in_flight.empty()) {
+      _complete(_passed, _pass_marked);
+    } else {
+      _in_flight.back().ends_pass = true;
+      _in_flight.back().pass = _passed;
+      _in_flight.back().marked = _pass_marked;
+    }
+    return true;
+  }
+
+  // The flush makes everything sent before it durable on the secondary
+  uint8_t request[FRAME_HEADER_SIZE];
+  uint64_t tag = _next_tag++;
+  FrameHeader(OP_FLUSH, 0, 0, tag).pack(request);
+  _in_flight.push_back({tag, 0, 0, std::chrono::steady_clock::now(), true, _passed, _pass_marked});
+  return _write_all(request, sizeof(request));
+}
+
+void Replicator::_complete(uint64_t pass, std::chrono::steady_clock::time_point marked) {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (pass > _acked) {
+      _acked = pass;
+      _lag->record(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - marked).count());
+    }
+    if (!_streaming) _logger->info("Secondary is in sync");
+    _streaming = true;
+  }
+  _changed.notify_all();
+}
+
+bool Replicator::_receive() {
+  size_t have = _rx.size();
+  _rx.resize(have + REPLICATOR_READ_SIZE);
+  boost::system::error_code ec;
+  size_t len = _socket->read_some(boost::asio::buffer(_rx.data() + have, REPLICATOR_READ_SIZE), ec);
+  _rx.resize(have + len);
+  if (ec == boost::asio::error::would_block) return true;
+  if (ec) {
+    _logger->warn("Lost the secondary: " + ec.message());
+    return false;
+  }
+
+  size_t pos = 0;
+  FrameHeader header;
+  while (_rx.size() - pos >= FRAME_HEADER_SIZE) {
+    if (!header.parse(_rx.data() + pos)) {
+      _logger->error("Bad frame from the secondary");
+      return false;
+    }
+    if (_rx.size() - pos - FRAME_HEADER_SIZE < header.length) break;
+    if (!_acknowledged(header, _rx.data() + pos + FRAME_HEADER_SIZE)) return false;
+    pos += FRAME_HEADER_SIZE + header.length;
+  }
+  _rx.erase(_rx.begin(), _rx.begin() + pos);
+  return true;
+}
+
+bool Replicator::_acknowledged(const FrameHeader& header, const uint8_t* payload) {
+  // The secondary may answer writes in any order, though a flush only once everything sent before it has been
+  auto it = std::find_if(_in_flight.begin(), _in_flight.end(), [&header](const InFlight& frame) { return frame.tag == header.tag; });
+  if (it == _in_flight.end()) {
+    _logger->error("Unexpected response from the secondary");
+    return false;
+  }
+  if (header.opcode == OP_ERROR) {
+    std::string what = it->count ? "blocks " + std::to_string(it->block) + "-" + std::to_string(it->block + it->count - 1) : "a flush";
+    _logger->error("Secondary failed " + what + ": " + std::string(payload, payload + header.length));
+    return false;
+  }
+
+  InFlight frame = *it;
+  _in_flight.erase(it);
+  _ack_latency->record(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - frame.sent).count());
+
+  if (frame.count) {
+    _unflushed.push_back(frame);
+  } else {
+    // Writes sent after the flush are not covered by it
+    _unflushed.erase(std::remove_if(_unflushed.begin(), _unflushed.end(), [&frame](const InFlight& run) { return run.tag < frame.tag; }), _unflushed.end());
+  }
+  if (frame.ends_pass) _complete(frame.pass, frame.marked);
+  return true;
+}
+
+//
+// Socket I/O
+//
+
+bool Replicator::_write_all(const uint8_t* data, size_t len) {
+  while (len) {
+    boost::system::error_code ec;
+    size_t written = _socket->write_some(boost::asio::buffer(data, len), ec);
+    data += written;
+    len -= written;
+    if (ec == boost::asio::error::would_block) {
+      short events;
+      if (!_poll(POLLOUT, false, _options.ack_timeout_ms, events)) ec = boost::asio::error::timed_out;
+    }
+    if (ec && ec != boost::asio::error::would_block) {
+      _logger->warn("Cannot send to the secondary: " + ec.message());
+      return false;
+    }
+  }
+  return true;
+}
+
+bool Replicator::_read_exact(uint8_t* data, size_t len) {
+  while (len) {
+    boost::system::error_code ec;
+    size_t read = _socket->read_some(boost::asio::buffer(data, len), ec);
+    data += read;
+    len -= read;
+    if (ec == boost::asio::error::would_block) {
+      short events;
+      if (!_poll(POLLIN, false, _options.ack_timeout_ms, events)) ec = boost::asio::error::timed_out;
+    }
+    if (ec && ec != boost::asio::error::would_block) return false;
+  }
+  return true;
+}
+
+bool Replicator::_poll(short events, bool wake, int timeout_ms, short& revents) {
+  pollfd fds[2] = {{_socket->native_handle(), events, 0}, {_wake_fd, POLLIN, 0}};
+  int ready;
+  do {
+    ready = ::poll(fds, wake ? 2 : 1, timeout_ms);
+  } while (ready < 0 && errno == EINTR);
+  if (ready <= 0) return false;
+
+  if (fds[1].revents) {
+    // Cleared after reading so a change marked in between always writes again
+    uint64_t value;
+    if (::read(_wake_fd, &value, sizeof(value)) < 0 && errno != EAGAIN) _logger->error("Cannot read the wake fd");
+    _wake_pending = false;
+  }
+  revents = fds[0].revents;
+  return true;
+}
+
+}  // namespace cppserver
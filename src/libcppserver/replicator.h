@@ -0,0 +1,194 @@
+//
+// cppserver
+//
+// Copyright (C) 2024 Tom Cully
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301, USA.
+//
+#pragma once
+
+#include <boost/asio.hpp>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "block_codec.h"
+#include "logger.h"
+#include "metrics.h"
+#include "protocol.h"
+
+namespace cppserver {
+
+// Bytes requested from the socket per read of acknowledgements
+#define REPLICATOR_READ_SIZE 4096
+
+class BlockDevice;
+
+class ReplicatorOptions {
+ public:
+  std::string host;                  // Secondary cppserverd to replicate to, empty to disable
+  uint16_t port = 26547;             // Its block port
+  uint64_t host_id = 0;              // Host the secondary's copies of the devices belong to
+  bool sync = false;                 // Writes wait until the secondary has them durably
+  uint32_t sync_timeout_ms = 1000;   // Longest a write waits for the secondary before it is acknowledged anyway
+  uint32_t window = 32;              // Frames sent but not yet acknowledged by the secondary
+  uint32_t run_bytes = 256 * 1024;   // Largest run of blocks sent in one frame
+  uint32_t ack_timeout_ms = 10000;   // Drop the connection if the secondary acknowledges nothing for this long
+  uint32_t retry_ms = 1000;          // Delay between attempts to connect to the secondary
+  bool compression = true;           // Send blocks compressed if the secondary allows it
+};
+
+// Ships a device's writes to a copy of it on a secondary cppserverd, over
+// an ordinary session attached to that copy. Writes and trims only mark
+// their blocks dirty in a bitmap. A thread sends dirty blocks in runs, reading
+// them back from the device when it sends them, so only the latest data of a
+// block rewritten many times goes over the wire, and clears their bits as it
+// takes them. Up to window frames are in flight at once. Runs of zeros are
+// sent as trims.
+//
+// The thread works in passes over the bitmap from the lowest dirty block,
+// each ending with a flush, so every change marked before a pass started is
+// durable on the secondary once the pass's flush is acknowledged. In sync
+// mode writes wait for the pass that follows them, so many writers share one
+// round trip and one flush on the secondary.
+//
+// While the secondary is unreachable writes keep marking blocks, and once it
+// is back only those are sent, as are the blocks of frames that were in
+// flight. Sync writes do not wait until the first pass after connecting has
+// caught the secondary up. The bitmap is saved to <file>.replica when the
+// device closes and loaded, then deleted, when it opens: without it, after a
+// crash or the first time, every block is sent.
+class Replicator {
+ public:
+  Replicator(std::shared_ptr<Logger> logger, std::shared_ptr<Metrics> metrics, BlockDevice& device, const ReplicatorOptions& options);
+  ~Replicator();
+
+  // Called once count blocks from block have changed. In sync mode waits until the secondary has them.
+  void replicate(uint64_t block, uint32_t count);
+
+  // Blocks changed but not yet sent
+  uint64_t dirty() const;
+  // True while connected and caught up
+  bool streaming() const;
+  // Wait until every change so far has been acknowledged by the secondary, false on timeout
+  bool wait_synced(std::chrono::milliseconds timeout);
+
+ private:
+  class InFlight {
+   public:
+    uint64_t tag;
+    uint64_t block;
+    uint32_t count;  // 0 for a flush
+    std::chrono::steady_clock::time_point sent;
+    // Set if this frame's acknowledgement completes a pass, with the pass and the time of its first change
+    bool ends_pass;
+    uint64_t pass;
+    std::chrono::steady_clock::time_point marked;
+  };
+
+  std::unique_ptr<Logger> _logger;
+  std::shared_ptr<Metrics> _metrics;
+  BlockDevice& _device;
+  ReplicatorOptions _options;
+  std::string _filename;
+  uint64_t _total;
+  uint32_t _run;
+
+  // Guards the bitmap and the sequence numbers below
+  mutable std::mutex _mutex;
+  std::condition_variable _changed;
+  bool _running = true;
+
+  // A bit per block, and a summary bit per word of it that is non-zero
+  std::vector<uint64_t> _dirty;
+  std::vector<uint64_t> _summary;
+  uint64_t _dirty_count = 0;
+
+  // Changes are numbered. A pass covers every change up to the number it started at.
+  uint64_t _marked = 0;
+  uint64_t _passed = 0;
+  uint64_t _acked = 0;
+  bool _streaming = false;
+  // Time of the first change after the latest pass started
+  std::chrono::steady_clock::time_point _first_marked;
+
+  // Written by writers to wake the thread, which polls it with the socket
+  int _wake_fd = -1;
+  std::atomic<bool> _wake_pending{false};
+
+  // Only used by the thread
+  boost::asio::io_context _io_context;
+  std::unique_ptr<boost::asio::ip::tcp::socket> _socket;
+  std::unique_ptr<BlockCodec> _codec;
+  bool _failing = false;
+  std::deque<InFlight> _in_flight;
+  // Runs acknowledged but not yet covered by an acknowledged flush, lost if the secondary crashes first
+  std::vector<InFlight> _unflushed;
+  std::vector<uint8_t> _rx;
+  uint64_t _next_tag = 1;
+  uint64_t _cursor = 0;
+  bool _pass_open = false;
+  bool _pass_sent = false;
+  std::chrono::steady_clock::time_point _pass_marked;
+
+  std::shared_ptr<Counter> _bytes;
+  std::shared_ptr<Counter> _connects;
+  std::shared_ptr<Counter> _sync_timeouts;
+  std::shared_ptr<Gauge> _dirty_gauge;
+  std::shared_ptr<Gauge> _connected;
+  std::shared_ptr<LatencyHistogram> _ack_latency;
+  std::shared_ptr<LatencyHistogram> _lag;
+
+  // Started once the bitmap is loaded
+  std::thread _thread;
+
+  void _load();
+  void _save();
+  void _set(uint64_t block, uint64_t count);
+  void _clear(uint64_t block, uint64_t count);
+  bool _test(uint64_t block) const { return _dirty[block / 64] >> (block % 64) & 1; }
+  uint64_t _next_dirty(uint64_t from) const;
+  // Take the next run of the current pass, starting one if there are changes. False when there is nothing to send.
+  bool _take(uint64_t& block, uint32_t& count, bool& pass_ended);
+  void _wake();
+  // Wait up to timeout_ms for the thread to stop, true if it has been asked to
+  bool _sleep(uint32_t timeout_ms);
+
+  void _execute();
+  bool _connect();
+  void _disconnect();
+  // Send and receive until the connection fails or the replicator stops
+  void _stream();
+  bool _send_run(uint64_t block, uint32_t count, std::vector<uint8_t>& data, std::vector<uint8_t>& frame);
+  bool _send_flush();
+  bool _end_pass();
+  void _complete(uint64_t pass, std::chrono::steady_clock::time_point marked);
+  // Read what the secondary has sent, handling every complete frame
+  bool _receive();
+  bool _acknowledged(const FrameHeader& header, const uint8_t* payload);
+  bool _write_all(const uint8_t* data, size_t len);
+  bool _read_exact(uint8_t* data, size_t len);
+  // Poll the socket for events, and the wake fd if asked, setting the socket's events in revents. False on timeout or error.
+  bool _poll(short events, bool wake, int timeout_ms, short& revents);
+};
+
+}  // namespace cppserver
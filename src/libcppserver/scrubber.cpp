@@ -0,0 +1,106 @@
+//
+// cppserver
+//
+// Copyright (C) 2024 Tom Cully
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301, USA.
+//
+#include "scrubber.h"
+
+#include <algorithm>
+
+#include "logger_scoped.h"
+
+namespace cppserver {
+
+Scrubber::Scrubber(std::shared_ptr<Logger> logger, std::shared_ptr<Metrics> metrics, uint64_t bytes_per_second)
+    : _logger(std::make_unique<LoggerScoped>("scrubber", logger)),
+      _rate(bytes_per_second, SCRUBBER_STEP_BYTES),
+      _bytes(metrics->counter("cppserver_scrub_bytes_total", "Total bytes verified by the scrubber")),
+      _mismatches(metrics->counter("cppserver_scrub_mismatches_total", "Total blocks the scrubber found not matching their checksum")),
+      _passes(metrics->counter("cppserver_scrub_passes_total", "Total complete passes of the scrubber over a device")),
+      _thread(&Scrubber::_execute, this) {}
+
+Scrubber::~Scrubber() {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _running = false;
+  }
+  _wake.notify_all();
+  _thread.join();
+}
+
+void Scrubber::add(std::shared_ptr<BlockDevice> device) {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _devices.push_back(device);
+  }
+  _wake.notify_all();
+}
+
+void Scrubber::remove(const std::shared_ptr<BlockDevice>& device) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  _devices.erase(std::remove(_devices.begin(), _devices.end(), device), _devices.end());
+}
+
+void Scrubber::_execute() {
+  std::vector<uint8_t> scratch;
+
+  for (size_t next = 0;; next++) {
+    std::shared_ptr<BlockDevice> device;
+    {
+      std::unique_lock<std::mutex> lock(_mutex);
+      _wake.wait(lock, [this]() { return !_running || !_devices.empty(); });
+      if (!_running) return;
+      device = _devices[next % _devices.size()];
+    }
+
+    if (!_scrub(*device, scratch)) return;
+  }
+}
+
+bool Scrubber::_scrub(BlockDevice& device, std::vector<uint8_t>& scratch) {
+  uint32_t step = std::max<uint32_t>(1, SCRUBBER_STEP_BYTES / device.device.block_size);
+  uint64_t mismatches = 0;
+
+  for (uint64_t block = 0; block < device.device.block_total; block += step) {
+    uint32_t count = std::min<uint64_t>(step, device.device.block_total - block);
+    uint64_t bytes = uint64_t(count) * device.device.block_size;
+
+    std::chrono::nanoseconds wait = _rate.reserve(bytes);
+    {
+      std::unique_lock<std::mutex> lock(_mutex);
+      if (_wake.wait_for(lock, wait, [this]() { return !_running; })) return false;
+    }
+
+    int found = device.scrub(block, count, scratch);
+    if (found > 0) {
+      mismatches += found;
+      _mismatches->inc(found);
+    }
+    _bytes->inc(bytes);
+  }
+
+  _passes->inc();
+  if (mismatches) {
+    _logger->warn("Device " + std::to_string(device.device.id) + " has " + std::to_string(mismatches) + " blocks not matching their checksums");
+  } else {
+    _logger->debug("Device " + std::to_string(device.device.id) + " verified");
+  }
+  return true;
+}
+
+}  // namespace cppserver
@@ -0,0 +1,76 @@
+//
+// cppserver
+//
+// Copyright (C) 2024 Tom Cully
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301, USA.
+//
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "block_device.h"
+#include "logger.h"
+#include "metrics.h"
+#include "token_bucket.h"
+
+namespace cppserver {
+
+// Bytes verified per step of a pass, and so the largest burst
+#define SCRUBBER_STEP_BYTES (1024 * 1024)
+
+// A background thread verifying every block of checksummed devices against
+// their checksums, one device after another, at a limited rate so it never
+// competes with sessions for long. Mismatches are logged by the device and
+// counted, blocks without checksums get one.
+class Scrubber {
+ public:
+  Scrubber(std::shared_ptr<Logger> logger, std::shared_ptr<Metrics> metrics, uint64_t bytes_per_second);
+  ~Scrubber();
+
+  // Include device in later passes
+  void add(std::shared_ptr<BlockDevice> device);
+  // Leave device out of later passes
+  void remove(const std::shared_ptr<BlockDevice>& device);
+
+ private:
+  std::unique_ptr<Logger> _logger;
+
+  std::mutex _mutex;
+  std::condition_variable _wake;
+  bool _running = true;
+  std::vector<std::shared_ptr<BlockDevice>> _devices;
+
+  TokenBucket _rate;
+
+  std::shared_ptr<Counter> _bytes;
+  std::shared_ptr<Counter> _mismatches;
+  std::shared_ptr<Counter> _passes;
+
+  // Declared last so it starts once everything else is constructed
+  std::thread _thread;
+
+  void _execute();
+  // Scrub a whole device, false if stopped part way
+  bool _scrub(BlockDevice& device, std::vector<uint8_t>& scratch);
+};
+
+}  // namespace cppserver
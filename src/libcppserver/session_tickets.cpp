@@ -0,0 +1,155 @@
+//
+// cppserver
+//
+// Copyright (C) 2024 Tom Cully
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301, USA.
+//
+#include "session_tickets.h"
+
+#include <openssl/evp.h>
+
+#include <algorithm>
+#include <cstring>
+
+namespace cppserver {
+
+// AES-256-GCM over len bytes from in to out, authenticating aad too. When
+// decrypting tag is checked rather than set, returning false if it does not match.
+static bool aes_gcm(bool encrypt, const uint8_t* key, const uint8_t* nonce, const uint8_t* aad, size_t aad_len, const uint8_t* in, size_t len,
+                    uint8_t* out, uint8_t* tag) {
+  EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+  if (!ctx) return false;
+
+  int out_len = 0;
+  bool ok = EVP_CipherInit_ex(ctx, EVP_aes_256_gcm(), nullptr, key, nonce, encrypt) == 1 &&
+            EVP_CipherUpdate(ctx, nullptr, &out_len, aad, aad_len) == 1 && EVP_CipherUpdate(ctx, out, &out_len, in, len) == 1;
+  if (ok && !encrypt) ok = EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, SESSION_TICKET_TAG_SIZE, tag) == 1;
+  if (ok) ok = EVP_CipherFinal_ex(ctx, out + out_len, &out_len) == 1;
+  if (ok && encrypt) ok = EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, SESSION_TICKET_TAG_SIZE, tag) == 1;
+
+  EVP_CIPHER_CTX_free(ctx);
+  return ok;
+}
+
+SessionTickets::SessionTickets(std::shared_ptr<Metrics> metrics, std::chrono::seconds plifetime, std::chrono::seconds protation)
+    : lifetime(plifetime),
+      rotation(std::max(protation, std::chrono::seconds(1))),
+      _issued(metrics->counter("cppserver_tickets_issued_total", "Total session resumption tickets issued")),
+      _redeemed(metrics->counter("cppserver_tickets_redeemed_total", "Total sessions resumed from a ticket")),
+      _rejected(metrics->counter("cppserver_tickets_rejected_total", "Total tickets refused as expired, unknown or altered")) {
+  // Ids of an earlier run's keys are unlikely to match
+  _next_id = _random.get_int32();
+}
+
+void SessionTickets::_rotate(clock::time_point now) {
+  if (_keys.empty() || now - _keys.back().created >= rotation) {
+    Key key;
+    key.id = _next_id++;
+    _random.get_random(key.secret.data(), key.secret.size());
+    key.created = now;
+    _keys.push_back(key);
+  }
+  // The last ticket a key sealed was issued before the next key was created
+  while (_keys.size() > 1 && now - _keys[1].created >= lifetime) _keys.pop_front();
+}
+
+size_t SessionTickets::keys() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _keys.size();
+}
+
+bool SessionTickets::issue(const SessionTicket& ticket, std::vector<uint8_t>& out, clock::time_point now) {
+  uint8_t fields[SESSION_TICKET_FIELDS_SIZE];
+  put_u64(fields, ticket.host_id);
+  put_u64(fields + 8, ticket.device_id);
+  put_u64(fields + 16, std::chrono::duration_cast<std::chrono::seconds>((now + lifetime).time_since_epoch()).count());
+  fields[24] = ticket.attach_flags;
+  ticket.hello.pack(fields + 25);
+
+  size_t offset = out.size();
+  out.resize(offset + SESSION_TICKET_SIZE);
+  uint8_t* ptr = out.data() + offset;
+  std::array<uint8_t, SESSION_TICKET_KEY_SIZE> secret;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _rotate(now);
+    Key& key = _keys.back();
+    secret = key.secret;
+    put_u32(ptr, key.id);
+    // A key never seals two tickets with the same nonce
+    put_u32(ptr + 4, 0);
+    put_u64(ptr + 8, key.sealed++);
+  }
+
+  uint8_t* nonce = ptr + 4;
+  uint8_t* sealed = nonce + SESSION_TICKET_NONCE_SIZE;
+  // The nonce is not given back, a key must never seal twice with one
+  if (!aes_gcm(true, secret.data(), nonce, ptr, 4, fields, sizeof(fields), sealed, sealed + SESSION_TICKET_FIELDS_SIZE)) {
+    out.resize(offset);
+    return false;
+  }
+  _issued->inc();
+  return true;
+}
+
+bool SessionTickets::redeem(const uint8_t* ptr, size_t len, SessionTicket& ticket, std::string& error, clock::time_point now) {
+  if (len != SESSION_TICKET_SIZE) {
+    error = "Bad ticket";
+    _rejected->inc();
+    return false;
+  }
+
+  std::array<uint8_t, SESSION_TICKET_KEY_SIZE> secret;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _rotate(now);
+    uint32_t id = get_u32(ptr);
+    auto it = std::find_if(_keys.begin(), _keys.end(), [id](const Key& key) { return key.id == id; });
+    if (it == _keys.end()) {
+      error = "Unknown ticket key";
+      _rejected->inc();
+      return false;
+    }
+    secret = it->secret;
+  }
+
+  const uint8_t* nonce = ptr + 4;
+  const uint8_t* sealed = nonce + SESSION_TICKET_NONCE_SIZE;
+  uint8_t fields[SESSION_TICKET_FIELDS_SIZE];
+  uint8_t tag[SESSION_TICKET_TAG_SIZE];
+  std::memcpy(tag, sealed + SESSION_TICKET_FIELDS_SIZE, sizeof(tag));
+  if (!aes_gcm(false, secret.data(), nonce, ptr, 4, sealed, sizeof(fields), fields, tag)) {
+    error = "Bad ticket";
+    _rejected->inc();
+    return false;
+  }
+
+  ticket.expires = clock::time_point(std::chrono::seconds(get_u64(fields + 16)));
+  if (now >= ticket.expires) {
+    error = "Ticket expired";
+    _rejected->inc();
+    return false;
+  }
+  ticket.host_id = get_u64(fields);
+  ticket.device_id = get_u64(fields + 8);
+  ticket.attach_flags = fields[24];
+  ticket.hello.parse(fields + 25, HELLO_SIZE);
+  _redeemed->inc();
+  return true;
+}
+
+}  // namespace cppserver
@@ -0,0 +1,104 @@
+//
+// cppserver
+//
+// Copyright (C) 2024 Tom Cully
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301, USA.
+//
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "metrics.h"
+#include "protocol.h"
+#include "random.h"
+
+namespace cppserver {
+
+#define SESSION_TICKET_KEY_SIZE 32
+#define SESSION_TICKET_NONCE_SIZE 12
+#define SESSION_TICKET_TAG_SIZE 16
+// Host id (8), device id (8), expiry (8), attach flags (1), hello
+#define SESSION_TICKET_FIELDS_SIZE (25 + HELLO_SIZE)
+// Key id (4), nonce, the fields encrypted, tag
+#define SESSION_TICKET_SIZE (4 + SESSION_TICKET_NONCE_SIZE + SESSION_TICKET_FIELDS_SIZE + SESSION_TICKET_TAG_SIZE)
+
+// What a session resumes from: the device it attached to and what it agreed in HELLO
+class SessionTicket {
+ public:
+  uint64_t host_id = 0;
+  uint64_t device_id = 0;
+  uint8_t attach_flags = 0;  // As granted at attach
+  Hello hello;
+  std::chrono::system_clock::time_point expires;  // Set when issued
+};
+
+// Issues and redeems the tickets sessions are resumed with. A ticket is
+// sealed with AES-256-GCM under a secret only this process knows, so clients
+// hold it but can neither read nor alter it. A new secret seals tickets every
+// rotation, and each is kept until every ticket it sealed has expired. Thread
+// safe.
+class SessionTickets {
+ public:
+  typedef std::chrono::system_clock clock;
+
+  SessionTickets(std::shared_ptr<Metrics> metrics, std::chrono::seconds lifetime, std::chrono::seconds rotation);
+
+  // Seal ticket to expire lifetime from now, appending SESSION_TICKET_SIZE bytes to out. Returns false, leaving out as it was, if sealing fails.
+  bool issue(const SessionTicket& ticket, std::vector<uint8_t>& out, clock::time_point now = clock::now());
+  // Open a ticket issued here that has not expired. On failure error says why.
+  bool redeem(const uint8_t* ptr, size_t len, SessionTicket& ticket, std::string& error, clock::time_point now = clock::now());
+
+  // Secrets currently able to open tickets
+  size_t keys();
+
+  const std::chrono::seconds lifetime;
+  const std::chrono::seconds rotation;
+
+ private:
+  class Key {
+   public:
+    uint32_t id;
+    std::array<uint8_t, SESSION_TICKET_KEY_SIZE> secret;
+    clock::time_point created;
+    // Tickets sealed with it, numbering their nonces
+    uint64_t sealed = 0;
+  };
+
+  Random _random;
+
+  // Guards the keys
+  std::mutex _mutex;
+  // Oldest first, the last seals new tickets
+  std::deque<Key> _keys;
+  uint32_t _next_id;
+
+  std::shared_ptr<Counter> _issued;
+  std::shared_ptr<Counter> _redeemed;
+  std::shared_ptr<Counter> _rejected;
+
+  // Start a new key if the newest is due, and drop keys whose tickets have all expired
+  void _rotate(clock::time_point now);
+};
+
+}  // namespace cppserver
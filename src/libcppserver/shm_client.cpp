@@ -0,0 +1,421 @@
+//
+// cppserver
+//
+// Copyright (C) 2024 Tom Cully
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301, USA.
+//
+#include "shm_client.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <future>
+
+#include "logger_scoped.h"
+
+namespace cppserver {
+
+ShmClient::ShmClient(std::shared_ptr<Logger> logger, std::shared_ptr<Metrics> metrics, const ShmClientOptions& options)
+    : _logger(std::make_unique<LoggerScoped>("shm client", logger)),
+      _metrics(metrics),
+      _options(options),
+      _latency(metrics->latency("cppserver_client_request_seconds", "Time from a client sending a request to its response")),
+      _requests(metrics->counter("cppserver_client_requests_total", "Total requests sent by clients")) {}
+
+ShmClient::~ShmClient() { close(); }
+
+bool ShmClient::connect(const std::string& path, uint64_t host_id, uint64_t device_id, std::string& error) {
+  close();
+  if (!ShmRegion::valid(_options.slots, _options.slot_size)) {
+    error = "Bad shared memory geometry";
+    return false;
+  }
+
+  struct sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path)) {
+    error = "Socket path too long";
+    return false;
+  }
+  std::memcpy(addr.sun_path, path.c_str(), path.size());
+  _fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (_fd < 0 || ::connect(_fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0) {
+    error = "Cannot connect to unix:" + path + ": " + std::strerror(errno);
+    close();
+    return false;
+  }
+  struct timeval timeout = {time_t(_options.timeout_ms / 1000), suseconds_t(_options.timeout_ms % 1000 * 1000)};
+  ::setsockopt(_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  ::setsockopt(_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+  if (!_handshake(host_id, device_id, error)) {
+    close();
+    return false;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _free.clear();
+    for (uint32_t i = _region->slots(); i > 0; i--) _free.push_back(i - 1);
+    _pending.assign(_region->slots(), Pending());
+    _in_flight = 0;
+    _connected = true;
+  }
+  _completer = std::make_unique<std::thread>(&ShmClient::_complete_requests, this);
+  _logger->debug("Connected to unix:" + path + ", " + std::to_string(_region->slots()) + " slots of " + std::to_string(_region->slot_size()) + " bytes");
+  return true;
+}
+
+bool ShmClient::_handshake(uint64_t host_id, uint64_t device_id, std::string& error) {
+  FrameHeader header;
+  std::vector<uint8_t> response;
+  std::vector<int> fds;
+
+  // Out of order, so the server's dispatch workers can run the slots' requests at once
+  uint8_t hello[HELLO_SIZE];
+  Hello(Version(CPPSERVER_VERSION_MAJOR, CPPSERVER_VERSION_MINOR, CPPSERVER_VERSION_PATCH), CAP_OUT_OF_ORDER, FRAME_MAX_PAYLOAD, _options.slots).pack(hello);
+  if (!_exchange(OP_HELLO, 0, hello, sizeof(hello), header, response, fds, error)) return false;
+  if (header.opcode != OP_HELLO) {
+    error = "Bad hello response";
+    return false;
+  }
+
+  uint8_t attach[ATTACH_REQUEST_SIZE];
+  put_u64(attach, host_id);
+  put_u64(attach + 8, device_id);
+  if (!_exchange(OP_ATTACH, 0, attach, sizeof(attach), header, response, fds, error)) return false;
+  if (header.opcode == OP_REDIRECT) {
+    // Shared memory only reaches this host
+    error = "Device " + std::to_string(device_id) + " is served by " + std::string(response.begin(), response.end());
+    return false;
+  }
+  if (header.opcode != OP_ATTACH || response.size() != ATTACH_RESPONSE_SIZE) {
+    error = "Bad attach response";
+    return false;
+  }
+  _block_size = get_u32(response.data());
+  _block_total = get_u64(response.data() + 4);
+  _read_only = response[12] & ATTACH_READ_ONLY;
+
+  uint8_t shm[SHM_REQUEST_SIZE];
+  put_u32(shm, _options.slots);
+  put_u32(shm + 4, _options.slot_size);
+  bool ok = _exchange(OP_SHM, 0, shm, sizeof(shm), header, response, fds, error);
+  if (ok && (header.opcode != OP_SHM || fds.size() != 3)) {
+    error = "Bad shm response";
+    ok = false;
+  }
+  if (!ok) {
+    for (int fd : fds) ::close(fd);
+    return false;
+  }
+
+  boost::system::error_code ec;
+  _region = ShmRegion::map(fds[0], fds[1], fds[2], ec);
+  if (!_region) {
+    error = "Cannot map shared memory: " + ec.message();
+    return false;
+  }
+  return true;
+}
+
+void ShmClient::close() {
+  // The completion thread sees the socket shut and fails whatever is in flight
+  if (_fd >= 0) ::shutdown(_fd, SHUT_RDWR);
+  if (_completer) {
+    _completer->join();
+    _completer.reset();
+  }
+  _region.reset();
+  if (_fd >= 0) {
+    ::close(_fd);
+    _fd = -1;
+  }
+}
+
+//
+// Handshake
+//
+
+bool ShmClient::_exchange(uint8_t opcode, uint8_t flags, const uint8_t* payload, uint32_t length, FrameHeader& header, std::vector<uint8_t>& response,
+                          std::vector<int>& fds, std::string& error) {
+  std::vector<uint8_t> frame(FRAME_HEADER_SIZE + length);
+  FrameHeader(opcode, flags, length, _next_tag++).pack(frame.data());
+  std::memcpy(frame.data() + FRAME_HEADER_SIZE, payload, length);
+  if (::send(_fd, frame.data(), frame.size(), MSG_NOSIGNAL) != ssize_t(frame.size())) {
+    error = "Cannot send: " + std::string(std::strerror(errno));
+    return false;
+  }
+
+  uint8_t packed[FRAME_HEADER_SIZE];
+  if (!_receive(packed, sizeof(packed), fds, error)) return false;
+  if (!header.parse(packed)) {
+    error = "Bad frame header";
+    return false;
+  }
+  response.resize(header.length);
+  if (!_receive(response.data(), response.size(), fds, error)) return false;
+  if (header.opcode == OP_ERROR) {
+    error = std::string(response.begin(), response.end());
+    return false;
+  }
+  return true;
+}
+
+bool ShmClient::_receive(uint8_t* data, size_t len, std::vector<int>& fds, std::string& error) {
+  while (len) {
+    alignas(struct cmsghdr) char control[CMSG_SPACE(3 * sizeof(int))];
+    struct iovec iov = {data, len};
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t received = ::recvmsg(_fd, &msg, MSG_CMSG_CLOEXEC);
+    if (received < 0 && errno == EINTR) continue;
+    if (received <= 0) {
+      error = received == 0 ? "Connection closed" : errno == EAGAIN ? "Timed out" : "Cannot receive: " + std::string(std::strerror(errno));
+      return false;
+    }
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+      size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      for (size_t i = 0; i < count; i++) {
+        int fd;
+        std::memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(fd));
+        fds.push_back(fd);
+      }
+    }
+    data += received;
+    len -= received;
+  }
+  return true;
+}
+
+//
+// Asynchronous requests
+//
+
+ShmClient::Completion ShmClient::_callback(BlockCallback callback) {
+  return [callback](uint8_t opcode, const uint8_t* data, uint32_t length) {
+    BlockResponse response;
+    response.opcode = opcode;
+    if (opcode == OP_ERROR) {
+      response.error = std::string(data, data + length);
+    } else {
+      response.data.assign(data, data + length);
+    }
+    if (callback) callback(response);
+  };
+}
+
+void ShmClient::read(uint64_t block, uint32_t count, BlockCallback callback, uint8_t flags) {
+  uint8_t fields[READ_REQUEST_SIZE];
+  put_u64(fields, block);
+  put_u32(fields + 8, count);
+  _submit(OP_READ, flags, fields, sizeof(fields), nullptr, 0, _callback(std::move(callback)));
+}
+
+void ShmClient::write(uint64_t block, uint32_t count, const uint8_t* data, BlockCallback callback, uint8_t flags) {
+  uint8_t fields[WRITE_REQUEST_HEADER_SIZE];
+  put_u64(fields, block);
+  _submit(OP_WRITE, flags, fields, sizeof(fields), data, size_t(count) * _block_size, _callback(std::move(callback)));
+}
+
+void ShmClient::trim(uint64_t block, uint32_t count, BlockCallback callback) {
+  uint8_t fields[TRIM_REQUEST_SIZE];
+  put_u64(fields, block);
+  put_u32(fields + 8, count);
+  _submit(OP_TRIM, 0, fields, sizeof(fields), nullptr, 0, _callback(std::move(callback)));
+}
+
+void ShmClient::flush(BlockCallback callback) { _submit(OP_FLUSH, 0, nullptr, 0, nullptr, 0, _callback(std::move(callback))); }
+
+//
+// Synchronous requests
+//
+
+bool ShmClient::read(uint64_t block, uint32_t count, uint8_t* data, std::string& error) {
+  uint8_t fields[READ_REQUEST_SIZE];
+  put_u64(fields, block);
+  put_u32(fields + 8, count);
+
+  // Copied straight out of the slot into the caller's buffer
+  size_t expected = size_t(count) * _block_size;
+  std::promise<std::string> promise;
+  std::future<std::string> future = promise.get_future();
+  _submit(OP_READ, 0, fields, sizeof(fields), nullptr, 0, [&promise, data, expected](uint8_t opcode, const uint8_t* payload, uint32_t length) {
+    if (opcode == OP_ERROR) {
+      promise.set_value(std::string(payload, payload + length));
+    } else if (length != expected) {
+      promise.set_value("Short read");
+    } else {
+      std::memcpy(data, payload, length);
+      promise.set_value("");
+    }
+  });
+  error = future.get();
+  return error.empty();
+}
+
+bool ShmClient::write(uint64_t block, uint32_t count, const uint8_t* data, bool fua, std::string& error) {
+  uint8_t fields[WRITE_REQUEST_HEADER_SIZE];
+  put_u64(fields, block);
+  BlockResponse response = _call(OP_WRITE, fua ? WRITE_FUA : 0, fields, sizeof(fields), data, size_t(count) * _block_size);
+  error = response.error;
+  return response.ok();
+}
+
+bool ShmClient::trim(uint64_t block, uint32_t count, std::string& error) {
+  uint8_t fields[TRIM_REQUEST_SIZE];
+  put_u64(fields, block);
+  put_u32(fields + 8, count);
+  BlockResponse response = _call(OP_TRIM, 0, fields, sizeof(fields));
+  error = response.error;
+  return response.ok();
+}
+
+bool ShmClient::flush(std::string& error) {
+  BlockResponse response = _call(OP_FLUSH, 0, nullptr, 0);
+  error = response.error;
+  return response.ok();
+}
+
+void ShmClient::drain() {
+  std::unique_lock<std::mutex> lock(_mutex);
+  _room.wait(lock, [this]() { return _in_flight == 0; });
+}
+
+BlockResponse ShmClient::_call(uint8_t opcode, uint8_t flags, const uint8_t* fields, size_t fields_length, const uint8_t* data, size_t data_length) {
+  std::promise<BlockResponse> promise;
+  std::future<BlockResponse> future = promise.get_future();
+  _submit(opcode, flags, fields, fields_length, data, data_length,
+          _callback([&promise](BlockResponse& response) { promise.set_value(std::move(response)); }));
+  return future.get();
+}
+
+//
+// Submission and completion
+//
+
+void ShmClient::_submit(uint8_t opcode, uint8_t flags, const uint8_t* fields, size_t fields_length, const uint8_t* data, size_t data_length,
+                        Completion completion) {
+  auto fail = [&completion](const std::string& error) { completion(OP_ERROR, reinterpret_cast<const uint8_t*>(error.data()), error.size()); };
+  if (_region && fields_length + data_length > _region->slot_size()) return fail("Request too large");
+
+  uint16_t slot;
+  {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _room.wait(lock, [this]() { return !_connected || !_free.empty(); });
+    if (!_connected) {
+      lock.unlock();
+      return fail("Not connected");
+    }
+    slot = _free.back();
+    _free.pop_back();
+    _in_flight++;
+  }
+
+  // Filled before the request is registered, so the caller's data is not read after any failure has called back
+  uint8_t* ptr = _region->slot(slot);
+  if (fields_length) std::memcpy(ptr, fields, fields_length);
+  if (data_length) std::memcpy(ptr + fields_length, data, data_length);
+
+  ShmEntry entry = {0, uint32_t(fields_length + data_length), slot, opcode, flags};
+  {
+    std::unique_lock<std::mutex> lock(_mutex);
+    if (!_connected) {
+      _in_flight--;
+      lock.unlock();
+      _room.notify_all();
+      return fail("Not connected");
+    }
+    entry.tag = _next_tag++;
+    _pending[slot] = Pending{entry.tag, std::move(completion), std::chrono::steady_clock::now()};
+  }
+
+  {
+    // One entry per slot, so the ring always has room
+    std::lock_guard<std::mutex> lock(_submit_mutex);
+    _region->submissions().push(entry);
+    _region->submissions().notify();
+  }
+  _requests->inc();
+}
+
+void ShmClient::_complete_requests() {
+  ShmRing& completions = _region->completions();
+  for (;;) {
+    // The socket turns readable once the server has gone or close() has shut it
+    bool hangup = false;
+    if (!completions.wait(_fd, -1, hangup)) {
+      if (hangup) break;
+      continue;
+    }
+
+    ShmEntry entry;
+    while (completions.pop(entry)) {
+      Pending pending;
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (entry.slot >= _pending.size() || _pending[entry.slot].tag != entry.tag || !entry.tag || entry.length > _region->slot_size()) {
+          _logger->warn("Response to unknown request " + std::to_string(entry.tag));
+          continue;
+        }
+        pending = std::move(_pending[entry.slot]);
+        _pending[entry.slot] = Pending();
+      }
+      _latency->record(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - pending.sent).count());
+      pending.completion(entry.opcode, _region->slot(entry.slot), entry.length);
+
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _free.push_back(entry.slot);
+        _in_flight--;
+      }
+      _room.notify_all();
+    }
+  }
+
+  _fail_all("Connection closed");
+}
+
+void ShmClient::_fail_all(const std::string& error) {
+  std::vector<Pending> failed;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _connected = false;
+    for (auto& pending : _pending) {
+      if (pending.tag) failed.push_back(std::move(pending));
+      pending = Pending();
+    }
+  }
+  _room.notify_all();
+
+  for (auto& pending : failed) pending.completion(OP_ERROR, reinterpret_cast<const uint8_t*>(error.data()), error.size());
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _in_flight -= failed.size();
+  }
+  _room.notify_all();
+}
+
+}  // namespace cppserver
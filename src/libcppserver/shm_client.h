@@ -0,0 +1,151 @@
+//
+// cppserver
+//
+// Copyright (C) 2024 Tom Cully
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301, USA.
+//
+#pragma once
+
+#include <atomic>
+#include <boost/system/error_code.hpp>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "block_client.h"
+#include "logger.h"
+#include "metrics.h"
+#include "protocol.h"
+#include "shm_ring.h"
+
+namespace cppserver {
+
+class ShmClientOptions {
+ public:
+  uint32_t slots = 64;              // Requests in flight at once, a power of two
+  uint32_t slot_size = 256 * 1024;  // Largest request or response payload, a multiple of SHM_PAGE_SIZE
+  uint32_t timeout_ms = 5000;       // How long connect() waits for each handshake response
+};
+
+// A client on the same host as the server, connecting through its Unix
+// socket, attaching to a device and then moving the session onto a ShmRegion
+// with SHM. Requests are written into free slots and their responses read
+// from the same slots, so block data never passes through the socket, which
+// is only kept open for each side to see the other go.
+//
+// Any number of threads may submit, waiting while every slot is in use.
+// Callbacks run on the completion thread, so must not wait for other
+// requests on the same client. The synchronous read copies straight out of
+// the slot.
+class ShmClient {
+ public:
+  ShmClient(std::shared_ptr<Logger> logger, std::shared_ptr<Metrics> metrics, const ShmClientOptions& options = ShmClientOptions());
+  ~ShmClient();
+
+  // Connect, negotiate, attach to a device and map the region. On failure error says why.
+  bool connect(const std::string& path, uint64_t host_id, uint64_t device_id, std::string& error);
+  // Fail every request in flight and close the session
+  void close();
+  bool connected() const { return _connected; }
+
+  uint32_t block_size() const { return _block_size; }
+  uint64_t block_total() const { return _block_total; }
+  bool read_only() const { return _read_only; }
+  // Largest request or response payload
+  uint32_t slot_size() const { return _region ? _region->slot_size() : 0; }
+
+  void read(uint64_t block, uint32_t count, BlockCallback callback, uint8_t flags = 0);
+  void write(uint64_t block, uint32_t count, const uint8_t* data, BlockCallback callback, uint8_t flags = 0);
+  void trim(uint64_t block, uint32_t count, BlockCallback callback);
+  void flush(BlockCallback callback);
+
+  bool read(uint64_t block, uint32_t count, uint8_t* data, std::string& error);
+  bool write(uint64_t block, uint32_t count, const uint8_t* data, bool fua, std::string& error);
+  bool trim(uint64_t block, uint32_t count, std::string& error);
+  bool flush(std::string& error);
+
+  // Wait until every request submitted so far has completed
+  void drain();
+
+ private:
+  // Called on the completion thread with the response's opcode and payload, still in its slot
+  typedef std::function<void(uint8_t opcode, const uint8_t* data, uint32_t length)> Completion;
+
+  class Pending {
+   public:
+    uint64_t tag = 0;
+    Completion completion;
+    std::chrono::steady_clock::time_point sent;
+  };
+
+  std::unique_ptr<Logger> _logger;
+  std::shared_ptr<Metrics> _metrics;
+  ShmClientOptions _options;
+
+  int _fd = -1;
+  std::unique_ptr<ShmRegion> _region;
+  std::atomic<bool> _connected{false};
+
+  uint32_t _block_size = 0;
+  uint64_t _block_total = 0;
+  bool _read_only = false;
+
+  // Guards the free slots and what each used one is waiting for
+  std::mutex _mutex;
+  std::condition_variable _room;
+  std::vector<uint16_t> _free;
+  // Indexed by slot, a tag of 0 while the slot is free
+  std::vector<Pending> _pending;
+  // Slots taken whose completion has not yet returned
+  uint32_t _in_flight = 0;
+  uint64_t _next_tag = 1;
+
+  // Serialises pushes to the submission ring
+  std::mutex _submit_mutex;
+
+  std::shared_ptr<LatencyHistogram> _latency;
+  std::shared_ptr<Counter> _requests;
+
+  std::unique_ptr<std::thread> _completer;
+
+  // Negotiate, attach and move the session onto the region it is then given
+  bool _handshake(uint64_t host_id, uint64_t device_id, std::string& error);
+  // Send one frame on the socket and wait for its response, collecting any fds passed with it
+  bool _exchange(uint8_t opcode, uint8_t flags, const uint8_t* payload, uint32_t length, FrameHeader& header, std::vector<uint8_t>& response,
+                 std::vector<int>& fds, std::string& error);
+  // Read exactly len bytes from the socket, collecting any fds passed with them
+  bool _receive(uint8_t* data, size_t len, std::vector<int>& fds, std::string& error);
+
+  // Take a free slot, waiting for one. Fills the slot with fields, then data, and submits it.
+  void _submit(uint8_t opcode, uint8_t flags, const uint8_t* fields, size_t fields_length, const uint8_t* data, size_t data_length, Completion completion);
+  void _complete_requests();
+  // Fail every request in flight with error
+  void _fail_all(const std::string& error);
+
+  // Adapt a BlockCallback to receive the response copied out of its slot
+  static Completion _callback(BlockCallback callback);
+  // Submit and wait for the response
+  BlockResponse _call(uint8_t opcode, uint8_t flags, const uint8_t* fields, size_t fields_length, const uint8_t* data = nullptr, size_t data_length = 0);
+};
+
+}  // namespace cppserver
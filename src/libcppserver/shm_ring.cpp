@@ -0,0 +1,196 @@
+//
+// cppserver
+//
+// Copyright (C) 2024 Tom Cully
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301, USA.
+//
+#include "shm_ring.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <new>
+#include <thread>
+
+namespace cppserver {
+
+ShmRing::ShmRing(ShmRingIndex* index, ShmEntry* entries, uint32_t size, int event_fd)
+    : _index(index), _entries(entries), _mask(size - 1), _event_fd(event_fd) {}
+
+bool ShmRing::push(const ShmEntry& entry) {
+  uint32_t tail = _index->tail.load(std::memory_order_relaxed);
+  if (tail - _index->head.load(std::memory_order_acquire) > _mask) return false;
+  _entries[tail & _mask] = entry;
+  _index->tail.store(tail + 1, std::memory_order_release);
+  return true;
+}
+
+void ShmRing::notify() {
+  // Pairs with the fence in wait(): either the consumer sees the entry or this sees it sleeping
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (_index->sleeping.load(std::memory_order_relaxed)) wake();
+}
+
+void ShmRing::wake() {
+  uint64_t one = 1;
+  (void)!::write(_event_fd, &one, sizeof(one));
+}
+
+bool ShmRing::empty() const { return _index->head.load(std::memory_order_relaxed) == _index->tail.load(std::memory_order_acquire); }
+
+bool ShmRing::pop(ShmEntry& entry) {
+  uint32_t head = _index->head.load(std::memory_order_relaxed);
+  if (head == _index->tail.load(std::memory_order_acquire)) return false;
+  entry = _entries[head & _mask];
+  _index->head.store(head + 1, std::memory_order_release);
+  return true;
+}
+
+bool ShmRing::wait(int extra_fd, int timeout_ms, bool& extra_ready) {
+  extra_ready = false;
+  if (!empty()) return true;
+
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(_spin_us);
+  do {
+    // Yield rather than pause, so on a busy CPU the producer gets to run
+    std::this_thread::yield();
+    if (!empty()) {
+      _spin_us = std::min<uint32_t>(_spin_us * 2, SHM_SPIN_MAX_US);
+      return true;
+    }
+  } while (std::chrono::steady_clock::now() < deadline);
+  _spin_us = std::max<uint32_t>(_spin_us / 2, 1);
+
+  _index->sleeping.store(1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (empty()) {
+    struct pollfd fds[2] = {{_event_fd, POLLIN, 0}, {extra_fd, POLLIN, 0}};
+    if (::poll(fds, extra_fd < 0 ? 1 : 2, timeout_ms) > 0) {
+      uint64_t count;
+      if (fds[0].revents & POLLIN) (void)!::read(_event_fd, &count, sizeof(count));
+      extra_ready = extra_fd >= 0 && fds[1].revents;
+    }
+  }
+  _index->sleeping.store(0, std::memory_order_relaxed);
+  return !empty();
+}
+
+bool ShmRegion::valid(uint32_t slots, uint32_t slot_size) {
+  return slots && slots <= SHM_MAX_SLOTS && !(slots & (slots - 1)) && slot_size >= SHM_PAGE_SIZE && slot_size % SHM_PAGE_SIZE == 0 &&
+         uint64_t(slots) * slot_size <= SHM_MAX_BYTES;
+}
+
+size_t ShmRegion::_ring_offset(uint32_t ring, uint32_t slots) {
+  size_t header = (sizeof(ShmHeader) + 63) / 64 * 64;
+  return header + ring * size_t(slots) * sizeof(ShmEntry);
+}
+
+size_t ShmRegion::_slots_offset(uint32_t slots) { return (_ring_offset(2, slots) + SHM_PAGE_SIZE - 1) / SHM_PAGE_SIZE * SHM_PAGE_SIZE; }
+
+std::unique_ptr<ShmRegion> ShmRegion::create(uint32_t slots, uint32_t slot_size, boost::system::error_code& ec) {
+  if (!valid(slots, slot_size)) {
+    ec = boost::system::errc::make_error_code(boost::system::errc::invalid_argument);
+    return nullptr;
+  }
+
+  std::unique_ptr<ShmRegion> region(new ShmRegion());
+  region->_memfd = ::memfd_create("cppserver-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  region->_submit_fd = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  region->_complete_fd = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  size_t size = _slots_offset(slots) + size_t(slots) * slot_size;
+  // Sealed at its size, a mapping the other side shrank would fault on access rather than fail
+  if (region->_memfd < 0 || region->_submit_fd < 0 || region->_complete_fd < 0 || ::ftruncate(region->_memfd, size) != 0 ||
+      ::fcntl(region->_memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0) {
+    ec = boost::system::error_code(errno, boost::system::system_category());
+    return nullptr;
+  }
+
+  region->_size = size;
+  region->_base = static_cast<uint8_t*>(::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, region->_memfd, 0));
+  if (region->_base == MAP_FAILED) {
+    region->_base = nullptr;
+    ec = boost::system::error_code(errno, boost::system::system_category());
+    return nullptr;
+  }
+  ShmHeader* header = new (region->_base) ShmHeader();
+  header->magic = SHM_MAGIC;
+  header->slots = slots;
+  header->slot_size = slot_size;
+  if (!region->_map(ec)) return nullptr;
+  return region;
+}
+
+std::unique_ptr<ShmRegion> ShmRegion::map(int memfd, int submit_fd, int complete_fd, boost::system::error_code& ec) {
+  std::unique_ptr<ShmRegion> region(new ShmRegion());
+  region->_memfd = memfd;
+  region->_submit_fd = submit_fd;
+  region->_complete_fd = complete_fd;
+
+  struct stat st;
+  if (::fstat(memfd, &st) != 0) {
+    ec = boost::system::error_code(errno, boost::system::system_category());
+    return nullptr;
+  }
+  region->_size = st.st_size;
+  if (region->_size < sizeof(ShmHeader)) {
+    ec = boost::system::errc::make_error_code(boost::system::errc::invalid_argument);
+    return nullptr;
+  }
+  region->_base = static_cast<uint8_t*>(::mmap(nullptr, region->_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0));
+  if (region->_base == MAP_FAILED) {
+    region->_base = nullptr;
+    ec = boost::system::error_code(errno, boost::system::system_category());
+    return nullptr;
+  }
+  if (!region->_map(ec)) return nullptr;
+  return region;
+}
+
+bool ShmRegion::_map(boost::system::error_code& ec) {
+  const ShmHeader* header = reinterpret_cast<const ShmHeader*>(_base);
+  uint32_t slots = header->slots;
+  uint32_t slot_size = header->slot_size;
+  if (header->magic != SHM_MAGIC || !valid(slots, slot_size) || _size < _slots_offset(slots) + size_t(slots) * slot_size) {
+    ec = boost::system::errc::make_error_code(boost::system::errc::invalid_argument);
+    return false;
+  }
+
+  // Kept here, as the other side could change the header
+  _slot_count = slots;
+  _slot_size = slot_size;
+  _slots = _base + _slots_offset(slots);
+  ShmHeader* shared = reinterpret_cast<ShmHeader*>(_base);
+  _submissions = std::make_unique<ShmRing>(&shared->submissions, reinterpret_cast<ShmEntry*>(_base + _ring_offset(0, slots)), slots, _submit_fd);
+  _completions = std::make_unique<ShmRing>(&shared->completions, reinterpret_cast<ShmEntry*>(_base + _ring_offset(1, slots)), slots, _complete_fd);
+  return true;
+}
+
+ShmRegion::~ShmRegion() {
+  if (_base) ::munmap(_base, _size);
+  for (int fd : {_memfd, _submit_fd, _complete_fd}) {
+    if (fd >= 0) ::close(fd);
+  }
+}
+
+}  // namespace cppserver
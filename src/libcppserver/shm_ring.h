@@ -0,0 +1,160 @@
+//
+// cppserver
+//
+// Copyright (C) 2024 Tom Cully
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301, USA.
+//
+#pragma once
+
+#include <atomic>
+#include <boost/system/error_code.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace cppserver {
+
+#define SHM_MAGIC 0x43535348
+// Most slots a region may have, and so requests in flight at once
+#define SHM_MAX_SLOTS 1024
+// Largest region a session may map
+#define SHM_MAX_BYTES (256 * 1024 * 1024)
+// Slots are whole pages
+#define SHM_PAGE_SIZE 4096
+// Longest a waiting consumer spins before sleeping on the eventfd
+#define SHM_SPIN_MAX_US 64
+
+// A request or response in a ring. A request's payload is in its slot,
+// which its response's payload replaces. Same layout in both directions.
+class ShmEntry {
+ public:
+  uint64_t tag;
+  uint32_t length;
+  uint16_t slot;
+  uint8_t opcode;
+  uint8_t flags;
+};
+
+// Where each side of a ring has got to, on separate cache lines
+class ShmRingIndex {
+ public:
+  // Next entry to pop, advanced by the consumer
+  alignas(64) std::atomic<uint32_t> head;
+  // Set while the consumer sleeps on the ring's eventfd
+  std::atomic<uint32_t> sleeping;
+  // Next entry to push, advanced by the producer
+  alignas(64) std::atomic<uint32_t> tail;
+};
+
+// The start of a region: its geometry and both rings' indices
+class ShmHeader {
+ public:
+  uint32_t magic;
+  uint32_t slots;
+  uint32_t slot_size;
+  ShmRingIndex submissions;
+  ShmRingIndex completions;
+};
+
+static_assert(std::atomic<uint32_t>::is_always_lock_free, "Ring indices are shared between processes");
+
+// One direction of a region, a single producer single consumer ring of
+// entries. Either side may be in another process. The producer wakes the
+// consumer through an eventfd, but only if it has gone to sleep: a waiting
+// consumer first spins for up to a budget that doubles whenever an entry
+// turns up while spinning and halves whenever it has to sleep, so a busy
+// ring is served without system calls and an idle one costs no CPU.
+class ShmRing {
+ public:
+  ShmRing(ShmRingIndex* index, ShmEntry* entries, uint32_t size, int event_fd);
+
+  // Producer. False if the ring is full.
+  bool push(const ShmEntry& entry);
+  // Wake the consumer if it is sleeping, after pushing
+  void notify();
+
+  // Consumer. False if the ring is empty.
+  bool pop(ShmEntry& entry);
+  bool empty() const;
+  // Wait up to timeout_ms for an entry, also returning early if extra_fd, when
+  // not -1, is readable or the ring is woken. True if there is an entry.
+  bool wait(int extra_fd, int timeout_ms, bool& extra_ready);
+
+  // Wake the consumer whether or not there is an entry
+  void wake();
+  int event_fd() const { return _event_fd; }
+
+ private:
+  ShmRingIndex* _index;
+  ShmEntry* _entries;
+  uint32_t _mask;
+  int _event_fd;
+  uint32_t _spin_us = 1;
+};
+
+// A region of shared memory in a memfd holding a ShmHeader, a submission and
+// a completion ring of one entry per slot, and the slots, page aligned. The
+// side creating it passes its memfd and one eventfd per ring to the other
+// over a Unix socket. Either side may be in another process, so nothing in it
+// is trusted beyond its geometry, which is checked when it is mapped. The
+// creator seals the memfd's size, so the other side cannot shrink it under
+// the creator's mapping.
+class ShmRegion {
+ public:
+  // Create a region with slots of slot_size bytes. slots must be a power of two.
+  static std::unique_ptr<ShmRegion> create(uint32_t slots, uint32_t slot_size, boost::system::error_code& ec);
+  // Map a region the other side created, taking ownership of its fds
+  static std::unique_ptr<ShmRegion> map(int memfd, int submit_fd, int complete_fd, boost::system::error_code& ec);
+  ~ShmRegion();
+
+  // Requests from client to server
+  ShmRing& submissions() { return *_submissions; }
+  // Responses from server to client
+  ShmRing& completions() { return *_completions; }
+
+  uint8_t* slot(uint32_t index) { return _slots + size_t(index) * _slot_size; }
+  uint32_t slots() const { return _slot_count; }
+  uint32_t slot_size() const { return _slot_size; }
+
+  int memfd() const { return _memfd; }
+  int submit_fd() const { return _submit_fd; }
+  int complete_fd() const { return _complete_fd; }
+
+  // True if a region of slots of slot_size bytes is allowed
+  static bool valid(uint32_t slots, uint32_t slot_size);
+
+ private:
+  ShmRegion() = default;
+
+  int _memfd = -1;
+  int _submit_fd = -1;
+  int _complete_fd = -1;
+  uint8_t* _base = nullptr;
+  size_t _size = 0;
+  uint32_t _slot_count = 0;
+  uint32_t _slot_size = 0;
+  uint8_t* _slots = nullptr;
+  std::unique_ptr<ShmRing> _submissions;
+  std::unique_ptr<ShmRing> _completions;
+
+  // Offsets of the rings and slots in a region of slots
+  static size_t _ring_offset(uint32_t ring, uint32_t slots);
+  static size_t _slots_offset(uint32_t slots);
+  bool _map(boost::system::error_code& ec);
+};
+
+}  // namespace cppserver
@@ -20,6 +20,13 @@
 //
 #include "tcp_server.h"
 
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <filesystem>
 #include <iostream>
 
 #include "logger_scoped.h"
@@ -27,19 +34,54 @@
 
 namespace cppserver {
 
-TCPServer::TCPServer(std::shared_ptr<Logger> logger, short port)
-    : _port(port),
+TCPServer::TCPServer(std::shared_ptr<Logger> logger, std::shared_ptr<Metrics> metrics, std::shared_ptr<BlockEngine> engine, uint16_t port,
+                     const TCPServerOptions& options)
+    : _options(options),
+      _timer_wheel(std::make_shared<TimerWheel>(std::chrono::milliseconds(options.timer_tick_ms))),
+      _dispatcher(options.dispatch_threads ? std::make_shared<Dispatcher>(metrics, options.dispatch_threads) : nullptr),
+      _tickets(options.ticket_lifetime ? std::make_shared<SessionTickets>(metrics, std::chrono::seconds(options.ticket_lifetime),
+                                                                         std::chrono::seconds(options.ticket_rotation))
+                                       : nullptr),
       _acceptor(_io_context, boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), port)),
-      _logger(std::make_shared<LoggerScoped>("server", logger)) {
+      _accept_backoff_timer(_io_context),
+      _unix_backoff_timer(_io_context),
+      _logger(std::make_shared<LoggerScoped>("server", logger)),
+      _metrics(metrics),
+      _engine(engine),
+      _sessions_accepted(metrics->counter("cppserver_sessions_accepted_total", "Total sessions accepted, over TCP or the Unix socket")),
+      _sessions_rejected(metrics->counter("cppserver_sessions_rejected_total", "Total connections refused at the session limit")),
+      _sessions_shed(metrics->counter("cppserver_sessions_shed_total", "Total connections refused over the accept rate limit")),
+      _sessions_denied(metrics->counter("cppserver_sessions_denied_total", "Total Unix socket connections refused for their peer's user")),
+      _accept_errors(metrics->counter("cppserver_accept_errors_total", "Total accept errors, over TCP or the Unix socket")) {
+  if (_options.max_accept_rate) _accept_bucket = std::make_unique<TokenBucket>(_options.max_accept_rate, _options.max_accept_rate);
   start_accept();
+
+  if (!_options.unix_path.empty()) {
+    // A socket left by a server that did not stop cleanly would fail the bind
+    std::error_code ec;
+    if (std::filesystem::is_socket(_options.unix_path, ec)) std::filesystem::remove(_options.unix_path, ec);
+    _unix_acceptor =
+        std::make_unique<boost::asio::local::stream_protocol::acceptor>(_io_context, boost::asio::local::stream_protocol::endpoint(_options.unix_path));
+    ::chmod(_options.unix_path.c_str(), _options.unix_mode);
+    _start_accept_unix();
+  }
 }
 
-TCPServer::~TCPServer() { stop(); }
+TCPServer::~TCPServer() {
+  stop();
+  if (_unix_acceptor) {
+    _unix_acceptor.reset();
+    std::error_code ec;
+    std::filesystem::remove(_options.unix_path, ec);
+  }
+}
 
 void TCPServer::start() {
   _logger->debug("Starting...");
+  _timer_wheel->start();
   _thread = std::make_shared<std::thread>([this]() { _io_context.run(); });
-  _logger->info("Listening on TCP " + std::to_string(_port));
+  _logger->info("Listening on TCP " + std::to_string(port()));
+  if (_unix_acceptor) _logger->info("Listening on Unix " + _options.unix_path);
 }
 
 void TCPServer::stop() {
@@ -51,6 +93,7 @@ void TCPServer::stop() {
       _thread->join();
       _thread.reset();
     }
+    _timer_wheel->stop();
     _logger->info("Stopped");
   }
 }
@@ -61,20 +104,102 @@ void TCPServer::start_accept() {
   _acceptor.async_accept(*new_connection, boost::bind(&TCPServer::_handle_accept, this, boost::asio::placeholders::error, new_connection));
 }
 
+void TCPServer::_start_accept_unix() {
+  auto new_connection = std::make_shared<boost::asio::local::stream_protocol::socket>(_io_context);
+
+  _unix_acceptor->async_accept(*new_connection, boost::bind(&TCPServer::_handle_accept_unix, this, boost::asio::placeholders::error, new_connection));
+}
+
+void TCPServer::_accept_failed(const boost::system::error_code& error, boost::asio::steady_timer& timer, uint32_t& backoff_ms, std::function<void()> retry) {
+  _accept_errors->inc();
+
+  // Errors such as EMFILE are usually transient, retry once sessions have had a chance to close
+  backoff_ms = std::min<uint32_t>(backoff_ms ? backoff_ms * 2 : TCP_SERVER_ACCEPT_BACKOFF_MIN_MS, TCP_SERVER_ACCEPT_BACKOFF_MAX_MS);
+  _logger->error("Error accepting new connection (" + error.what() + "), retrying in " + std::to_string(backoff_ms) + "ms");
+
+  timer.expires_after(std::chrono::milliseconds(backoff_ms));
+  timer.async_wait([retry](const boost::system::error_code& ec) {
+    if (!ec) retry();
+  });
+}
+
 void TCPServer::_handle_accept(const boost::system::error_code& error, std::shared_ptr<boost::asio::ip::tcp::socket> new_connection) {
-  if (!error) {
+  if (error) {
+    if (error == boost::asio::error::operation_aborted) return;
+    _accept_failed(error, _accept_backoff_timer, _accept_backoff_ms, [this]() { start_accept(); });
+    return;
+  }
+  _accept_backoff_ms = 0;
+
+  boost::system::error_code ec;
+  auto endpoint = new_connection->remote_endpoint(ec);
+  std::string peer = endpoint.address().to_string() + ":" + std::to_string(endpoint.port());
+  _admit(std::make_shared<boost::asio::generic::stream_protocol::socket>(std::move(*new_connection)), peer);
+
+  // Start accepting another connection
+  start_accept();
+}
+
+void TCPServer::_handle_accept_unix(const boost::system::error_code& error, std::shared_ptr<boost::asio::local::stream_protocol::socket> new_connection) {
+  if (error) {
+    if (error == boost::asio::error::operation_aborted) return;
+    _accept_failed(error, _unix_backoff_timer, _unix_backoff_ms, [this]() { _start_accept_unix(); });
+    return;
+  }
+  _unix_backoff_ms = 0;
+
+  auto connection = std::make_shared<boost::asio::generic::stream_protocol::socket>(std::move(*new_connection));
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+  if (::getsockopt(connection->native_handle(), SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0) {
+    _logger->error("Error reading peer credentials (" + std::string(std::strerror(errno)) + ")");
+    boost::system::error_code ec;
+    connection->close(ec);
+  } else if (!_options.unix_uids.empty() && std::find(_options.unix_uids.begin(), _options.unix_uids.end(), cred.uid) == _options.unix_uids.end()) {
+    _sessions_denied->inc();
+    _shed(connection, "Permission denied for uid " + std::to_string(cred.uid));
+  } else {
+    _admit(connection, "pid " + std::to_string(cred.pid) + " uid " + std::to_string(cred.uid));
+  }
+
+  // Start accepting another connection
+  _start_accept_unix();
+}
+
+void TCPServer::_admit(std::shared_ptr<boost::asio::generic::stream_protocol::socket> connection, const std::string& peer) {
+  if (_options.max_sessions && _connections.size() >= _options.max_sessions) {
+    _sessions_rejected->inc();
+    _shed(connection, "Too many sessions");
+  } else if (_accept_bucket && !_accept_bucket->try_take()) {
+    _sessions_shed->inc();
+    _shed(connection, "Too many connections");
+  } else {
     // Add the new connection to the map
     int id = next_connection_id_++;
+    _logger->info("New Connection #" + std::to_string(id) + " (" + peer + ")");
 
-    _connections[id] = std::make_shared<TCPSession>(_logger, new_connection);
+    // Finished sessions are removed on this thread, which joins the session thread
+    _connections[id] = std::make_shared<TCPSession>(_logger, _metrics, _timer_wheel, _dispatcher, _tickets, _engine, _options.session, connection, peer,
+                                                    [this, id]() { boost::asio::post(_io_context, [this, id]() { _connections.erase(id); }); });
+    _sessions_accepted->inc();
+  }
+}
 
-    _logger->info("New Connection #" + std::to_string(id) + " (" + new_connection->remote_endpoint().address().to_string() + ")");
+void TCPServer::_shed(std::shared_ptr<boost::asio::generic::stream_protocol::socket> connection, const std::string& reason) {
+  boost::system::error_code ec;
+  _logger->debug("Refused Connection (" + reason + ")");
 
-    // Start accepting another connection
-    start_accept();
-  } else {
-    _logger->error("Error accepting new connection");
+  // Never block the accept thread, a fresh socket has room for one small frame
+  if (_options.shed_mode == SHED_BUSY) {
+    uint8_t packed[FRAME_HEADER_SIZE];
+    FrameHeader(OP_BUSY, 0, reason.size(), 0).pack(packed);
+    std::array<boost::asio::const_buffer, 2> buffers = {boost::asio::buffer(packed), boost::asio::buffer(reason)};
+
+    connection->non_blocking(true, ec);
+    connection->send(buffers, 0, ec);
   }
+
+  connection->close(ec);
 }
 
 }  // namespace cppserver
@@ -23,35 +23,106 @@
 #include <boost/asio.hpp>
 #include <boost/bind/bind.hpp>
 #include <memory>
+#include <string>
 #include <thread>
 #include <unordered_map>
+#include <vector>
 
+#include "block_engine.h"
+#include "dispatcher.h"
 #include "logger.h"
+#include "metrics.h"
 #include "server.h"
+#include "session_tickets.h"
 #include "tcp_session.h"
+#include "timer_wheel.h"
+#include "token_bucket.h"
 
 namespace cppserver {
 
+// Accept error backoff, doubling from min to max until an accept succeeds
+#define TCP_SERVER_ACCEPT_BACKOFF_MIN_MS 10
+#define TCP_SERVER_ACCEPT_BACKOFF_MAX_MS 1000
+
+// How connections refused by admission control are turned away
+enum ShedMode {
+  SHED_CLOSE,  // Close immediately
+  SHED_BUSY,   // Send an OP_BUSY frame, then close
+};
+
+class TCPServerOptions {
+ public:
+  uint32_t timer_tick_ms = 10;      // Granularity of every session deadline
+  uint32_t max_sessions = 0;        // Refuse connections while this many sessions are open, 0 for no limit
+  uint32_t max_accept_rate = 0;     // Refuse connections arriving faster than this per second, 0 for no limit
+  uint32_t dispatch_threads = 8;    // Workers running requests from every session, 0 for each session to run its own in order
+  uint32_t ticket_lifetime = 3600;  // Seconds a session can be resumed from the ticket it was given at attach, 0 to give none
+  uint32_t ticket_rotation = 3600;  // Seconds between new secrets for sealing tickets
+  ShedMode shed_mode = SHED_BUSY;
+  std::string unix_path;              // Also listen on a Unix stream socket at this path, empty for TCP only
+  uint32_t unix_mode = 0660;          // Permissions of the Unix socket
+  std::vector<uint32_t> unix_uids;    // Only serve Unix peers running as one of these users, by SO_PEERCRED, empty for any
+  TCPSessionOptions session;
+};
+
+// Serves sessions over TCP and optionally a Unix stream socket, for clients
+// on the same host, at once. Connections from both share the session limits,
+// dispatch workers and tickets. A Unix peer's credentials are taken from
+// SO_PEERCRED and name its session in logs.
 class TCPServer : public Server {
  public:
-  TCPServer(std::shared_ptr<Logger> logger, short port);
+  TCPServer(std::shared_ptr<Logger> logger, std::shared_ptr<Metrics> metrics, std::shared_ptr<BlockEngine> engine, uint16_t port,
+            const TCPServerOptions& options);
   ~TCPServer();
 
   virtual void start();
   virtual void stop();
 
+  // The TCP port listened on, the one chosen if constructed with port 0
+  uint16_t port() const { return _acceptor.local_endpoint().port(); }
+
  private:
   void _handle_accept(const boost::system::error_code &error, std::shared_ptr<boost::asio::ip::tcp::socket> new_connection);
   void start_accept();
+  void _handle_accept_unix(const boost::system::error_code& error, std::shared_ptr<boost::asio::local::stream_protocol::socket> new_connection);
+  void _start_accept_unix();
+  // Back off before retry accepts again after an error, doubling backoff_ms each time
+  void _accept_failed(const boost::system::error_code& error, boost::asio::steady_timer& timer, uint32_t& backoff_ms, std::function<void()> retry);
+  // Start a session unless admission control refuses it
+  void _admit(std::shared_ptr<boost::asio::generic::stream_protocol::socket> connection, const std::string& peer);
+  void _shed(std::shared_ptr<boost::asio::generic::stream_protocol::socket> connection, const std::string& reason);
+
+  TCPServerOptions _options;
+
+  // Shared by all sessions, declared before _connections so they outlive them
+  std::shared_ptr<TimerWheel> _timer_wheel;
+  std::shared_ptr<Dispatcher> _dispatcher;
+  std::shared_ptr<SessionTickets> _tickets;
 
   boost::asio::io_context _io_context;
   boost::asio::ip::tcp::acceptor _acceptor;
+  std::unique_ptr<boost::asio::local::stream_protocol::acceptor> _unix_acceptor;
   std::unordered_map<int, std::shared_ptr<TCPSession>> _connections;
+
+  // Admission control, only touched on the accept thread
+  std::unique_ptr<TokenBucket> _accept_bucket;
+  boost::asio::steady_timer _accept_backoff_timer;
+  uint32_t _accept_backoff_ms = 0;
+  boost::asio::steady_timer _unix_backoff_timer;
+  uint32_t _unix_backoff_ms = 0;
+
   int next_connection_id_ = 0;
-  uint16_t _port;
   std::shared_ptr<std::thread> _thread;
 
   std::shared_ptr<Logger> _logger;
+  std::shared_ptr<Metrics> _metrics;
+  std::shared_ptr<BlockEngine> _engine;
+
+  std::shared_ptr<Counter> _sessions_accepted;
+  std::shared_ptr<Counter> _sessions_rejected;
+  std::shared_ptr<Counter> _sessions_shed;
+  std::shared_ptr<Counter> _sessions_denied;
+  std::shared_ptr<Counter> _accept_errors;
 };
 
 }  // namespace cppserver
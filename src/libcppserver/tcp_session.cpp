@@ -20,6 +20,11 @@
 //
 #include "tcp_session.h"
 
+#include <poll.h>
+#include <sys/socket.h>
+
+#include <chrono>
+#include <cstring>
 #include <functional>
 #include <iostream>
 
@@ -27,13 +32,38 @@
 
 namespace cppserver {
 
-TCPSession::TCPSession(std::shared_ptr<Logger> logger, std::shared_ptr<boost::asio::ip::tcp::socket> connection)
-    : _connection(connection),
-      _logger(std::make_unique<LoggerScoped>(connection->remote_endpoint().address().to_string() + ":" + std::to_string(connection->remote_endpoint().port()),
-                                             logger)),
+// Move an accepted socket onto another io_context
+static std::shared_ptr<boost::asio::generic::stream_protocol::socket> adopt_socket(boost::asio::io_context& io_context,
+                                                                                 boost::asio::generic::stream_protocol::socket& socket) {
+  auto protocol = socket.local_endpoint().protocol();
+  return std::make_shared<boost::asio::generic::stream_protocol::socket>(io_context, protocol, socket.release());
+}
+
+TCPSession::TCPSession(std::shared_ptr<Logger> logger, std::shared_ptr<Metrics> metrics, std::shared_ptr<TimerWheel> timer_wheel,
+                       std::shared_ptr<Dispatcher> dispatcher, std::shared_ptr<SessionTickets> tickets, std::shared_ptr<BlockEngine> engine,
+                       const TCPSessionOptions& options, std::shared_ptr<boost::asio::generic::stream_protocol::socket> connection, const std::string& peer,
+                       std::function<void()> on_closed)
+    : _logger(std::make_unique<LoggerScoped>(peer, logger)),
       _running(false),
-      _thread(std::make_unique<std::thread>(std::bind(&TCPSession::_execute, this, 0))),
-      _rx_timer(_rx_wait_context, boost::asio::chrono::seconds(10)) {}
+      _on_closed(on_closed),
+      _connection(adopt_socket(_rx_wait_context, *connection)),
+      _rx_buffer(std::make_shared<std::vector<uint8_t>>()),
+      _timer_wheel(timer_wheel),
+      _options(options),
+      _metrics(metrics),
+      _engine(engine),
+      _tickets(tickets),
+      _dispatcher(options.max_in_flight > 1 ? dispatcher : nullptr),
+      _sessions_active(metrics->gauge("cppserver_sessions_active", "Block protocol sessions currently open")),
+      _requests_in_flight(metrics->gauge("cppserver_session_requests_in_flight", "Requests from sessions running on dispatch workers")),
+      _bytes_read(metrics->counter("cppserver_session_bytes_read_total", "Total bytes read from sessions")),
+      _read_timeouts(metrics->counter("cppserver_session_read_timeouts_total", "Total session reads that timed out")),
+      _idle_timeouts(metrics->counter("cppserver_session_idle_timeouts_total", "Total sessions closed for being idle")),
+      _frames(metrics->counter("cppserver_session_frames_total", "Total frames received from sessions")),
+      _read_latency(metrics->latency("cppserver_session_read_latency_seconds", "Time for a session read to complete")),
+      _frame_latency(metrics->latency("cppserver_session_frame_latency_seconds", "Time to handle a frame received from a session")),
+      _output(std::make_unique<OutputQueue>(metrics, timer_wheel, _connection->native_handle(), options.output)),
+      _thread(std::make_unique<std::thread>(std::bind(&TCPSession::_execute, this, 0))) {}
 
 TCPSession::~TCPSession() { close(); }
 
@@ -42,32 +72,68 @@ void TCPSession::close() {
     // Signal Thread
     _running = false;
 
-    // Cancel reading
-    _rx_timer.cancel();
-    _connection->close();
+    // Fail a write blocked on a peer that is not reading
+    _output->close();
+
+    // Cancel reading on the session thread, which owns the socket and closes it once no request is in flight
+    boost::asio::post(_rx_wait_context, [this]() {
+      boost::system::error_code ec;
+      _connection->cancel(ec);
+    });
+
+    // Or wake it from waiting on the submission ring
+    int wake_fd = _shm_wake_fd;
+    if (wake_fd >= 0) {
+      uint64_t one = 1;
+      (void)!::write(wake_fd, &one, sizeof(one));
+    }
   }
 
   // Wait for thread quit
   if (_thread->joinable()) {
     _thread->join();
   }
+
+  // Once cancelled no deadline callback can still reference this session
+  _timer_wheel->cancel(_rx_deadline);
+  _timer_wheel->cancel(_idle_deadline);
+}
+
+void TCPSession::_arm_idle_deadline() {
+  if (!_options.idle_timeout_ms) return;
+
+  _timer_wheel->arm(_idle_deadline, std::chrono::milliseconds(_options.idle_timeout_ms), [this]() {
+    boost::asio::post(_rx_wait_context, [this]() {
+      _idle = true;
+      boost::system::error_code ec;
+      _connection->cancel(ec);
+    });
+  });
 }
 
 void TCPSession::_execute(int id) {
   _running = true;
+  _sessions_active->inc();
 
   _logger->info("Connected");
-
-  char buffer[65535];
+  _arm_idle_deadline();
 
   while (_running) {
     boost::system::error_code ec;
 
-    ssize_t len = _read_with_timeout(buffer, 65535, 5000, ec);
+    // Make room for a full read after any partial frame
+    if (_rx_buffer->size() - _rx_len < TCP_SESSION_READ_SIZE) _rx_buffer->resize(_rx_len + TCP_SESSION_READ_SIZE);
+
+    ssize_t len = _read_with_timeout(_rx_buffer->data() + _rx_len, _rx_buffer->size() - _rx_len, _options.read_timeout_ms, ec);
 
-    if (ec) {
+    if (_idle) {
+      _logger->info("Closing (Idle)");
+      _idle_timeouts->inc();
+      _running = false;
+    } else if (ec) {
       if (ec == boost::asio::error::operation_aborted) {
         // Timed out, normal operation
+        _read_timeouts->inc();
       } else if (ec == boost::asio::error::eof) {
         _logger->info("Remote Closed Connection");
         _running = false;
@@ -76,26 +142,546 @@ void TCPSession::_execute(int id) {
         _running = false;
       }
     } else {
+      _bytes_read->inc(len);
       _logger->debug("Read " + std::to_string(len) + " bytes");
+
+      _rx_len += len;
+      if (!_process_frames()) _running = false;
+      _arm_idle_deadline();
+
+      if (_shm) {
+        _timer_wheel->cancel(_idle_deadline);
+        _serve_shm();
+        _running = false;
+      }
     }
   }
 
+  // Requests in flight may still be writing their responses
+  _wait_in_flight(0);
+
   if (_connection->is_open()) {
-    _connection->close();
+    boost::system::error_code ec;
+    _connection->close(ec);
   }
 
+  _output->close();
+  _sessions_active->dec();
   _logger->info("Closed");
+
+  if (_on_closed) _on_closed();
+}
+
+bool TCPSession::_process_frames() {
+  size_t offset = 0;
+
+  // Frames after SHM are not read
+  while (!_shm && _rx_len - offset >= FRAME_HEADER_SIZE) {
+    FrameHeader header;
+    if (!header.parse(_rx_buffer->data() + offset)) {
+      _logger->error("Closing (Bad frame header)");
+      return false;
+    }
+
+    // Wait for the rest of the payload
+    if (_rx_len - offset < FRAME_HEADER_SIZE + header.length) break;
+
+    ScopedLatency frame_timer(*_frame_latency);
+    _frames->inc();
+    if (!_handle_frame(header, BufferRef(_rx_buffer, offset + FRAME_HEADER_SIZE, header.length))) return false;
+
+    offset += FRAME_HEADER_SIZE + header.length;
+  }
+
+  // Write every response to this read together
+  if (!_flush()) return false;
+
+  // Move any partial frame to the front of the buffer
+  if (offset) {
+    if (_rx_buffer.use_count() > 1) {
+      // Queued output still references this buffer, carry on in a new one
+      auto buffer = std::make_shared<std::vector<uint8_t>>(_rx_len - offset + TCP_SESSION_READ_SIZE);
+      std::memcpy(buffer->data(), _rx_buffer->data() + offset, _rx_len - offset);
+      _rx_buffer = buffer;
+    } else {
+      std::memmove(_rx_buffer->data(), _rx_buffer->data() + offset, _rx_len - offset);
+    }
+    _rx_len -= offset;
+  }
+
+  return true;
+}
+
+bool TCPSession::_handle_frame(const FrameHeader& header, BufferRef payload) {
+  switch (header.opcode) {
+    case OP_ECHO:
+      return _send_frame(FrameHeader(OP_ECHO, 0, header.length, header.tag), payload);
+    case OP_HELLO:
+      return _handle_hello(header, payload);
+    case OP_RESUME:
+      return _handle_resume(header, payload);
+    case OP_ATTACH:
+      return _handle_attach(header, payload);
+    case OP_SHM:
+      return _handle_shm(header, payload);
+    case OP_READ:
+      return _handle_read(header, payload);
+    case OP_WRITE:
+      return _handle_write(header, payload);
+    case OP_TRIM:
+      return _handle_trim(header, payload);
+    case OP_FLUSH:
+      return _handle_flush(header);
+    case OP_SNAPSHOT:
+      return _handle_snapshot(header);
+    default:
+      return _send_error(header, "Unknown opcode " + std::to_string(header.opcode));
+  }
+}
+
+Hello TCPSession::_server_hello() const {
+  uint32_t capabilities = (_dispatcher ? uint32_t(CAP_OUT_OF_ORDER) : 0) | (_options.compression ? uint32_t(CAP_COMPRESSION) : 0);
+  return Hello(Version(CPPSERVER_VERSION_MAJOR, CPPSERVER_VERSION_MINOR, CPPSERVER_VERSION_PATCH), capabilities, FRAME_MAX_PAYLOAD,
+               _dispatcher ? _options.max_in_flight : 1);
+}
+
+bool TCPSession::_handle_hello(const FrameHeader& header, const BufferRef& payload) {
+  Hello client;
+  if (!client.parse(payload.data(), payload.size())) return _send_error(header, "Bad hello request");
+
+  // Requests in flight were started under the previous agreement
+  _wait_in_flight(0);
+  _hello = _server_hello().agree(client);
+  _logger->debug("Hello from client " + client.version.to_string() + ", capabilities " + std::to_string(_hello.capabilities) + ", max in flight " +
+                 std::to_string(_hello.max_in_flight));
+
+  auto response = std::make_shared<std::vector<uint8_t>>(HELLO_SIZE);
+  _hello.pack(response->data());
+  return _send_frame(FrameHeader(OP_HELLO, 0, response->size(), header.tag), BufferRef(response));
+}
+
+bool TCPSession::_handle_attach(const FrameHeader& header, const BufferRef& payload) {
+  if (payload.size() != ATTACH_REQUEST_SIZE) return _send_error(header, "Bad attach request");
+  if (!_engine) return _send_error(header, "No devices");
+
+  // Requests in flight use the device and codec being replaced
+  _wait_in_flight(0);
+  return _attach(header, OP_ATTACH, get_u64(payload.data()), get_u64(payload.data() + 8), header.flags, false);
+}
+
+bool TCPSession::_handle_resume(const FrameHeader& header, const BufferRef& payload) {
+  if (!_engine || !_tickets) return _send_error(header, "No tickets");
+
+  SessionTicket ticket;
+  std::string error;
+  if (!_tickets->redeem(payload.data(), payload.size(), ticket, error)) {
+    _logger->debug("Resume refused (" + error + ")");
+    return _send_error(header, error);
+  }
+
+  _wait_in_flight(0);
+  // Agreed again in case this server now supports less
+  _hello = _server_hello().agree(ticket.hello);
+  return _attach(header, OP_RESUME, ticket.host_id, ticket.device_id, (ticket.attach_flags & ATTACH_COMPRESSED) | (header.flags & ATTACH_TICKET), true);
+}
+
+bool TCPSession::_attach(const FrameHeader& header, uint8_t opcode, uint64_t host_id, uint64_t device_id, uint8_t flags, bool resumed) {
+  std::string owner;
+  if (!_engine->owns(device_id, owner)) {
+    _host.reset();
+    _device.reset();
+    if (owner.empty()) return _send_error(header, "No node serves device " + std::to_string(device_id));
+    _logger->info("Redirected device " + std::to_string(device_id) + " to " + owner);
+    auto response = std::make_shared<std::vector<uint8_t>>(owner.begin(), owner.end());
+    return _send_frame(FrameHeader(OP_REDIRECT, 0, response->size(), header.tag), BufferRef(response));
+  }
+
+  std::string error;
+  bool attached = resumed ? _engine->resume(host_id, device_id, _host, _device, error) : _engine->attach(host_id, device_id, _host, _device, error);
+  if (!attached) {
+    _host.reset();
+    _device.reset();
+    _logger->warn("Attach failed (" + error + ")");
+    return _send_error(header, error);
+  }
+  _logger->info(std::string(resumed ? "Resumed" : "Attached") + " host " + std::to_string(_host->host.id) + " to device " +
+                std::to_string(_device->device.id));
+  _read_stream.reset();
+
+  bool compressed = (flags & ATTACH_COMPRESSED) && _options.compression;
+  _codec = compressed ? std::make_unique<BlockCodec>(_metrics, "wire", _device->device.block_size) : nullptr;
+
+  auto response = std::make_shared<std::vector<uint8_t>>();
+  response->reserve(HELLO_SIZE + ATTACH_RESPONSE_SIZE + SESSION_TICKET_SIZE);
+  if (resumed) {
+    response->resize(HELLO_SIZE);
+    _hello.pack(response->data());
+  }
+  size_t offset = response->size();
+  response->resize(offset + ATTACH_RESPONSE_SIZE);
+  uint8_t* ptr = response->data() + offset;
+  put_u32(ptr, _device->device.block_size);
+  put_u64(ptr + 4, _device->device.block_total);
+  ptr[12] = (_device->device.read_only ? ATTACH_READ_ONLY : 0) | (compressed ? ATTACH_COMPRESSED : 0);
+
+  if ((flags & ATTACH_TICKET) && _tickets) {
+    SessionTicket ticket;
+    ticket.host_id = _host->host.id;
+    ticket.device_id = _device->device.id;
+    ticket.attach_flags = ptr[12];
+    ticket.hello = _hello;
+    // Without a ticket the client attaches again next time
+    if (_tickets->issue(ticket, *response)) {
+      (*response)[offset + 12] |= ATTACH_TICKET;
+    } else {
+      _logger->error("Cannot seal a resumption ticket");
+    }
+  }
+  return _send_frame(FrameHeader(opcode, 0, response->size(), header.tag), BufferRef(response));
+}
+
+bool TCPSession::_handle_read(const FrameHeader& header, const BufferRef& payload) {
+  if (!_device) return _send_error(header, "Not attached");
+  if (payload.size() != READ_REQUEST_SIZE) return _send_error(header, "Bad read request");
+
+  uint64_t block = get_u64(payload.data());
+  uint32_t count = get_u32(payload.data() + 8);
+  uint64_t len = uint64_t(count) * _device->device.block_size;
+  uint64_t response_len = _codec ? _codec->records_bound(count) : len;
+  if (!_device->valid_range(block, count) || response_len > _hello.max_payload) return _send_error(header, "Bad read range");
+
+  _engine->throttle(*_host, *_device, len);
+
+  // Blocks of a raw read only image go from the file to the socket, unless they are to be compressed or copied into a slot.
+  // A read only device has no snapshot to read, that still fails below.
+  int fd;
+  off_t offset;
+  if (_options.zero_copy && !_codec && !_shm && !(header.flags & READ_SNAPSHOT) && count > 0 && _device->file_range(block, count, fd, offset)) {
+    return _send_frame(FrameHeader(OP_READ, 0, len, header.tag), BufferRef::file(_device, fd, offset, len));
+  }
+
+  // Read-ahead fills the cache, which holds the current blocks rather than the snapshot's
+  if (!(header.flags & READ_SNAPSHOT)) _engine->read_ahead(_device, _read_stream, block, count);
+
+  // The response references the read buffer directly
+  auto data = std::make_shared<std::vector<uint8_t>>(len);
+
+  // Blocks all in the cache are answered here, handing them to a worker would cost more than the read
+  if (_hello.max_in_flight > 1 && !(header.flags & READ_SNAPSHOT) && _device->read_hit(block, count, data->data())) {
+    return _send_read(header, data, _codec.get(), count);
+  }
+
+  return _run([this, header, device = _device, codec = _codec.get(), data, block, count]() {
+    boost::system::error_code ec;
+    bool read = header.flags & READ_SNAPSHOT ? device->read_snapshot(block, count, data->data(), ec) : device->read(block, count, data->data(), ec);
+    if (!read) return _send_error(header, "Read failed: " + ec.message());
+    return _send_read(header, data, codec, count);
+  });
+}
+
+bool TCPSession::_send_read(const FrameHeader& header, std::shared_ptr<std::vector<uint8_t>> data, BlockCodec* codec, uint32_t count) {
+  if (codec) {
+    auto records = std::make_shared<std::vector<uint8_t>>();
+    codec->encode_records(data->data(), count, *records);
+    data = records;
+  }
+  return _send_frame(FrameHeader(OP_READ, 0, data->size(), header.tag), BufferRef(data));
+}
+
+bool TCPSession::_handle_write(const FrameHeader& header, const BufferRef& payload) {
+  if (!_device) return _send_error(header, "Not attached");
+  if (payload.size() < WRITE_REQUEST_HEADER_SIZE) return _send_error(header, "Bad write request");
+
+  uint64_t block = get_u64(payload.data());
+  const uint8_t* data = payload.data() + WRITE_REQUEST_HEADER_SIZE;
+  uint64_t len = payload.size() - WRITE_REQUEST_HEADER_SIZE;
+  // Compressed writes are decoded into their own buffer, as requests in flight together each need one
+  std::shared_ptr<std::vector<uint8_t>> decoded;
+  if (header.flags & WRITE_COMPRESSED) {
+    // Decoded no larger than an uncompressed write could be
+    decoded = std::make_shared<std::vector<uint8_t>>();
+    if (!_codec || !_codec->decode_records(data, len, FRAME_MAX_PAYLOAD / _device->device.block_size, *decoded)) {
+      return _send_error(header, "Bad compressed write request");
+    }
+    data = decoded->data();
+    len = decoded->size();
+  } else if (len % _device->device.block_size) {
+    return _send_error(header, "Bad write request");
+  }
+
+  uint32_t count = len / _device->device.block_size;
+  if (!_device->valid_range(block, count)) return _send_error(header, "Bad write range");
+
+  _engine->throttle(*_host, *_device, len);
+
+  // The payload reference keeps the received data alive until the write completes
+  return _run([this, header, device = _device, payload, decoded, block, count, data]() {
+    boost::system::error_code ec;
+    if (!device->write(block, count, data, header.flags & WRITE_FUA, ec)) {
+      return _send_error(header, "Write failed: " + ec.message());
+    }
+
+    return _send_frame(FrameHeader(OP_WRITE, 0, 0, header.tag), BufferRef());
+  });
+}
+
+bool TCPSession::_handle_trim(const FrameHeader& header, const BufferRef& payload) {
+  if (!_device) return _send_error(header, "Not attached");
+  if (payload.size() != TRIM_REQUEST_SIZE) return _send_error(header, "Bad trim request");
+
+  uint64_t block = get_u64(payload.data());
+  uint32_t count = get_u32(payload.data() + 8);
+  if (!_device->valid_range(block, count)) return _send_error(header, "Bad trim range");
+
+  // A trim moves no data, it only counts against IOPS limits
+  _engine->throttle(*_host, *_device, 0);
+
+  return _run([this, header, device = _device, block, count]() {
+    boost::system::error_code ec;
+    if (!device->trim(block, count, ec)) return _send_error(header, "Trim failed: " + ec.message());
+
+    return _send_frame(FrameHeader(OP_TRIM, 0, 0, header.tag), BufferRef());
+  });
+}
+
+bool TCPSession::_handle_flush(const FrameHeader& header) {
+  if (!_device) return _send_error(header, "Not attached");
+  _wait_in_flight(0);
+
+  boost::system::error_code ec;
+  if (!_device->flush(ec)) return _send_error(header, "Flush failed: " + ec.message());
+
+  return _send_frame(FrameHeader(OP_FLUSH, 0, 0, header.tag), BufferRef());
+}
+
+bool TCPSession::_handle_snapshot(const FrameHeader& header) {
+  if (!_device) return _send_error(header, "Not attached");
+  _wait_in_flight(0);
+
+  boost::system::error_code ec;
+  if (header.flags & SNAPSHOT_DELETE) {
+    if (!_device->delete_snapshot(ec)) return _send_error(header, "Snapshot delete failed: " + ec.message());
+  } else if (!_device->snapshot(ec)) {
+    return _send_error(header, "Snapshot failed: " + ec.message());
+  }
+
+  return _send_frame(FrameHeader(OP_SNAPSHOT, 0, 0, header.tag), BufferRef());
+}
+
+bool TCPSession::_handle_shm(const FrameHeader& header, const BufferRef& payload) {
+  if (payload.size() != SHM_REQUEST_SIZE) return _send_error(header, "Bad shm request");
+  if (_connection->local_endpoint().protocol().family() != AF_UNIX) return _send_error(header, "Shared memory needs a Unix socket");
+
+  boost::system::error_code ec;
+  auto region = ShmRegion::create(get_u32(payload.data()), get_u32(payload.data() + 4), ec);
+  if (!region) return _send_error(header, "Cannot create shared memory: " + ec.message());
+
+  // Everything before goes through the socket
+  _wait_in_flight(0);
+  if (!_flush()) return false;
+
+  uint8_t response[FRAME_HEADER_SIZE + SHM_REQUEST_SIZE];
+  FrameHeader(OP_SHM, 0, SHM_REQUEST_SIZE, header.tag).pack(response);
+  put_u32(response + FRAME_HEADER_SIZE, region->slots());
+  put_u32(response + FRAME_HEADER_SIZE + 4, region->slot_size());
+
+  int fds[3] = {region->memfd(), region->submit_fd(), region->complete_fd()};
+  alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(fds))] = {};
+  struct iovec iov = {response, sizeof(response)};
+  struct msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  std::memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+  // Written directly, as the fds go with the first byte sent
+  int fd = _connection->native_handle();
+  auto writable = [this, fd]() {
+    struct pollfd pfd = {fd, POLLOUT, 0};
+    return ::poll(&pfd, 1, _options.output.write_timeout_ms) > 0;
+  };
+  ssize_t sent;
+  while ((sent = ::sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT)) < 0 && (errno == EAGAIN || errno == EINTR) && writable()) {
+  }
+  while (sent >= 0 && size_t(sent) < sizeof(response)) {
+    ssize_t more = writable() ? ::send(fd, response + sent, sizeof(response) - sent, MSG_NOSIGNAL | MSG_DONTWAIT) : -1;
+    if (more > 0) sent += more;
+    if (more < 0 && errno != EAGAIN && errno != EINTR) sent = -1;
+  }
+  if (sent < 0) {
+    _logger->error("Closing (Error sending shared memory: " + std::string(std::strerror(errno)) + ")");
+    return false;
+  }
+
+  _logger->info("Moved onto shared memory, " + std::to_string(region->slots()) + " slots of " + std::to_string(region->slot_size()) + " bytes");
+  _hello.max_payload = region->slot_size();
+  _shm = std::move(region);
+  _shm_wake_fd = _shm->submit_fd();
+  return true;
+}
+
+void TCPSession::_serve_shm() {
+  ShmRing& submissions = _shm->submissions();
+  while (_running) {
+    bool hangup = false;
+    if (!submissions.wait(_connection->native_handle(), _options.read_timeout_ms, hangup)) {
+      if (!hangup) continue;
+
+      // The socket only carries the client going away
+      uint8_t byte;
+      if (::recv(_connection->native_handle(), &byte, 1, MSG_DONTWAIT) != -1 || (errno != EAGAIN && errno != EINTR)) {
+        _logger->info("Remote Closed Connection");
+        return;
+      }
+      continue;
+    }
+
+    ShmEntry entry;
+    while (_running && submissions.pop(entry)) {
+      FrameHeader header(entry.opcode, entry.flags, entry.length, entry.tag);
+      bool added;
+      {
+        std::lock_guard<std::mutex> lock(_shm_mutex);
+        added = entry.slot < _shm->slots() && entry.length <= _shm->slot_size() && _shm_slots.emplace(entry.tag, entry.slot).second;
+      }
+      if (!added) {
+        _logger->error("Closing (Bad submission)");
+        return;
+      }
+
+      ScopedLatency frame_timer(*_frame_latency);
+      _frames->inc();
+      // The slot stays the request's until its response, so its data is used where it is
+      if (!_handle_frame(header, BufferRef(_shm->slot(entry.slot), entry.length))) return;
+    }
+  }
+}
+
+bool TCPSession::_complete_shm(const FrameHeader& header, const BufferRef& payload) {
+  uint16_t slot;
+  {
+    std::lock_guard<std::mutex> lock(_shm_mutex);
+    auto it = _shm_slots.find(header.tag);
+    if (it == _shm_slots.end()) return false;
+    slot = it->second;
+    _shm_slots.erase(it);
+  }
+
+  ShmEntry entry = {header.tag, uint32_t(payload.size()), slot, header.opcode, header.flags};
+  uint8_t* data = _shm->slot(slot);
+  if (payload.size() > _shm->slot_size()) {
+    static const char message[] = "Response larger than a slot";
+    entry.opcode = OP_ERROR;
+    entry.length = sizeof(message) - 1;
+    std::memcpy(data, message, entry.length);
+  } else if (payload.data() != data) {
+    // An echo's payload is already there
+    std::memcpy(data, payload.data(), payload.size());
+  }
+
+  std::lock_guard<std::mutex> lock(_shm_mutex);
+  if (!_shm->completions().push(entry)) {
+    _logger->error("Closing (Completion ring full)");
+    return false;
+  }
+  _shm->completions().notify();
+  return true;
+}
+
+bool TCPSession::_run(std::function<bool()> request) {
+  if (!_dispatcher || _hello.max_in_flight <= 1) return request();
+
+  _wait_in_flight(_hello.max_in_flight - 1);
+  if (!_running) return false;
+  {
+    std::lock_guard<std::mutex> lock(_in_flight_mutex);
+    _in_flight++;
+  }
+  _requests_in_flight->inc();
+
+  _dispatcher->submit(_dispatch_queue, [this, request = std::move(request)]() {
+    // Responses are written as each request completes, or left to a worker already writing
+    if (!request() || !_flush(false)) {
+      _running = false;
+      boost::asio::post(_rx_wait_context, [this]() {
+        boost::system::error_code ec;
+        _connection->cancel(ec);
+      });
+    }
+    _requests_in_flight->dec();
+
+    // Notified under the lock, the session may be destroyed as soon as it is released
+    std::lock_guard<std::mutex> lock(_in_flight_mutex);
+    _in_flight--;
+    _in_flight_done.notify_all();
+  });
+  return true;
+}
+
+void TCPSession::_wait_in_flight(uint32_t count) {
+  std::unique_lock<std::mutex> lock(_in_flight_mutex);
+  _in_flight_done.wait(lock, [this, count]() { return _in_flight <= count; });
+}
+
+bool TCPSession::_send_error(const FrameHeader& header, const std::string& message) {
+  auto buffer = std::make_shared<std::vector<uint8_t>>(message.begin(), message.end());
+  return _send_frame(FrameHeader(OP_ERROR, 0, buffer->size(), header.tag), BufferRef(buffer));
+}
+
+bool TCPSession::_send_frame(const FrameHeader& header, BufferRef payload) {
+  if (_shm) return _complete_shm(header, payload);
+
+  boost::system::error_code ec;
+  if (!_output->push(header, std::move(payload), ec)) {
+    _log_write_error(ec);
+    return false;
+  }
+  return true;
+}
+
+bool TCPSession::_flush(bool wait) {
+  // Responses in the completion ring are already visible
+  if (_shm) return true;
+
+  boost::system::error_code ec;
+  if (!_output->flush(ec, wait)) {
+    _log_write_error(ec);
+    return false;
+  }
+  return true;
+}
+
+void TCPSession::_log_write_error(const boost::system::error_code& ec) {
+  if (ec == boost::asio::error::timed_out) {
+    _logger->error("Closing (Write timed out)");
+  } else if (ec) {
+    _logger->error("Closing (Error during write: " + ec.what() + ")");
+  }
 }
 
 ssize_t TCPSession::_read_with_timeout(void *ptr, size_t len, uint32_t timeout_ms, boost::system::error_code &ec) {
   if (!ptr || len == 0) return -1;  // Validate input parameters
 
   ssize_t rec_len = 0;
+  auto start = std::chrono::steady_clock::now();
 
-  // Set the timeout
-  _rx_timer.expires_after(boost::asio::chrono::milliseconds(timeout_ms));
+  // Set the timeout. The wheel callback hands the cancel to this thread, where
+  // it is ignored if it arrives after this read has already finished.
+  uint64_t generation = ++_rx_generation;
+  _timer_wheel->arm(_rx_deadline, std::chrono::milliseconds(timeout_ms), [this, generation]() {
+    boost::asio::post(_rx_wait_context, [this, generation]() {
+      if (generation != _rx_generation) return;
+      boost::system::error_code cancel_ec;
+      _connection->cancel(cancel_ec);
+    });
+  });
 
-  // Do the async read
+  // Do the async read, a timeout completes it with operation_aborted
   _connection->async_read_some(boost::asio::buffer(ptr, len), [&](const boost::system::error_code &error, std::size_t length) {
     if (!error) {
       rec_len = length;
@@ -103,25 +689,15 @@ ssize_t TCPSession::_read_with_timeout(void *ptr, size_t len, uint32_t timeout_m
       rec_len = -1;
     }
     ec = error;
-    _rx_timer.cancel();
-  });
-
-  // Set up the asynchronous wait on the _rx_timer
-  _rx_timer.async_wait([&](const boost::system::error_code &error) {
-    if (error) {
-      if (error == boost::asio::error::operation_aborted) {
-        // Normal operation.
-      }
-
-    } else {
-      _connection->cancel();
-      ec = boost::asio::error::operation_aborted;
-    }
   });
 
   // Wait for the timeout, or read to complete
   _rx_wait_context.run();
   _rx_wait_context.reset();
+  _timer_wheel->cancel(_rx_deadline);
+
+  // Only completed reads count, timeouts are tracked separately
+  if (rec_len > 0) _read_latency->record(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
 
   return static_cast<ssize_t>(rec_len);  // Successfully read 'length' bytes
 }
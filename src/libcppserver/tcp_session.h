@@ -23,18 +23,72 @@
 #include <atomic>
 #include <boost/asio.hpp>
 #include <boost/bind/bind.hpp>
+#include <condition_variable>
 #include <cstdint>
 #include <fstream>
+#include <functional>
+#include <mutex>
 #include <thread>
+#include <unordered_map>
+#include <vector>
 
+#include "block_codec.h"
+#include "block_engine.h"
+#include "dispatcher.h"
 #include "logger.h"
+#include "metrics.h"
+#include "output_queue.h"
+#include "protocol.h"
 #include "session.h"
+#include "session_tickets.h"
+#include "shm_ring.h"
+#include "timer_wheel.h"
 
 namespace cppserver {
 
+// Bytes requested from the socket per read
+#define TCP_SESSION_READ_SIZE 65535
+
+class TCPSessionOptions {
+ public:
+  uint32_t read_timeout_ms = 5000;    // Wake the session loop when nothing arrives for this long
+  uint32_t idle_timeout_ms = 0;       // Close a session that sends no frames for this long, 0 to disable
+  bool compression = true;            // Grant compressed transfers to clients that ask at attach
+  uint32_t max_in_flight = 32;        // Reads, writes and trims run at once on dispatch workers, 1 to run every request in order
+  bool zero_copy = true;              // Send reads of read only raw devices from the file with sendfile rather than through a buffer
+  OutputQueueOptions output;
+};
+
+// Serves one connection, over TCP or a Unix socket, named peer in its logs.
+// All session deadlines are timers on a TimerWheel shared by every session of
+// a server, rather than per-session asio timers.
+//
+// With a Dispatcher and a client agreeing CAP_OUT_OF_ORDER in HELLO, reads,
+// writes and trims are validated and throttled on the session thread in
+// arrival order, then run on the dispatch workers with up to the agreed
+// max_in_flight at once, each answered as soon as it completes. Like
+// any block device the order of overlapping requests in flight together is
+// undefined. Attach, flush and snapshot wait for every request in flight
+// first, so a flush covers every write received before it.
+//
+// With SessionTickets a client asking at ATTACH is given a ticket, and a later
+// session RESUMEs from it with one request, restoring the HELLO agreement and
+// attachment without the engine checking the host again.
+//
+// A session on a Unix socket can move onto a ShmRegion with SHM. Requests are
+// then taken from its submission ring and go through the same handlers, each
+// write's data used in place in its slot, and responses are copied into the
+// request's slot rather than queued for the socket.
+//
+// With zero_copy, reads of a device whose blocks never change, one read only,
+// uncompressed and unchecksummed, are answered with a range of its file that
+// the OutputQueue sends with sendfile, bypassing the block cache. Compressed
+// transfers and sessions on shared memory read the blocks as usual.
 class TCPSession : public Session {
  public:
-  TCPSession(std::shared_ptr<Logger> logger, std::shared_ptr<boost::asio::ip::tcp::socket> connection);
+  TCPSession(std::shared_ptr<Logger> logger, std::shared_ptr<Metrics> metrics, std::shared_ptr<TimerWheel> timer_wheel, std::shared_ptr<Dispatcher> dispatcher,
+             std::shared_ptr<SessionTickets> tickets, std::shared_ptr<BlockEngine> engine, const TCPSessionOptions& options,
+             std::shared_ptr<boost::asio::generic::stream_protocol::socket> connection, const std::string& peer, std::function<void()> on_closed);
   ~TCPSession();
 
   virtual void close();
@@ -42,16 +96,104 @@ class TCPSession : public Session {
  private:
   std::unique_ptr<Logger> _logger;
 
-  std::unique_ptr<std::thread> _thread;
   std::atomic<bool> _running;
 
-  std::shared_ptr<boost::asio::ip::tcp::socket> _connection;
+  // Called on the session thread once the session has finished
+  std::function<void()> _on_closed;
+
+  // The session's socket is moved onto _rx_wait_context so its handlers run on the session thread
+  boost::asio::io_context _rx_wait_context;
+  std::shared_ptr<boost::asio::generic::stream_protocol::socket> _connection;
 
   void _execute(int id);
   ssize_t _read_with_timeout(void* ptr, size_t len, uint32_t timeout_ms, boost::system::error_code& ec);
 
-  boost::asio::io_context _rx_wait_context;
-  boost::asio::steady_timer _rx_timer;
+  bool _process_frames();
+  bool _handle_frame(const FrameHeader& header, BufferRef payload);
+  bool _handle_hello(const FrameHeader& header, const BufferRef& payload);
+  bool _handle_attach(const FrameHeader& header, const BufferRef& payload);
+  bool _handle_resume(const FrameHeader& header, const BufferRef& payload);
+  // Attach to device and respond with opcode, first the HELLO agreement if resumed
+  bool _attach(const FrameHeader& header, uint8_t opcode, uint64_t host_id, uint64_t device_id, uint8_t flags, bool resumed);
+  // What this session supports, for the client's HELLO to agree with
+  Hello _server_hello() const;
+  bool _handle_read(const FrameHeader& header, const BufferRef& payload);
+  bool _send_read(const FrameHeader& header, std::shared_ptr<std::vector<uint8_t>> data, BlockCodec* codec, uint32_t count);
+  bool _handle_write(const FrameHeader& header, const BufferRef& payload);
+  bool _handle_trim(const FrameHeader& header, const BufferRef& payload);
+  bool _handle_flush(const FrameHeader& header);
+  bool _handle_snapshot(const FrameHeader& header);
+  bool _handle_shm(const FrameHeader& header, const BufferRef& payload);
+  // Serve requests from the submission ring until the client goes or the session closes
+  void _serve_shm();
+  // Answer a request from the submission ring in its slot
+  bool _complete_shm(const FrameHeader& header, const BufferRef& payload);
+  // Run a request's I/O on a dispatch worker if there is one, otherwise here. A request failing to send its response closes the session.
+  bool _run(std::function<bool()> request);
+  // Wait until at most count requests are in flight
+  void _wait_in_flight(uint32_t count);
+  bool _send_error(const FrameHeader& header, const std::string& message);
+  bool _send_frame(const FrameHeader& header, BufferRef payload);
+  bool _flush(bool wait = true);
+  void _log_write_error(const boost::system::error_code& ec);
+
+  // Received bytes not yet consumed as complete frames. Shared so responses can reference payloads in place.
+  std::shared_ptr<std::vector<uint8_t>> _rx_buffer;
+  size_t _rx_len = 0;
+
+  std::shared_ptr<TimerWheel> _timer_wheel;
+  TCPSessionOptions _options;
+  std::shared_ptr<Metrics> _metrics;
+
+  // Block I/O, once attached
+  std::shared_ptr<BlockEngine> _engine;
+  std::shared_ptr<BlockHost> _host;
+  std::shared_ptr<BlockDevice> _device;
+  ReadStream _read_stream;
+  std::shared_ptr<SessionTickets> _tickets;
+
+  // Set while compressed transfers are granted
+  std::unique_ptr<BlockCodec> _codec;
+
+  // What the client agreed to in HELLO, the baseline until then
+  Hello _hello;
+
+  // Set once the session has moved onto shared memory
+  std::unique_ptr<ShmRegion> _shm;
+  // Guards the completion ring, and the slot each request from the submission ring holds
+  std::mutex _shm_mutex;
+  std::unordered_map<uint64_t, uint16_t> _shm_slots;
+  // The submission ring's eventfd, for close() to wake the session with
+  std::atomic<int> _shm_wake_fd{-1};
+
+  std::shared_ptr<Dispatcher> _dispatcher;
+  Dispatcher::Queue _dispatch_queue;
+  std::mutex _in_flight_mutex;
+  std::condition_variable _in_flight_done;
+  uint32_t _in_flight = 0;
+
+  // Read deadlines are only acted on by the read that armed them
+  TimerWheel::Timer _rx_deadline;
+  uint64_t _rx_generation = 0;
+
+  TimerWheel::Timer _idle_deadline;
+  bool _idle = false;
+
+  void _arm_idle_deadline();
+
+  std::shared_ptr<Gauge> _sessions_active;
+  std::shared_ptr<Gauge> _requests_in_flight;
+  std::shared_ptr<Counter> _bytes_read;
+  std::shared_ptr<Counter> _read_timeouts;
+  std::shared_ptr<Counter> _idle_timeouts;
+  std::shared_ptr<Counter> _frames;
+  std::shared_ptr<LatencyHistogram> _read_latency;
+  std::shared_ptr<LatencyHistogram> _frame_latency;
+
+  std::unique_ptr<OutputQueue> _output;
+
+  // Declared last so the session thread only starts once every other member is constructed
+  std::unique_ptr<std::thread> _thread;
 };
 
 }  // namespace cppserver
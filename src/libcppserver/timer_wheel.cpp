@@ -0,0 +1,210 @@
+//
+// cppserver
+//
+// Copyright (C) 2024 Tom Cully
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301, USA.
+//
+#include "timer_wheel.h"
+
+#include <algorithm>
+
+namespace cppserver {
+
+TimerWheel::TimerWheel(std::chrono::milliseconds ptick) : tick(ptick) {
+  for (auto& slot : _root) _init_list(slot);
+  for (auto& wheel : _levels) {
+    for (auto& slot : wheel) _init_list(slot);
+  }
+  _init_list(_expired);
+}
+
+TimerWheel::~TimerWheel() { stop(); }
+
+void TimerWheel::start() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (_thread) return;
+  _running = true;
+  _origin = std::chrono::steady_clock::now();
+  _first = _current;
+  _thread = std::make_unique<std::thread>(&TimerWheel::_execute, this);
+}
+
+void TimerWheel::stop() {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (!_thread) return;
+    _running = false;
+  }
+  _fired.notify_all();
+
+  if (_thread->joinable()) _thread->join();
+  _thread.reset();
+}
+
+void TimerWheel::arm(Timer& timer, std::chrono::milliseconds delay, std::function<void()> callback) {
+  uint64_t ticks = (delay.count() + tick.count() - 1) / tick.count();
+  if (ticks == 0) ticks = 1;
+
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (timer.armed()) {
+    _unlink(timer);
+    _size--;
+  }
+
+  // Count from the tick due now, not one the thread has fallen behind on and
+  // will run straight through while catching up
+  uint64_t now = _current;
+  if (_thread) now = std::max(now, _first + (std::chrono::steady_clock::now() - _origin) / tick);
+  timer._expiry = now + ticks;
+  timer._callback = std::move(callback);
+  _place(timer);
+  _size++;
+}
+
+bool TimerWheel::cancel(Timer& timer) {
+  std::unique_lock<std::mutex> lock(_mutex);
+
+  if (timer.armed()) {
+    _unlink(timer);
+    _size--;
+    timer._callback = nullptr;
+    return true;
+  }
+
+  // Already fired, make sure its callback has finished unless we are that callback
+  if (_firing == &timer && _firing_thread != std::this_thread::get_id()) {
+    _fired.wait(lock, [&]() { return _firing != &timer; });
+  }
+  return false;
+}
+
+void TimerWheel::advance(uint64_t ticks) {
+  std::unique_lock<std::mutex> lock(_mutex);
+  for (uint64_t i = 0; i < ticks; i++) _tick(lock);
+}
+
+size_t TimerWheel::size() {
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _size;
+}
+
+void TimerWheel::_init_list(Node& head) { head.prev = head.next = &head; }
+
+void TimerWheel::_link(Node& head, Node& node) {
+  node.prev = head.prev;
+  node.next = &head;
+  head.prev->next = &node;
+  head.prev = &node;
+}
+
+void TimerWheel::_unlink(Node& node) {
+  node.prev->next = node.next;
+  node.next->prev = node.prev;
+  node.prev = node.next = nullptr;
+}
+
+void TimerWheel::_splice(Node& from, Node& to) {
+  if (from.next == &from) return;
+  from.next->prev = to.prev;
+  from.prev->next = &to;
+  to.prev->next = from.next;
+  to.prev = from.prev;
+  _init_list(from);
+}
+
+void TimerWheel::_place(Timer& timer) {
+  uint64_t delta = timer._expiry - _current;
+
+  if (delta < (1 << TIMER_WHEEL_ROOT_BITS)) {
+    _link(_root[timer._expiry & ((1 << TIMER_WHEEL_ROOT_BITS) - 1)], timer);
+    return;
+  }
+
+  // Clamp anything beyond the top wheel to its furthest slot
+  const uint64_t horizon = uint64_t(1) << (TIMER_WHEEL_ROOT_BITS + TIMER_WHEEL_LEVELS * TIMER_WHEEL_LEVEL_BITS);
+  if (delta >= horizon) timer._expiry = _current + horizon - 1;
+
+  for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+    int shift = TIMER_WHEEL_ROOT_BITS + level * TIMER_WHEEL_LEVEL_BITS;
+    if (delta < (uint64_t(1) << (shift + TIMER_WHEEL_LEVEL_BITS)) || level == TIMER_WHEEL_LEVELS - 1) {
+      _link(_levels[level][(timer._expiry >> shift) & ((1 << TIMER_WHEEL_LEVEL_BITS) - 1)], timer);
+      return;
+    }
+  }
+}
+
+void TimerWheel::_cascade(LevelWheel& wheel, size_t index) {
+  // Re-place every timer in the slot, they now fall into a lower wheel
+  Node pending;
+  _init_list(pending);
+  _splice(wheel[index], pending);
+
+  while (pending.next != &pending) {
+    Timer& timer = static_cast<Timer&>(*pending.next);
+    _unlink(timer);
+    _place(timer);
+  }
+}
+
+void TimerWheel::_tick(std::unique_lock<std::mutex>& lock) {
+  size_t index = _current & ((1 << TIMER_WHEEL_ROOT_BITS) - 1);
+
+  // On each full turn of a wheel, pull the next slot of the wheel above down
+  if (index == 0) {
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+      size_t level_index = (_current >> (TIMER_WHEEL_ROOT_BITS + level * TIMER_WHEEL_LEVEL_BITS)) & ((1 << TIMER_WHEEL_LEVEL_BITS) - 1);
+      _cascade(_levels[level], level_index);
+      if (level_index != 0) break;
+    }
+  }
+
+  // Fire due timers one at a time without holding the lock
+  _splice(_root[index], _expired);
+  while (_expired.next != &_expired) {
+    Timer& timer = static_cast<Timer&>(*_expired.next);
+    _unlink(timer);
+    _size--;
+
+    std::function<void()> callback = std::move(timer._callback);
+    timer._callback = nullptr;
+    _firing = &timer;
+    _firing_thread = std::this_thread::get_id();
+
+    lock.unlock();
+    if (callback) callback();
+    lock.lock();
+
+    _firing = nullptr;
+    _fired.notify_all();
+  }
+
+  _current++;
+}
+
+void TimerWheel::_execute() {
+  std::unique_lock<std::mutex> lock(_mutex);
+
+  while (_running) {
+    // Catch up on every tick that has elapsed, then sleep until the next
+    uint64_t target = _first + (std::chrono::steady_clock::now() - _origin) / tick;
+    while (_running && _current < target) _tick(lock);
+
+    _fired.wait_until(lock, _origin + tick * (_current - _first + 1), [&]() { return !_running; });
+  }
+}
+
+}  // namespace cppserver
@@ -0,0 +1,122 @@
+//
+// cppserver
+//
+// Copyright (C) 2024 Tom Cully
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301, USA.
+//
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace cppserver {
+
+// Wheel geometry: one 256 slot wheel of single ticks, then three 64 slot
+// wheels each covering 64 turns of the wheel below, 2^26 ticks in all.
+#define TIMER_WHEEL_ROOT_BITS 8
+#define TIMER_WHEEL_LEVEL_BITS 6
+#define TIMER_WHEEL_LEVELS 3
+
+// Hierarchical hashed timer wheel (Varghese & Lauck, as in the classic Linux
+// kernel timer list). Arming and cancelling a timer are O(1) list operations
+// regardless of how many timers are pending, at the cost of expiry being
+// rounded up to a whole tick.
+//
+// Timers are intrusive: the owner embeds a TimerWheel::Timer and must cancel
+// it before destroying it. Callbacks run on the wheel thread one at a time and
+// should only hand work off (e.g. post to an io_context). cancel() waits for a
+// callback that is already running, so once it returns the callback will not
+// touch the owner again.
+class TimerWheel {
+ public:
+  class Node {
+   public:
+    Node* prev = nullptr;
+    Node* next = nullptr;
+  };
+
+  class Timer : private Node {
+   public:
+    bool armed() const { return prev != nullptr; }
+
+   private:
+    friend class TimerWheel;
+    uint64_t _expiry = 0;
+    std::function<void()> _callback;
+  };
+
+  TimerWheel(std::chrono::milliseconds tick);
+  ~TimerWheel();
+
+  // Run the wheel on its own thread in real time
+  void start();
+  void stop();
+
+  // Arm (or re-arm) timer to call callback after delay, rounded up to the next tick
+  void arm(Timer& timer, std::chrono::milliseconds delay, std::function<void()> callback);
+
+  // Cancel timer. Returns true if it was pending, false if it had fired or was never armed.
+  bool cancel(Timer& timer);
+
+  // Process ticks without a thread, for tests and benchmarks
+  void advance(uint64_t ticks);
+
+  size_t size();
+
+  const std::chrono::milliseconds tick;
+
+ private:
+  typedef std::array<Node, 1 << TIMER_WHEEL_ROOT_BITS> RootWheel;
+  typedef std::array<Node, 1 << TIMER_WHEEL_LEVEL_BITS> LevelWheel;
+
+  std::mutex _mutex;
+  std::condition_variable _fired;
+  uint64_t _current = 0;
+  size_t _size = 0;
+
+  RootWheel _root;
+  std::array<LevelWheel, TIMER_WHEEL_LEVELS> _levels;
+
+  // Timers due on the tick being processed, still cancellable until fired
+  Node _expired;
+  Timer* _firing = nullptr;
+  std::thread::id _firing_thread;
+
+  std::unique_ptr<std::thread> _thread;
+  bool _running = false;
+  // When the thread started and the tick it started on, to know which tick is due now
+  std::chrono::steady_clock::time_point _origin;
+  uint64_t _first = 0;
+
+  static void _init_list(Node& head);
+  static void _link(Node& head, Node& node);
+  static void _unlink(Node& node);
+  static void _splice(Node& from, Node& to);
+
+  void _place(Timer& timer);
+  void _cascade(LevelWheel& wheel, size_t index);
+  void _tick(std::unique_lock<std::mutex>& lock);
+  void _execute();
+};
+
+}  // namespace cppserver
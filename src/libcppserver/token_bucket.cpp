@@ -0,0 +1,64 @@
+//
+// cppserver
+//
+// Copyright (C) 2024 Tom Cully
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301, USA.
+//
+#include "token_bucket.h"
+
+#include <algorithm>
+
+namespace cppserver {
+
+TokenBucket::TokenBucket(double prate, double pburst)
+    : rate(prate), burst(pburst), _origin(clock::now()), _burst_ns(_cost(pburst)), _full_at(0) {}
+
+bool TokenBucket::try_take(double count) {
+  int64_t now = _now();
+  int64_t cost = _cost(count);
+  int64_t full_at = _full_at.load(std::memory_order_relaxed);
+
+  while (true) {
+    int64_t next = std::max(full_at, now) + cost;
+    if (next - now > _burst_ns) return false;
+    if (_full_at.compare_exchange_weak(full_at, next, std::memory_order_relaxed)) return true;
+  }
+}
+
+std::chrono::nanoseconds TokenBucket::reserve(double count) {
+  int64_t now = _now();
+  int64_t cost = _cost(count);
+  int64_t full_at = _full_at.load(std::memory_order_relaxed);
+
+  int64_t next;
+  do {
+    next = std::max(full_at, now) + cost;
+  } while (!_full_at.compare_exchange_weak(full_at, next, std::memory_order_relaxed));
+
+  return std::chrono::nanoseconds(std::max<int64_t>(0, next - now - _burst_ns));
+}
+
+double TokenBucket::available() {
+  int64_t empty_ns = std::max<int64_t>(0, _full_at.load(std::memory_order_relaxed) - _now());
+  return std::max(0.0, burst - empty_ns * rate / 1e9);
+}
+
+int64_t TokenBucket::_now() const { return std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - _origin).count(); }
+
+int64_t TokenBucket::_cost(double count) const { return static_cast<int64_t>(count * 1e9 / rate); }
+
+}  // namespace cppserver
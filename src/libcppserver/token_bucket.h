@@ -0,0 +1,64 @@
+//
+// cppserver
+//
+// Copyright (C) 2024 Tom Cully
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301, USA.
+//
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+namespace cppserver {
+
+// Lock-free rate limiter allowing bursts of up to burst units, refilled
+// continuously at rate units per second.
+//
+// Implemented as GCRA: rather than a token count the bucket keeps the time at
+// which it would next be full, so taking tokens is a single compare-exchange.
+class TokenBucket {
+ public:
+  TokenBucket(double rate, double burst);
+
+  // Take count tokens if available
+  bool try_take(double count = 1);
+
+  // Take count tokens, going into debt if needed. Returns how long the caller
+  // must wait before proceeding, so callers are served in reservation order.
+  std::chrono::nanoseconds reserve(double count = 1);
+
+  // Tokens currently available
+  double available();
+
+  const double rate;
+  const double burst;
+
+ private:
+  typedef std::chrono::steady_clock clock;
+
+  clock::time_point _origin;
+  int64_t _burst_ns;
+
+  // Nanoseconds after _origin at which the bucket is full again
+  std::atomic<int64_t> _full_at;
+
+  int64_t _now() const;
+  int64_t _cost(double count) const;
+};
+
+}  // namespace cppserver
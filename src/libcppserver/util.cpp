@@ -20,6 +20,13 @@
 //
 #include <util.h>
 
+#if defined(__x86_64__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include <array>
+#include <cctype>
+#include <cstring>
 #include <iomanip>
 #include <iostream>
 #include <sstream>
@@ -46,4 +53,150 @@ std::string Util::to_hex(const uint8_t arr[], uint16_t len) {
   return oss.str();
 }
 
-}  // namespace cppserver
\ No newline at end of file
+bool Util::from_hex(const std::string& hex, std::vector<uint8_t>& vec) {
+  if (hex.size() % 2) return false;
+
+  vec.clear();
+  for (size_t i = 0; i < hex.size(); i += 2) {
+    int value = 0;
+    for (size_t j = i; j < i + 2; j++) {
+      int c = std::tolower(static_cast<unsigned char>(hex[j]));
+      if (!std::isxdigit(c)) return false;
+      value = (value << 4) | (std::isdigit(c) ? c - '0' : c - 'a' + 10);
+    }
+    vec.push_back(value);
+  }
+  return true;
+}
+
+bool Util::is_zero(const uint8_t* data, size_t len) {
+  size_t i = 0;
+
+  // OR each 64 byte chunk together and test once, the loads need no alignment
+#if defined(__AVX2__)
+  for (; i + 64 <= len; i += 64) {
+    __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+    __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i + 32));
+    __m256i v = _mm256_or_si256(a, b);
+    if (!_mm256_testz_si256(v, v)) return false;
+  }
+#elif defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+  for (; i + 64 <= len; i += 64) {
+    __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+    __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + 16));
+    __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + 32));
+    __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + 48));
+    __m128i v = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) != 0xFFFF) return false;
+  }
+#else
+  for (; i + 64 <= len; i += 64) {
+    uint64_t words[8];
+    std::memcpy(words, data + i, sizeof(words));
+    if (words[0] | words[1] | words[2] | words[3] | words[4] | words[5] | words[6] | words[7]) return false;
+  }
+#endif
+
+  for (; i < len; i++) {
+    if (data[i]) return false;
+  }
+  return true;
+}
+
+// Reflected Castagnoli polynomial
+#define CRC32C_POLY 0x82F63B78
+
+// Bytes per stream of the three streams checksummed in parallel, the long one for large buffers
+#define CRC32C_LONG_STRIDE 8192
+#define CRC32C_SHORT_STRIDE 256
+
+// The CRC register multiplied by x^8, one byte shifted through it
+static uint32_t crc32c_shift8(uint32_t crc) {
+  for (int bit = 0; bit < 8; bit++) crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+  return crc;
+}
+
+static const std::array<uint32_t, 256> crc32c_table = []() {
+  std::array<uint32_t, 256> table;
+  for (uint32_t i = 0; i < 256; i++) table[i] = crc32c_shift8(i);
+  return table;
+}();
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t* data, size_t len) {
+  for (size_t i = 0; i < len; i++) crc = crc32c_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+  return crc;
+}
+
+#if defined(__x86_64__)
+
+// x^(8 * len - 33) mod P, so that crc32(0, clmul(crc, k)) shifts crc over len zero bytes
+static uint32_t crc32c_fold_constant(size_t len) {
+  uint32_t k = 0x80000000;  // x^0
+  for (size_t bit = 0; bit < len * 8 - 33; bit++) k = k & 1 ? (k >> 1) ^ CRC32C_POLY : k >> 1;
+  return k;
+}
+
+static const uint32_t crc32c_long_1 = crc32c_fold_constant(CRC32C_LONG_STRIDE);
+static const uint32_t crc32c_long_2 = crc32c_fold_constant(2 * CRC32C_LONG_STRIDE);
+static const uint32_t crc32c_short_1 = crc32c_fold_constant(CRC32C_SHORT_STRIDE);
+static const uint32_t crc32c_short_2 = crc32c_fold_constant(2 * CRC32C_SHORT_STRIDE);
+
+__attribute__((target("sse4.2,pclmul"))) static uint32_t crc32c_fold(uint32_t crc, uint32_t k) {
+  __m128i product = _mm_clmulepi64_si128(_mm_cvtsi32_si128(crc), _mm_cvtsi32_si128(k), 0);
+  return _mm_crc32_u64(0, _mm_cvtsi128_si64(product));
+}
+
+// The crc32 instruction has a latency of three cycles but issues every cycle, so
+// three independent streams over consecutive strides run at full speed. The
+// first two are then shifted past the strides following them and combined.
+__attribute__((target("sse4.2,pclmul"))) static uint64_t crc32c_streams(uint64_t crc, const uint8_t*& data, size_t& len, size_t stride, uint32_t k1,
+                                                                         uint32_t k2) {
+  while (len >= 3 * stride) {
+    uint64_t a = crc, b = 0, c = 0;
+    for (size_t i = 0; i < stride; i += 8) {
+      uint64_t words[3];
+      std::memcpy(&words[0], data + i, 8);
+      std::memcpy(&words[1], data + stride + i, 8);
+      std::memcpy(&words[2], data + 2 * stride + i, 8);
+      a = _mm_crc32_u64(a, words[0]);
+      b = _mm_crc32_u64(b, words[1]);
+      c = _mm_crc32_u64(c, words[2]);
+    }
+    crc = crc32c_fold(a, k2) ^ crc32c_fold(b, k1) ^ c;
+    data += 3 * stride;
+    len -= 3 * stride;
+  }
+  return crc;
+}
+
+__attribute__((target("sse4.2,pclmul"))) static uint32_t crc32c_hw(uint32_t crc, const uint8_t* data, size_t len) {
+  uint64_t crc64 = crc32c_streams(crc, data, len, CRC32C_LONG_STRIDE, crc32c_long_1, crc32c_long_2);
+  crc64 = crc32c_streams(crc64, data, len, CRC32C_SHORT_STRIDE, crc32c_short_1, crc32c_short_2);
+
+  for (; len >= 8; data += 8, len -= 8) {
+    uint64_t word;
+    std::memcpy(&word, data, 8);
+    crc64 = _mm_crc32_u64(crc64, word);
+  }
+  crc = crc64;
+  for (; len; data++, len--) crc = _mm_crc32_u8(crc, *data);
+  return crc;
+}
+
+// Static initialisers run before the CPU model is, so initialise it first
+static const bool crc32c_has_hw = []() {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("pclmul");
+}();
+
+#endif
+
+uint32_t Util::crc32c(const uint8_t* data, size_t len, uint32_t crc) {
+#if defined(__x86_64__)
+  if (crc32c_has_hw) return ~crc32c_hw(~crc, data, len);
+#endif
+  return ~crc32c_sw(~crc, data, len);
+}
+
+}  // namespace cppserver
@@ -20,6 +20,8 @@
 //
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
 #include <string>
 #include <vector>
 
@@ -29,6 +31,16 @@ class Util {
  public:
   static std::string to_hex(const std::vector<uint8_t>& vec);
   static std::string to_hex(const uint8_t arr[], uint16_t len);
+
+  // Parse a hex string, returning false if it has an odd length or a non-hex character
+  static bool from_hex(const std::string& hex, std::vector<uint8_t>& vec);
+
+  // True if all len bytes are zero. Vectorized, stopping at the first non-zero 64 byte chunk.
+  static bool is_zero(const uint8_t* data, size_t len);
+
+  // CRC32C (Castagnoli) of len bytes, continuing from crc so a buffer can be checksummed in pieces.
+  // Uses the SSE4.2 crc32 instruction when the CPU has it, a table otherwise.
+  static uint32_t crc32c(const uint8_t* data, size_t len, uint32_t crc = 0);
 };
 
 }  // namespace cppserver
\ No newline at end of file
@@ -26,6 +26,11 @@
 
 namespace cppserver {
 
+// This build, as logged at startup and sent in HELLO
+#define CPPSERVER_VERSION_MAJOR 0
+#define CPPSERVER_VERSION_MINOR 1
+#define CPPSERVER_VERSION_PATCH 0
+
 class Version {
  public:
   Version(uint8_t* ptr, size_t len);
@@ -0,0 +1,247 @@
+//
+// cppserver
+//
+// Copyright (C) 2024 Tom Cully
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301, USA.
+//
+#include "write_queue.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/falloc.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+
+#include "util.h"
+
+namespace cppserver {
+
+static boost::system::error_code last_error() { return boost::system::error_code(errno, boost::system::system_category()); }
+
+static const std::vector<double> batchBuckets = {1, 2, 4, 8, 16, 32, 64, 128, 256};
+
+WriteQueue::WriteQueue(std::shared_ptr<Metrics> metrics, int fd, uint32_t block_size)
+    : _fd(fd),
+      _block_size(block_size),
+      _write_calls(metrics->counter("cppserver_device_write_calls_total", "Total pwritev calls made for block writes")),
+      _syncs(metrics->counter("cppserver_device_syncs_total", "Total fdatasync calls made for flushes and FUA writes")),
+      _batch_requests(metrics->histogram("cppserver_device_write_batch_requests", "Requests executed together by one write queue leader", batchBuckets)),
+      _sync_latency(metrics->latency("cppserver_device_sync_latency_seconds", "Device fdatasync latency")),
+      _zero_bytes(metrics->counter("cppserver_device_zero_write_bytes_total", "Total bytes of all-zero blocks written as holes rather than data")),
+      _punched_bytes(metrics->counter("cppserver_device_punched_bytes_total", "Total bytes punched out of device files by zero writes and trims")) {}
+
+bool WriteQueue::write(uint64_t block, uint32_t count, const uint8_t* data, bool fua, boost::system::error_code& ec) {
+  Request request;
+  request.block = block;
+  request.count = count;
+  request.data = data;
+  request.sync = fua;
+  return _submit(request, ec);
+}
+
+bool WriteQueue::trim(uint64_t block, uint32_t count, boost::system::error_code& ec) {
+  Request request;
+  request.block = block;
+  request.count = count;
+  return _submit(request, ec);
+}
+
+bool WriteQueue::flush(boost::system::error_code& ec) {
+  Request request;
+  request.sync = true;
+  return _submit(request, ec);
+}
+
+bool WriteQueue::_submit(Request& request, boost::system::error_code& ec) {
+  std::unique_lock<std::mutex> lock(_mutex);
+  _queue.push_back(&request);
+
+  while (!request.done) {
+    if (_leading) {
+      request.wake.wait(lock);
+      continue;
+    }
+
+    // Lead until this request is done, each pass taking everything queued meanwhile
+    _leading = true;
+    while (!request.done) {
+      // A trim can span far more blocks than a write, so it runs as a batch of its own
+      size_t take = 1;
+      if (!_is_trim(*_queue.front())) {
+        while (take < _queue.size() && take < WRITE_QUEUE_MAX_BATCH && !_is_trim(*_queue[take])) take++;
+      }
+      _batch.assign(_queue.begin(), _queue.begin() + take);
+      _queue.erase(_queue.begin(), _queue.begin() + take);
+
+      lock.unlock();
+      _execute();
+      lock.lock();
+
+      for (Request* done : _batch) {
+        done->done = true;
+        if (done != &request) done->wake.notify_one();
+      }
+    }
+    _leading = false;
+
+    // Wake only the oldest waiter to lead the next batch, not every caller
+    if (!_queue.empty()) _queue.front()->wake.notify_one();
+  }
+
+  ec = request.ec;
+  return !ec;
+}
+
+void WriteQueue::_execute() {
+  _batch_requests->observe(_batch.size());
+
+  if (_is_trim(*_batch.front())) {
+    Request& trim = *_batch.front();
+    _write_run(trim.block, trim.count, true, trim.ec);
+    return;
+  }
+
+  // Every block written by the batch, latest request first where blocks repeat
+  _extents.clear();
+  bool sync = false;
+  for (uint32_t order = 0; order < _batch.size(); order++) {
+    const Request& request = *_batch[order];
+    sync = sync || request.sync;
+    for (uint32_t i = 0; i < request.count; i++) {
+      const uint8_t* data = request.data ? request.data + size_t(i) * _block_size : nullptr;
+      if (data && Util::is_zero(data, _block_size)) {
+        data = nullptr;
+        _zero_bytes->inc(_block_size);
+      }
+      _extents.push_back(Extent{request.block + i, order, data});
+    }
+  }
+  std::sort(_extents.begin(), _extents.end(), [](const Extent& a, const Extent& b) { return a.block < b.block || (a.block == b.block && a.order > b.order); });
+
+  // Runs of consecutive blocks become one pwritev, joining iovecs where a
+  // request's blocks are contiguous in memory, or one punch for zero blocks
+  boost::system::error_code ec;
+  bool running = false;
+  bool run_hole = false;
+  uint64_t run_block = 0;
+  uint64_t next_block = 0;
+  for (const Extent& extent : _extents) {
+    if (running && extent.block == next_block - 1) continue;  // Overwritten by a later request
+
+    bool hole = extent.data == nullptr;
+    if (running && (extent.block != next_block || hole != run_hole || _iovecs.size() == IOV_MAX)) {
+      if (!_write_run(run_block, next_block - run_block, run_hole, ec)) break;
+      running = false;
+    }
+
+    if (!running) {
+      running = true;
+      run_hole = hole;
+      run_block = extent.block;
+      _iovecs.clear();
+    }
+    if (!hole) {
+      if (!_iovecs.empty() && static_cast<const uint8_t*>(_iovecs.back().iov_base) + _iovecs.back().iov_len == extent.data) {
+        _iovecs.back().iov_len += _block_size;
+      } else {
+        _iovecs.push_back(iovec{const_cast<uint8_t*>(extent.data), _block_size});
+      }
+    }
+    next_block = extent.block + 1;
+  }
+  if (!ec && running) _write_run(run_block, next_block - run_block, run_hole, ec);
+
+  if (!ec && sync) {
+    ScopedLatency timer(*_sync_latency);
+    _syncs->inc();
+    if (::fdatasync(_fd) != 0) ec = last_error();
+  }
+
+  // A failure anywhere fails the whole batch, callers cannot tell which blocks landed
+  if (ec) {
+    for (Request* request : _batch) request->ec = ec;
+  }
+}
+
+bool WriteQueue::_write_run(uint64_t block, uint64_t count, bool hole, boost::system::error_code& ec) {
+  if (!hole) return _pwritev(block, ec);
+  if (_punch_supported) return _punch(block, count, ec);
+
+  // Write zeros instead, a chunk at a time
+  if (_zeros.empty()) _zeros.resize(std::max<size_t>(WRITE_QUEUE_ZERO_CHUNK / _block_size, 1) * _block_size);
+  while (count) {
+    uint64_t chunk = std::min<uint64_t>(count, _zeros.size() / _block_size);
+    _iovecs.assign(1, iovec{_zeros.data(), size_t(chunk) * _block_size});
+    if (!_pwritev(block, ec)) return false;
+    block += chunk;
+    count -= chunk;
+  }
+  return true;
+}
+
+bool WriteQueue::_punch(uint64_t block, uint64_t count, boost::system::error_code& ec) {
+  off_t offset = block * _block_size;
+  off_t len = count * _block_size;
+
+  for (;;) {
+    if (::fallocate(_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len) == 0) break;
+    if (errno == EINTR) continue;
+    if (errno == EOPNOTSUPP) {
+      _punch_supported = false;
+      return _write_run(block, count, true, ec);
+    }
+    ec = last_error();
+    return false;
+  }
+
+  _punched_bytes->inc(len);
+  _holes = true;
+  return true;
+}
+
+bool WriteQueue::_pwritev(uint64_t block, boost::system::error_code& ec) {
+  struct iovec* iov = _iovecs.data();
+  size_t iovcnt = _iovecs.size();
+  off_t offset = block * _block_size;
+
+  while (iovcnt) {
+    _write_calls->inc();
+    ssize_t n = ::pwritev(_fd, iov, iovcnt, offset);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      ec = last_error();
+      return false;
+    }
+
+    // Skip what a short write completed
+    offset += n;
+    while (iovcnt && size_t(n) >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt) {
+      iov->iov_base = static_cast<uint8_t*>(iov->iov_base) + n;
+      iov->iov_len -= n;
+    }
+  }
+  return true;
+}
+
+}  // namespace cppserver
@@ -0,0 +1,133 @@
+//
+// cppserver
+//
+// Copyright (C) 2024 Tom Cully
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License
+// as published by the Free Software Foundation; either version 2
+// of the License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301, USA.
+//
+#pragma once
+
+#include <sys/uio.h>
+
+#include <atomic>
+#include <boost/system/error_code.hpp>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "metrics.h"
+
+namespace cppserver {
+
+// Most requests one leader takes from the queue at a time
+#define WRITE_QUEUE_MAX_BATCH 256
+
+// Zeros written per call where holes cannot be punched
+#define WRITE_QUEUE_ZERO_CHUNK (1024 * 1024)
+
+// Block writes and flushes waiting for a device's backing file.
+//
+// Callers block until their request completes. Whichever caller finds no
+// leader becomes the leader and executes everything queued so far as one
+// batch: the blocks of all writes are sorted, later writes win where they
+// overlap, and each run of consecutive blocks becomes a single pwritev. If
+// any request in the batch needs durability (a flush or a FUA write) one
+// fdatasync follows the writes and covers them all, so concurrent flushes
+// share a sync (group commit). Nothing is acknowledged before the write, or
+// for durable requests the sync, has completed.
+//
+// Blocks that are entirely zero, and trimmed ranges, are punched out of the
+// file with fallocate instead of being written, leaving holes that take no
+// disk space. Filesystems without hole punching get zeros written. Trims are
+// executed alone rather than merged, as one can cover the whole device.
+//
+// Requests are taken in arrival order, so a flush covers every write that
+// completed before it was issued. Once its own request is done the leader
+// hands over to a waiting caller rather than serving others indefinitely.
+class WriteQueue {
+ public:
+  WriteQueue(std::shared_ptr<Metrics> metrics, int fd, uint32_t block_size);
+
+  // Write count blocks from data. With fua the write is durable when this returns.
+  bool write(uint64_t block, uint32_t count, const uint8_t* data, bool fua, boost::system::error_code& ec);
+
+  // Discard count blocks, which then read as zeros
+  bool trim(uint64_t block, uint32_t count, boost::system::error_code& ec);
+
+  // Make every completed write durable
+  bool flush(boost::system::error_code& ec);
+
+  // True once any blocks have been punched out
+  bool holes() const { return _holes; }
+
+ private:
+  class Request {
+   public:
+    uint64_t block = 0;
+    uint32_t count = 0;             // 0 for a flush
+    const uint8_t* data = nullptr;  // nullptr for a trim
+    bool sync = false;
+    bool done = false;
+    boost::system::error_code ec;
+
+    // Signalled when the request is done or it should take over as leader
+    std::condition_variable wake;
+  };
+
+  // One block of a batch, tagged with its request's position so overlaps resolve to the latest
+  class Extent {
+   public:
+    uint64_t block;
+    uint32_t order;
+    const uint8_t* data;  // nullptr for a block to punch out
+  };
+
+  int _fd;
+  uint32_t _block_size;
+
+  std::mutex _mutex;
+  std::deque<Request*> _queue;
+  bool _leading = false;
+
+  std::atomic<bool> _holes{false};
+
+  // Only touched by the leader, kept to reuse their capacity
+  std::vector<Request*> _batch;
+  std::vector<Extent> _extents;
+  std::vector<struct iovec> _iovecs;
+  bool _punch_supported = true;
+  std::vector<uint8_t> _zeros;
+
+  std::shared_ptr<Counter> _write_calls;
+  std::shared_ptr<Counter> _syncs;
+  std::shared_ptr<Histogram> _batch_requests;
+  std::shared_ptr<LatencyHistogram> _sync_latency;
+  std::shared_ptr<Counter> _zero_bytes;
+  std::shared_ptr<Counter> _punched_bytes;
+
+  static bool _is_trim(const Request& request) { return request.count && !request.data; }
+
+  bool _submit(Request& request, boost::system::error_code& ec);
+  void _execute();
+  bool _write_run(uint64_t block, uint64_t count, bool hole, boost::system::error_code& ec);
+  bool _pwritev(uint64_t block, boost::system::error_code& ec);
+  bool _punch(uint64_t block, uint64_t count, boost::system::error_code& ec);
+};
+
+}  // namespace cppserver
@@ -0,0 +1,124 @@
+#include <gtest/gtest.h>
+
+#include <vector>
+
+#include "block_cache.h"
+
+namespace cppserver {
+
+#define TEST_BLOCK_SIZE 512
+
+class BlockCacheTest : public ::testing::Test {
+ protected:
+  std::shared_ptr<Metrics> metrics = std::make_shared<Metrics>();
+
+  // Blocks are filled with their block number
+  std::vector<uint8_t> block(uint64_t n) { return std::vector<uint8_t>(TEST_BLOCK_SIZE, uint8_t(n)); }
+
+  // Look a block up, caching it on a miss. Returns true on a hit.
+  bool read(BlockCache& cache, uint64_t device, uint64_t n) {
+    std::vector<uint8_t> data(TEST_BLOCK_SIZE);
+    uint64_t ticket;
+    if (cache.lookup(device, n, data.data(), ticket)) {
+      EXPECT_EQ(data, block(n));
+      return true;
+    }
+    cache.insert(device, n, block(n).data(), ticket);
+    return false;
+  }
+};
+
+// Test blocks are cached per device and counted
+TEST_F(BlockCacheTest, HitMiss) {
+  BlockCache cache(metrics, 64 * TEST_BLOCK_SIZE, TEST_BLOCK_SIZE);
+  EXPECT_EQ(cache.capacity(), 64);
+
+  EXPECT_FALSE(read(cache, 1, 7));
+  EXPECT_TRUE(read(cache, 1, 7));
+  EXPECT_FALSE(read(cache, 2, 7));
+  EXPECT_TRUE(read(cache, 2, 7));
+  EXPECT_EQ(cache.size(), 2);
+  EXPECT_DOUBLE_EQ(cache.hit_ratio(), 0.5);
+  EXPECT_EQ(metrics->counter("cppserver_cache_hits_total", "")->value(), 2);
+}
+
+// Test the cache stays within capacity and evicts
+TEST_F(BlockCacheTest, Capacity) {
+  BlockCache cache(metrics, 64 * TEST_BLOCK_SIZE, TEST_BLOCK_SIZE);
+
+  for (uint64_t n = 0; n < 1000; n++) read(cache, 1, n);
+  EXPECT_EQ(cache.size(), 64);
+  EXPECT_EQ(metrics->counter("cppserver_cache_evictions_total", "")->value(), 1000 - 64);
+  EXPECT_EQ(metrics->gauge("cppserver_cache_blocks", "")->value(), 64);
+}
+
+// Test a frequently read working set survives a sequential scan larger than the cache
+TEST_F(BlockCacheTest, ScanResistance) {
+  BlockCache cache(metrics, 64 * TEST_BLOCK_SIZE, TEST_BLOCK_SIZE);
+
+  for (int pass = 0; pass < 3; pass++) {
+    for (uint64_t n = 0; n < 32; n++) read(cache, 1, n);
+  }
+  for (uint64_t n = 1000; n < 2000; n++) read(cache, 1, n);
+
+  int hits = 0;
+  for (uint64_t n = 0; n < 32; n++) hits += read(cache, 1, n);
+  EXPECT_EQ(hits, 32);
+}
+
+// Test blocks evicted on probation and soon read again are admitted to the main queue
+TEST_F(BlockCacheTest, Ghosts) {
+  BlockCache cache(metrics, 64 * TEST_BLOCK_SIZE, TEST_BLOCK_SIZE);
+
+  // Two passes over a working set a little larger than the cache, the second re-admits from ghosts
+  for (uint64_t n = 0; n < 80; n++) read(cache, 1, n);
+  for (uint64_t n = 0; n < 80; n++) read(cache, 1, n);
+
+  int hits = 0;
+  for (uint64_t n = 0; n < 80; n++) hits += read(cache, 1, n);
+  EXPECT_GT(hits, 40);
+}
+
+// Test a prefetched block read once is not promoted, but one read twice is
+TEST_F(BlockCacheTest, Prefetched) {
+  BlockCache cache(metrics, 64 * TEST_BLOCK_SIZE, TEST_BLOCK_SIZE);
+  uint64_t ticket;
+
+  // A working set read once after read-ahead, then a scan
+  for (uint64_t n = 0; n < 32; n++) {
+    EXPECT_FALSE(cache.probe(1, n, ticket));
+    cache.insert(1, n, block(n).data(), ticket, true);
+    EXPECT_TRUE(cache.probe(1, n, ticket));
+  }
+  for (uint64_t n = 0; n < 16; n++) EXPECT_TRUE(read(cache, 1, n));
+  for (uint64_t n = 0; n < 8; n++) EXPECT_TRUE(read(cache, 1, n));
+  for (uint64_t n = 1000; n < 1100; n++) read(cache, 1, n);
+
+  // Only the blocks read twice survive
+  int hits = 0;
+  for (uint64_t n = 0; n < 8; n++) hits += read(cache, 1, n);
+  EXPECT_EQ(hits, 8);
+  EXPECT_EQ(metrics->counter("cppserver_cache_prefetch_hits_total", "")->value(), 16);
+}
+
+// Test writes invalidate cached blocks and reads racing a write do not cache stale data
+TEST_F(BlockCacheTest, Invalidate) {
+  BlockCache cache(metrics, 64 * TEST_BLOCK_SIZE, TEST_BLOCK_SIZE);
+  std::vector<uint8_t> data(TEST_BLOCK_SIZE);
+  uint64_t ticket;
+
+  read(cache, 1, 3);
+  cache.invalidate(1, 3);
+  EXPECT_FALSE(cache.lookup(1, 3, data.data(), ticket));
+  EXPECT_EQ(cache.size(), 0);
+
+  // The write lands between the miss and the insert
+  cache.invalidate(1, 3);
+  cache.insert(1, 3, block(3).data(), ticket);
+  EXPECT_FALSE(cache.lookup(1, 3, data.data(), ticket));
+
+  cache.insert(1, 3, block(3).data(), ticket);
+  EXPECT_TRUE(cache.lookup(1, 3, data.data(), ticket));
+}
+
+}  // namespace cppserver
@@ -0,0 +1,115 @@
+#include <gtest/gtest.h>
+
+#include <filesystem>
+#include <vector>
+
+#include "block_checksums.h"
+#include "test_helpers.h"
+
+namespace cppserver {
+
+class BlockChecksumsTest : public ::testing::Test {
+ protected:
+  std::string filename = test_path(".crc").string();
+
+  void TearDown() override { std::filesystem::remove(filename); }
+};
+
+// Test a new sidecar has no checksums, and set ones survive reopening
+TEST_F(BlockChecksumsTest, Persist) {
+  boost::system::error_code ec;
+  {
+    BlockChecksums checksums(filename, 1000);
+    ASSERT_TRUE(checksums.open(false, ec)) << ec.message();
+    EXPECT_EQ(std::filesystem::file_size(filename), 4000u);
+    EXPECT_EQ(checksums.get(999), 0u);
+
+    std::vector<uint64_t> state;
+    uint32_t crcs[2] = {0x1234, 0x5678};
+    checksums.begin_change(998, 2, state);
+    checksums.end_change(998, 2, crcs, state);
+    ASSERT_TRUE(checksums.sync(ec));
+  }
+
+  // Growing the device adds blocks without checksums
+  BlockChecksums checksums(filename, 2000);
+  ASSERT_TRUE(checksums.open(false, ec));
+  EXPECT_EQ(checksums.get(998), 0x1234u);
+  EXPECT_EQ(checksums.get(999), 0x5678u);
+  EXPECT_EQ(checksums.get(1999), 0u);
+
+  EXPECT_FALSE(BlockChecksums(filename, 4000).open(true, ec));
+}
+
+// Test readers see changes in progress and completed, only in the stripes changed
+TEST_F(BlockChecksumsTest, Snapshot) {
+  BlockChecksums checksums(filename, 100000);
+  boost::system::error_code ec;
+  ASSERT_TRUE(checksums.open(false, ec));
+
+  std::vector<uint64_t> read, change;
+  ASSERT_TRUE(checksums.snapshot(30, 4, read));
+
+  checksums.begin_change(32, 1, change);
+  std::vector<uint64_t> during;
+  EXPECT_FALSE(checksums.snapshot(30, 4, during));
+  EXPECT_TRUE(checksums.snapshot(64, 4, during));
+  checksums.end_change(32, 1, 0xABCDu, change);
+
+  EXPECT_FALSE(checksums.unchanged(30, 4, read));
+  EXPECT_TRUE(checksums.unchanged(64, 4, during));
+  EXPECT_EQ(checksums.get(32), 0xABCDu);
+
+  // A read of every stripe
+  ASSERT_TRUE(checksums.snapshot(0, 100000, read));
+  EXPECT_EQ(read.size(), size_t(BLOCK_CHECKSUMS_STRIPES));
+  EXPECT_TRUE(checksums.unchanged(0, 100000, read));
+
+  // A snapshot of other blocks does not vouch for them
+  EXPECT_FALSE(checksums.unchanged(64, 4, read));
+}
+
+// Test overlapping changes and failed ones leave no checksum
+TEST_F(BlockChecksumsTest, Overlap) {
+  BlockChecksums checksums(filename, 1000);
+  boost::system::error_code ec;
+  ASSERT_TRUE(checksums.open(false, ec));
+
+  std::vector<uint64_t> a, b;
+  checksums.begin_change(10, 4, a);
+  checksums.begin_change(12, 1, b);
+  checksums.end_change(12, 1, 0x1111u, b);
+  checksums.end_change(10, 4, 0x2222u, a);
+  for (uint64_t block = 10; block < 14; block++) EXPECT_EQ(checksums.get(block), 0u) << block;
+
+  checksums.begin_change(10, 1, a);
+  checksums.end_change(10, 1, 0x3333u, a);
+  EXPECT_EQ(checksums.get(10), 0x3333u);
+  checksums.begin_change(10, 1, a);
+  checksums.end_change(10, 1, nullptr, a);
+  EXPECT_EQ(checksums.get(10), 0u);
+}
+
+// Test recording only fills blocks without checksums, and is taken back if a change raced it
+TEST_F(BlockChecksumsTest, Record) {
+  BlockChecksums checksums(filename, 1000);
+  boost::system::error_code ec;
+  ASSERT_TRUE(checksums.open(false, ec));
+
+  std::vector<uint64_t> read, change;
+  checksums.begin_change(1, 1, change);
+  checksums.end_change(1, 1, 0x1111u, change);
+
+  uint32_t crcs[2] = {0xAAAA, 0xBBBB};
+  ASSERT_TRUE(checksums.snapshot(0, 2, read));
+  checksums.record(0, 2, crcs, read);
+  EXPECT_EQ(checksums.get(0), 0xAAAAu);
+  EXPECT_EQ(checksums.get(1), 0x1111u);
+
+  ASSERT_TRUE(checksums.snapshot(5, 1, read));
+  checksums.begin_change(5, 1, change);
+  checksums.record(5, 1, crcs, read);
+  EXPECT_EQ(checksums.get(5), 0u);
+}
+
+}  // namespace cppserver
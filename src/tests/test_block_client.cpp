@@ -0,0 +1,371 @@
+#include <gtest/gtest.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "block_client.h"
+#include "tcp_server.h"
+#include "test_helpers.h"
+
+namespace cppserver {
+
+// Two servers on loopback sharing one device database, the second only used to redirect to
+class BlockClientTest : public BlockServerTest {
+ protected:
+  std::vector<std::shared_ptr<BlockEngine>> engines;
+  std::vector<std::shared_ptr<Metrics>> server_metrics;
+  std::vector<std::unique_ptr<TCPServer>> servers;
+  // Chosen by the system as the servers start, reused when a test restarts one
+  std::vector<uint16_t> ports;
+
+  void SetUp() override {
+    BlockServerTest::SetUp();
+    for (int node = 0; node < 2; node++) {
+      engines.push_back(open_engine());
+      server_metrics.push_back(std::make_shared<Metrics>());
+      servers.push_back(std::make_unique<TCPServer>(logger, server_metrics.back(), engines.back(), 0, TCPServerOptions()));
+      servers.back()->start();
+      ports.push_back(servers.back()->port());
+    }
+  }
+
+  uint64_t resumed(int node) { return server_metrics[node]->counter("cppserver_tickets_redeemed_total", "")->value(); }
+
+  void TearDown() override {
+    for (auto& server : servers) {
+      if (server) server->stop();
+    }
+    servers.clear();
+    engines.clear();
+    BlockServerTest::TearDown();
+  }
+
+  std::unique_ptr<BlockClient> connect(const BlockClientOptions& options = BlockClientOptions()) {
+    auto client = std::make_unique<BlockClient>(logger, metrics, options);
+    boost::system::error_code ec;
+    EXPECT_TRUE(client->connect("127.0.0.1", ports[0], ec)) << ec.message();
+    std::string error;
+    EXPECT_TRUE(client->attach(1, 1, error)) << error;
+    return client;
+  }
+};
+
+// Test synchronous writes, reads, trims and flushes round trip
+TEST_F(BlockClientTest, RoundTrip) {
+  auto client = connect();
+  EXPECT_EQ(client->block_size(), uint32_t(TEST_DEVICE_BLOCK_SIZE));
+  EXPECT_EQ(client->block_total(), uint64_t(TEST_DEVICE_BLOCKS));
+  EXPECT_FALSE(client->read_only());
+
+  std::string error;
+  auto data = pattern(10, 8);
+  ASSERT_TRUE(client->write(10, 8, data.data(), false, error)) << error;
+  ASSERT_TRUE(client->flush(error)) << error;
+
+  std::vector<uint8_t> read(data.size());
+  ASSERT_TRUE(client->read(10, 8, read.data(), error)) << error;
+  EXPECT_EQ(read, data);
+
+  ASSERT_TRUE(client->trim(12, 2, error)) << error;
+  ASSERT_TRUE(client->read(10, 8, read.data(), error)) << error;
+  std::fill(data.begin() + 2 * TEST_DEVICE_BLOCK_SIZE, data.begin() + 4 * TEST_DEVICE_BLOCK_SIZE, 0);
+  EXPECT_EQ(read, data);
+}
+
+// Test many requests in flight from several threads each complete once, with the right data
+TEST_F(BlockClientTest, Pipelined) {
+  BlockClientOptions options;
+  options.max_in_flight = 16;
+  auto client = connect(options);
+
+  std::vector<std::vector<uint8_t>> blocks;
+  for (uint64_t block = 0; block < TEST_DEVICE_BLOCKS; block++) blocks.push_back(pattern(block, 1));
+
+  std::atomic<int> written{0};
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([&, t]() {
+      for (uint64_t block = t; block < TEST_DEVICE_BLOCKS; block += 4) {
+        client->write(block, 1, blocks[block].data(), [&](BlockResponse& response) {
+          EXPECT_TRUE(response.ok()) << response.error;
+          written++;
+        });
+      }
+    });
+  }
+  for (auto& thread : threads) thread.join();
+  client->drain();
+  EXPECT_EQ(written, TEST_DEVICE_BLOCKS);
+  EXPECT_EQ(client->in_flight(), 0u);
+
+  std::atomic<int> matched{0};
+  for (uint64_t block = 0; block < TEST_DEVICE_BLOCKS; block++) {
+    client->read(block, 1, [&, block](BlockResponse& response) {
+      EXPECT_TRUE(response.ok()) << response.error;
+      if (response.data == blocks[block]) matched++;
+    });
+  }
+  client->drain();
+  EXPECT_EQ(matched, TEST_DEVICE_BLOCKS);
+}
+
+// Test a batch larger than max_in_flight is sent in turns, every request completing
+TEST_F(BlockClientTest, Batch) {
+  BlockClientOptions options;
+  options.max_in_flight = 8;
+  auto client = connect(options);
+
+  std::string error;
+  auto data = pattern(0, 64);
+  ASSERT_TRUE(client->write(0, 64, data.data(), false, error)) << error;
+
+  std::atomic<int> matched{0};
+  std::vector<BlockRequest> requests(64);
+  for (uint64_t block = 0; block < requests.size(); block++) {
+    requests[block].opcode = OP_READ;
+    requests[block].block = block;
+    requests[block].count = 1;
+    requests[block].callback = [&, block](BlockResponse& response) {
+      if (response.ok() && std::equal(response.data.begin(), response.data.end(), data.begin() + block * TEST_DEVICE_BLOCK_SIZE)) matched++;
+    };
+  }
+  client->submit(requests);
+  client->drain();
+  EXPECT_EQ(matched, 64);
+}
+
+// Test server errors fail only their request, and requests fail once the connection closes
+TEST_F(BlockClientTest, Errors) {
+  auto client = connect();
+
+  std::string error;
+  std::vector<uint8_t> data(TEST_DEVICE_BLOCK_SIZE);
+  EXPECT_FALSE(client->read(TEST_DEVICE_BLOCKS, 1, data.data(), error));
+  EXPECT_FALSE(error.empty());
+  EXPECT_TRUE(client->read(0, 1, data.data(), error)) << error;
+
+  std::vector<uint8_t> large(FRAME_MAX_PAYLOAD + TEST_DEVICE_BLOCK_SIZE);
+  EXPECT_FALSE(client->write(0, large.size() / TEST_DEVICE_BLOCK_SIZE, large.data(), false, error));
+  EXPECT_EQ(error, "Request too large");
+
+  client->close();
+  EXPECT_FALSE(client->connected());
+  EXPECT_FALSE(client->read(0, 1, data.data(), error));
+  EXPECT_EQ(error, "Not connected");
+}
+
+// Test HELLO agrees out of order completion, and a client without it still works in the baseline
+TEST_F(BlockClientTest, Hello) {
+  auto client = connect();
+  Hello hello = client->hello();
+  EXPECT_EQ(hello.version.minor, CPPSERVER_VERSION_MINOR);
+  EXPECT_TRUE(hello.capabilities & CAP_OUT_OF_ORDER);
+  EXPECT_FALSE(hello.capabilities & CAP_COMPRESSION);
+  EXPECT_EQ(hello.max_in_flight, TCPSessionOptions().max_in_flight);
+  EXPECT_EQ(hello.max_payload, uint32_t(FRAME_MAX_PAYLOAD));
+
+  BlockClientOptions options;
+  options.hello = false;
+  auto baseline = connect(options);
+  EXPECT_EQ(baseline->hello().capabilities, 0u);
+  EXPECT_EQ(baseline->hello().max_in_flight, 1u);
+
+  // Answered in order
+  std::mutex mutex;
+  std::vector<uint64_t> order;
+  for (uint64_t block = 0; block < 64; block++) {
+    baseline->read(block, 1 + block % 8, [&, block](BlockResponse& response) {
+      EXPECT_TRUE(response.ok()) << response.error;
+      std::lock_guard<std::mutex> lock(mutex);
+      order.push_back(block);
+    });
+  }
+  baseline->drain();
+  ASSERT_EQ(order.size(), 64u);
+  for (uint64_t block = 0; block < 64; block++) EXPECT_EQ(order[block], block);
+}
+
+// Test compressed transfers are decoded on read
+TEST_F(BlockClientTest, Compressed) {
+  BlockClientOptions options;
+  options.compression = true;
+  auto client = connect(options);
+  EXPECT_TRUE(client->compressed());
+
+  std::string error;
+  std::vector<uint8_t> data(16 * TEST_DEVICE_BLOCK_SIZE, 'x');
+  ASSERT_TRUE(client->write(100, 16, data.data(), false, error)) << error;
+  std::vector<uint8_t> read(data.size());
+  ASSERT_TRUE(client->read(100, 16, read.data(), error)) << error;
+  EXPECT_EQ(read, data);
+}
+
+// Test reads of a read only device are sent from its file, and compressed transfers of it still read it
+TEST_F(BlockClientTest, ZeroCopy) {
+  auto file_bytes = server_metrics[0]->counter("cppserver_session_file_bytes_written_total", "");
+  std::vector<uint8_t> image = pattern(0, TEST_DEVICE_BLOCKS);
+
+  for (bool compression : {false, true}) {
+    BlockClientOptions options;
+    options.compression = compression;
+    BlockClient client(logger, metrics, options);
+    boost::system::error_code ec;
+    ASSERT_TRUE(client.connect("127.0.0.1", ports[0], ec)) << ec.message();
+    std::string error;
+    ASSERT_TRUE(client.attach(1, 2, error)) << error;
+    EXPECT_TRUE(client.read_only());
+
+    std::vector<uint8_t> read(64 * TEST_DEVICE_BLOCK_SIZE);
+    ASSERT_TRUE(client.read(100, 64, read.data(), error)) << error;
+    EXPECT_TRUE(std::equal(read.begin(), read.end(), image.begin() + 100 * TEST_DEVICE_BLOCK_SIZE));
+
+    // Interleaved with responses from buffers
+    std::atomic<int> matched{0};
+    for (uint64_t block = 0; block < TEST_DEVICE_BLOCKS; block += 16) {
+      client.read(block, 16, [&, block](BlockResponse& response) {
+        EXPECT_TRUE(response.ok()) << response.error;
+        if (std::equal(response.data.begin(), response.data.end(), image.begin() + block * TEST_DEVICE_BLOCK_SIZE)) matched++;
+      });
+      client.read(block, 0, [](BlockResponse& response) { EXPECT_TRUE(response.ok()) << response.error; });
+    }
+    client.drain();
+    EXPECT_EQ(matched, TEST_DEVICE_BLOCKS / 16);
+
+    EXPECT_EQ(file_bytes->value(), uint64_t(TEST_DEVICE_BLOCKS + 64) * TEST_DEVICE_BLOCK_SIZE);
+  }
+}
+
+// Test an attach redirected by the cluster is followed to the node serving the device
+TEST_F(BlockClientTest, Redirect) {
+  std::string owner = "127.0.0.1:" + std::to_string(ports[1]);
+  auto ring = std::make_shared<HashRing>(std::vector<std::string>{owner});
+  engines[0]->cluster("127.0.0.1:" + std::to_string(ports[0]), ring);
+  engines[1]->cluster(owner, ring);
+
+  auto client = connect();
+  EXPECT_EQ(client->node(), owner);
+
+  BlockClientOptions options;
+  options.follow_redirects = false;
+  BlockClient fixed(logger, metrics, options);
+  boost::system::error_code ec;
+  ASSERT_TRUE(fixed.connect("127.0.0.1", ports[0], ec)) << ec.message();
+  std::string error;
+  EXPECT_FALSE(fixed.attach(1, 1, error));
+  EXPECT_NE(error.find(owner), std::string::npos) << error;
+}
+
+// Test a reconnect resumes from the ticket given at attach, and starts over once the server cannot read it
+TEST_F(BlockClientTest, Resume) {
+  BlockClientOptions options;
+  options.compression = true;
+  auto client = connect(options);
+  std::vector<uint8_t> ticket = client->ticket();
+  ASSERT_FALSE(ticket.empty());
+
+  std::string error;
+  std::vector<uint8_t> data = pattern(10, 4);
+  ASSERT_TRUE(client->write(10, 4, data.data(), false, error)) << error;
+
+  ASSERT_TRUE(client->reconnect(error)) << error;
+  EXPECT_EQ(resumed(0), 1u);
+  EXPECT_TRUE(client->compressed());
+  EXPECT_EQ(client->block_total(), uint64_t(TEST_DEVICE_BLOCKS));
+  EXPECT_TRUE(client->hello().capabilities & CAP_OUT_OF_ORDER);
+  EXPECT_FALSE(client->ticket().empty());
+  EXPECT_NE(client->ticket(), ticket);
+  std::vector<uint8_t> read(data.size());
+  ASSERT_TRUE(client->read(10, 4, read.data(), error)) << error;
+  EXPECT_EQ(read, data);
+
+  // A restarted server has a new secret
+  servers[0].reset();
+  servers[0] = std::make_unique<TCPServer>(logger, server_metrics[0], engines[0], ports[0], TCPServerOptions());
+  servers[0]->start();
+  ASSERT_TRUE(client->reconnect(error)) << error;
+  EXPECT_EQ(resumed(0), 1u);
+  EXPECT_EQ(server_metrics[0]->counter("cppserver_tickets_rejected_total", "")->value(), 1u);
+  ASSERT_TRUE(client->read(10, 4, read.data(), error)) << error;
+  EXPECT_EQ(read, data);
+
+  // Without tickets a reconnect attaches again
+  TCPServerOptions server_options;
+  server_options.ticket_lifetime = 0;
+  servers[0].reset();
+  servers[0] = std::make_unique<TCPServer>(logger, server_metrics[0], engines[0], ports[0], server_options);
+  servers[0]->start();
+  ASSERT_TRUE(client->reconnect(error)) << error;
+  EXPECT_TRUE(client->ticket().empty());
+  ASSERT_TRUE(client->reconnect(error)) << error;
+  EXPECT_TRUE(client->compressed());
+}
+
+// Test a client on the same host is served through the Unix socket alongside TCP, if its user is allowed
+TEST_F(BlockClientTest, Unix) {
+  TCPServerOptions server_options;
+  server_options.unix_path = (dir / "cppserver.sock").string();
+  servers[0].reset();
+  servers[0] = std::make_unique<TCPServer>(logger, server_metrics[0], engines[0], ports[0], server_options);
+  servers[0]->start();
+
+  BlockClient local(logger, metrics);
+  boost::system::error_code ec;
+  ASSERT_TRUE(local.connect_unix(server_options.unix_path, ec)) << ec.message();
+  std::string error;
+  ASSERT_TRUE(local.attach(1, 1, error)) << error;
+  EXPECT_EQ(local.node(), "unix:" + server_options.unix_path);
+  EXPECT_TRUE(local.hello().capabilities & CAP_OUT_OF_ORDER);
+
+  std::vector<uint8_t> data = pattern(20, 8);
+  ASSERT_TRUE(local.write(20, 8, data.data(), false, error)) << error;
+  auto remote = connect();
+  std::vector<uint8_t> read(data.size());
+  ASSERT_TRUE(remote->read(20, 8, read.data(), error)) << error;
+  EXPECT_EQ(read, data);
+
+  ASSERT_TRUE(local.reconnect(error)) << error;
+  EXPECT_EQ(resumed(0), 1u);
+  std::fill(read.begin(), read.end(), 0);
+  ASSERT_TRUE(local.read(20, 8, read.data(), error)) << error;
+  EXPECT_EQ(read, data);
+
+  server_options.unix_uids = {getuid() + 1};
+  servers[0].reset();
+  servers[0] = std::make_unique<TCPServer>(logger, server_metrics[0], engines[0], ports[0], server_options);
+  servers[0]->start();
+  ASSERT_TRUE(local.connect_unix(server_options.unix_path, ec)) << ec.message();
+  EXPECT_FALSE(local.attach(1, 1, error));
+  EXPECT_EQ(server_metrics[0]->counter("cppserver_sessions_denied_total", "")->value(), 1u);
+}
+
+// Test a pool spreads requests over its connections
+TEST_F(BlockClientTest, Pool) {
+  BlockClientPool pool(logger, metrics, 4);
+  std::string error;
+  ASSERT_TRUE(pool.connect("127.0.0.1", ports[0], 1, 1, error)) << error;
+  ASSERT_EQ(pool.size(), 4u);
+
+  std::atomic<int> completed{0};
+  std::set<BlockClient*> used;
+  for (uint64_t block = 0; block < 256; block++) {
+    BlockClient& client = pool.next();
+    used.insert(&client);
+    client.read(block, 4, [&](BlockResponse& response) {
+      EXPECT_TRUE(response.ok()) << response.error;
+      completed++;
+    });
+  }
+  pool.drain();
+  EXPECT_EQ(completed, 256);
+  EXPECT_EQ(used.size(), 4u);
+  pool.close();
+}
+
+}  // namespace cppserver
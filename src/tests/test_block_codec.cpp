@@ -0,0 +1,98 @@
+#include <gtest/gtest.h>
+
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "block_codec.h"
+#include "protocol.h"
+
+namespace cppserver {
+
+#define TEST_BLOCK_SIZE 4096
+
+class BlockCodecTest : public ::testing::Test {
+ protected:
+  std::shared_ptr<Metrics> metrics = std::make_shared<Metrics>();
+  BlockCodec codec{metrics, "test", TEST_BLOCK_SIZE};
+
+  std::vector<uint8_t> textBlock() {
+    static const char* text = "the quick brown fox jumps over the lazy dog ";
+    std::vector<uint8_t> block(TEST_BLOCK_SIZE);
+    for (size_t i = 0; i < block.size(); i++) block[i] = text[i % std::strlen(text)];
+    return block;
+  }
+
+  std::vector<uint8_t> randomBlock() {
+    std::mt19937 gen(1);
+    std::vector<uint8_t> block(TEST_BLOCK_SIZE);
+    for (auto& byte : block) byte = gen();
+    return block;
+  }
+
+  uint64_t counter(const char* name) { return metrics->counter(name, "", "path=\"test\"")->value(); }
+};
+
+// Test each form of block round trips and is told apart by its length
+TEST_F(BlockCodecTest, RoundTrip) {
+  std::vector<uint8_t> encoded(TEST_BLOCK_SIZE), decoded(TEST_BLOCK_SIZE);
+
+  auto text = textBlock();
+  uint32_t len = codec.encode(text.data(), encoded.data());
+  EXPECT_GT(len, 0u);
+  EXPECT_LT(len, TEST_BLOCK_SIZE / 4);
+  ASSERT_TRUE(codec.decode(encoded.data(), len, decoded.data()));
+  EXPECT_EQ(decoded, text);
+
+  // Incompressible blocks are kept raw
+  auto random = randomBlock();
+  EXPECT_EQ(codec.encode(random.data(), encoded.data()), TEST_BLOCK_SIZE);
+  ASSERT_TRUE(codec.decode(encoded.data(), TEST_BLOCK_SIZE, decoded.data()));
+  EXPECT_EQ(decoded, random);
+  EXPECT_EQ(counter("cppserver_compression_incompressible_blocks_total"), 1);
+
+  std::vector<uint8_t> zero(TEST_BLOCK_SIZE);
+  EXPECT_EQ(codec.encode(zero.data(), encoded.data()), 0u);
+  ASSERT_TRUE(codec.decode(encoded.data(), 0, decoded.data()));
+  EXPECT_EQ(decoded, zero);
+
+  EXPECT_EQ(counter("cppserver_compression_raw_bytes_total"), 3 * TEST_BLOCK_SIZE);
+  EXPECT_EQ(counter("cppserver_compression_encoded_bytes_total"), len + TEST_BLOCK_SIZE);
+}
+
+// Test runs of blocks round trip as records
+TEST_F(BlockCodecTest, Records) {
+  std::vector<uint8_t> blocks = textBlock(), random = randomBlock();
+  blocks.insert(blocks.end(), TEST_BLOCK_SIZE, 0);
+  blocks.insert(blocks.end(), random.begin(), random.end());
+
+  std::vector<uint8_t> records, decoded;
+  codec.encode_records(blocks.data(), 3, records);
+  EXPECT_LE(records.size(), codec.records_bound(3));
+  EXPECT_EQ(get_u32(records.data() + records.size() - TEST_BLOCK_SIZE - 8), 0u);
+
+  ASSERT_TRUE(codec.decode_records(records.data(), records.size(), 3, decoded));
+  EXPECT_EQ(decoded, blocks);
+}
+
+// Test malformed records and too many blocks are rejected
+TEST_F(BlockCodecTest, Malformed) {
+  std::vector<uint8_t> blocks = textBlock(), records, decoded;
+  codec.encode_records(blocks.data(), 1, records);
+
+  // Truncated data, truncated length, corrupt data
+  EXPECT_FALSE(codec.decode_records(records.data(), records.size() - 1, 1, decoded));
+  EXPECT_FALSE(codec.decode_records(records.data(), 2, 1, decoded));
+  std::vector<uint8_t> corrupt = records;
+  put_u32(corrupt.data(), get_u32(corrupt.data()) - 1);
+  corrupt.pop_back();
+  EXPECT_FALSE(codec.decode_records(corrupt.data(), corrupt.size(), 1, decoded));
+
+  // A few bytes of zero block records must not expand past the limit
+  std::vector<uint8_t> zeros(4 * 100, 0);
+  EXPECT_FALSE(codec.decode_records(zeros.data(), zeros.size(), 99, decoded));
+  EXPECT_TRUE(codec.decode_records(zeros.data(), zeros.size(), 100, decoded));
+  EXPECT_EQ(decoded.size(), 100u * TEST_BLOCK_SIZE);
+}
+
+}  // namespace cppserver
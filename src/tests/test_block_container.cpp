@@ -0,0 +1,132 @@
+#include <gtest/gtest.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <filesystem>
+#include <random>
+#include <vector>
+
+#include "block_container.h"
+#include "test_helpers.h"
+
+namespace cppserver {
+
+#define TEST_BLOCK_SIZE 4096
+
+class BlockContainerTest : public ::testing::Test {
+ protected:
+  std::shared_ptr<Metrics> metrics = std::make_shared<Metrics>();
+  std::string filename = test_path(".img").string();
+  Device device;
+  int fd = -1;
+
+  void SetUp() override {
+    device.id = 1;
+    device.block_size = TEST_BLOCK_SIZE;
+    device.block_total = 256;
+    fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  }
+
+  void TearDown() override {
+    ::close(fd);
+    std::filesystem::remove(filename);
+  }
+
+  // Blocks with a compressible pattern differing by seed
+  std::vector<uint8_t> pattern(uint32_t count, uint8_t seed) {
+    std::vector<uint8_t> data(size_t(count) * TEST_BLOCK_SIZE);
+    for (size_t i = 0; i < data.size(); i++) data[i] = uint8_t(seed + (i / 64) % 7);
+    return data;
+  }
+
+  int64_t stored() { return metrics->gauge("cppserver_device_stored_bytes", "", "device=\"1\"")->value(); }
+};
+
+// Test blocks round trip, unwritten blocks read as zeros and data survives reopening
+TEST_F(BlockContainerTest, ReadWrite) {
+  boost::system::error_code ec;
+  auto data = pattern(8, 1);
+  {
+    BlockContainer container(metrics, fd, device);
+    ASSERT_TRUE(container.open(false, ec)) << ec.message();
+
+    std::vector<uint8_t> in(10 * TEST_BLOCK_SIZE, 0xFF);
+    ASSERT_TRUE(container.read(0, 10, in.data(), ec));
+    EXPECT_EQ(in, std::vector<uint8_t>(10 * TEST_BLOCK_SIZE));
+
+    ASSERT_TRUE(container.write(100, 8, data.data(), ec));
+    ASSERT_TRUE(container.flush(ec));
+    EXPECT_GT(stored(), 0);
+    EXPECT_LT(stored(), 8 * TEST_BLOCK_SIZE / 4);
+  }
+  EXPECT_EQ(stored(), 0);
+
+  BlockContainer container(metrics, fd, device);
+  ASSERT_TRUE(container.open(true, ec));
+  std::vector<uint8_t> in(8 * TEST_BLOCK_SIZE);
+  ASSERT_TRUE(container.read(100, 8, in.data(), ec));
+  EXPECT_EQ(in, data);
+}
+
+// Test rewrites go in place when they fit and move when they grow
+TEST_F(BlockContainerTest, Rewrite) {
+  BlockContainer container(metrics, fd, device);
+  boost::system::error_code ec;
+  ASSERT_TRUE(container.open(false, ec));
+
+  auto a = pattern(4, 1), b = pattern(4, 2);
+  ASSERT_TRUE(container.write(0, 4, a.data(), ec));
+  off_t size = ::lseek(fd, 0, SEEK_END);
+  ASSERT_TRUE(container.write(0, 4, b.data(), ec));
+  EXPECT_EQ(::lseek(fd, 0, SEEK_END), size);
+
+  // Random data grows block 1 past its space, it alone moves
+  std::mt19937 gen(1);
+  std::vector<uint8_t> random(TEST_BLOCK_SIZE);
+  for (auto& byte : random) byte = gen();
+  std::copy(random.begin(), random.end(), b.begin() + TEST_BLOCK_SIZE);
+  ASSERT_TRUE(container.write(0, 4, b.data(), ec));
+  EXPECT_EQ(::lseek(fd, 0, SEEK_END), size + TEST_BLOCK_SIZE);
+
+  std::vector<uint8_t> in(4 * TEST_BLOCK_SIZE);
+  ASSERT_TRUE(container.read(0, 4, in.data(), ec));
+  EXPECT_EQ(in, b);
+}
+
+// Test trimmed and zero blocks read as zeros, trims giving up their space
+TEST_F(BlockContainerTest, Trim) {
+  BlockContainer container(metrics, fd, device);
+  boost::system::error_code ec;
+  ASSERT_TRUE(container.open(false, ec));
+
+  auto data = pattern(4, 3);
+  ASSERT_TRUE(container.write(10, 4, data.data(), ec));
+  int64_t used = stored();
+
+  std::vector<uint8_t> zero(TEST_BLOCK_SIZE);
+  ASSERT_TRUE(container.write(10, 1, zero.data(), ec));
+  EXPECT_EQ(stored(), used);
+  ASSERT_TRUE(container.trim(11, 2, ec));
+  EXPECT_GT(stored(), 0);
+  EXPECT_LT(stored(), used);
+
+  std::vector<uint8_t> in(4 * TEST_BLOCK_SIZE), expected(3 * TEST_BLOCK_SIZE);
+  expected.insert(expected.end(), data.begin() + 3 * TEST_BLOCK_SIZE, data.end());
+  ASSERT_TRUE(container.read(10, 4, in.data(), ec));
+  EXPECT_EQ(in, expected);
+}
+
+// Test a file of different geometry is refused
+TEST_F(BlockContainerTest, Geometry) {
+  boost::system::error_code ec;
+  ASSERT_TRUE(BlockContainer(metrics, fd, device).open(false, ec));
+
+  device.block_total = 512;
+  EXPECT_FALSE(BlockContainer(metrics, fd, device).open(false, ec));
+
+  // Nor is an empty file opened read only
+  ASSERT_EQ(::ftruncate(fd, 0), 0);
+  EXPECT_FALSE(BlockContainer(metrics, fd, device).open(true, ec));
+}
+
+}  // namespace cppserver
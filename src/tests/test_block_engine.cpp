@@ -0,0 +1,249 @@
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "block_engine.h"
+#include "device_db_file.h"
+#include "logger_stdio.h"
+#include "test_helpers.h"
+
+namespace cppserver {
+
+class BlockEngineTest : public ::testing::Test {
+ protected:
+  std::shared_ptr<Logger> logger = std::make_shared<LoggerStdIO>(LogLevel::ERROR);
+  std::shared_ptr<Metrics> metrics = std::make_shared<Metrics>();
+  std::filesystem::path dir = test_path();
+  std::unique_ptr<DeviceDBFile> db;
+  std::unique_ptr<BlockEngine> engine;
+
+  void SetUp() override {
+    std::filesystem::create_directories(dir);
+    std::ofstream(dir / "devices.conf") << "host 1 alpha " TEST_KEY "\n"
+                                        << "device 10 1 disk0 " << (dir / "disk0.img").string() << " 512 64\n"
+                                        << "device 11 1 disk1 " << (dir / "disk1.img").string() << " 512 64 iops=100\n"
+                                        << "device 12 1 disk3 " << (dir / "disk3.img").string() << " 512 64 lz4\n"
+                                        << "host 2 beta " TEST_KEY " bps=51200\n"
+                                        << "device 20 2 disk2 " << (dir / "disk2.img").string() << " 512 64\n";
+
+    db = std::make_unique<DeviceDBFile>(logger, (dir / "devices.conf").string());
+    ASSERT_TRUE(db->initialise());
+    engine = std::make_unique<BlockEngine>(logger, metrics, *db);
+  }
+
+  void TearDown() override {
+    engine.reset();
+    std::filesystem::remove_all(dir);
+  }
+
+  // Time n throttled requests of bytes each
+  double throttleSeconds(BlockHost& host, BlockDevice& device, int n, uint64_t bytes) {
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < n; i++) engine->throttle(host, device, bytes);
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  }
+};
+
+// Test attaching creates the device and blocks round trip
+TEST_F(BlockEngineTest, AttachReadWrite) {
+  std::shared_ptr<BlockHost> host;
+  std::shared_ptr<BlockDevice> device;
+  std::string error;
+  ASSERT_TRUE(engine->attach(1, 10, host, device, error)) << error;
+  EXPECT_EQ(std::filesystem::file_size(dir / "disk0.img"), 512 * 64);
+
+  boost::system::error_code ec;
+  std::vector<uint8_t> out(1024, 0x5A), in(1024);
+  ASSERT_TRUE(device->write(62, 2, out.data(), false, ec));
+  ASSERT_TRUE(device->flush(ec));
+  ASSERT_TRUE(device->read(62, 2, in.data(), ec));
+  EXPECT_EQ(in, out);
+
+  EXPECT_TRUE(device->valid_range(0, 64));
+  EXPECT_FALSE(device->valid_range(63, 2));
+
+  // Sessions share one device
+  std::shared_ptr<BlockDevice> again;
+  ASSERT_TRUE(engine->attach(1, 10, host, again, error));
+  EXPECT_EQ(device, again);
+}
+
+// Test cached reads see completed writes
+TEST_F(BlockEngineTest, Cache) {
+  BlockEngineOptions options;
+  options.cache_bytes = 16 * 512;
+  options.cache_block_size = 512;
+  engine = std::make_unique<BlockEngine>(logger, metrics, *db, options);
+
+  std::shared_ptr<BlockHost> host;
+  std::shared_ptr<BlockDevice> device;
+  std::string error;
+  ASSERT_TRUE(engine->attach(1, 10, host, device, error)) << error;
+
+  boost::system::error_code ec;
+  std::vector<uint8_t> in(512 * 8), out(512 * 8, 0x11);
+  ASSERT_TRUE(device->write(0, 8, out.data(), false, ec));
+  ASSERT_TRUE(device->read(2, 2, in.data(), ec));
+  ASSERT_TRUE(device->read(0, 8, in.data(), ec));
+  EXPECT_EQ(in, out);
+
+  std::fill(out.begin() + 512, out.end(), 0x22);
+  ASSERT_TRUE(device->write(1, 7, out.data() + 512, false, ec));
+  ASSERT_TRUE(device->read(0, 8, in.data(), ec));
+  EXPECT_EQ(in, out);
+
+  auto hits = metrics->counter("cppserver_cache_hits_total", "")->value();
+  EXPECT_EQ(hits, 3);
+}
+
+// Test trimmed blocks read as zeros without reading the disk
+TEST_F(BlockEngineTest, Trim) {
+  std::shared_ptr<BlockHost> host;
+  std::shared_ptr<BlockDevice> device;
+  std::string error;
+  ASSERT_TRUE(engine->attach(1, 10, host, device, error)) << error;
+
+  boost::system::error_code ec;
+  std::vector<uint8_t> in(512 * 64), out(512 * 64, 0x42);
+  ASSERT_TRUE(device->write(0, 64, out.data(), false, ec));
+  ASSERT_TRUE(device->trim(16, 32, ec));
+  ASSERT_TRUE(device->read(0, 64, in.data(), ec));
+
+  std::fill(out.begin() + 16 * 512, out.begin() + 48 * 512, 0);
+  EXPECT_EQ(in, out);
+  EXPECT_EQ(metrics->counter("cppserver_device_hole_read_bytes_total", "", "device=\"10\"")->value(), 32 * 512);
+}
+
+// Test compressed devices are stored as containers and read back what was written
+TEST_F(BlockEngineTest, Compressed) {
+  std::shared_ptr<BlockHost> host;
+  std::shared_ptr<BlockDevice> device;
+  std::string error;
+  ASSERT_TRUE(engine->attach(1, 12, host, device, error)) << error;
+
+  boost::system::error_code ec;
+  std::vector<uint8_t> out(64 * 512, 0x5A), in(64 * 512);
+  ASSERT_TRUE(device->write(0, 64, out.data(), true, ec));
+  ASSERT_TRUE(device->trim(16, 32, ec));
+  ASSERT_TRUE(device->read(0, 64, in.data(), ec));
+
+  std::fill(out.begin() + 16 * 512, out.begin() + 48 * 512, 0);
+  EXPECT_EQ(in, out);
+  EXPECT_LT(std::filesystem::file_size(dir / "disk3.img"), 512 * 64);
+  EXPECT_GT(metrics->counter("cppserver_compression_raw_bytes_total", "", "path=\"disk\"")->value(), 0);
+}
+
+// Test writes keep checksums that catch the file changing underneath
+TEST_F(BlockEngineTest, Checksums) {
+  std::shared_ptr<BlockHost> host;
+  std::shared_ptr<BlockDevice> device;
+  std::string error;
+  ASSERT_TRUE(engine->attach(1, 10, host, device, error)) << error;
+  ASSERT_TRUE(device->checksummed());
+  EXPECT_EQ(std::filesystem::file_size(dir / "disk0.img.crc"), 4 * 64);
+
+  boost::system::error_code ec;
+  std::vector<uint8_t> out(4 * 512, 0x5A), in(4 * 512);
+  ASSERT_TRUE(device->write(8, 4, out.data(), false, ec));
+  ASSERT_TRUE(device->trim(12, 1, ec));
+
+  std::fstream(dir / "disk0.img", std::ios::in | std::ios::out | std::ios::binary).seekp(9 * 512 + 100).put(0x00);
+  EXPECT_FALSE(device->read(8, 4, in.data(), ec));
+  EXPECT_EQ(ec, boost::system::errc::io_error);
+  EXPECT_TRUE(device->read(12, 1, in.data(), ec));
+  EXPECT_EQ(metrics->counter("cppserver_device_checksum_errors_total", "", "device=\"10\"")->value(), 1);
+
+  // Rewriting the block repairs it
+  ASSERT_TRUE(device->write(9, 1, out.data(), false, ec));
+  EXPECT_TRUE(device->read(8, 4, in.data(), ec));
+  EXPECT_EQ(in, out);
+}
+
+// Test a snapshot keeps the image as it was while writes continue, and deleting it merges them in
+TEST_F(BlockEngineTest, Snapshot) {
+  std::shared_ptr<BlockHost> host;
+  std::shared_ptr<BlockDevice> device;
+  std::string error;
+  ASSERT_TRUE(engine->attach(1, 10, host, device, error)) << error;
+
+  boost::system::error_code ec;
+  std::vector<uint8_t> before(64 * 512, 0x11), after(8 * 512, 0x22), in(64 * 512);
+  ASSERT_TRUE(device->write(0, 64, before.data(), false, ec));
+  EXPECT_FALSE(device->read_snapshot(0, 1, in.data(), ec));
+
+  ASSERT_TRUE(device->snapshot(ec)) << ec.message();
+  EXPECT_FALSE(device->snapshot(ec));
+  ASSERT_TRUE(device->write(4, 8, after.data(), false, ec));
+  ASSERT_TRUE(device->trim(40, 2, ec));
+
+  std::vector<uint8_t> current = before;
+  std::copy(after.begin(), after.end(), current.begin() + 4 * 512);
+  std::fill(current.begin() + 40 * 512, current.begin() + 42 * 512, 0);
+  ASSERT_TRUE(device->read(0, 64, in.data(), ec));
+  EXPECT_EQ(in, current);
+  ASSERT_TRUE(device->read_snapshot(0, 64, in.data(), ec));
+  EXPECT_EQ(in, before);
+
+  // The snapshot survives reopening the device
+  device.reset();
+  engine = std::make_unique<BlockEngine>(logger, metrics, *db);
+  ASSERT_TRUE(engine->attach(1, 10, host, device, error)) << error;
+  ASSERT_TRUE(device->read(0, 64, in.data(), ec));
+  EXPECT_EQ(in, current);
+
+  // And making it read only, when it is read through the overlay rather than sent from the file
+  Device frozen = device->device;
+  frozen.read_only = true;
+  {
+    BlockDevice read_only(logger, metrics, frozen);
+    ASSERT_TRUE(read_only.open(ec)) << ec.message();
+    ASSERT_TRUE(read_only.read(0, 64, in.data(), ec));
+    EXPECT_EQ(in, current);
+    int fd;
+    off_t offset;
+    EXPECT_FALSE(read_only.file_range(0, 64, fd, offset));
+    EXPECT_FALSE(read_only.delete_snapshot(ec));
+  }
+
+  ASSERT_TRUE(device->delete_snapshot(ec)) << ec.message();
+  EXPECT_FALSE(std::filesystem::exists(dir / "disk0.img.cow.map"));
+  ASSERT_TRUE(device->read(0, 64, in.data(), ec));
+  EXPECT_EQ(in, current);
+  EXPECT_FALSE(device->delete_snapshot(ec));
+}
+
+// Test hosts can only attach their own devices
+TEST_F(BlockEngineTest, AttachOwnership) {
+  std::shared_ptr<BlockHost> host;
+  std::shared_ptr<BlockDevice> device;
+  std::string error;
+  EXPECT_FALSE(engine->attach(1, 20, host, device, error));
+  EXPECT_FALSE(engine->attach(3, 10, host, device, error));
+  EXPECT_EQ(error, "Unknown host 3");
+}
+
+// Test device IOPS and host bandwidth limits delay requests rather than failing them
+TEST_F(BlockEngineTest, Throttle) {
+  std::shared_ptr<BlockHost> host;
+  std::shared_ptr<BlockDevice> device;
+  std::string error;
+
+  // Unlimited
+  ASSERT_TRUE(engine->attach(1, 10, host, device, error));
+  EXPECT_LT(throttleSeconds(*host, *device, 1000, 512), 0.05);
+
+  // 100 IOPS with a 10 request burst, 30 requests take about 0.2s
+  ASSERT_TRUE(engine->attach(1, 11, host, device, error));
+  EXPECT_NEAR(throttleSeconds(*host, *device, 30, 512), 0.2, 0.05);
+
+  // 50KiB/s with a 5KiB burst, 15KiB takes about 0.2s
+  ASSERT_TRUE(engine->attach(2, 20, host, device, error));
+  EXPECT_NEAR(throttleSeconds(*host, *device, 30, 512), 0.2, 0.05);
+  EXPECT_GT(host->throttle_latency->lifetime().count(), 0);
+}
+
+}  // namespace cppserver
@@ -0,0 +1,119 @@
+#include <gtest/gtest.h>
+
+#include <filesystem>
+#include <vector>
+
+#include "block_overlay.h"
+#include "test_helpers.h"
+
+namespace cppserver {
+
+#define TEST_BLOCK_SIZE 512
+#define TEST_BLOCK_TOTAL 100000
+
+class BlockOverlayTest : public ::testing::Test {
+ protected:
+  std::shared_ptr<Metrics> metrics = std::make_shared<Metrics>();
+  std::string base = test_path(".img").string();
+
+  void TearDown() override {
+    std::filesystem::remove(base + ".cow");
+    std::filesystem::remove(base + ".cow.map");
+  }
+
+  std::unique_ptr<BlockOverlay> makeOverlay() { return std::make_unique<BlockOverlay>(metrics, base, 1, TEST_BLOCK_SIZE, TEST_BLOCK_TOTAL); }
+
+  std::vector<uint8_t> readSlots(BlockOverlay& overlay, uint32_t slot, uint32_t count) {
+    std::vector<uint8_t> data(count * TEST_BLOCK_SIZE);
+    boost::system::error_code ec;
+    EXPECT_TRUE(overlay.read(slot, count, data.data(), ec));
+    return data;
+  }
+};
+
+// Test first writes take slots in order and rewrites stay in them
+TEST_F(BlockOverlayTest, Write) {
+  auto overlay = makeOverlay();
+  boost::system::error_code ec;
+  ASSERT_TRUE(overlay->create(ec)) << ec.message();
+
+  uint32_t slot;
+  EXPECT_FALSE(overlay->lookup(5000, slot));
+
+  std::vector<uint8_t> a(4 * TEST_BLOCK_SIZE, 0xAA), b(4 * TEST_BLOCK_SIZE, 0xBB);
+  ASSERT_TRUE(overlay->write(5000, 4, a.data(), ec));
+  ASSERT_TRUE(overlay->write(5002, 4, b.data(), ec));
+  EXPECT_EQ(overlay->blocks(), 6u);
+
+  // 5000-5003 in slots 0-3, 5004-5005 appended after
+  ASSERT_TRUE(overlay->lookup(5003, slot));
+  EXPECT_EQ(slot, 3u);
+  ASSERT_TRUE(overlay->lookup(5005, slot));
+  EXPECT_EQ(slot, 5u);
+  EXPECT_FALSE(overlay->lookup(5006, slot));
+
+  std::vector<uint8_t> expected(a.begin(), a.begin() + 2 * TEST_BLOCK_SIZE);
+  expected.insert(expected.end(), b.begin(), b.end());
+  EXPECT_EQ(readSlots(*overlay, 0, 6), expected);
+  EXPECT_EQ(metrics->gauge("cppserver_device_snapshot_blocks", "", "device=\"1\"")->value(), 6);
+}
+
+// Test zeroed blocks have no slot until written again
+TEST_F(BlockOverlayTest, Zero) {
+  auto overlay = makeOverlay();
+  boost::system::error_code ec;
+  ASSERT_TRUE(overlay->create(ec));
+
+  std::vector<uint8_t> a(2 * TEST_BLOCK_SIZE, 0xAA);
+  ASSERT_TRUE(overlay->write(10, 2, a.data(), ec));
+  ASSERT_TRUE(overlay->zero(0, 20000, ec));
+
+  uint32_t slot;
+  ASSERT_TRUE(overlay->lookup(11, slot));
+  EXPECT_EQ(slot, BLOCK_OVERLAY_ZERO);
+  ASSERT_TRUE(overlay->lookup(19999, slot));
+  EXPECT_EQ(slot, BLOCK_OVERLAY_ZERO);
+
+  ASSERT_TRUE(overlay->write(11, 1, a.data(), ec));
+  ASSERT_TRUE(overlay->lookup(11, slot));
+  EXPECT_EQ(slot, 2u);
+  EXPECT_EQ(overlay->blocks(), 20000u);
+}
+
+// Test the map is rebuilt on open and blocks are visited in order
+TEST_F(BlockOverlayTest, Reopen) {
+  boost::system::error_code ec;
+  EXPECT_FALSE(makeOverlay()->open(false, ec));
+  EXPECT_EQ(ec, boost::system::errc::no_such_file_or_directory);
+
+  std::vector<uint8_t> a(TEST_BLOCK_SIZE, 0xAA);
+  {
+    auto overlay = makeOverlay();
+    ASSERT_TRUE(overlay->create(ec));
+    ASSERT_TRUE(overlay->write(99999, 1, a.data(), ec));
+    ASSERT_TRUE(overlay->write(7, 1, a.data(), ec));
+    ASSERT_TRUE(overlay->zero(8, 1, ec));
+    ASSERT_TRUE(overlay->flush(ec));
+  }
+
+  auto overlay = makeOverlay();
+  ASSERT_TRUE(overlay->open(false, ec)) << ec.message();
+  std::vector<std::pair<uint64_t, uint32_t>> mapped;
+  overlay->for_each([&](uint64_t block, uint32_t slot) {
+    mapped.emplace_back(block, slot);
+    return true;
+  });
+  std::vector<std::pair<uint64_t, uint32_t>> expected = {{7, 1}, {8, BLOCK_OVERLAY_ZERO}, {99999, 0}};
+  EXPECT_EQ(mapped, expected);
+
+  // New blocks go after the existing slots
+  ASSERT_TRUE(overlay->write(50, 1, a.data(), ec));
+  uint32_t slot;
+  ASSERT_TRUE(overlay->lookup(50, slot));
+  EXPECT_EQ(slot, 2u);
+
+  overlay->remove();
+  EXPECT_FALSE(std::filesystem::exists(base + ".cow.map"));
+}
+
+}  // namespace cppserver
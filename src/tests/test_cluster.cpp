@@ -0,0 +1,145 @@
+#include <gtest/gtest.h>
+
+#include <boost/asio.hpp>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "block_engine.h"
+#include "device_db_file.h"
+#include "logger_stdio.h"
+#include "protocol.h"
+#include "tcp_server.h"
+#include "test_helpers.h"
+
+namespace cppserver {
+
+#define TEST_NODES 3
+#define TEST_DEVICES 150
+
+// Three nodes on loopback sharing one device database, each serving the devices the ring gives it
+class ClusterTest : public ::testing::Test {
+ protected:
+  std::shared_ptr<Logger> logger = std::make_shared<LoggerStdIO>(LogLevel::ERROR);
+  std::filesystem::path dir = test_path();
+  std::vector<std::string> nodes;
+  std::vector<std::unique_ptr<DeviceDBFile>> dbs;
+  std::vector<std::shared_ptr<BlockEngine>> engines;
+  std::vector<std::unique_ptr<TCPServer>> servers;
+
+  void SetUp() override {
+    std::filesystem::create_directories(dir);
+    std::ofstream conf(dir / "devices.conf");
+    conf << "host 1 alpha " TEST_KEY "\n";
+    for (int device = 1; device <= TEST_DEVICES; device++) {
+      conf << "device " << device << " 1 disk" << device << " " << (dir / "disk").string() << device << ".img 512 8\n";
+    }
+    conf.close();
+
+    // Nodes are named by the ports their servers are given, so the ring waits for them all
+    for (int node = 0; node < TEST_NODES; node++) {
+      dbs.push_back(std::make_unique<DeviceDBFile>(logger, (dir / "devices.conf").string()));
+      ASSERT_TRUE(dbs.back()->initialise());
+      engines.push_back(std::make_shared<BlockEngine>(logger, std::make_shared<Metrics>(), *dbs.back()));
+      servers.push_back(std::make_unique<TCPServer>(logger, std::make_shared<Metrics>(), engines.back(), 0, TCPServerOptions()));
+      nodes.push_back("127.0.0.1:" + std::to_string(servers.back()->port()));
+    }
+    auto ring = std::make_shared<HashRing>(nodes);
+    for (int node = 0; node < TEST_NODES; node++) {
+      engines[node]->cluster(nodes[node], ring);
+      servers[node]->start();
+    }
+  }
+
+  void TearDown() override {
+    for (auto& server : servers) {
+      if (server) server->stop();
+    }
+    servers.clear();
+    engines.clear();
+    std::filesystem::remove_all(dir);
+  }
+
+  // Attach to device at node, returning the response opcode and payload
+  std::pair<uint8_t, std::string> attach(const std::string& node, uint64_t device) {
+    boost::asio::io_context io_context;
+    boost::asio::ip::tcp::socket socket(io_context);
+    size_t colon = node.find(':');
+    socket.connect(boost::asio::ip::tcp::endpoint(boost::asio::ip::make_address(node.substr(0, colon)), std::stoi(node.substr(colon + 1))));
+
+    uint8_t request[FRAME_HEADER_SIZE + ATTACH_REQUEST_SIZE];
+    FrameHeader(OP_ATTACH, 0, ATTACH_REQUEST_SIZE, 1).pack(request);
+    put_u64(request + FRAME_HEADER_SIZE, 1);
+    put_u64(request + FRAME_HEADER_SIZE + 8, device);
+    boost::asio::write(socket, boost::asio::buffer(request));
+
+    uint8_t header_bytes[FRAME_HEADER_SIZE];
+    boost::asio::read(socket, boost::asio::buffer(header_bytes));
+    FrameHeader header;
+    EXPECT_TRUE(header.parse(header_bytes));
+    std::string payload(header.length, '\0');
+    boost::asio::read(socket, boost::asio::buffer(payload));
+    return {header.opcode, payload};
+  }
+
+  // Attach to every device through the first node, following redirects. Returns the node each was served by.
+  std::map<uint64_t, std::string> attachAll() {
+    std::map<uint64_t, std::string> served;
+    for (uint64_t device = 1; device <= TEST_DEVICES; device++) {
+      std::string node = nodes[0];
+      auto response = attach(node, device);
+      if (response.first == OP_REDIRECT) {
+        node = response.second;
+        response = attach(node, device);
+      }
+      EXPECT_EQ(response.first, OP_ATTACH) << "device " << device << ": " << response.second;
+      served[device] = node;
+    }
+    return served;
+  }
+};
+
+// Test devices spread evenly over the nodes, each attached at its own node after at most one redirect
+TEST_F(ClusterTest, Spread) {
+  auto served = attachAll();
+
+  std::map<std::string, int> counts;
+  for (const auto& device : served) counts[device.second]++;
+  ASSERT_EQ(counts.size(), size_t(TEST_NODES));
+  for (const auto& count : counts) {
+    EXPECT_GT(count.second, TEST_DEVICES / TEST_NODES * 0.7) << count.first;
+    EXPECT_LT(count.second, TEST_DEVICES / TEST_NODES * 1.3) << count.first;
+  }
+}
+
+// Test when a node leaves only its devices move, and a node no longer serving a device redirects it
+TEST_F(ClusterTest, Leave) {
+  auto before = attachAll();
+
+  auto ring = std::make_shared<HashRing>(std::vector<std::string>{nodes[0], nodes[1]});
+  for (auto& engine : engines) engine->cluster(nodes[&engine - &engines[0]], ring);
+  auto after = attachAll();
+
+  int moved = 0;
+  for (uint64_t device = 1; device <= TEST_DEVICES; device++) {
+    if (before[device] == nodes[2]) {
+      EXPECT_NE(after[device], nodes[2]);
+      moved++;
+    } else {
+      EXPECT_EQ(after[device], before[device]);
+    }
+  }
+  EXPECT_GT(moved, 0);
+
+  for (uint64_t device = 1; device <= TEST_DEVICES; device++) {
+    if (before[device] != nodes[2]) continue;
+    auto response = attach(nodes[2], device);
+    EXPECT_EQ(response.first, OP_REDIRECT);
+    EXPECT_EQ(response.second, after[device]);
+    break;
+  }
+}
+
+}  // namespace cppserver
@@ -0,0 +1,75 @@
+#include <gtest/gtest.h>
+
+#include <filesystem>
+#include <fstream>
+#include <string>
+
+#include "device_db_file.h"
+#include "logger_stdio.h"
+#include "test_helpers.h"
+
+namespace cppserver {
+
+class DeviceDBFileTest : public ::testing::Test {
+ protected:
+  std::shared_ptr<Logger> logger = std::make_shared<LoggerStdIO>(LogLevel::ERROR);
+  std::string filename = test_path(".conf").string();
+
+  void write(const std::string& content) { std::ofstream(filename) << content; }
+
+  void TearDown() override { std::filesystem::remove(filename); }
+};
+
+// Test hosts and devices are loaded with their limits
+TEST_F(DeviceDBFileTest, Load) {
+  write("# Test database\n"
+        "host 1 alpha " TEST_KEY " iops=100 bps=1048576\n"
+        "device 10 1 disk0 /tmp/disk0.img 4096 256\n"
+        "device 11 1 disk1 /tmp/disk1.img 512 1024 ro iops=50\n"
+        "\n"
+        "host 2 beta " TEST_KEY "\n");
+
+  DeviceDBFile db(logger, filename);
+  ASSERT_TRUE(db.initialise());
+
+  auto host = db.get_host(1);
+  ASSERT_TRUE(host);
+  EXPECT_EQ(host->name, "alpha");
+  EXPECT_EQ(host->aes_key[31], 0x1f);
+  EXPECT_EQ(host->iops_limit, 100);
+  EXPECT_EQ(host->bps_limit, 1048576);
+  EXPECT_EQ(host->devices, std::vector<uint64_t>({10, 11}));
+
+  auto device = db.get_device(11);
+  ASSERT_TRUE(device);
+  EXPECT_EQ(device->filename, "/tmp/disk1.img");
+  EXPECT_EQ(device->block_size, 512);
+  EXPECT_EQ(device->block_total, 1024);
+  EXPECT_TRUE(device->read_only);
+  EXPECT_EQ(device->iops_limit, 50);
+  EXPECT_EQ(device->bps_limit, 0);
+
+  EXPECT_EQ(db.get_host_devices(1).size(), 2);
+  EXPECT_TRUE(db.get_host_devices(2).empty());
+  EXPECT_FALSE(db.get_host(3));
+  EXPECT_FALSE(db.get_device(12));
+}
+
+// Test malformed records are rejected
+TEST_F(DeviceDBFileTest, BadRecords) {
+  DeviceDBFile db(logger, filename);
+
+  write("host 1 alpha 0011\n");
+  EXPECT_FALSE(db.initialise());
+
+  write("device 10 1 disk0 /tmp/disk0.img 4096 256\n");
+  EXPECT_FALSE(db.initialise());
+
+  write("host 1 alpha " TEST_KEY " speed=10\n");
+  EXPECT_FALSE(db.initialise());
+
+  std::filesystem::remove(filename);
+  EXPECT_FALSE(db.initialise());
+}
+
+}  // namespace cppserver
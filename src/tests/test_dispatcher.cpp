@@ -0,0 +1,79 @@
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "dispatcher.h"
+
+namespace cppserver {
+
+class DispatcherTest : public ::testing::Test {
+ protected:
+  std::shared_ptr<Metrics> metrics = std::make_shared<Metrics>();
+};
+
+// Test queues take turns, so one with a backlog does not hold back another
+TEST_F(DispatcherTest, Fair) {
+  Dispatcher dispatcher(metrics, 1);
+  Dispatcher::Queue busy, quiet;
+
+  // Hold the only worker while both queues fill
+  std::promise<void> started, release;
+  std::shared_future<void> released = release.get_future().share();
+  dispatcher.submit(busy, [&started, released]() {
+    started.set_value();
+    released.wait();
+  });
+  started.get_future().wait();
+
+  std::mutex mutex;
+  std::vector<int> order;
+  std::promise<void> done;
+  for (int i = 0; i < 100; i++) {
+    dispatcher.submit(busy, [&, i]() {
+      std::lock_guard<std::mutex> lock(mutex);
+      order.push_back(i);
+    });
+  }
+  dispatcher.submit(quiet, [&]() {
+    std::lock_guard<std::mutex> lock(mutex);
+    order.push_back(-1);
+  });
+  dispatcher.submit(busy, [&]() { done.set_value(); });
+  release.set_value();
+  done.get_future().wait();
+
+  // The quiet queue's one request runs second, not after the backlog
+  ASSERT_EQ(order.size(), 101u);
+  EXPECT_EQ(order[0], 0);
+  EXPECT_EQ(order[1], -1);
+  for (int i = 1; i < 100; i++) EXPECT_EQ(order[i + 1], i);
+}
+
+// Test a request that blocks does not stop the other workers running later ones
+TEST_F(DispatcherTest, Concurrent) {
+  Dispatcher dispatcher(metrics, 4);
+  Dispatcher::Queue queue;
+
+  std::promise<void> release;
+  std::shared_future<void> released = release.get_future().share();
+  std::atomic<bool> slow_done{false};
+  dispatcher.submit(queue, [&, released]() {
+    released.wait();
+    slow_done = true;
+  });
+
+  std::promise<void> fast;
+  dispatcher.submit(queue, [&]() { fast.set_value(); });
+  EXPECT_EQ(fast.get_future().wait_for(std::chrono::seconds(5)), std::future_status::ready);
+  EXPECT_FALSE(slow_done);
+
+  release.set_value();
+  while (!slow_done) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+}
+
+}  // namespace cppserver
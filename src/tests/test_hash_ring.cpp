@@ -0,0 +1,71 @@
+#include <gtest/gtest.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "hash_ring.h"
+
+namespace cppserver {
+
+#define TEST_DEVICES 30000
+
+class HashRingTest : public ::testing::Test {
+ protected:
+  std::vector<std::string> nodes = {"10.0.0.1:26547", "10.0.0.2:26547", "10.0.0.3:26547"};
+
+  std::map<std::string, int> shares(const HashRing& ring) {
+    std::map<std::string, int> counts;
+    for (uint64_t device = 0; device < TEST_DEVICES; device++) counts[ring.owner(device)]++;
+    return counts;
+  }
+};
+
+// Test every node gets close to an even share of devices
+TEST_F(HashRingTest, Balance) {
+  HashRing ring(nodes);
+  auto counts = shares(ring);
+  ASSERT_EQ(counts.size(), 3u);
+  for (const auto& count : counts) {
+    EXPECT_GT(count.second, TEST_DEVICES / 3 * 0.85) << count.first;
+    EXPECT_LT(count.second, TEST_DEVICES / 3 * 1.15) << count.first;
+  }
+}
+
+// Test owners depend only on the set of nodes
+TEST_F(HashRingTest, Stable) {
+  HashRing ring(nodes);
+  HashRing reordered({nodes[2], nodes[0], nodes[1], nodes[0]});
+  EXPECT_EQ(reordered.nodes().size(), 3u);
+  for (uint64_t device = 0; device < 1000; device++) EXPECT_EQ(ring.owner(device), reordered.owner(device));
+
+  EXPECT_TRUE(ring.contains(nodes[1]));
+  EXPECT_FALSE(ring.contains("10.0.0.4:26547"));
+  EXPECT_EQ(HashRing({}).owner(1), "");
+}
+
+// Test a node joining only takes devices for itself, and leaving only gives its own away
+TEST_F(HashRingTest, Rebalance) {
+  HashRing ring(nodes);
+  std::vector<std::string> grown = nodes;
+  grown.push_back("10.0.0.4:26547");
+  HashRing joined(grown);
+
+  int moved = 0;
+  for (uint64_t device = 0; device < TEST_DEVICES; device++) {
+    if (ring.owner(device) == joined.owner(device)) continue;
+    EXPECT_EQ(joined.owner(device), "10.0.0.4:26547");
+    moved++;
+  }
+  EXPECT_GT(moved, TEST_DEVICES / 4 * 0.85);
+  EXPECT_LT(moved, TEST_DEVICES / 4 * 1.15);
+
+  HashRing left({nodes[0], nodes[2]});
+  for (uint64_t device = 0; device < TEST_DEVICES; device++) {
+    if (ring.owner(device) != nodes[1]) {
+      EXPECT_EQ(left.owner(device), ring.owner(device));
+    }
+  }
+}
+
+}  // namespace cppserver
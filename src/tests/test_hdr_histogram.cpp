@@ -0,0 +1,100 @@
+#include <gtest/gtest.h>
+
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "hdr_histogram.h"
+
+namespace cppserver {
+
+class HdrHistogramTest : public ::testing::Test {
+ protected:
+  // Values within 3 significant digits of expected
+  void expectClose(uint64_t actual, uint64_t expected) { EXPECT_NEAR(static_cast<double>(actual), static_cast<double>(expected), expected * 0.001 + 1); }
+};
+
+// Test an empty histogram
+TEST_F(HdrHistogramTest, Empty) {
+  HdrHistogram histogram(3600000000, 3);
+  EXPECT_EQ(histogram.count(), 0);
+  EXPECT_EQ(histogram.value_at_percentile(99), 0);
+  EXPECT_EQ(histogram.min(), 0);
+  EXPECT_EQ(histogram.max(), 0);
+}
+
+// Test small values are recorded exactly
+TEST_F(HdrHistogramTest, ExactSmallValues) {
+  HdrHistogram histogram(3600000000, 3);
+  for (uint64_t i = 1; i <= 1000; i++) histogram.record(i);
+
+  EXPECT_EQ(histogram.count(), 1000);
+  EXPECT_EQ(histogram.min(), 1);
+  EXPECT_EQ(histogram.max(), 1000);
+  EXPECT_EQ(histogram.value_at_percentile(50), 500);
+  EXPECT_EQ(histogram.value_at_percentile(99), 990);
+  EXPECT_DOUBLE_EQ(histogram.mean(), 500.5);
+}
+
+// Test percentiles of large values are within precision
+TEST_F(HdrHistogramTest, LargeValuePrecision) {
+  HdrHistogram histogram(3600000000, 3);
+  for (uint64_t i = 1; i <= 10000; i++) histogram.record(i * 1000);
+
+  expectClose(histogram.value_at_percentile(50), 5000000);
+  expectClose(histogram.value_at_percentile(99), 9900000);
+  expectClose(histogram.value_at_percentile(99.9), 9990000);
+  expectClose(histogram.max(), 10000000);
+}
+
+// Test out of range values are clamped
+TEST_F(HdrHistogramTest, Clamp) {
+  HdrHistogram histogram(100000, 3);
+  histogram.record(0);
+  histogram.record(1000000);
+  EXPECT_EQ(histogram.min(), 1);
+  expectClose(histogram.max(), 100000);
+}
+
+// Test merge and subtract
+TEST_F(HdrHistogramTest, MergeSubtract) {
+  HdrHistogram a(3600000000, 3);
+  HdrHistogram b(3600000000, 3);
+  for (int i = 0; i < 100; i++) a.record(10);
+  for (int i = 0; i < 100; i++) b.record(1000);
+
+  HdrHistogram merged(a);
+  merged.merge(b);
+  EXPECT_EQ(merged.count(), 200);
+  EXPECT_EQ(merged.value_at_percentile(50), 10);
+  EXPECT_EQ(merged.value_at_percentile(51), 1000);
+
+  merged.subtract(a);
+  EXPECT_EQ(merged.count(), 100);
+  EXPECT_EQ(merged.min(), 1000);
+}
+
+// Test merging histograms with different configurations
+TEST_F(HdrHistogramTest, MergeIncompatible) {
+  HdrHistogram a(3600000000, 3);
+  HdrHistogram b(3600000000, 2);
+  EXPECT_THROW(a.merge(b), std::invalid_argument);
+}
+
+// Test concurrent recording loses nothing
+TEST_F(HdrHistogramTest, ConcurrentRecord) {
+  HdrHistogram histogram(3600000000, 3);
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 8; t++) {
+    threads.emplace_back([&]() {
+      for (uint64_t i = 1; i <= 10000; i++) histogram.record(i);
+    });
+  }
+  for (auto& thread : threads) thread.join();
+
+  EXPECT_EQ(histogram.count(), 80000);
+  EXPECT_EQ(histogram.sum(), 8 * 50005000ULL);
+}
+
+}  // namespace cppserver
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <gtest/gtest.h>
+#include <unistd.h>
+
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "block_engine.h"
+#include "device_db_file.h"
+#include "logger_stdio.h"
+
+namespace cppserver {
+
+#define TEST_KEY "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f"
+// Geometry of BlockServerTest's devices
+#define TEST_DEVICE_BLOCK_SIZE 512
+#define TEST_DEVICE_BLOCKS 1024
+
+// A temporary path of the running test's own, named for the test and process so
+// tests can run in parallel, with suffix appended
+inline std::filesystem::path test_path(const std::string& suffix = "") {
+  const ::testing::TestInfo* info = ::testing::UnitTest::GetInstance()->current_test_info();
+  std::string name = "cppserver_" + std::string(info->test_suite_name()) + "_" + info->name() + "_" + std::to_string(::getpid()) + suffix;
+  return std::filesystem::temp_directory_path() / name;
+}
+
+// Devices for a server in front of an engine to serve, described by a
+// devices.conf in a directory of the test's own: host 1 with device 1, disk,
+// and device 2, rodisk, a read only copy of the pattern.
+class BlockServerTest : public ::testing::Test {
+ protected:
+  std::shared_ptr<Logger> logger = std::make_shared<LoggerStdIO>(LogLevel::ERROR);
+  std::shared_ptr<Metrics> metrics = std::make_shared<Metrics>();
+  std::filesystem::path dir = test_path();
+  std::vector<std::unique_ptr<DeviceDBFile>> dbs;
+
+  void SetUp() override {
+    std::filesystem::create_directories(dir);
+    std::ofstream conf(dir / "devices.conf");
+    conf << "host 1 alpha " TEST_KEY "\n";
+    conf << "device 1 1 disk " << (dir / "disk.img").string() << " " << TEST_DEVICE_BLOCK_SIZE << " " << TEST_DEVICE_BLOCKS << "\n";
+    conf << "device 2 1 rodisk " << (dir / "rodisk.img").string() << " " << TEST_DEVICE_BLOCK_SIZE << " " << TEST_DEVICE_BLOCKS << " ro\n";
+    conf.close();
+    // A read only device is not created on first use
+    std::vector<uint8_t> image = pattern(0, TEST_DEVICE_BLOCKS);
+    std::ofstream(dir / "rodisk.img", std::ios::binary).write(reinterpret_cast<const char*>(image.data()), image.size());
+  }
+
+  // Stop servers before this removes the devices
+  void TearDown() override { std::filesystem::remove_all(dir); }
+
+  // An engine over a database of its own
+  std::shared_ptr<BlockEngine> open_engine() {
+    dbs.push_back(std::make_unique<DeviceDBFile>(logger, (dir / "devices.conf").string()));
+    EXPECT_TRUE(dbs.back()->initialise());
+    return std::make_shared<BlockEngine>(logger, std::make_shared<Metrics>(), *dbs.back());
+  }
+
+  // Data for count blocks from block, different in every block
+  static std::vector<uint8_t> pattern(uint64_t block, uint32_t count) {
+    std::vector<uint8_t> data(size_t(count) * TEST_DEVICE_BLOCK_SIZE);
+    for (size_t i = 0; i < data.size(); i++) data[i] = uint8_t(block * 31 + i / TEST_DEVICE_BLOCK_SIZE * 7 + i);
+    return data;
+  }
+};
+
+}  // namespace cppserver
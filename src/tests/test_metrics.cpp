@@ -0,0 +1,118 @@
+#include <gtest/gtest.h>
+
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "metrics.h"
+
+namespace cppserver {
+
+class MetricsTest : public ::testing::Test {
+ protected:
+  Metrics metrics;
+};
+
+// Test counter aggregation across threads
+TEST_F(MetricsTest, CounterAcrossThreads) {
+  auto counter = metrics.counter("test_total", "Test counter");
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 8; t++) {
+    threads.emplace_back([&]() {
+      for (int i = 0; i < 1000; i++) counter->inc();
+    });
+  }
+  for (auto& thread : threads) thread.join();
+
+  EXPECT_EQ(counter->value(), 8000);
+}
+
+// Test gauge inc/dec
+TEST_F(MetricsTest, GaugeIncDec) {
+  auto gauge = metrics.gauge("test_gauge", "Test gauge");
+  gauge->inc(5);
+  gauge->dec(2);
+  EXPECT_EQ(gauge->value(), 3);
+}
+
+// Test the same name returns the same metric
+TEST_F(MetricsTest, GetOrCreate) {
+  auto a = metrics.counter("test_total", "Test counter");
+  auto b = metrics.counter("test_total", "Test counter");
+  EXPECT_EQ(a, b);
+}
+
+// Test registering a name twice with different types
+TEST_F(MetricsTest, TypeMismatch) {
+  metrics.counter("test_metric", "Test counter");
+  EXPECT_THROW(metrics.gauge("test_metric", "Test gauge"), std::runtime_error);
+}
+
+// Test histogram bucketing is cumulative
+TEST_F(MetricsTest, HistogramSnapshot) {
+  auto histogram = metrics.histogram("test_seconds", "Test histogram", {1, 2, 5});
+  histogram->observe(0.5);
+  histogram->observe(1);
+  histogram->observe(3);
+  histogram->observe(10);
+
+  std::vector<uint64_t> buckets;
+  uint64_t count;
+  double sum;
+  histogram->snapshot(buckets, count, sum);
+
+  EXPECT_EQ(buckets, std::vector<uint64_t>({2, 2, 3, 4}));
+  EXPECT_EQ(count, 4);
+  EXPECT_DOUBLE_EQ(sum, 14.5);
+}
+
+// Test Prometheus text output
+TEST_F(MetricsTest, PrometheusFormat) {
+  metrics.counter("test_total", "Test counter")->inc(3);
+  metrics.histogram("test_seconds", "Test histogram", {0.5})->observe(0.25);
+
+  std::string out = metrics.to_prometheus();
+  EXPECT_NE(out.find("# TYPE test_total counter\ntest_total 3\n"), std::string::npos);
+  EXPECT_NE(out.find("# TYPE test_seconds histogram\n"), std::string::npos);
+  EXPECT_NE(out.find("test_seconds_bucket{le=\"0.5\"} 1\n"), std::string::npos);
+  EXPECT_NE(out.find("test_seconds_bucket{le=\"+Inf\"} 1\n"), std::string::npos);
+  EXPECT_NE(out.find("test_seconds_count 1\n"), std::string::npos);
+}
+
+// Test latency intervals only cover values since the previous rotation
+TEST_F(MetricsTest, LatencyRotate) {
+  auto latency = metrics.latency("test_latency_seconds", "Test latency");
+  for (int i = 0; i < 100; i++) latency->record(1000);
+  metrics.rotate();
+  EXPECT_EQ(latency->interval().count(), 100);
+
+  for (int i = 0; i < 10; i++) latency->record(2000000);
+  metrics.rotate();
+
+  HdrHistogram interval = latency->interval();
+  EXPECT_EQ(interval.count(), 10);
+  EXPECT_NEAR(interval.min(), 2000000, 2000);
+  EXPECT_EQ(latency->lifetime().count(), 110);
+
+  std::string out = metrics.to_prometheus();
+  EXPECT_NE(out.find("# TYPE test_latency_seconds summary\n"), std::string::npos);
+  EXPECT_NE(out.find("test_latency_seconds_count{window=\"interval\"} 10\n"), std::string::npos);
+  EXPECT_NE(out.find("test_latency_seconds_count{window=\"lifetime\"} 110\n"), std::string::npos);
+}
+
+// Test labelled series share one family header
+TEST_F(MetricsTest, Labels) {
+  metrics.counter("test_total", "Test counter", "host=\"1\"")->inc(2);
+  metrics.counter("test_total", "Test counter", "host=\"2\"")->inc(5);
+  metrics.counter("test_total_other", "Other counter");
+  metrics.latency("test_latency_seconds", "Test latency", "host=\"1\"")->record(1000);
+  EXPECT_NE(metrics.counter("test_total", "Test counter", "host=\"1\""), metrics.counter("test_total", "Test counter", "host=\"2\""));
+  EXPECT_THROW(metrics.gauge("test_total", "Test gauge", "host=\"3\""), std::runtime_error);
+
+  std::string out = metrics.to_prometheus();
+  EXPECT_NE(out.find("# TYPE test_total counter\ntest_total{host=\"1\"} 2\ntest_total{host=\"2\"} 5\n"), std::string::npos);
+  EXPECT_NE(out.find("test_latency_seconds_count{host=\"1\",window=\"lifetime\"} 1\n"), std::string::npos);
+}
+
+}  // namespace cppserver
@@ -0,0 +1,328 @@
+#include <arpa/inet.h>
+#include <gtest/gtest.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <filesystem>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "nbd_protocol.h"
+#include "nbd_server.h"
+#include "protocol.h"
+#include "test_helpers.h"
+
+namespace cppserver {
+
+// A minimal NBD client, speaking the protocol as a stock one would
+class NBDTestClient {
+ public:
+  class Reply {
+   public:
+    uint64_t cookie = 0;
+    uint32_t error = 0;
+    std::vector<uint8_t> data;
+  };
+
+  int fd = -1;
+  bool structured = false;
+  uint64_t size = 0;
+  uint16_t flags = 0;
+  uint32_t min_block_size = 0;
+
+  ~NBDTestClient() {
+    if (fd >= 0) ::close(fd);
+  }
+
+  bool connect(uint16_t port) {
+    fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (::connect(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0) return false;
+
+    uint8_t greeting[18];
+    if (!receive(greeting, sizeof(greeting)) || get_u64(greeting) != NBD_MAGIC || get_u64(greeting + 8) != NBD_OPTION_MAGIC) return false;
+    if (!(get_u16(greeting + 16) & NBD_FLAG_FIXED_NEWSTYLE)) return false;
+    uint8_t client[4];
+    put_u32(client, NBD_FLAG_C_FIXED_NEWSTYLE | NBD_FLAG_C_NO_ZEROES);
+    return send(client, sizeof(client));
+  }
+
+  void send_option(uint32_t option, const std::vector<uint8_t>& data) {
+    std::vector<uint8_t> packed(NBD_OPTION_HEADER_SIZE + data.size());
+    put_u64(packed.data(), NBD_OPTION_MAGIC);
+    put_u32(packed.data() + 8, option);
+    put_u32(packed.data() + 12, data.size());
+    std::copy(data.begin(), data.end(), packed.begin() + NBD_OPTION_HEADER_SIZE);
+    send(packed.data(), packed.size());
+  }
+
+  // Send an option and read its replies up to ACK or an error, which is last
+  std::vector<std::pair<uint32_t, std::vector<uint8_t>>> option(uint32_t option, const std::vector<uint8_t>& data = {}) {
+    send_option(option, data);
+    std::vector<std::pair<uint32_t, std::vector<uint8_t>>> replies;
+    for (;;) {
+      uint8_t header[NBD_OPTION_REPLY_HEADER_SIZE];
+      if (!receive(header, sizeof(header)) || get_u64(header) != NBD_OPTION_REPLY_MAGIC || get_u32(header + 8) != option) break;
+      std::vector<uint8_t> reply(get_u32(header + 16));
+      if (!receive(reply.data(), reply.size())) break;
+      uint32_t type = get_u32(header + 12);
+      replies.emplace_back(type, reply);
+      if (type == NBD_REP_ACK || (type & 0x80000000)) break;
+    }
+    return replies;
+  }
+
+  // Asking for the block size unless told not to, which the server refuses
+  static std::vector<uint8_t> info_request(const std::string& name, bool block_size = true) {
+    std::vector<uint8_t> data(6 + name.size() + (block_size ? 2 : 0));
+    put_u32(data.data(), name.size());
+    std::copy(name.begin(), name.end(), data.begin() + 4);
+    put_u16(data.data() + 4 + name.size(), block_size ? 1 : 0);
+    if (block_size) put_u16(data.data() + 6 + name.size(), NBD_INFO_BLOCK_SIZE);
+    return data;
+  }
+
+  // Negotiate structured replies if asked, then GO, keeping the export's geometry
+  bool go(const std::string& name, bool structured_replies = true) {
+    if (structured_replies) {
+      auto replies = option(NBD_OPT_STRUCTURED_REPLY);
+      structured = replies.size() == 1 && replies[0].first == NBD_REP_ACK;
+      if (!structured) return false;
+    }
+    auto replies = option(NBD_OPT_GO, info_request(name));
+    if (replies.empty() || replies.back().first != NBD_REP_ACK) return false;
+    for (auto& reply : replies) {
+      if (reply.first != NBD_REP_INFO) continue;
+      if (get_u16(reply.second.data()) == NBD_INFO_EXPORT) {
+        size = get_u64(reply.second.data() + 2);
+        flags = get_u16(reply.second.data() + 10);
+      } else if (get_u16(reply.second.data()) == NBD_INFO_BLOCK_SIZE) {
+        min_block_size = get_u32(reply.second.data() + 2);
+      }
+    }
+    return true;
+  }
+
+  void request(uint16_t type, uint16_t command_flags, uint64_t cookie, uint64_t offset, uint32_t length, const uint8_t* data = nullptr) {
+    uint8_t packed[NBD_REQUEST_SIZE];
+    put_u32(packed, NBD_REQUEST_MAGIC);
+    put_u16(packed + 4, command_flags);
+    put_u16(packed + 6, type);
+    put_u64(packed + 8, cookie);
+    put_u64(packed + 16, offset);
+    put_u32(packed + 24, length);
+    send(packed, sizeof(packed));
+    if (data) send(data, length);
+    if (type == NBD_CMD_READ) _read_lengths[cookie] = length;
+  }
+
+  bool reply(Reply& reply) {
+    uint8_t magic[4];
+    if (!receive(magic, sizeof(magic))) return false;
+    if (get_u32(magic) == NBD_SIMPLE_REPLY_MAGIC) {
+      uint8_t rest[NBD_SIMPLE_REPLY_SIZE - 4];
+      if (!receive(rest, sizeof(rest))) return false;
+      reply.error = get_u32(rest);
+      reply.cookie = get_u64(rest + 4);
+      auto read = _read_lengths.find(reply.cookie);
+      if (read != _read_lengths.end()) {
+        if (!reply.error) reply.data.resize(read->second);
+        _read_lengths.erase(read);
+      }
+      return receive(reply.data.data(), reply.data.size());
+    }
+    if (get_u32(magic) != NBD_STRUCTURED_REPLY_MAGIC) return false;
+
+    for (;;) {
+      uint8_t rest[NBD_STRUCTURED_REPLY_SIZE - 4];
+      if (!receive(rest, sizeof(rest))) return false;
+      uint16_t chunk_flags = get_u16(rest);
+      uint16_t type = get_u16(rest + 2);
+      reply.cookie = get_u64(rest + 4);
+      std::vector<uint8_t> payload(get_u32(rest + 12));
+      if (!receive(payload.data(), payload.size())) return false;
+      if (type == NBD_REPLY_TYPE_OFFSET_DATA) reply.data.insert(reply.data.end(), payload.begin() + 8, payload.end());
+      if (type == NBD_REPLY_TYPE_ERROR) reply.error = get_u32(payload.data());
+      if (chunk_flags & NBD_REPLY_FLAG_DONE) break;
+      if (!receive(magic, sizeof(magic))) return false;
+    }
+    _read_lengths.erase(reply.cookie);
+    return true;
+  }
+
+  // Send one request and wait for its reply
+  Reply call(uint16_t type, uint64_t offset, uint32_t length, const uint8_t* data = nullptr, uint16_t command_flags = 0) {
+    request(type, command_flags, ++_cookie, offset, length, data);
+    Reply result;
+    EXPECT_TRUE(reply(result));
+    EXPECT_EQ(result.cookie, _cookie);
+    return result;
+  }
+
+  bool send(const void* data, size_t len) { return ::send(fd, data, len, MSG_NOSIGNAL) == ssize_t(len); }
+
+  bool receive(void* data, size_t len) { return len == 0 || ::recv(fd, data, len, MSG_WAITALL) == ssize_t(len); }
+
+ private:
+  uint64_t _cookie = 0;
+  std::map<uint64_t, uint32_t> _read_lengths;
+};
+
+// A server exporting host 1's devices, disk and a read only copy
+class NBDServerTest : public BlockServerTest {
+ protected:
+  std::shared_ptr<BlockEngine> engine;
+  std::unique_ptr<NBDServer> server;
+
+  void SetUp() override {
+    BlockServerTest::SetUp();
+    engine = open_engine();
+    NBDServerOptions options;
+    options.host_id = 1;
+    server = std::make_unique<NBDServer>(logger, metrics, engine, 0, options);
+    server->start();
+  }
+
+  void TearDown() override {
+    if (server) server->stop();
+    server.reset();
+    engine.reset();
+    BlockServerTest::TearDown();
+  }
+};
+
+// Test LIST names every export and INFO describes one without attaching
+TEST_F(NBDServerTest, Options) {
+  NBDTestClient client;
+  ASSERT_TRUE(client.connect(server->port()));
+
+  auto replies = client.option(NBD_OPT_LIST);
+  ASSERT_EQ(replies.size(), 3u);
+  std::set<std::string> names;
+  for (size_t i = 0; i < 2; i++) {
+    EXPECT_EQ(replies[i].first, NBD_REP_SERVER);
+    names.insert(std::string(replies[i].second.begin() + 4, replies[i].second.end()));
+  }
+  EXPECT_EQ(names, std::set<std::string>({"disk", "rodisk"}));
+  EXPECT_EQ(replies[2].first, NBD_REP_ACK);
+
+  replies = client.option(NBD_OPT_INFO, NBDTestClient::info_request("2"));
+  ASSERT_EQ(replies.size(), 3u);
+  EXPECT_EQ(get_u64(replies[0].second.data() + 2), uint64_t(TEST_DEVICE_BLOCKS) * TEST_DEVICE_BLOCK_SIZE);
+  EXPECT_TRUE(get_u16(replies[0].second.data() + 10) & NBD_FLAG_READ_ONLY);
+  EXPECT_EQ(get_u32(replies[1].second.data() + 2), uint32_t(TEST_DEVICE_BLOCK_SIZE));
+
+  // A client that has not agreed to the block size cannot use the export
+  replies = client.option(NBD_OPT_INFO, NBDTestClient::info_request("2", false));
+  ASSERT_EQ(replies.size(), 1u);
+  EXPECT_EQ(replies[0].first, NBD_REP_ERR_BLOCK_SIZE_REQD);
+  replies = client.option(NBD_OPT_GO, NBDTestClient::info_request("disk", false));
+  ASSERT_EQ(replies.size(), 1u);
+  EXPECT_EQ(replies[0].first, NBD_REP_ERR_BLOCK_SIZE_REQD);
+
+  replies = client.option(NBD_OPT_GO, NBDTestClient::info_request("missing"));
+  ASSERT_EQ(replies.size(), 1u);
+  EXPECT_EQ(replies[0].first, NBD_REP_ERR_UNKNOWN);
+  replies = client.option(NBD_OPT_STARTTLS);
+  ASSERT_EQ(replies.size(), 1u);
+  EXPECT_EQ(replies[0].first, NBD_REP_ERR_POLICY);
+  replies = client.option(99);
+  ASSERT_EQ(replies.size(), 1u);
+  EXPECT_EQ(replies[0].first, NBD_REP_ERR_UNSUP);
+
+  ASSERT_TRUE(client.go("disk"));
+  EXPECT_EQ(client.size, uint64_t(TEST_DEVICE_BLOCKS) * TEST_DEVICE_BLOCK_SIZE);
+  EXPECT_TRUE(client.flags & NBD_FLAG_CAN_MULTI_CONN);
+  EXPECT_TRUE(client.flags & NBD_FLAG_SEND_TRIM);
+  EXPECT_FALSE(client.flags & NBD_FLAG_READ_ONLY);
+}
+
+// Test writes, reads, flushes, trims and zeroing round trip with structured replies
+TEST_F(NBDServerTest, Structured) {
+  NBDTestClient client;
+  ASSERT_TRUE(client.connect(server->port()));
+  ASSERT_TRUE(client.go("disk"));
+
+  std::vector<uint8_t> data = pattern(8, 16);
+  EXPECT_EQ(client.call(NBD_CMD_WRITE, 8 * TEST_DEVICE_BLOCK_SIZE, data.size(), data.data(), NBD_CMD_FLAG_FUA).error, 0u);
+  EXPECT_EQ(client.call(NBD_CMD_FLUSH, 0, 0).error, 0u);
+  auto read = client.call(NBD_CMD_READ, 8 * TEST_DEVICE_BLOCK_SIZE, data.size());
+  EXPECT_EQ(read.error, 0u);
+  EXPECT_EQ(read.data, data);
+
+  EXPECT_EQ(client.call(NBD_CMD_TRIM, 8 * TEST_DEVICE_BLOCK_SIZE, 4 * TEST_DEVICE_BLOCK_SIZE).error, 0u);
+  EXPECT_EQ(client.call(NBD_CMD_WRITE_ZEROES, 12 * TEST_DEVICE_BLOCK_SIZE, 4 * TEST_DEVICE_BLOCK_SIZE, nullptr, NBD_CMD_FLAG_NO_HOLE).error, 0u);
+  read = client.call(NBD_CMD_READ, 8 * TEST_DEVICE_BLOCK_SIZE, data.size());
+  std::fill(data.begin(), data.begin() + 8 * TEST_DEVICE_BLOCK_SIZE, 0);
+  EXPECT_EQ(read.data, data);
+
+  EXPECT_EQ(client.call(NBD_CMD_READ, 1, TEST_DEVICE_BLOCK_SIZE).error, uint32_t(NBD_EINVAL));
+  EXPECT_EQ(client.call(NBD_CMD_READ, uint64_t(TEST_DEVICE_BLOCKS) * TEST_DEVICE_BLOCK_SIZE, TEST_DEVICE_BLOCK_SIZE).error, uint32_t(NBD_EINVAL));
+  EXPECT_EQ(client.call(NBD_CMD_WRITE, uint64_t(TEST_DEVICE_BLOCKS) * TEST_DEVICE_BLOCK_SIZE, data.size(), data.data()).error, uint32_t(NBD_ENOSPC));
+  EXPECT_EQ(client.call(42, 0, 0).error, uint32_t(NBD_EINVAL));
+
+  client.request(NBD_CMD_DISC, 0, 0, 0, 0);
+  uint8_t byte;
+  EXPECT_EQ(::recv(client.fd, &byte, 1, 0), 0);
+}
+
+// Test EXPORT_NAME with simple replies, and that a read only export refuses writes
+TEST_F(NBDServerTest, Simple) {
+  NBDTestClient client;
+  ASSERT_TRUE(client.connect(server->port()));
+  client.send_option(NBD_OPT_EXPORT_NAME, std::vector<uint8_t>({'r', 'o', 'd', 'i', 's', 'k'}));
+  uint8_t geometry[10];
+  ASSERT_TRUE(client.receive(geometry, sizeof(geometry)));
+  EXPECT_EQ(get_u64(geometry), uint64_t(TEST_DEVICE_BLOCKS) * TEST_DEVICE_BLOCK_SIZE);
+  EXPECT_TRUE(get_u16(geometry + 8) & NBD_FLAG_READ_ONLY);
+
+  std::vector<uint8_t> data = pattern(0, 2);
+  EXPECT_EQ(client.call(NBD_CMD_WRITE, 0, data.size(), data.data()).error, uint32_t(NBD_EPERM));
+  EXPECT_EQ(client.call(NBD_CMD_TRIM, 0, data.size()).error, uint32_t(NBD_EPERM));
+  auto read = client.call(NBD_CMD_READ, 0, data.size());
+  EXPECT_EQ(read.error, 0u);
+  EXPECT_EQ(read.data, data);
+  EXPECT_EQ(client.call(NBD_CMD_READ, 3, TEST_DEVICE_BLOCK_SIZE).error, uint32_t(NBD_EINVAL));
+  EXPECT_EQ(client.call(NBD_CMD_READ, 0, TEST_DEVICE_BLOCK_SIZE).data.size(), size_t(TEST_DEVICE_BLOCK_SIZE));
+}
+
+// Test requests sent without waiting are all answered, and writes on one connection are read on another after a flush
+TEST_F(NBDServerTest, MultiConn) {
+  NBDTestClient writer;
+  NBDTestClient reader;
+  ASSERT_TRUE(writer.connect(server->port()));
+  ASSERT_TRUE(writer.go("disk"));
+  ASSERT_TRUE(reader.connect(server->port()));
+  ASSERT_TRUE(reader.go("1", false));
+
+  std::vector<std::vector<uint8_t>> data;
+  for (uint64_t i = 0; i < 64; i++) data.push_back(pattern(i * 4, 4));
+  for (uint64_t i = 0; i < 64; i++) writer.request(NBD_CMD_WRITE, 0, 1000 + i, i * 4 * TEST_DEVICE_BLOCK_SIZE, data[i].size(), data[i].data());
+  std::set<uint64_t> cookies;
+  for (uint64_t i = 0; i < 64; i++) {
+    NBDTestClient::Reply reply;
+    ASSERT_TRUE(writer.reply(reply));
+    EXPECT_EQ(reply.error, 0u);
+    cookies.insert(reply.cookie);
+  }
+  EXPECT_EQ(cookies.size(), 64u);
+  EXPECT_EQ(writer.call(NBD_CMD_FLUSH, 0, 0).error, 0u);
+
+  for (uint64_t i = 0; i < 64; i++) reader.request(NBD_CMD_READ, 0, 2000 + i, i * 4 * TEST_DEVICE_BLOCK_SIZE, data[i].size());
+  for (uint64_t i = 0; i < 64; i++) {
+    NBDTestClient::Reply reply;
+    ASSERT_TRUE(reader.reply(reply));
+    ASSERT_GE(reply.cookie, 2000u);
+    ASSERT_LT(reply.cookie, 2064u);
+    EXPECT_EQ(reply.data, data[reply.cookie - 2000]);
+  }
+  EXPECT_EQ(metrics->gauge("cppserver_nbd_sessions_active", "")->value(), 2);
+}
+
+}  // namespace cppserver
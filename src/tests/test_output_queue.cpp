@@ -0,0 +1,170 @@
+#include <gtest/gtest.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <boost/asio/error.hpp>
+#include <thread>
+#include <vector>
+
+#include "output_queue.h"
+
+namespace cppserver {
+
+class OutputQueueTest : public ::testing::Test {
+ protected:
+  std::shared_ptr<Metrics> metrics = std::make_shared<Metrics>();
+  std::shared_ptr<TimerWheel> wheel = std::make_shared<TimerWheel>(std::chrono::milliseconds(10));
+  int fds[2];
+
+  void SetUp() override { ASSERT_EQ(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0); }
+
+  void TearDown() override {
+    ::close(fds[0]);
+    ::close(fds[1]);
+  }
+
+  BufferRef payload(size_t size, uint8_t value) { return BufferRef(std::make_shared<std::vector<uint8_t>>(size, value)); }
+
+  // Read exactly len bytes from the peer
+  std::vector<uint8_t> readPeer(size_t len) {
+    std::vector<uint8_t> data(len);
+    size_t got = 0;
+    while (got < len) {
+      ssize_t n = ::read(fds[1], data.data() + got, len - got);
+      if (n <= 0) break;
+      got += n;
+    }
+    data.resize(got);
+    return data;
+  }
+};
+
+// Test queued frames arrive in order with their headers
+TEST_F(OutputQueueTest, WritesInOrder) {
+  OutputQueue queue(metrics, wheel, fds[0], OutputQueueOptions());
+  boost::system::error_code ec;
+
+  for (uint64_t tag = 0; tag < 3; tag++) EXPECT_TRUE(queue.push(FrameHeader(OP_ECHO, 0, 10, tag), payload(10, tag), ec));
+  EXPECT_EQ(queue.queued_bytes(), 3 * (FRAME_HEADER_SIZE + 10));
+  EXPECT_TRUE(queue.flush(ec));
+  EXPECT_EQ(queue.queued_bytes(), 0);
+
+  std::vector<uint8_t> data = readPeer(3 * (FRAME_HEADER_SIZE + 10));
+  ASSERT_EQ(data.size(), 3 * (FRAME_HEADER_SIZE + 10));
+  for (uint64_t tag = 0; tag < 3; tag++) {
+    FrameHeader header;
+    ASSERT_TRUE(header.parse(&data[tag * (FRAME_HEADER_SIZE + 10)]));
+    EXPECT_EQ(header.tag, tag);
+    EXPECT_EQ(data[tag * (FRAME_HEADER_SIZE + 10) + FRAME_HEADER_SIZE], tag);
+  }
+}
+
+// Test a flush gathers every queued frame into one write, or one per frame without coalescing
+TEST_F(OutputQueueTest, Coalesces) {
+  OutputQueueOptions options;
+  boost::system::error_code ec;
+  auto writes = metrics->counter("cppserver_session_writes_total", "");
+
+  {
+    OutputQueue queue(metrics, wheel, fds[0], options);
+    for (int i = 0; i < 10; i++) queue.push(FrameHeader(OP_ECHO, 0, 8, i), payload(8, 0), ec);
+    EXPECT_TRUE(queue.flush(ec));
+  }
+  EXPECT_EQ(writes->value(), 1);
+
+  options.coalesce = false;
+  {
+    OutputQueue queue(metrics, wheel, fds[0], options);
+    for (int i = 0; i < 10; i++) queue.push(FrameHeader(OP_ECHO, 0, 8, i), payload(8, 0), ec);
+    EXPECT_TRUE(queue.flush(ec));
+  }
+  EXPECT_EQ(writes->value(), 11);
+  EXPECT_EQ(readPeer(20 * (FRAME_HEADER_SIZE + 8)).size(), 20 * (FRAME_HEADER_SIZE + 8));
+}
+
+// Test push blocks above the high water mark until the peer reads
+TEST_F(OutputQueueTest, Backpressure) {
+  OutputQueueOptions options;
+  options.high_water = 64 * 1024;
+  options.low_water = 16 * 1024;
+  OutputQueue queue(metrics, wheel, fds[0], options);
+
+  const size_t frames = 256;
+  std::vector<uint8_t> received;
+  std::thread reader([&]() { received = readPeer(frames * (FRAME_HEADER_SIZE + 4096)); });
+
+  boost::system::error_code ec;
+  for (size_t i = 0; i < frames; i++) {
+    ASSERT_TRUE(queue.push(FrameHeader(OP_ECHO, 0, 4096, i), payload(4096, 1), ec));
+    EXPECT_LE(queue.queued_bytes(), options.high_water + FRAME_HEADER_SIZE + 4096);
+  }
+  EXPECT_TRUE(queue.flush(ec));
+  reader.join();
+
+  EXPECT_EQ(received.size(), frames * (FRAME_HEADER_SIZE + 4096));
+  EXPECT_GT(metrics->counter("cppserver_session_output_stalls_total", "")->value(), 0);
+}
+
+// Test a peer that never reads fails the write on the deadline
+TEST_F(OutputQueueTest, WriteTimeout) {
+  OutputQueueOptions options;
+  options.write_timeout_ms = 50;
+  OutputQueue queue(metrics, wheel, fds[0], options);
+  wheel->start();
+
+  boost::system::error_code ec;
+  for (int i = 0; i < 64; i++) queue.push(FrameHeader(OP_ECHO, 0, 65536, i), payload(65536, 0), ec);
+  EXPECT_FALSE(queue.flush(ec));
+  EXPECT_EQ(ec, boost::asio::error::timed_out);
+  EXPECT_FALSE(queue.push(FrameHeader(OP_ECHO, 0, 0, 0), BufferRef(), ec));
+
+  wheel->stop();
+}
+
+// Test file ranges are sent between frames from buffers, and fail the queue if the file is short
+TEST_F(OutputQueueTest, FileRanges) {
+  char path[] = "/tmp/cppserver_test_output_queue_XXXXXX";
+  int file = ::mkstemp(path);
+  ASSERT_GE(file, 0);
+  ::unlink(path);
+  std::vector<uint8_t> contents(3000);
+  for (size_t i = 0; i < contents.size(); i++) contents[i] = uint8_t(i * 7);
+  ASSERT_EQ(::write(file, contents.data(), contents.size()), ssize_t(contents.size()));
+
+  OutputQueue queue(metrics, wheel, fds[0], OutputQueueOptions());
+  boost::system::error_code ec;
+  EXPECT_TRUE(queue.push(FrameHeader(OP_ECHO, 0, 10, 0), payload(10, 1), ec));
+  EXPECT_TRUE(queue.push(FrameHeader(OP_READ, 0, 2000, 1), BufferRef::file(nullptr, file, 100, 2000), ec));
+  EXPECT_TRUE(queue.push(FrameHeader(OP_ECHO, 0, 10, 2), payload(10, 3), ec));
+  EXPECT_TRUE(queue.flush(ec));
+  EXPECT_EQ(metrics->counter("cppserver_session_file_bytes_written_total", "")->value(), 2000u);
+
+  std::vector<uint8_t> data = readPeer(3 * FRAME_HEADER_SIZE + 2020);
+  ASSERT_EQ(data.size(), 3 * FRAME_HEADER_SIZE + 2020);
+  FrameHeader header;
+  ASSERT_TRUE(header.parse(&data[FRAME_HEADER_SIZE + 10]));
+  EXPECT_EQ(header.tag, 1u);
+  EXPECT_TRUE(std::equal(contents.begin() + 100, contents.begin() + 2100, data.begin() + 2 * FRAME_HEADER_SIZE + 10));
+  ASSERT_TRUE(header.parse(&data[2 * FRAME_HEADER_SIZE + 2010]));
+  EXPECT_EQ(header.tag, 2u);
+  EXPECT_EQ(data.back(), 3);
+
+  EXPECT_TRUE(queue.push(FrameHeader(OP_READ, 0, 2000, 3), BufferRef::file(nullptr, file, 2000, 2000), ec));
+  EXPECT_FALSE(queue.flush(ec));
+  EXPECT_EQ(ec, boost::system::errc::io_error);
+  ::close(file);
+}
+
+// Test pushes fail once closed
+TEST_F(OutputQueueTest, Close) {
+  OutputQueue queue(metrics, wheel, fds[0], OutputQueueOptions());
+  boost::system::error_code ec;
+
+  queue.push(FrameHeader(OP_ECHO, 0, 4, 0), payload(4, 0), ec);
+  queue.close();
+  EXPECT_EQ(queue.queued_bytes(), 0);
+  EXPECT_FALSE(queue.push(FrameHeader(OP_ECHO, 0, 4, 1), payload(4, 0), ec));
+}
+
+}  // namespace cppserver
@@ -0,0 +1,89 @@
+#include <gtest/gtest.h>
+
+#include "protocol.h"
+
+namespace cppserver {
+
+class FrameHeaderTest : public ::testing::Test {};
+
+// Test pack then parse round trips every field
+TEST_F(FrameHeaderTest, RoundTrip) {
+  FrameHeader header(OP_ECHO, 0x5A, 123456, 0x0102030405060708ULL);
+  uint8_t buffer[FRAME_HEADER_SIZE];
+  EXPECT_EQ(header.pack(buffer), FRAME_HEADER_SIZE);
+
+  FrameHeader parsed;
+  ASSERT_TRUE(parsed.parse(buffer));
+  EXPECT_EQ(parsed.opcode, OP_ECHO);
+  EXPECT_EQ(parsed.flags, 0x5A);
+  EXPECT_EQ(parsed.length, 123456);
+  EXPECT_EQ(parsed.tag, 0x0102030405060708ULL);
+}
+
+// Test the wire layout is big-endian
+TEST_F(FrameHeaderTest, WireLayout) {
+  FrameHeader header(OP_ECHO, 0, 0x01020304, 0x1122334455667788ULL);
+  uint8_t buffer[FRAME_HEADER_SIZE];
+  header.pack(buffer);
+
+  uint8_t expected[FRAME_HEADER_SIZE] = {'C', 'S', OP_ECHO, 0, 0x01, 0x02, 0x03, 0x04, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88};
+  for (int i = 0; i < FRAME_HEADER_SIZE; i++) EXPECT_EQ(buffer[i], expected[i]) << "byte " << i;
+}
+
+// Test bad magic is rejected
+TEST_F(FrameHeaderTest, BadMagic) {
+  uint8_t buffer[FRAME_HEADER_SIZE] = {'G', 'E', 'T', ' '};
+  FrameHeader header;
+  EXPECT_FALSE(header.parse(buffer));
+}
+
+// Test oversize payloads are rejected
+TEST_F(FrameHeaderTest, OversizePayload) {
+  uint8_t buffer[FRAME_HEADER_SIZE];
+  FrameHeader(OP_ECHO, 0, FRAME_MAX_PAYLOAD + 1, 0).pack(buffer);
+  FrameHeader header;
+  EXPECT_FALSE(header.parse(buffer));
+}
+
+class HelloTest : public ::testing::Test {};
+
+// Test pack then parse round trips every field, and short payloads are refused
+TEST_F(HelloTest, RoundTrip) {
+  Hello hello(Version(1, 2, 3), CAP_COMPRESSION | CAP_OUT_OF_ORDER, 1024 * 1024, 48);
+  uint8_t buffer[HELLO_SIZE + 4] = {};
+  EXPECT_EQ(hello.pack(buffer), HELLO_SIZE);
+
+  Hello parsed;
+  ASSERT_TRUE(parsed.parse(buffer, sizeof(buffer)));
+  EXPECT_EQ(parsed.version.major, 1);
+  EXPECT_EQ(parsed.version.minor, 2);
+  EXPECT_EQ(parsed.version.patch, 3);
+  EXPECT_EQ(parsed.capabilities, uint32_t(CAP_COMPRESSION | CAP_OUT_OF_ORDER));
+  EXPECT_EQ(parsed.max_payload, 1024u * 1024);
+  EXPECT_EQ(parsed.max_in_flight, 48u);
+
+  EXPECT_FALSE(parsed.parse(buffer, HELLO_SIZE - 1));
+}
+
+// Test agreement keeps the common capabilities and smaller limits, in order only allowing one request at a time
+TEST_F(HelloTest, Agree) {
+  Hello server(Version(0, 1, 0), CAP_COMPRESSION | CAP_OUT_OF_ORDER, FRAME_MAX_PAYLOAD, 32);
+
+  Hello agreed = server.agree(Hello(Version(0, 2, 0), CAP_OUT_OF_ORDER | 0x80000000, 1024 * 1024, 64));
+  EXPECT_EQ(agreed.version.minor, 1);
+  EXPECT_EQ(agreed.capabilities, uint32_t(CAP_OUT_OF_ORDER));
+  EXPECT_EQ(agreed.max_payload, 1024u * 1024);
+  EXPECT_EQ(agreed.max_in_flight, 32u);
+
+  agreed = server.agree(Hello(Version(0, 1, 0), CAP_COMPRESSION, 16, 64));
+  EXPECT_EQ(agreed.capabilities, uint32_t(CAP_COMPRESSION));
+  EXPECT_EQ(agreed.max_payload, uint32_t(HELLO_MIN_PAYLOAD));
+  EXPECT_EQ(agreed.max_in_flight, 1u);
+
+  // The baseline a client gets without HELLO
+  Hello baseline;
+  EXPECT_EQ(baseline.capabilities, 0u);
+  EXPECT_EQ(baseline.max_in_flight, 1u);
+}
+
+}  // namespace cppserver
@@ -0,0 +1,97 @@
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <filesystem>
+#include <thread>
+#include <vector>
+
+#include "logger_stdio.h"
+#include "read_ahead.h"
+#include "test_helpers.h"
+
+namespace cppserver {
+
+class ReadAheadTest : public ::testing::Test {
+ protected:
+  std::shared_ptr<Logger> logger = std::make_shared<LoggerStdIO>(LogLevel::ERROR);
+  std::shared_ptr<Metrics> metrics = std::make_shared<Metrics>();
+  std::string filename = test_path(".img").string();
+
+  void TearDown() override { std::filesystem::remove(filename); }
+
+  // Blocks read ahead for a read, 0 for none
+  uint32_t access(ReadStream& stream, uint64_t block, uint32_t count, uint64_t* block_ahead = nullptr) {
+    uint64_t ahead;
+    uint32_t count_ahead;
+    stream.access(block, count, 256, ahead, count_ahead);
+    if (block_ahead) *block_ahead = ahead;
+    return count_ahead;
+  }
+};
+
+// Test sequential reads grow the window and stay ahead of the reader
+TEST_F(ReadAheadTest, Sequential) {
+  ReadStream stream;
+  uint64_t ahead;
+
+  EXPECT_EQ(access(stream, 100, 8), 0);
+  EXPECT_EQ(access(stream, 108, 8, &ahead), 32);
+  EXPECT_EQ(ahead, 116);
+  EXPECT_EQ(access(stream, 116, 8, &ahead), 64 - 24);
+  EXPECT_EQ(ahead, 148);
+
+  // Grows to the maximum and then only tops up in chunks
+  uint64_t block = 124;
+  for (int i = 0; i < 10; i++, block += 8) access(stream, block, 8);
+  EXPECT_EQ(stream.window(), 256);
+  EXPECT_EQ(access(stream, block, 8), 0);
+}
+
+// Test random reads shrink the window and turn read-ahead off
+TEST_F(ReadAheadTest, Random) {
+  ReadStream stream;
+  for (uint64_t block = 0; block < 64; block += 8) access(stream, block, 8);
+  EXPECT_EQ(stream.window(), 256);
+
+  EXPECT_EQ(access(stream, 5000, 8), 0);
+  EXPECT_EQ(stream.window(), 128);
+  for (uint64_t block : {900, 17, 3000, 42, 7777}) EXPECT_EQ(access(stream, block, 8), 0);
+  EXPECT_EQ(stream.window(), 0);
+
+  // Sequential again
+  access(stream, 7785, 8);
+  EXPECT_GT(stream.window(), 0);
+}
+
+// Test prefetched blocks land in the cache and are served from it
+TEST_F(ReadAheadTest, Prefetch) {
+  auto cache = std::make_shared<BlockCache>(metrics, 128 * 512, 512);
+  Device row;
+  row.id = 1;
+  row.filename = filename;
+  row.block_size = 512;
+  row.block_total = 64;
+  row.read_only = false;
+  auto device = std::make_shared<BlockDevice>(logger, metrics, row, cache);
+  boost::system::error_code ec;
+  ASSERT_TRUE(device->open(ec));
+
+  std::vector<uint8_t> data(512 * 64, 0x3C);
+  ASSERT_TRUE(device->write(0, 64, data.data(), false, ec));
+
+  {
+    ReadAhead read_ahead(metrics, 1);
+    read_ahead.submit(device, 32, 64);
+    for (int i = 0; i < 100 && cache->size() < 32; i++) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  EXPECT_EQ(cache->size(), 32);
+  EXPECT_EQ(metrics->counter("cppserver_read_ahead_blocks_total", "")->value(), 32);
+
+  std::vector<uint8_t> in(512 * 32);
+  ASSERT_TRUE(device->read(32, 32, in.data(), ec));
+  EXPECT_EQ(in, std::vector<uint8_t>(512 * 32, 0x3C));
+  EXPECT_EQ(metrics->counter("cppserver_cache_prefetch_hits_total", "")->value(), 32);
+  EXPECT_EQ(metrics->counter("cppserver_cache_misses_total", "")->value(), 0);
+}
+
+}  // namespace cppserver
@@ -0,0 +1,165 @@
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "block_engine.h"
+#include "device_db_file.h"
+#include "logger_stdio.h"
+#include "tcp_server.h"
+#include "test_helpers.h"
+
+namespace cppserver {
+
+#define TEST_BLOCKS 4096
+
+// A primary engine replicating to a secondary engine served on loopback, each with its own copy of device 10
+class ReplicatorTest : public ::testing::Test {
+ protected:
+  std::shared_ptr<Logger> logger = std::make_shared<LoggerStdIO>(LogLevel::ERROR);
+  std::shared_ptr<Metrics> metrics = std::make_shared<Metrics>();
+  std::filesystem::path dir = test_path();
+  std::unique_ptr<DeviceDBFile> primary_db;
+  std::unique_ptr<DeviceDBFile> secondary_db;
+  std::unique_ptr<BlockEngine> primary;
+  std::shared_ptr<BlockEngine> secondary;
+  std::unique_ptr<TCPServer> server;
+  ReplicatorOptions options;
+
+  std::shared_ptr<BlockHost> host;
+  std::shared_ptr<BlockDevice> device;
+
+  void SetUp() override {
+    for (const char* side : {"primary", "secondary"}) {
+      std::filesystem::create_directories(dir / side);
+      std::ofstream(dir / side / "devices.conf") << "host 1 alpha " TEST_KEY "\n"
+                                                 << "device 10 1 disk0 " << (dir / side / "disk0.img").string() << " 512 " << TEST_BLOCKS << "\n";
+    }
+    primary_db = std::make_unique<DeviceDBFile>(logger, (dir / "primary" / "devices.conf").string());
+    secondary_db = std::make_unique<DeviceDBFile>(logger, (dir / "secondary" / "devices.conf").string());
+    ASSERT_TRUE(primary_db->initialise());
+    ASSERT_TRUE(secondary_db->initialise());
+
+    options.host = "127.0.0.1";
+    // Chosen by the system when the secondary first starts, and kept across its restarts
+    options.port = 0;
+    options.host_id = 1;
+    options.retry_ms = 20;
+    secondary = std::make_shared<BlockEngine>(logger, std::make_shared<Metrics>(), *secondary_db);
+  }
+
+  void TearDown() override {
+    device.reset();
+    primary.reset();
+    stopSecondary();
+    secondary.reset();
+    std::filesystem::remove_all(dir);
+  }
+
+  void startSecondary() {
+    server = std::make_unique<TCPServer>(logger, std::make_shared<Metrics>(), secondary, options.port, TCPServerOptions());
+    server->start();
+    options.port = server->port();
+  }
+
+  void stopSecondary() {
+    if (server) server->stop();
+    server.reset();
+  }
+
+  void startPrimary() {
+    BlockEngineOptions engine_options;
+    engine_options.replication = options;
+    primary = std::make_unique<BlockEngine>(logger, metrics, *primary_db, engine_options);
+    std::string error;
+    ASSERT_TRUE(primary->attach(1, 10, host, device, error)) << error;
+  }
+
+  void stopPrimary() {
+    device.reset();
+    primary.reset();
+  }
+
+  std::vector<uint8_t> readSecondary(uint64_t block, uint32_t count) {
+    std::shared_ptr<BlockHost> secondary_host;
+    std::shared_ptr<BlockDevice> secondary_device;
+    std::string error;
+    std::vector<uint8_t> data(count * 512);
+    boost::system::error_code ec;
+    EXPECT_TRUE(secondary->attach(1, 10, secondary_host, secondary_device, error)) << error;
+    EXPECT_TRUE(secondary_device->read(block, count, data.data(), ec)) << ec.message();
+    return data;
+  }
+
+  uint64_t bytesSent() { return metrics->counter("cppserver_replica_bytes_total", "", "device=\"10\"")->value(); }
+};
+
+// Test writes reach the secondary, zeros as trims
+TEST_F(ReplicatorTest, Async) {
+  startSecondary();
+  startPrimary();
+  ASSERT_TRUE(device->replicator()->wait_synced(std::chrono::seconds(5)));
+  // The first time every block is sent, here all zeros
+  EXPECT_EQ(bytesSent(), 0u);
+
+  boost::system::error_code ec;
+  std::vector<uint8_t> data(TEST_BLOCKS * 512);
+  for (size_t i = 0; i < data.size(); i++) data[i] = uint8_t(i * 7 + i / 512);
+  std::fill(data.begin() + 100 * 512, data.begin() + 200 * 512, 0);
+  for (uint64_t block = 0; block < TEST_BLOCKS; block += 64) ASSERT_TRUE(device->write(block, 64, data.data() + block * 512, false, ec));
+  // Rewritten blocks are sent once if still dirty
+  ASSERT_TRUE(device->write(0, 64, data.data(), false, ec));
+
+  ASSERT_TRUE(device->replicator()->wait_synced(std::chrono::seconds(5)));
+  EXPECT_EQ(readSecondary(0, TEST_BLOCKS), data);
+  EXPECT_LE(bytesSent(), (TEST_BLOCKS + 64) * 512u);
+  EXPECT_EQ(metrics->gauge("cppserver_replica_dirty_blocks", "", "device=\"10\"")->value(), 0);
+}
+
+// Test writes while the secondary is down are sent once it is back, including across a restart of the primary
+TEST_F(ReplicatorTest, CatchUp) {
+  startSecondary();
+  startPrimary();
+  ASSERT_TRUE(device->replicator()->wait_synced(std::chrono::seconds(5)));
+  stopSecondary();
+
+  boost::system::error_code ec;
+  std::vector<uint8_t> a(8 * 512, 0xAA), b(2 * 512, 0xBB);
+  ASSERT_TRUE(device->write(1000, 8, a.data(), false, ec));
+  stopPrimary();
+  EXPECT_TRUE(std::filesystem::exists(dir / "primary" / "disk0.img.replica"));
+
+  startPrimary();
+  EXPECT_FALSE(std::filesystem::exists(dir / "primary" / "disk0.img.replica"));
+  ASSERT_TRUE(device->write(3000, 2, b.data(), false, ec));
+  EXPECT_EQ(device->replicator()->dirty(), 10u);
+  EXPECT_FALSE(device->replicator()->streaming());
+
+  uint64_t sent = bytesSent();
+  startSecondary();
+  ASSERT_TRUE(device->replicator()->wait_synced(std::chrono::seconds(5)));
+  EXPECT_EQ(bytesSent() - sent, 10 * 512u);
+  EXPECT_EQ(readSecondary(1000, 8), a);
+  EXPECT_EQ(readSecondary(3000, 2), b);
+}
+
+// Test a sync write is on the secondary once it returns
+TEST_F(ReplicatorTest, Sync) {
+  options.sync = true;
+  startSecondary();
+  startPrimary();
+  ASSERT_TRUE(device->replicator()->wait_synced(std::chrono::seconds(5)));
+
+  boost::system::error_code ec;
+  for (int i = 0; i < 20; i++) {
+    std::vector<uint8_t> data(4 * 512, uint8_t(i + 1));
+    ASSERT_TRUE(device->write(i * 4, 4, data.data(), false, ec));
+    ASSERT_EQ(readSecondary(i * 4, 4), data);
+  }
+  EXPECT_EQ(metrics->counter("cppserver_replica_sync_timeouts_total", "", "device=\"10\"")->value(), 0);
+}
+
+}  // namespace cppserver
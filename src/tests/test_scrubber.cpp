@@ -0,0 +1,75 @@
+#include <gtest/gtest.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <filesystem>
+#include <thread>
+#include <vector>
+
+#include "logger_stdio.h"
+#include "scrubber.h"
+#include "test_helpers.h"
+
+namespace cppserver {
+
+class ScrubberTest : public ::testing::Test {
+ protected:
+  std::shared_ptr<Logger> logger = std::make_shared<LoggerStdIO>(LogLevel::ERROR);
+  std::shared_ptr<Metrics> metrics = std::make_shared<Metrics>();
+  std::filesystem::path dir = test_path();
+  Device device;
+
+  void SetUp() override {
+    std::filesystem::create_directories(dir);
+    device.id = 1;
+    device.filename = (dir / "disk.img").string();
+    device.block_size = 512;
+    device.block_total = 4096;
+    device.read_only = false;
+  }
+
+  void TearDown() override { std::filesystem::remove_all(dir); }
+
+  uint64_t counter(const char* name) { return metrics->counter(name, "")->value(); }
+
+  // Wait up to a second for the scrubber to complete passes
+  bool waitPasses(uint64_t passes) {
+    for (int i = 0; i < 100 && counter("cppserver_scrub_passes_total") < passes; i++) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    return counter("cppserver_scrub_passes_total") >= passes;
+  }
+};
+
+// Test the scrubber records missing checksums, then finds corruption that reads also fail on
+TEST_F(ScrubberTest, Mismatch) {
+  auto disk = std::make_shared<BlockDevice>(logger, metrics, device, nullptr, true);
+  boost::system::error_code ec;
+  ASSERT_TRUE(disk->open(ec));
+  ASSERT_TRUE(disk->checksummed());
+
+  // Written behind the device's back, so without checksums
+  std::vector<uint8_t> data(512, 0x42);
+  int fd = ::open(device.filename.c_str(), O_WRONLY);
+  ASSERT_EQ(::pwrite(fd, data.data(), 512, 100 * 512), 512);
+
+  Scrubber scrubber(logger, metrics, 64 * 1024 * 1024);
+  scrubber.add(disk);
+  ASSERT_TRUE(waitPasses(1));
+  EXPECT_EQ(counter("cppserver_scrub_mismatches_total"), 0);
+
+  data[7] ^= 0x01;
+  ASSERT_EQ(::pwrite(fd, data.data(), 512, 100 * 512), 512);
+  ::close(fd);
+
+  uint64_t passes = counter("cppserver_scrub_passes_total");
+  ASSERT_TRUE(waitPasses(passes + 2));
+  EXPECT_GE(counter("cppserver_scrub_mismatches_total"), 1);
+  EXPECT_GE(counter("cppserver_scrub_bytes_total"), 4096 * 512);
+
+  std::vector<uint8_t> in(512);
+  EXPECT_FALSE(disk->read(100, 1, in.data(), ec));
+  EXPECT_EQ(ec, boost::system::errc::io_error);
+  EXPECT_TRUE(disk->read(101, 1, in.data(), ec));
+}
+
+}  // namespace cppserver
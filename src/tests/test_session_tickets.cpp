@@ -0,0 +1,104 @@
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <vector>
+
+#include "session_tickets.h"
+
+namespace cppserver {
+
+class SessionTicketsTest : public ::testing::Test {
+ protected:
+  std::shared_ptr<Metrics> metrics = std::make_shared<Metrics>();
+  SessionTickets tickets{metrics, std::chrono::seconds(60), std::chrono::seconds(600)};
+  SessionTickets::clock::time_point now = SessionTickets::clock::now();
+
+  static SessionTicket ticket() {
+    SessionTicket ticket;
+    ticket.host_id = 7;
+    ticket.device_id = 42;
+    ticket.attach_flags = ATTACH_COMPRESSED;
+    ticket.hello = Hello(Version(0, 1, 0), CAP_OUT_OF_ORDER, HELLO_MIN_PAYLOAD, 16);
+    return ticket;
+  }
+};
+
+// Test a ticket opens to what was sealed, appended to what is already there
+TEST_F(SessionTicketsTest, RoundTrip) {
+  std::vector<uint8_t> out(3, 0xAA);
+  ASSERT_TRUE(tickets.issue(ticket(), out, now));
+  ASSERT_EQ(out.size(), 3u + SESSION_TICKET_SIZE);
+
+  SessionTicket opened;
+  std::string error;
+  ASSERT_TRUE(tickets.redeem(out.data() + 3, SESSION_TICKET_SIZE, opened, error, now)) << error;
+  EXPECT_EQ(opened.host_id, 7u);
+  EXPECT_EQ(opened.device_id, 42u);
+  EXPECT_EQ(opened.attach_flags, ATTACH_COMPRESSED);
+  EXPECT_EQ(opened.hello.capabilities, uint32_t(CAP_OUT_OF_ORDER));
+  EXPECT_EQ(opened.hello.max_in_flight, 16u);
+  EXPECT_EQ(metrics->counter("cppserver_tickets_redeemed_total", "")->value(), 1u);
+
+  // Each ticket is sealed under its own nonce
+  std::vector<uint8_t> again;
+  tickets.issue(ticket(), again, now);
+  EXPECT_FALSE(std::equal(again.begin(), again.end(), out.begin() + 3));
+}
+
+// Test altered, truncated and foreign tickets are refused
+TEST_F(SessionTicketsTest, Forged) {
+  std::vector<uint8_t> out;
+  tickets.issue(ticket(), out, now);
+  SessionTicket opened;
+  std::string error;
+
+  for (size_t i : {4, 20, SESSION_TICKET_SIZE - 1}) {
+    std::vector<uint8_t> altered = out;
+    altered[i] ^= 1;
+    EXPECT_FALSE(tickets.redeem(altered.data(), altered.size(), opened, error, now)) << i;
+    EXPECT_EQ(error, "Bad ticket");
+  }
+  EXPECT_FALSE(tickets.redeem(out.data(), out.size() - 1, opened, error, now));
+
+  SessionTickets other(metrics, std::chrono::seconds(60), std::chrono::seconds(600));
+  EXPECT_FALSE(other.redeem(out.data(), out.size(), opened, error, now));
+  EXPECT_EQ(metrics->counter("cppserver_tickets_rejected_total", "")->value(), 5u);
+}
+
+// Test a ticket expires after its lifetime
+TEST_F(SessionTicketsTest, Expired) {
+  std::vector<uint8_t> out;
+  tickets.issue(ticket(), out, now);
+  SessionTicket opened;
+  std::string error;
+  EXPECT_TRUE(tickets.redeem(out.data(), out.size(), opened, error, now + std::chrono::seconds(59))) << error;
+  EXPECT_FALSE(tickets.redeem(out.data(), out.size(), opened, error, now + std::chrono::seconds(61)));
+  EXPECT_EQ(error, "Ticket expired");
+}
+
+// Test a rotated secret still opens its tickets until they have all expired
+TEST_F(SessionTicketsTest, Rotation) {
+  std::vector<uint8_t> first, last;
+  tickets.issue(ticket(), first, now);
+  tickets.issue(ticket(), last, now + std::chrono::seconds(590));
+
+  // Sealed under a new secret, the old one kept
+  auto rotated = now + std::chrono::seconds(600);
+  std::vector<uint8_t> next;
+  tickets.issue(ticket(), next, rotated);
+  EXPECT_EQ(tickets.keys(), 2u);
+  EXPECT_EQ(get_u32(first.data()), get_u32(last.data()));
+  EXPECT_NE(get_u32(last.data()), get_u32(next.data()));
+
+  SessionTicket opened;
+  std::string error;
+  EXPECT_TRUE(tickets.redeem(last.data(), last.size(), opened, error, rotated + std::chrono::seconds(30))) << error;
+  EXPECT_TRUE(tickets.redeem(next.data(), next.size(), opened, error, rotated + std::chrono::seconds(30))) << error;
+
+  // Once every ticket the old secret sealed has expired it is dropped
+  EXPECT_FALSE(tickets.redeem(last.data(), last.size(), opened, error, rotated + std::chrono::seconds(60)));
+  EXPECT_EQ(error, "Unknown ticket key");
+  EXPECT_EQ(tickets.keys(), 1u);
+}
+
+}  // namespace cppserver
@@ -0,0 +1,173 @@
+#include <gtest/gtest.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <filesystem>
+#include <future>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "block_client.h"
+#include "shm_client.h"
+#include "tcp_server.h"
+#include "test_helpers.h"
+
+namespace cppserver {
+
+// A server listening on a Unix socket as well as loopback
+class ShmClientTest : public BlockServerTest {
+ protected:
+  std::string path = (dir / "cppserver.sock").string();
+  std::shared_ptr<BlockEngine> engine;
+  std::unique_ptr<TCPServer> server;
+
+  void SetUp() override {
+    BlockServerTest::SetUp();
+    engine = open_engine();
+    TCPServerOptions options;
+    options.unix_path = path;
+    server = std::make_unique<TCPServer>(logger, std::make_shared<Metrics>(), engine, 0, options);
+    server->start();
+  }
+
+  void TearDown() override {
+    if (server) server->stop();
+    server.reset();
+    engine.reset();
+    BlockServerTest::TearDown();
+  }
+};
+
+// Test synchronous writes, reads, trims and flushes through shared memory, seen by a client on the socket
+TEST_F(ShmClientTest, RoundTrip) {
+  ShmClient client(logger, metrics);
+  std::string error;
+  ASSERT_TRUE(client.connect(path, 1, 1, error)) << error;
+  EXPECT_EQ(client.block_size(), uint32_t(TEST_DEVICE_BLOCK_SIZE));
+  EXPECT_EQ(client.block_total(), uint64_t(TEST_DEVICE_BLOCKS));
+
+  std::vector<uint8_t> data = pattern(10, 16);
+  ASSERT_TRUE(client.write(10, 16, data.data(), true, error)) << error;
+  ASSERT_TRUE(client.flush(error)) << error;
+  std::vector<uint8_t> read(data.size());
+  ASSERT_TRUE(client.read(10, 16, read.data(), error)) << error;
+  EXPECT_EQ(read, data);
+
+  BlockClient other(logger, metrics);
+  boost::system::error_code ec;
+  ASSERT_TRUE(other.connect_unix(path, ec)) << ec.message();
+  ASSERT_TRUE(other.attach(1, 1, error)) << error;
+  std::fill(read.begin(), read.end(), 0);
+  ASSERT_TRUE(other.read(10, 16, read.data(), error)) << error;
+  EXPECT_EQ(read, data);
+
+  ASSERT_TRUE(client.trim(10, 16, error)) << error;
+  ASSERT_TRUE(client.read(10, 16, read.data(), error)) << error;
+  EXPECT_EQ(read, std::vector<uint8_t>(data.size(), 0));
+
+  EXPECT_FALSE(client.read(TEST_DEVICE_BLOCKS, 1, read.data(), error));
+  EXPECT_EQ(error, "Bad read range");
+}
+
+// Test more requests than slots from several threads all complete, each with its own data
+TEST_F(ShmClientTest, Concurrent) {
+  ShmClientOptions options;
+  options.slots = 4;
+  options.slot_size = 2 * SHM_PAGE_SIZE;
+  ShmClient client(logger, metrics, options);
+  std::string error;
+  ASSERT_TRUE(client.connect(path, 1, 1, error)) << error;
+
+  std::atomic<int> failures{0};
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([&, t]() {
+      for (uint64_t block = t; block < 256; block += 4) {
+        std::vector<uint8_t> data = pattern(block, 2);
+        std::string error;
+        std::vector<uint8_t> read(data.size());
+        if (!client.write(block * 2, 2, data.data(), false, error) || !client.read(block * 2, 2, read.data(), error) || read != data) failures++;
+      }
+    });
+  }
+  for (auto& thread : threads) thread.join();
+  EXPECT_EQ(failures, 0);
+
+  std::atomic<int> completed{0};
+  for (uint64_t block = 0; block < 64; block++) {
+    client.read(block, 1, [&completed](BlockResponse& response) {
+      if (response.ok() && response.data.size() == TEST_DEVICE_BLOCK_SIZE) completed++;
+    });
+  }
+  client.drain();
+  EXPECT_EQ(completed, 64);
+
+  std::vector<uint8_t> big(3 * SHM_PAGE_SIZE);
+  EXPECT_FALSE(client.write(0, big.size() / TEST_DEVICE_BLOCK_SIZE, big.data(), false, error));
+  EXPECT_EQ(error, "Request too large");
+}
+
+// Test a client cannot shrink the region under the server, which keeps serving it
+TEST_F(ShmClientTest, Sealed) {
+  ShmClient client(logger, metrics);
+  std::string error;
+  ASSERT_TRUE(client.connect(path, 1, 1, error)) << error;
+
+  // Client and server are in this process, so every open copy of the region is here
+  int sealed = 0;
+  for (const auto& entry : std::filesystem::directory_iterator("/proc/self/fd")) {
+    std::error_code ec;
+    std::string target = std::filesystem::read_symlink(entry.path(), ec).string();
+    if (ec || target.rfind("/memfd:cppserver-shm", 0) != 0) continue;
+    int fd = std::stoi(entry.path().filename().string());
+    int result = ::ftruncate(fd, 0);
+    int err = errno;
+    EXPECT_NE(result, 0);
+    EXPECT_EQ(err, EPERM);
+    sealed++;
+  }
+  EXPECT_GE(sealed, 2);
+
+  std::vector<uint8_t> data = pattern(20, 8);
+  ASSERT_TRUE(client.write(20, 8, data.data(), false, error)) << error;
+  std::vector<uint8_t> read(data.size());
+  ASSERT_TRUE(client.read(20, 8, read.data(), error)) << error;
+  EXPECT_EQ(read, data);
+}
+
+// Test requests fail once the server has gone, and that connecting needs a device and a Unix socket
+TEST_F(ShmClientTest, Closed) {
+  ShmClient client(logger, metrics);
+  std::string error;
+  EXPECT_FALSE(client.connect(path, 1, 3, error));
+  EXPECT_FALSE(client.connect((dir / "missing.sock").string(), 1, 1, error));
+
+  ASSERT_TRUE(client.connect(path, 1, 1, error)) << error;
+  server->stop();
+  server.reset();
+  std::vector<uint8_t> read(TEST_DEVICE_BLOCK_SIZE);
+  EXPECT_FALSE(client.read(0, 1, read.data(), error));
+  EXPECT_FALSE(client.connected());
+
+  BlockClient tcp(logger, metrics);
+  TCPServerOptions options;
+  server = std::make_unique<TCPServer>(logger, std::make_shared<Metrics>(), engine, 0, options);
+  server->start();
+  boost::system::error_code ec;
+  ASSERT_TRUE(tcp.connect("127.0.0.1", server->port(), ec)) << ec.message();
+  ASSERT_TRUE(tcp.attach(1, 1, error)) << error;
+  uint8_t shm[SHM_REQUEST_SIZE];
+  put_u32(shm, 4);
+  put_u32(shm + 4, SHM_PAGE_SIZE);
+  std::promise<BlockResponse> promise;
+  std::vector<BlockRequest> requests(1);
+  requests[0].opcode = OP_SHM;
+  requests[0].data = shm;
+  requests[0].length = sizeof(shm);
+  requests[0].callback = [&promise](BlockResponse& response) { promise.set_value(response); };
+  tcp.submit(requests);
+  EXPECT_EQ(promise.get_future().get().error, "Shared memory needs a Unix socket");
+}
+
+}  // namespace cppserver
@@ -0,0 +1,113 @@
+#include <gtest/gtest.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <thread>
+
+#include "shm_ring.h"
+
+namespace cppserver {
+
+class ShmRingTest : public ::testing::Test {
+ protected:
+  std::unique_ptr<ShmRegion> create(uint32_t slots, uint32_t slot_size = SHM_PAGE_SIZE) {
+    boost::system::error_code ec;
+    auto region = ShmRegion::create(slots, slot_size, ec);
+    EXPECT_TRUE(region) << ec.message();
+    return region;
+  }
+
+  // Map the region again, as the other side would from the fds passed to it
+  std::unique_ptr<ShmRegion> map(const ShmRegion& region) {
+    boost::system::error_code ec;
+    auto mapped = ShmRegion::map(::dup(region.memfd()), ::dup(region.submit_fd()), ::dup(region.complete_fd()), ec);
+    EXPECT_TRUE(mapped) << ec.message();
+    return mapped;
+  }
+};
+
+// Test entries and slot contents pushed on one mapping are popped in order on another, wrapping around the ring
+TEST_F(ShmRingTest, PushPop) {
+  auto server = create(4);
+  auto client = map(*server);
+  EXPECT_EQ(client->slots(), 4u);
+  EXPECT_EQ(client->slot_size(), uint32_t(SHM_PAGE_SIZE));
+
+  ShmEntry entry;
+  EXPECT_FALSE(server->submissions().pop(entry));
+  for (uint64_t tag = 1; tag <= 10; tag++) {
+    uint16_t slot = tag % 4;
+    client->slot(slot)[0] = uint8_t(tag);
+    ASSERT_TRUE(client->submissions().push(ShmEntry{tag, 1, slot, 0x11, 0}));
+    ASSERT_TRUE(server->submissions().pop(entry));
+    EXPECT_EQ(entry.tag, tag);
+    EXPECT_EQ(entry.slot, slot);
+    EXPECT_EQ(entry.opcode, 0x11);
+    EXPECT_EQ(server->slot(entry.slot)[0], uint8_t(tag));
+  }
+  EXPECT_TRUE(server->submissions().empty());
+  EXPECT_TRUE(server->completions().empty());
+}
+
+// Test a ring refuses more entries than it has slots until one is popped
+TEST_F(ShmRingTest, Full) {
+  auto region = create(4);
+  ShmRing& ring = region->completions();
+  for (uint64_t tag = 1; tag <= 4; tag++) ASSERT_TRUE(ring.push(ShmEntry{tag, 0, 0, 0, 0}));
+  EXPECT_FALSE(ring.push(ShmEntry{5, 0, 0, 0, 0}));
+
+  ShmEntry entry;
+  ASSERT_TRUE(ring.pop(entry));
+  EXPECT_EQ(entry.tag, 1u);
+  EXPECT_TRUE(ring.push(ShmEntry{5, 0, 0, 0, 0}));
+}
+
+// Test a sleeping consumer is woken by notify, by wake, and by its extra fd
+TEST_F(ShmRingTest, Wait) {
+  auto server = create(8);
+  auto client = map(*server);
+  ShmRing& consumer = server->submissions();
+  bool extra = false;
+
+  EXPECT_FALSE(consumer.wait(-1, 10, extra));
+
+  std::thread producer([&client]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    client->submissions().push(ShmEntry{1, 0, 0, 0, 0});
+    client->submissions().notify();
+  });
+  auto start = std::chrono::steady_clock::now();
+  EXPECT_TRUE(consumer.wait(-1, 5000, extra));
+  EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(4));
+  producer.join();
+  ShmEntry entry;
+  ASSERT_TRUE(consumer.pop(entry));
+
+  client->submissions().wake();
+  EXPECT_FALSE(consumer.wait(-1, 5000, extra));
+  EXPECT_FALSE(extra);
+
+  int pipe_fds[2];
+  ASSERT_EQ(::pipe(pipe_fds), 0);
+  ASSERT_EQ(::write(pipe_fds[1], "x", 1), 1);
+  EXPECT_FALSE(consumer.wait(pipe_fds[0], 5000, extra));
+  EXPECT_TRUE(extra);
+  ::close(pipe_fds[0]);
+  ::close(pipe_fds[1]);
+}
+
+// Test only sane geometries are allowed
+TEST_F(ShmRingTest, Valid) {
+  EXPECT_TRUE(ShmRegion::valid(64, 64 * 1024));
+  EXPECT_FALSE(ShmRegion::valid(0, SHM_PAGE_SIZE));
+  EXPECT_FALSE(ShmRegion::valid(3, SHM_PAGE_SIZE));
+  EXPECT_FALSE(ShmRegion::valid(SHM_MAX_SLOTS * 2, SHM_PAGE_SIZE));
+  EXPECT_FALSE(ShmRegion::valid(4, 1000));
+  EXPECT_FALSE(ShmRegion::valid(1024, 1024 * 1024));
+
+  boost::system::error_code ec;
+  EXPECT_FALSE(ShmRegion::create(3, SHM_PAGE_SIZE, ec));
+  EXPECT_TRUE(ec);
+}
+
+}  // namespace cppserver
@@ -0,0 +1,125 @@
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "timer_wheel.h"
+
+namespace cppserver {
+
+class TimerWheelTest : public ::testing::Test {
+ protected:
+  TimerWheel wheel{std::chrono::milliseconds(10)};
+
+  // Advance one tick at a time, returning the tick on which fired became true
+  uint64_t advanceUntil(bool& fired, uint64_t limit) {
+    for (uint64_t i = 1; i <= limit; i++) {
+      wheel.advance(1);
+      if (fired) return i;
+    }
+    return 0;
+  }
+};
+
+// Test a timer fires on its tick and not before
+TEST_F(TimerWheelTest, FiresOnTick) {
+  TimerWheel::Timer timer;
+  bool fired = false;
+  wheel.arm(timer, std::chrono::milliseconds(50), [&]() { fired = true; });
+
+  EXPECT_TRUE(timer.armed());
+  EXPECT_EQ(wheel.size(), 1);
+  EXPECT_EQ(advanceUntil(fired, 100), 6);
+  EXPECT_FALSE(timer.armed());
+  EXPECT_EQ(wheel.size(), 0);
+}
+
+// Test delays round up to whole ticks
+TEST_F(TimerWheelTest, RoundsUp) {
+  TimerWheel::Timer timer;
+  bool fired = false;
+  wheel.arm(timer, std::chrono::milliseconds(11), [&]() { fired = true; });
+  EXPECT_EQ(advanceUntil(fired, 100), 3);
+}
+
+// Test a cancelled timer never fires
+TEST_F(TimerWheelTest, Cancel) {
+  TimerWheel::Timer timer;
+  bool fired = false;
+  wheel.arm(timer, std::chrono::milliseconds(50), [&]() { fired = true; });
+
+  EXPECT_TRUE(wheel.cancel(timer));
+  EXPECT_FALSE(wheel.cancel(timer));
+  wheel.advance(100);
+  EXPECT_FALSE(fired);
+  EXPECT_EQ(wheel.size(), 0);
+}
+
+// Test re-arming replaces the previous deadline
+TEST_F(TimerWheelTest, Rearm) {
+  TimerWheel::Timer timer;
+  int fired = 0;
+  wheel.arm(timer, std::chrono::milliseconds(50), [&]() { fired = 1; });
+  wheel.arm(timer, std::chrono::milliseconds(200), [&]() { fired = 2; });
+  EXPECT_EQ(wheel.size(), 1);
+
+  wheel.advance(10);
+  EXPECT_EQ(fired, 0);
+  wheel.advance(11);
+  EXPECT_EQ(fired, 2);
+}
+
+// Test timers in every level cascade down and fire on the exact tick
+TEST_F(TimerWheelTest, Cascade) {
+  std::vector<uint64_t> delays = {255, 256, 257, 1000, 16383, 16384, 100000, 1048576, 3000000};
+  std::vector<TimerWheel::Timer> timers(delays.size());
+  std::vector<uint64_t> fired_at(delays.size(), 0);
+  uint64_t now = 0;
+
+  // Start part way round the wheel so slots are not aligned
+  wheel.advance(77);
+
+  for (size_t i = 0; i < delays.size(); i++) {
+    wheel.arm(timers[i], std::chrono::milliseconds(delays[i] * 10), [&, i]() { fired_at[i] = now; });
+  }
+
+  while (wheel.size() > 0 && now < 4000000) {
+    now++;
+    wheel.advance(1);
+  }
+
+  for (size_t i = 0; i < delays.size(); i++) EXPECT_EQ(fired_at[i], delays[i] + 1) << "delay " << delays[i];
+}
+
+// Test a callback may re-arm its own timer
+TEST_F(TimerWheelTest, RearmFromCallback) {
+  TimerWheel::Timer timer;
+  int fired = 0;
+  std::function<void()> callback = [&]() {
+    if (++fired < 3) wheel.arm(timer, std::chrono::milliseconds(10), callback);
+  };
+  wheel.arm(timer, std::chrono::milliseconds(10), callback);
+
+  wheel.advance(10);
+  EXPECT_EQ(fired, 3);
+}
+
+// Test the wheel thread fires timers in real time
+TEST_F(TimerWheelTest, RealTime) {
+  TimerWheel::Timer timer;
+  std::atomic<bool> fired{false};
+
+  wheel.start();
+  auto start = std::chrono::steady_clock::now();
+  wheel.arm(timer, std::chrono::milliseconds(30), [&]() { fired = true; });
+
+  while (!fired && std::chrono::steady_clock::now() - start < std::chrono::seconds(5)) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  wheel.stop();
+
+  EXPECT_TRUE(fired);
+  EXPECT_GE(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(30));
+}
+
+}  // namespace cppserver
@@ -0,0 +1,42 @@
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <thread>
+
+#include "token_bucket.h"
+
+namespace cppserver {
+
+class TokenBucketTest : public ::testing::Test {};
+
+// Test a full bucket allows a burst and then refuses
+TEST_F(TokenBucketTest, Burst) {
+  TokenBucket bucket(1, 5);
+  for (int i = 0; i < 5; i++) EXPECT_TRUE(bucket.try_take());
+  EXPECT_FALSE(bucket.try_take());
+}
+
+// Test tokens refill over time, capped at the burst size
+TEST_F(TokenBucketTest, Refill) {
+  TokenBucket bucket(1000, 10);
+  EXPECT_TRUE(bucket.try_take(10));
+  EXPECT_FALSE(bucket.try_take(5));
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  EXPECT_TRUE(bucket.try_take(5));
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  EXPECT_LE(bucket.available(), 10);
+  EXPECT_FALSE(bucket.try_take(11));
+}
+
+// Test reservations queue behind each other instead of failing
+TEST_F(TokenBucketTest, Reserve) {
+  TokenBucket bucket(1000, 10);
+  EXPECT_EQ(bucket.reserve(10).count(), 0);
+  EXPECT_NEAR(bucket.reserve(10).count(), 10000000, 1000000);
+  EXPECT_NEAR(bucket.reserve(5).count(), 15000000, 1000000);
+  EXPECT_FALSE(bucket.try_take());
+}
+
+}  // namespace cppserver
@@ -64,4 +64,44 @@ TEST_F(UtilTest, ArrayToHex_Zeroes) {
   EXPECT_EQ(output, "000000");
 }
 
+// Test from_hex round trips and rejects bad input
+TEST_F(UtilTest, FromHex) {
+  std::vector<uint8_t> vec;
+  EXPECT_TRUE(Util::from_hex("00abCDef", vec));
+  EXPECT_EQ(vec, std::vector<uint8_t>({0x00, 0xAB, 0xCD, 0xEF}));
+  EXPECT_FALSE(Util::from_hex("abc", vec));
+  EXPECT_FALSE(Util::from_hex("zz", vec));
+}
+
+// Test is_zero finds a single set byte at any position, including unaligned tails
+TEST_F(UtilTest, IsZero) {
+  std::vector<uint8_t> buffer(4096 + 67);
+  EXPECT_TRUE(Util::is_zero(buffer.data(), buffer.size()));
+  EXPECT_TRUE(Util::is_zero(buffer.data() + 1, 0));
+
+  for (size_t i : {size_t(0), size_t(63), size_t(64), size_t(2049), buffer.size() - 1}) {
+    buffer[i] = 0x10;
+    EXPECT_FALSE(Util::is_zero(buffer.data(), buffer.size())) << i;
+    EXPECT_TRUE(Util::is_zero(buffer.data() + i + 1, buffer.size() - i - 1)) << i;
+    buffer[i] = 0;
+  }
+}
+
+// Test CRC32C against known values, and that the parallel streams of large buffers agree with checksumming byte by byte
+TEST_F(UtilTest, Crc32c) {
+  const std::string check = "123456789";
+  EXPECT_EQ(Util::crc32c(reinterpret_cast<const uint8_t*>(check.data()), check.size()), 0xE3069283u);
+  std::vector<uint8_t> zeros(32);
+  EXPECT_EQ(Util::crc32c(zeros.data(), zeros.size()), 0x8A9136AAu);
+  EXPECT_EQ(Util::crc32c(zeros.data(), 0), 0u);
+
+  std::vector<uint8_t> buffer(3 * 8192 * 2 + 3 * 256 + 13);
+  for (size_t i = 0; i < buffer.size(); i++) buffer[i] = uint8_t(i * 131 + (i >> 7));
+
+  uint32_t bytewise = 0;
+  for (size_t i = 0; i < buffer.size(); i++) bytewise = Util::crc32c(buffer.data() + i, 1, bytewise);
+  EXPECT_EQ(Util::crc32c(buffer.data(), buffer.size()), bytewise);
+  EXPECT_EQ(Util::crc32c(buffer.data() + 1000, buffer.size() - 1000, Util::crc32c(buffer.data(), 1000)), bytewise);
+}
+
 }  // namespace cppserver
@@ -0,0 +1,127 @@
+#include <gtest/gtest.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <filesystem>
+#include <thread>
+#include <vector>
+
+#include "test_helpers.h"
+#include "write_queue.h"
+
+namespace cppserver {
+
+#define TEST_BLOCK_SIZE 512
+
+class WriteQueueTest : public ::testing::Test {
+ protected:
+  std::shared_ptr<Metrics> metrics = std::make_shared<Metrics>();
+  std::string filename = test_path(".img").string();
+  int fd = -1;
+
+  void SetUp() override { fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644); }
+
+  void TearDown() override {
+    ::close(fd);
+    std::filesystem::remove(filename);
+  }
+
+  // Bytes of the file allocated on disk
+  off_t allocated() {
+    struct stat st;
+    ::fstat(fd, &st);
+    return st.st_blocks * 512;
+  }
+
+  std::vector<uint8_t> readBlocks(uint64_t block, uint32_t count) {
+    std::vector<uint8_t> data(count * TEST_BLOCK_SIZE);
+    EXPECT_EQ(::pread(fd, data.data(), data.size(), block * TEST_BLOCK_SIZE), ssize_t(data.size()));
+    return data;
+  }
+};
+
+// Test writes land at their blocks and later writes win
+TEST_F(WriteQueueTest, Write) {
+  WriteQueue queue(metrics, fd, TEST_BLOCK_SIZE);
+  boost::system::error_code ec;
+
+  std::vector<uint8_t> a(4 * TEST_BLOCK_SIZE, 0xAA), b(2 * TEST_BLOCK_SIZE, 0xBB);
+  ASSERT_TRUE(queue.write(2, 4, a.data(), false, ec));
+  ASSERT_TRUE(queue.write(3, 2, b.data(), true, ec));
+
+  std::vector<uint8_t> expected(4 * TEST_BLOCK_SIZE, 0xAA);
+  std::fill(expected.begin() + TEST_BLOCK_SIZE, expected.begin() + 3 * TEST_BLOCK_SIZE, 0xBB);
+  EXPECT_EQ(readBlocks(2, 4), expected);
+  EXPECT_EQ(metrics->counter("cppserver_device_syncs_total", "")->value(), 1);
+}
+
+// Test concurrent writers and flushers all complete, sharing write calls and syncs
+TEST_F(WriteQueueTest, GroupCommit) {
+  WriteQueue queue(metrics, fd, TEST_BLOCK_SIZE);
+
+  const int threads = 16;
+  const int rounds = 50;
+  std::vector<std::thread> writers;
+  std::atomic<int> failures{0};
+  for (int t = 0; t < threads; t++) {
+    writers.emplace_back([&, t]() {
+      std::vector<uint8_t> data(TEST_BLOCK_SIZE, uint8_t(t));
+      boost::system::error_code ec;
+      for (int round = 0; round < rounds; round++) {
+        if (!queue.write(round * threads + t, 1, data.data(), false, ec) || !queue.flush(ec)) failures++;
+      }
+    });
+  }
+  for (auto& writer : writers) writer.join();
+
+  EXPECT_EQ(failures, 0);
+  for (int t = 0; t < threads; t++) EXPECT_EQ(readBlocks((rounds - 1) * threads + t, 1), std::vector<uint8_t>(TEST_BLOCK_SIZE, uint8_t(t)));
+  EXPECT_LE(metrics->counter("cppserver_device_syncs_total", "")->value(), threads * rounds);
+  EXPECT_LE(metrics->counter("cppserver_device_write_calls_total", "")->value(), threads * rounds);
+}
+
+// Test zero blocks and trims become holes that read back as zeros
+TEST_F(WriteQueueTest, Holes) {
+  WriteQueue queue(metrics, fd, 4096);
+  boost::system::error_code ec;
+
+  std::vector<uint8_t> data(64 * 4096, 0x77);
+  ASSERT_TRUE(queue.write(0, 64, data.data(), true, ec));
+  off_t full = allocated();
+  EXPECT_GE(full, 64 * 4096);
+  EXPECT_FALSE(queue.holes());
+
+  // Blocks 8-15 written as zeros, the rest of the write is data
+  std::fill(data.begin() + 8 * 4096, data.begin() + 16 * 4096, 0);
+  ASSERT_TRUE(queue.write(0, 32, data.data(), true, ec));
+  ASSERT_TRUE(queue.trim(32, 16, ec));
+  ASSERT_TRUE(queue.flush(ec));
+
+  EXPECT_TRUE(queue.holes());
+  EXPECT_EQ(metrics->counter("cppserver_device_zero_write_bytes_total", "")->value(), 8 * 4096);
+  EXPECT_EQ(metrics->counter("cppserver_device_punched_bytes_total", "")->value(), 24 * 4096);
+  EXPECT_LE(allocated(), full - 24 * 4096);
+  EXPECT_EQ(::lseek(fd, 0, SEEK_HOLE), 8 * 4096);
+  EXPECT_EQ(::lseek(fd, 8 * 4096, SEEK_DATA), 16 * 4096);
+
+  std::vector<uint8_t> zeros(4096);
+  std::vector<uint8_t> block(4096);
+  ASSERT_EQ(::pread(fd, block.data(), 4096, 40 * 4096), 4096);
+  EXPECT_EQ(block, zeros);
+}
+
+// Test a failed write fails its request
+TEST_F(WriteQueueTest, Error) {
+  ::close(fd);
+  fd = ::open(filename.c_str(), O_RDONLY);
+
+  WriteQueue queue(metrics, fd, TEST_BLOCK_SIZE);
+  boost::system::error_code ec;
+  std::vector<uint8_t> data(TEST_BLOCK_SIZE);
+  EXPECT_FALSE(queue.write(0, 1, data.data(), false, ec));
+  EXPECT_EQ(ec.value(), EBADF);
+}
+
+}  // namespace cppserver